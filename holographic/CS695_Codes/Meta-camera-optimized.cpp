@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <signal.h>
+#include <errno.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -17,9 +18,15 @@
 #include <immintrin.h>
 #include <xmmintrin.h>
 
+#include "Meta/frame.h"
+#include "Meta/net.h"
+#include "Meta/convert.h"
+#include "Meta/roi.h"
+#include "Meta/depthfilter.h"
+#include "Meta/postprocess.h"
+
 #define TIME_NOW    std::chrono::high_resolution_clock::now()
 #define BUF_SIZE    5000000
-#define CONV_RATE   1000.0
 #define DOWNSAMPLE  1
 #define PORT        8000
 
@@ -51,12 +58,68 @@ bool send_buffer = false;
 bool cutoff = false;
 bool use_simd = false;
 bool compress = false;
+bool framed = false;
+int wire_format = FORMAT_XYZRGB16;
 int num_of_threads = 1;
+
+// Conversion kernel picked from CPUID, and when replaying with -b every kernel is checked against the scalar one.
+int convert_kernel = CONVERT_SCALAR;
+bool bench_kernels = false;
+short *kernel_buffer;
+double kernel_ms_sum[NUM_CONVERT_KERNELS];
+int kernel_mismatches[NUM_CONVERT_KERNELS];
+
+// With -d the Z16 depth image is converted directly by the fused kernel, using the unit-depth rays of the
+// depth intrinsics, instead of rs2::pointcloud. Colors are registered by the kernel from the extrinsics and
+// the color intrinsics (every registration_step x registration_step depth pixels with -g), rs2::align is
+// only used for a color distortion model the kernel can not project.
+bool depth_direct = false;
+depthRayTable depth_rays;
+int registration_step = 1;
+colorRegistration color_registration;
+bool color_registered = false;
+
+// Quantization of the records (Meta/quantize.h) from -Q and -O, the kernels convert with quant_tf, tf_mat
+// followed by the origin shift. Framed frames carry it with the bounding box of their records (last_quant).
+quantizer quant;
+float quant_tf[16];
+quantExtension last_quant;
+
+// Region of interest after tf_mat (Meta/roi.h), from -r and replaced by REQUEST_ROI. Only the points inside
+// it are sent; roi_quant is the same region after quant_tf for the point cloud kernels and roi_records in
+// record units for the fused depth kernels.
+char *roi_filename = NULL;
+roiSet stage_roi;
+roiSet roi_quant;
+roiSet roi_records;
+
+// Flying-pixel (-j) and outlier (-o) removal on the Z16 image in front of every deprojection (Meta/depthfilter.h).
+float jump_percent = 0;
+float outlier_std_mul = -1;
+depthFilter depth_filter;
+
+// Post-processing chain on the Z16 image in front of the depth filter (Meta/postprocess.h): decimation (-x),
+// distance threshold (-n, -N) and temporal filter (-T, -P). A decimated image only goes through the fused
+// depth kernels, and an aligned color frame is decimated the same way into decimated_color.
+depthChain depth_chain;
+uint8_t *decimated_color = NULL;
+
 int client_sock = 0;
 int sockfd = 0;
 
 short *thread_buffers[16];
 
+// Framed wire buffer, decode buffer for the round trip check, and packing statistics for the replay benchmark.
+uint8_t *wire_buffer;
+short *decode_buffer;
+int raw_size = 0;
+double encode_ms = 0;
+
+// sendmsg based sender for client_sock and the iovecs of the last frame.
+frameSender sender;
+bool zerocopy = false;
+struct iovec frame_iov[2];
+
 timestamp time_start, time_end;
 
 // inilizing the matrix for the factarization
@@ -67,12 +130,6 @@ float tf_mat[] =   {-0.99977970,  0.00926272,  0.01883480,  0.00000000,
                      0.00000000,  0.00000000,  0.00000000,  1.00000000};
                  
 
-// creates the SSE resigistries with values from the tf_mat array and a zero value. 
-__m128 ss_a = _mm_set_ps(0, tf_mat[8], tf_mat[4], tf_mat[0]);
-__m128 ss_b = _mm_set_ps(0, tf_mat[9], tf_mat[5], tf_mat[1]);
-__m128 ss_c = _mm_set_ps(0, tf_mat[10], tf_mat[6], tf_mat[2]);
-__m128 ss_d = _mm_set_ps(0, tf_mat[11], tf_mat[7], tf_mat[3]);
-
 // Create TCP socket with specific port and IP address for server.
 void initSocket(int port) {
     struct sockaddr_in serv_addr;
@@ -109,20 +166,64 @@ void initSocket(int port) {
 // Defining the function which sends the buffer size as the responce back to server.
 int sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer);
 
+// Describes a textured point cloud for the conversion kernels of Meta/convert.h.
+convertParams convertParamsOf(rs2::points& pts, const rs2::video_frame& color);
+
+// Same for the fused depth kernels, color has to be registered or aligned to depth.
+depthConvertParams depthConvertParamsFor(const rs2::depth_frame& depth, const rs2::video_frame& color);
+bool registerColor(const rs2::depth_frame& depth, const rs2::video_frame& color);
+
+// Defining the function which converts the depth image directly and sends the buffer.
+int sendXYZRGBDepth(rs2::depth_frame depth, rs2::video_frame color, short * buffer);
+int sendRecords(short * buffer, int size, const rs2::video_frame& color);
+
+// Drops the flying pixels and outliers of the depth frame in place.
+depthFilterStats filterDepthFrame(const rs2::depth_frame& depth);
+
+// Runs the post-processing chain on the depth frame in place, and the size of the image it leaves.
+void processDepthFrame(const rs2::depth_frame& depth);
+int depthWidthOf(const rs2::depth_frame& depth);
+int depthHeightOf(const rs2::depth_frame& depth);
+
 // This Function handles the signal.
 void sigintHandler(int dummy) {
     std::cout << "\n Exiting \n " << std::endl;
     exit(0);
 }
 
-//void print_usage() {
-//    printf("\nUsage: Meta-camera-test-samples -f <samples.bag> -v (visualize)\n\n");
-//}
+// Prints the command to run this program.
+void print_usage() {
+    printf("\nUsage: Meta-camera-optimized [-f <samples.bag>] [options]\n\n");
+    printf("Options:\n");
+    printf(" -h (help)      Display command line options\n");
+    printf(" -f (file)      Replay frames from a .bag file instead of the camera\n");
+    printf(" -v (verbose)   Display updates\n");
+    printf(" -s (send)      Send the buffer to the client when replaying a file\n");
+    printf(" -t <threads>   Number of OpenMP threads\n");
+    printf(" -c (cutoff)    Drop points outside of the capture range\n");
+    printf(" -m (simd)      Use the SIMD conversion kernel (the widest the CPU supports)\n");
+    printf(" -b (bench)     Check every conversion kernel against the scalar one on the replayed frames and time them\n");
+    printf(" -d (depth)     Convert the Z16 depth image directly with the fused kernel instead of rs2::pointcloud\n");
+    printf(" -g <step>      Register color once per step x step depth pixels with -d (1, 2, 4 or 8)\n");
+    printf(" -j <percent>   Drop flying pixels, whose depth jumps by more than percent of it to both sides\n");
+    printf(" -o <std_mul>   Drop pixels deviating from their neighbours by more than std_mul sigmas of the frame\n");
+    printf(" -x <factor>    Decimate the depth image by 2 or 4 with the median of every block, implies -d\n");
+    printf(" -n <meters>    Drop pixels closer than the distance\n");
+    printf(" -N <meters>    Drop pixels farther than the distance\n");
+    printf(" -T <alpha>     Temporal filter, weight of the new frame in (0, 1]\n");
+    printf(" -P <frames>    Keep the last depth of a pixel that had depth in that many of the last 8 frames with -T\n");
+    printf(" -r <file>      Only send the points inside the region of interest of the file (see Meta/roi.h)\n");
+    printf(" -Q <mm>        Quantization step of the coordinates, 0.25 to 8 (default 1, framed consumers only)\n");
+    printf(" -O <x,y,z>     Origin of the quantized coordinates in meters after the transform (default 0,0,0)\n");
+    printf(" -p <format>    Send framed frames in the given wire format (0-4, see Meta/frame.h)\n");
+    printf(" -z (compress)  Send the lossless compressed stream, same as -p %d\n", FORMAT_COMPRESSED);
+    printf(" -Z (zerocopy)  Send frames with MSG_ZEROCOPY\n\n");
+}
 
 // Function to get Arguments from the terminal
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hf:vst:cmz")) != -1) {
+    while ((c = getopt(argc, argv, "hf:vst:cmbdg:j:o:x:n:N:T:P:r:Q:O:zp:Z")) != -1) {
         switch(c) {
             case 'h':
                 print_usage();
@@ -145,26 +246,148 @@ void parseArgs(int argc, char** argv) {
             case 'm':
                 use_simd = true;
                 break;
+            case 'b':
+                bench_kernels = true;
+                break;
+            case 'd':
+                depth_direct = true;
+                break;
+            case 'g':
+                registration_step = atoi(optarg);
+                if (registration_step != 1 && registration_step != 2 && registration_step != 4 && registration_step != 8) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                jump_percent = atof(optarg);
+                if (jump_percent <= 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                outlier_std_mul = atof(optarg);
+                if (outlier_std_mul < 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'x':
+                depth_chain.decimation = atoi(optarg);
+                if (depth_chain.decimation != 2 && depth_chain.decimation != 4) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                depth_chain.min_distance = atof(optarg);
+                if (depth_chain.min_distance <= 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                depth_chain.max_distance = atof(optarg);
+                if (depth_chain.max_distance <= 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                depth_chain.alpha = atof(optarg);
+                if (depth_chain.alpha <= 0 || depth_chain.alpha > 1) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                depth_chain.persistence = atoi(optarg);
+                if (depth_chain.persistence < 1 || depth_chain.persistence > DEPTH_HISTORY_FRAMES) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                roi_filename = optarg;
+                break;
+            case 'Q':
+                quant.step_mm = atof(optarg);
+                if (!validQuantStep(quant.step_mm)) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                if (sscanf(optarg, "%f,%f,%f", &quant.origin[0], &quant.origin[1], &quant.origin[2]) != 3) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'z':
                 compress = true;
+                framed = true;
+                wire_format = FORMAT_COMPRESSED;
+                break;
+            case 'Z':
+                zerocopy = true;
+                break;
+            case 'p':
+                framed = true;
+                wire_format = atoi(optarg);
+                if (!recordFormat(wire_format)) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
                 break;
         }
     }
 }
 
 int main (int argc, char** argv) {
+    initDepthChain(&depth_chain, false);
+    quant = defaultQuantizer();
     parseArgs(argc, argv);              
     signal(SIGINT, sigintHandler);      
+
+    quantizeTransform(quant, tf_mat, quant_tf);
+    if (!isDefaultQuantizer(quant))
+        std::cout << "Quantization: " << quant.step_mm << " mm around " << quant.origin[0] << ", " << quant.origin[1]
+                  << ", " << quant.origin[2] << " m, an unframed consumer would misread the records" << std::endl;
+
+    if (roi_filename && !loadRoiFile(roi_filename, &stage_roi))
+        exit(EXIT_FAILURE);
+    quantizeRoi(stage_roi, quant, &roi_quant, &roi_records);
+
+    convert_kernel = bestConvertKernel();
+    std::cout << "Conversion kernel: " << convert_kernel_names[convert_kernel] << std::endl;
+
+    initDepthFilter(&depth_filter, jump_percent, outlier_std_mul, use_simd && convertKernelSupported(CONVERT_AVX2));
+    depth_chain.avx2 = use_simd && convertKernelSupported(CONVERT_AVX2);
+    if (depth_chain.decimation > 1 && !depth_direct) {
+        std::cout << "Decimation needs the fused depth kernels, converting with -d" << std::endl;
+        depth_direct = true;
+    }
     
     // defineing the dynamic array and required varabiles.
-    int buff_size = 0, buff_size_sum = 0;
+    int buff_size = 0;
+    long buff_size_sum = 0, raw_size_sum = 0;
+    double encode_ms_sum = 0, decode_ms_sum = 0;
+    int round_trip_failures = 0;
     short *buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
+
+    // Any consumer may switch the connection to framed mode, so the wire buffer always exists.
+    wire_buffer = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(BUF_SIZE / 5));
+    decode_buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
+    kernel_buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
     
     // checking the file is null or not.
     if (filename == NULL) {
         char pull_request[1] = {0};
         // Defining the object to save the point cloud.
         rs2::pointcloud pc;
+        // Registers the color frame to the depth frame when the fused depth kernel can not.
+        rs2::align align_to_depth(RS2_STREAM_DEPTH);
          // defining the pipeline
         rs2::pipeline pipe;
         // Passing the configuration object to the pipeline. 
@@ -178,21 +401,83 @@ int main (int argc, char** argv) {
             depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 0.f);
 
         initSocket(PORT);
+        initFrameSender(&sender, client_sock, zerocopy);
         signal(SIGINT, sigintHandler);
 
         
+        // Frames the consumer asked for, one per pull request or as many as a credit grant allows.
+        long credits = 0;
+
         while (1) {
-            
-            if (recv(client_sock, pull_request, 1, 0) < 0) {
+            // Only block on the socket while there is nothing granted, otherwise just pick up new requests.
+            ssize_t received = recv(client_sock, pull_request, 1, credits > 0 ? MSG_DONTWAIT : 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
                 std::cout << "Client disconnected" << std::endl;
                 break;
             }
-            if (pull_request[0] == 'Z') {          
-                
+
+            if (received < 1) {
+                // No new request, keep sending on the credits that are left.
+            }
+            else if (pull_request[0] == REQUEST_FORMAT) {
+                // The consumer picks the wire format for this connection, frames carry a frameHeader from now on.
+                if (recv(client_sock, pull_request, 1, MSG_WAITALL) < 1 || !recordFormat(pull_request[0])) {
+                    std::cerr << "Faulty format request" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                wire_format = pull_request[0];
+                framed = true;
+                std::cout << "Wire format: " << wire_format << std::endl;
+                continue;
+            }
+            else if (pull_request[0] == REQUEST_CREDIT) {
+                // Push mode: the consumer grants a window of frames and tops it up as it consumes them.
+                uint32_t grant;
+                if (!readCreditGrant(client_sock, &grant)) {
+                    std::cerr << "Faulty credit request" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                credits += grant;
+                continue;
+            }
+            else if (pull_request[0] == REQUEST_ROI) {
+                // The stitcher or the VR client moved the stage, the next frame is culled to the new region.
+                if (!readRoiRequest(client_sock, &stage_roi)) {
+                    std::cerr << "Faulty region of interest" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                quantizeRoi(stage_roi, quant, &roi_quant, &roi_records);
+                std::cout << "Region of interest: " << stage_roi.num_volumes << " volumes" << std::endl;
+                continue;
+            }
+            else if (pull_request[0] == REQUEST_PULL) {
+                credits++;
+                continue;
+            }
+            else {                                     // Did not receive a correct pull request
+                std::cerr << "Faulty pull request" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            if (credits > 0) {
                 // Grab depth and color frames, and map each point to a color value
                 //It waits to execute the pipeline untill a frame. 
                 auto frames = pipe.wait_for_frames();
 
+                // The alignment reprojects the full depth image, so it goes before the post-processing.
+                if (depth_direct && !registerColor(frames.get_depth_frame(), frames.get_color_frame()))
+                    frames = align_to_depth.process(frames);
+                if (depthChainActive(&depth_chain))
+                    processDepthFrame(frames.get_depth_frame());
+                if (depthFilterActive(&depth_filter))
+                    filterDepthFrame(frames.get_depth_frame());
+
+                if (depth_direct) {
+                    buff_size = sendXYZRGBDepth(frames.get_depth_frame(), frames.get_color_frame(), buffer);
+                    credits--;
+                    continue;
+                }
+
                 // Getting the color and the depth data of the frames.
                 auto depth = frames.get_depth_frame();
                 auto color = frames.get_color_frame();
@@ -202,13 +487,8 @@ int main (int argc, char** argv) {
                  // Mapping the colour to the point cloud to get the colored point cloud.
                 pc.map_to(color);                      
 
-            
-
                 buff_size = sendXYZRGBPointcloud(pts, color, buffer);
-            }
-            else {                                     // Did not receive a correct pull request
-                std::cerr << "Faulty pull request" << std::endl;
-                exit(EXIT_FAILURE);
+                credits--;
             }
         }
 
@@ -224,6 +504,8 @@ int main (int argc, char** argv) {
         rs2::pipeline pipe;
         // Defining the object to save the point cloud.
         rs2::pointcloud pc;
+        // Registers the color frame to the depth frame when the fused depth kernel can not.
+        rs2::align align_to_depth(RS2_STREAM_DEPTH);
         // enabling pipe line to write in the file.
         cfg.enable_device_from_file(filename);
         // Passing the configuration object to the pipeline. 
@@ -263,12 +545,17 @@ int main (int argc, char** argv) {
         //get_extrinsics(const rs2::stream_profile& from_stream, const rs2::stream_profile& to_stream)
 
         int i = 0, last_frame = 0;
-        double duration_sum = 0;
+        double duration_sum = 0, rs_ms_sum = 0;
+        double filter_ms_sum = 0, chain_ms_sum = 0;
+        long filter_valid_sum = 0, filter_flying_sum = 0, filter_outliers_sum = 0;
         
          // Defining the frames object in which we can store the frames.
         rs2::frameset frames;
 
-        if (send_buffer) initSocket(PORT);
+        if (send_buffer) {
+            initSocket(PORT);
+            initFrameSender(&sender, client_sock, zerocopy);
+        }
         
         while (true)
         {    
@@ -293,14 +580,58 @@ int main (int argc, char** argv) {
                                                                     // stairs.bag vs sample.bag
                 rs2::video_frame color = frames.get_color_frame();  // 0.003 ms vs 0.001ms
                 rs2::depth_frame depth = frames.get_depth_frame();  // 0.001ms vs 0.001ms
-                // It's been used caluclate the point cloud from the depth data.
-                rs2::points pts = pc.calculate(depth);              // 27ms vs 27ms  
-                // Mapping the colour to the point cloud to get the colored point cloud.          
-                pc.map_to(color);       // 0.01ms vs 0.02ms  // Maps color values to a point in 3D space
+                rs2::points pts;
+
+                // Time of the librealsense pass in front of the conversion: the alignment, which needs the full
+                // depth image before the post-processing, or the point cloud after it.
+                timestamp rs_start = TIME_NOW;
+                if (depth_direct && !registerColor(depth, color)) {
+                    rs2::frameset aligned = align_to_depth.process(frames);
+                    color = aligned.get_color_frame();
+                    depth = aligned.get_depth_frame();
+                }
+                double rs_ms = timeMilli(TIME_NOW - rs_start).count();
+
+                if (depthChainActive(&depth_chain)) {
+                    timestamp chain_start = TIME_NOW;
+                    processDepthFrame(depth);
+                    const double chain_ms = timeMilli(TIME_NOW - chain_start).count();
+
+                    std::cout << "Post-processing Time: " << chain_ms << " ms, depth image " \
+                        << depthWidthOf(depth) << " x " << depthHeightOf(depth) << std::endl;
+                    chain_ms_sum += chain_ms;
+                }
+
+                // Flying pixels and outliers go before anything is deprojected from the depth image.
+                if (depthFilterActive(&depth_filter)) {
+                    timestamp filter_start = TIME_NOW;
+                    const depthFilterStats removed = filterDepthFrame(depth);
+                    const double filter_ms = timeMilli(TIME_NOW - filter_start).count();
+
+                    std::cout << "Depth Filter Time: " << filter_ms << " ms, removed " \
+                        << 100.0 * (removed.flying + removed.outliers) / std::max(removed.valid, 1L) << " % of the points" << std::endl;
+                    filter_ms_sum += filter_ms;
+                    filter_valid_sum += removed.valid;
+                    filter_flying_sum += removed.flying;
+                    filter_outliers_sum += removed.outliers;
+                }
+
+                if (!depth_direct) {
+                    rs_start = TIME_NOW;
+                    // It's been used caluclate the point cloud from the depth data.
+                    pts = pc.calculate(depth);              // 27ms vs 27ms  
+                    // Mapping the colour to the point cloud to get the colored point cloud.          
+                    pc.map_to(color);       // 0.01ms vs 0.02ms  // Maps color values to a point in 3D space
+                    rs_ms = timeMilli(TIME_NOW - rs_start).count();
+                }
+                rs_ms_sum += rs_ms;
                 
                 time_start = TIME_NOW;
                  // Getting the size and time for converting the point cloud to buffer.
-                buff_size = sendXYZRGBPointcloud(pts, color, buffer);   // 86ms vs 9.7ms
+                if (depth_direct)
+                    buff_size = sendXYZRGBDepth(depth, color, buffer);
+                else
+                    buff_size = sendXYZRGBPointcloud(pts, color, buffer);   // 86ms vs 9.7ms
                 time_end = TIME_NOW;
                 
                 // Dislaying the results.
@@ -310,6 +641,62 @@ int main (int argc, char** argv) {
                 duration_sum += timeMilli(time_end - time_start).count();
                 buff_size_sum += buff_size;
 
+                if (bench_kernels && depth_direct) {
+                    // Same for the fused depth kernels, there is no SSE one.
+                    const depthConvertParams params = depthConvertParamsFor(depth, color);
+                    const int num_pixels = depthWidthOf(depth) * depthHeightOf(depth);
+                    int reference_points = 0;
+                    for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+                        if (!convertKernelSupported(k) || k == CONVERT_SSE) continue;
+                        short * out = k == CONVERT_SCALAR ? decode_buffer : kernel_buffer;
+                        timestamp kernel_start = TIME_NOW;
+                        int num_points = convertDepth(depthConvertKernelOf(k), params, num_pixels, out, num_of_threads);
+                        kernel_ms_sum[k] += timeMilli(TIME_NOW - kernel_start).count();
+                        if (k == CONVERT_SCALAR)
+                            reference_points = num_points;
+                        else if (num_points != reference_points || memcmp(out, decode_buffer, sizeof(short) * 5 * num_points) != 0)
+                            kernel_mismatches[k]++;
+                    }
+                }
+                else if (bench_kernels) {
+                    // Run every kernel on the same frame, the scalar one first as the reference.
+                    // With cutoff or a region of interest the two-pass compaction is checked instead.
+                    const convertParams params = convertParamsOf(pts, color);
+                    int reference_points = pts.size();
+                    for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+                        if (!convertKernelSupported(k)) continue;
+                        short * out = k == CONVERT_SCALAR ? decode_buffer : kernel_buffer;
+                        int num_points = pts.size();
+                        timestamp kernel_start = TIME_NOW;
+                        if (cutoff || roiActive(&stage_roi))
+                            num_points = convertPointsInRange(k, params, pts.size(), out, num_of_threads);
+                        else
+                            convertPoints(convertKernelOf(k), params, pts.size(), out, num_of_threads);
+                        kernel_ms_sum[k] += timeMilli(TIME_NOW - kernel_start).count();
+                        if (k == CONVERT_SCALAR)
+                            reference_points = num_points;
+                        else if (num_points != reference_points || memcmp(out, decode_buffer, sizeof(short) * 5 * num_points) != 0)
+                            kernel_mismatches[k]++;
+                    }
+                }
+
+                if (framed) {
+                    // Unpack the frame again to time the receiver side and check the round trip (rgb565 is lossy).
+                    frameHeader header;
+                    memcpy(&header, wire_buffer, sizeof(header));
+                    timestamp decode_start = TIME_NOW;
+                    int num_points = unpackFrame(header, (const uint8_t *)frame_iov[1].iov_base, decode_buffer, BUF_SIZE / 5, num_of_threads);
+                    decode_ms_sum += timeMilli(TIME_NOW - decode_start).count();
+
+                    if (num_points * 5 * int(sizeof(short)) != raw_size)
+                        round_trip_failures++;
+                    else if (wire_format != FORMAT_XYZ16_RGB565 && memcmp(decode_buffer, buffer, raw_size) != 0)
+                        round_trip_failures++;
+
+                    raw_size_sum += raw_size;
+                    encode_ms_sum += encode_ms;
+                }
+
             }
         }
         
@@ -317,6 +704,7 @@ int main (int argc, char** argv) {
         
         if (send_buffer)
         {
+            waitFrameSent(&sender);
             close(client_sock);
             close(sockfd);
         }
@@ -337,6 +725,19 @@ int main (int argc, char** argv) {
         std::cout << "\n### Total Frames = " << i << std::endl;
         std::cout << "### AVG Frame Time: " << duration_sum / i << " ms" << std::endl;
         std::cout << "### AVG FPS: " << 1000.0 / (duration_sum / i) << std::endl;
+        std::cout << "### AVG " << (depth_direct ? "Align" : "Point Cloud") << " Time (librealsense): " << rs_ms_sum / i << " ms" << std::endl;
+        if (depthChainActive(&depth_chain))
+        {
+            std::cout << "### AVG Post-processing Time: " << chain_ms_sum / i << " ms, depth image " \
+                << depth.get_width() / depth_chain.decimation << " x " << depth.get_height() / depth_chain.decimation << std::endl;
+        }
+        if (depthFilterActive(&depth_filter))
+        {
+            const double valid = std::max(filter_valid_sum, 1L);
+            std::cout << "### AVG Depth Filter Time: " << filter_ms_sum / i << " ms, removed " \
+                << 100.0 * (filter_flying_sum + filter_outliers_sum) / valid << " % of the points (flying pixels " \
+                << 100.0 * filter_flying_sum / valid << " %, outliers " << 100.0 * filter_outliers_sum / valid << " %)" << std::endl;
+        }
         
         if (num_of_threads)
         {
@@ -346,380 +747,289 @@ int main (int argc, char** argv) {
             std::cout << "### Running Serialized" << std::endl;
         }
 
-        if (compress)
+        if (framed)
         {
-            std::cout << "\n### Sending Compressed Stream" << std::endl;
+            std::cout << "\n### Sending Framed Stream, Format " << wire_format << std::endl;
             std::cout << "### AVG Bytes/Frame: " << float(buff_size_sum) / (i*1000000) << " MBytes" << std::endl;
-            std::cout << "### AVG Compression Ratio " << float(buff_size_sum) / ( (pts.size()/100) * 5 * sizeof(short) * i) << " %" << std::endl;
+            std::cout << "### AVG Raw Bytes/Frame: " << float(raw_size_sum) / (i*1000000) << " MBytes" << std::endl;
+            std::cout << "### AVG Reduction: " << double(raw_size_sum) / buff_size_sum << " : 1 (" \
+                << 100.0 * buff_size_sum / raw_size_sum << " %)" << std::endl;
+            std::cout << "### AVG Pack: " << encode_ms_sum / i << " ms, " << (raw_size_sum / 1e6) / (encode_ms_sum / 1000) << " MB/s" << std::endl;
+            std::cout << "### AVG Unpack: " << decode_ms_sum / i << " ms, " << (raw_size_sum / 1e6) / (decode_ms_sum / 1000) << " MB/s" << std::endl;
+            std::cout << "### Round trip failures: " << round_trip_failures << std::endl;
+            std::cout << "### Quantization: " << last_quant.step_mm << " mm, last frame from " << last_quant.box_min[0] \
+                << ", " << last_quant.box_min[1] << ", " << last_quant.box_min[2] << " to " << last_quant.box_max[0] \
+                << ", " << last_quant.box_max[1] << ", " << last_quant.box_max[2] << " units" << std::endl;
         }else
         {
             std::cout << "\n### AVG Bytes/Frame: " << float(buff_size_sum) / (i*1000000) << " MBytes" << std::endl;
             std::cout << "### AVG Filter Compress Ratio " << float(buff_size_sum) / ( (pts.size()/100) * 5 * sizeof(short) * i) << " %" << std::endl;
         }
+
+        if (bench_kernels)
+        {
+            std::cout << "\n### " << (depth_direct ? "Fused depth" : "Conversion") << " kernels (" << pts.size() << " pixels, selected: " << convert_kernel_names[convert_kernel] << ")" << std::endl;
+            for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+                if (depth_direct && k == CONVERT_SSE) continue;
+                if (!convertKernelSupported(k)) {
+                    std::cout << "### " << convert_kernel_names[k] << ": not supported by this CPU" << std::endl;
+                    continue;
+                }
+                std::cout << "### " << convert_kernel_names[k] << ": " << kernel_ms_sum[k] / i << " ms, " \
+                    << pts.size() / (kernel_ms_sum[k] / i) / 1000 << " Mpts/s, " \
+                    << kernel_ms_sum[CONVERT_SCALAR] / kernel_ms_sum[k] << "x scalar, mismatching frames: " << kernel_mismatches[k] << std::endl;
+            }
+        }
+
+        if (sender.zerocopy)
+        {
+            std::cout << "### Zero copy sends: " << sender.zc_calls << ", copied by the kernel: " << sender.zc_copied << std::endl;
+        }
     }
 
     free(buffer);
+    free(wire_buffer);
+    free(decode_buffer);
+    free(kernel_buffer);
+    freeRayTable(&depth_rays);
+    freeColorRegistration(&color_registration);
+    freeDepthFilter(&depth_filter);
+    freeDepthChain(&depth_chain);
+    free(decimated_color);
     return 0;
 }
 
-bool initialized = false;
-int pts_size;
-int w, h, cl_bp, cl_sb, w_min, h_min;
-
-// TODO CLEAN
-float conv_rate, point5f, w_f, h_f, h_min_f, cl_bp_f, cl_sb_f;
-
-// Float
-__m128 _conv_rate, _cl_bp_f, _cl_sb_f, _f5, _w, _h, z_lo, z_hi, x_lo, x_hi;
-
-// integ
-__m128i _zero, _w_min, _h_min, _cl_bp, _cl_sb;
+// Describes the vertices, texture coordinates and color frame of a textured point cloud.
+convertParams convertParamsOf(rs2::points& pts, const rs2::video_frame& color) {
+    convertParams params;
+    params.vertices = reinterpret_cast<const float*>(pts.get_vertices());
+    params.tex_coords = reinterpret_cast<const float*>(pts.get_texture_coordinates());
+    params.color = reinterpret_cast<const uint8_t*>(color.get_data());
+    params.w = color.get_width();
+    params.h = color.get_height();
+    params.cl_bp = color.get_bytes_per_pixel();
+    params.cl_sb = color.get_stride_in_bytes();
+    params.tf = quant_tf;
+    params.conv_rate = quantRate(quant);
+    // capture range of the cutoff, otherwise only the region of interest culls
+    params.z_min = cutoff ? 0 : -INFINITY;
+    params.z_max = cutoff ? 1.5 : INFINITY;
+    params.x_min = cutoff ? -2 : -INFINITY;
+    params.x_max = cutoff ? 2 : INFINITY;
+    params.roi = &roi_quant;
+    return params;
+}
 
 // Converting the point cloud to buffer to send the data through the network if we have simd enabled.
+// The widest kernel the CPU supports converts every point, or with cutoff the points in the capture range
+// and with a region of interest the points inside it.
 int copyPointCloudXYZRGBToBufferSIMD(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer)
 {
-    // Getting the vertices of the point object.
-    const auto vert = pts.get_vertices();
-     // Getting the texture of the coordinate points.
-    const rs2::texture_coordinate* tcrd = pts.get_texture_coordinates();
-    const uint8_t* color_data = reinterpret_cast<const uint8_t*>(color.get_data());
-
-    if (!initialized){
-        // getting the information from the video frames.
-        initialized = true;
-        pts_size = pts.size();
-        w = color.get_width();
-        h = color.get_height();
-        cl_bp = color.get_bytes_per_pixel();
-        cl_sb = color.get_stride_in_bytes();
-        w_min = (w - 1);
-        h_min = (h - 1);
-
-        // TODO CLEAN
-        conv_rate = CONV_RATE;
-        point5f = .5f;
-        w_f = float(w);
-        h_f = float(h);
-
-        cl_bp_f = float(cl_bp);
-        cl_sb_f = float(cl_sb);
-
-        // Float
-        // creates the SSE resigistries with a single value.  
-        _conv_rate = _mm_broadcast_ss(&conv_rate);
-        _cl_bp_f = _mm_broadcast_ss(&cl_bp_f);
-        _cl_sb_f = _mm_broadcast_ss(&cl_sb_f);
-     
-        _f5 = _mm_broadcast_ss(&point5f);
-        
-        _w = _mm_broadcast_ss(&w_f);
-        _h = _mm_broadcast_ss(&h_f);
-       
-        // creates a new vector variable with one floating-point values.
-        z_lo = _mm_set_ps1(0);
-        z_hi = _mm_set_ps1(1.5);
-        x_lo = _mm_set_ps1(-2);
-        x_hi = _mm_set_ps1(2);
-
-        // integ
-        // setting the 128-bit integer register to zero.
-        _zero = _mm_setzero_si128();
-
-        // creates a vector of four 32-bit integers with all elements set to the same value
-        _w_min = _mm_set1_epi32(w_min);
-        _h_min = _mm_set1_epi32(h_min);
-        _cl_bp = _mm_set1_epi32(cl_bp);
-        const __m128i _cl_sb = _mm_set1_epi32(cl_sb);
-    }
-    
-    int global_count = 0;
-    // inilizing the multi-therding parameters
-    #pragma omp parallel for ordered schedule(static, 10000) num_threads(num_of_threads)
-    for (int i = 0; i < pts_size; i += 4) {
-          
-        
-        int i1 = i;
-        int i2 = i+1;
-        int i3 = i+2;
-        int i4 = i+3;
-
-         // aligning the arrays of four single-precision floating-point numbers to 16 byte boundary.
-        __attribute__((aligned(16))) float v_temp1[4];
-        __attribute__((aligned(16))) float v_temp2[4];
-        __attribute__((aligned(16))) float v_temp3[4];
-        __attribute__((aligned(16))) float v_temp4[4];
-
-        __attribute__((aligned(16))) int idx[4];
-        __attribute__((aligned(16))) int idy[4];
-
-        // load
-        // creates a new 128 byte vector variable with four 32-bit floating-point values.
-        __m128 _x = _mm_set_ps(tcrd[i1].u, tcrd[i2].u, tcrd[i3].u, tcrd[i4].u); // load u
-        __m128 _y = _mm_set_ps(tcrd[i1].v, tcrd[i2].v, tcrd[i3].v, tcrd[i4].v); // load v
-
-
-        // Multiplies the first two vectors and add the result to third vector.
-        _x = _mm_fmadd_ps(_x, _w, _f5); // fma
-        _y = _mm_fmadd_ps(_y, _h, _f5);
-
-        // float to int
-        // Converting the 128 floating-point vector to integer vector.
-        __m128i _xi = _mm_cvttps_epi32(_x);
-        __m128i _yi = _mm_cvttps_epi32(_y);
-
-        // Getting the maxium values of the both the varabiles.
-        _xi = _mm_max_epi32(_xi, _zero);    // max
-        _yi = _mm_max_epi32(_yi, _zero);
-        _xi = _mm_min_epi32(_xi, _w_min);   // min
-        _yi = _mm_min_epi32(_yi, _h_min);
-        
-        _mm_storeu_si128((__m128i_u*)idx, _xi);
-        _mm_storeu_si128((__m128i_u*)idy, _yi);
-
-        int idx1 = idx[3]*cl_bp + idy[3]*cl_sb;
-        int idx2 = idx[2]*cl_bp + idy[2]*cl_sb;
-        int idx3 = idx[1]*cl_bp + idy[1]*cl_sb;
-        int idx4 = idx[0]*cl_bp + idy[0]*cl_sb;
-
-         // creates the SSE resigistries with a single value. 
-        __m128 ss_x1 = _mm_broadcast_ss(&vert[i].x);
-        __m128 ss_y1 = _mm_broadcast_ss(&vert[i].y);
-        __m128 ss_z1 = _mm_broadcast_ss(&vert[i].z);
-
-        __m128 ss_x2 = _mm_broadcast_ss(&vert[i2].x);
-        __m128 ss_y2 = _mm_broadcast_ss(&vert[i2].y);
-        __m128 ss_z2 = _mm_broadcast_ss(&vert[i2].z);
-
-        __m128 ss_x3 = _mm_broadcast_ss(&vert[i3].x);
-        __m128 ss_y3 = _mm_broadcast_ss(&vert[i3].y);
-        __m128 ss_z3 = _mm_broadcast_ss(&vert[i3].z);
-
-        __m128 ss_x4 = _mm_broadcast_ss(&vert[i4].x);
-        __m128 ss_y4 = _mm_broadcast_ss(&vert[i4].y);
-        __m128 ss_z4 = _mm_broadcast_ss(&vert[i4].z);
-
-        // Multiplies the first two vectors and add the result to third vector.
-        __m128 _v1 = _mm_fmadd_ps(ss_x1, ss_a, ss_d);
-        _v1 = _mm_fmadd_ps(ss_y1, ss_b, _v1);
-        _v1 = _mm_fmadd_ps(ss_z1, ss_c, _v1);
-
-        __m128 _v2 = _mm_fmadd_ps(ss_x2, ss_a, ss_d);
-        _v2 = _mm_fmadd_ps(ss_y2, ss_b, _v2);
-        _v2 = _mm_fmadd_ps(ss_z2, ss_c, _v2);
-
-        __m128 _v3 = _mm_fmadd_ps(ss_x3, ss_a, ss_d);
-        _v3 = _mm_fmadd_ps(ss_y3, ss_b, _v3);
-        _v3 = _mm_fmadd_ps(ss_z3, ss_c, _v3);
-
-        __m128 _v4 = _mm_fmadd_ps(ss_x4, ss_a, ss_d);
-        _v4 = _mm_fmadd_ps(ss_y4, ss_b, _v4);
-        _v4 = _mm_fmadd_ps(ss_z4, ss_c, _v4);
-
-        // Multipling the two vectors.
-        _v1 = _mm_mul_ps(_v1, _conv_rate); // multiply with _conv_rate
-        _v2 = _mm_mul_ps(_v2, _conv_rate); // multiply with _conv_rate
-        _v3 = _mm_mul_ps(_v3, _conv_rate); // multiply with _conv_rate
-        _v4 = _mm_mul_ps(_v4, _conv_rate); // multiply with _conv_rate
-
-        
-        _mm_store_ps(v_temp1, _v1);
-        _mm_store_ps(v_temp2, _v2);
-        _mm_store_ps(v_temp3, _v3);
-        _mm_store_ps(v_temp4, _v4);
-
-        if (cutoff) {
-            
-            __m128 z_pts = _mm_set_ps(vert[i].z, vert[i2].z, vert[i3].z, vert[i4].z);
-            __m128 x_pts = _mm_set_ps(vert[i].x, vert[i2].x, vert[i3].x, vert[i4].x);
-
-            __m128 z_gt_lo = _mm_cmpgt_ps(z_pts, z_lo);
-            __m128 z_le_hi = _mm_cmple_ps(z_pts, z_hi);
-            __m128 x_gt_lo = _mm_cmpgt_ps(x_pts, x_lo);
-            __m128 x_le_hi = _mm_cmple_ps(x_pts, x_hi);
+    if (cutoff || roiActive(&stage_roi))
+        return convertPointsInRange(convert_kernel, convertParamsOf(pts, color), pts.size(), pc_buffer, num_of_threads);
 
-            __m128 z_mask = _mm_and_ps(z_gt_lo, z_le_hi);
-            __m128 x_mask = _mm_and_ps(x_gt_lo, x_le_hi);
-            __m128 pt_mask = _mm_and_ps(z_mask, x_mask);
-
-            float pt_mask_f[4];
-            _mm_store_ps(pt_mask_f, pt_mask);
+    convertPoints(convertKernelOf(convert_kernel), convertParamsOf(pts, color), pts.size(), pc_buffer, num_of_threads);
+    return pts.size();
+}
 
-            long count = -1;
+// Converting the point cloud to buffer to send the data through the network.
+int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer) {
 
-            //v1
-            if (pt_mask_f[0] != 0) {
+    const convertParams params = convertParamsOf(pts, color);
+    const int pts_size = pts.size();
 
-                #pragma omp atomic capture
-                count = global_count++;
+    // Same two-pass compaction as the SIMD path, the points in range stay in raster order.
+    if (cutoff || roiActive(&stage_roi))
+        return convertPointsInRange(CONVERT_SCALAR, params, pts_size, pc_buffer, num_of_threads);
 
-                pc_buffer[count * 5 + 0] = short(v_temp1[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp1[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp1[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx1] + (color_data[idx1 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx1 + 2];
+    // Same rounding as the SIMD kernels, so every kernel can be checked against this one bit for bit.
+    convertPoints(convertPointsScalar, params, pts_size, pc_buffer, num_of_threads);
 
-                
-            }
-            
-           
-            if (pt_mask_f[1] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
+    return pts_size;
 
-                pc_buffer[count * 5 + 0] = short(v_temp2[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp2[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp2[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx2] + (color_data[idx2 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx2 + 2];
+}
 
-                
-            }
-            
-            
-            if (pt_mask_f[2] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
-                
-                pc_buffer[count * 5 + 0] = short(v_temp3[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp3[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp3[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx3] + (color_data[idx3 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx3 + 2];
+// Header extension of a depth frame: intrinsics and depth unit of the stream and the camera transform.
+depthExtension depthExtensionOf(const rs2::depth_frame& depth) {
+    const rs2_intrinsics intr = depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    depthExtension ext;
+    memset(&ext, 0, sizeof(ext));
+
+    ext.width = uint16_t(intr.width);
+    ext.height = uint16_t(intr.height);
+    ext.model = intr.model;
+    ext.fx = intr.fx;
+    ext.fy = intr.fy;
+    ext.ppx = intr.ppx;
+    ext.ppy = intr.ppy;
+    memcpy(ext.coeffs, intr.coeffs, sizeof(ext.coeffs));
+    ext.depth_scale = depth.get_units();
+    memcpy(ext.tf, tf_mat, sizeof(ext.tf));
+
+    // The post-processing chain leaves a decimated image in the frame.
+    return depth_chain.decimation > 1 ? decimateExtension(ext, depth_chain.decimation) : ext;
+}
 
-                
-            }
+// Sets up the registration of color into depth from the stream profiles. Returns false, and the color frame
+// has to be aligned to depth, when the color stream has a distortion model the kernels can not project.
+bool registerColor(const rs2::depth_frame& depth, const rs2::video_frame& color) {
+    const rs2_intrinsics intr = color.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    const rs2_extrinsics extr = depth.get_profile().get_extrinsics_to(color.get_profile());
+
+    // The cell tables are only recomputed when the depth resolution or the step change.
+    color_registered = color.get_bytes_per_pixel() >= 3 &&
+                       updateColorRegistration(&color_registration, depthExtensionOf(depth), extr.rotation,
+                                               extr.translation, intr.width, intr.height, intr.fx, intr.fy,
+                                               intr.ppx, intr.ppy, intr.model, intr.coeffs,
+                                               color.get_bytes_per_pixel(), color.get_stride_in_bytes(),
+                                               registration_step);
+    return color_registered;
+}
 
-            //v4
-            if (pt_mask_f[3] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
+depthConvertParams depthConvertParamsFor(const rs2::depth_frame& depth, const rs2::video_frame& color) {
+    const int cl_bp = color.get_bytes_per_pixel();
+    if (!color_registered &&
+        (color.get_width() != depth.get_width() || color.get_height() != depth.get_height() ||
+         color.get_stride_in_bytes() != color.get_width() * cl_bp || cl_bp < 3)) {
+        std::cerr << "Color frame is not aligned to the depth frame" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-                pc_buffer[count * 5 + 0] = short(v_temp4[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp4[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp4[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx4] + (color_data[idx4 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx4 + 2];
+    // The rays are only recomputed when the intrinsics change, the records are quantized with quant_tf.
+    depthExtension ext = depthExtensionOf(depth);
+    memcpy(ext.tf, quant_tf, sizeof(ext.tf));
+    const uint8_t * color_data = (const uint8_t *)color.get_data();
+
+    // An aligned color frame still has the full resolution, it takes the center pixel of every block.
+    if (!color_registered && depth_chain.decimation > 1) {
+        if (!decimated_color)
+            decimated_color = (uint8_t *)malloc(size_t(color.get_width()) * color.get_height() * cl_bp);
+        decimateColor(color_data, color.get_width(), color.get_height(), cl_bp, color.get_stride_in_bytes(),
+                      depth_chain.decimation, decimated_color, num_of_threads);
+        color_data = decimated_color;
+    }
 
-                
-            }
-        }
+    depthConvertParams params = depthConvertParamsOf(ext, &depth_rays, (const uint16_t *)depth.get_data(),
+                                                     color_data, cl_bp, quantRate(quant));
+    if (color_registered) {
+        params.reg = &color_registration;
+        if (registration_step > 1)
+            updateRegistrationMap(params, &color_registration, ext.height, num_of_threads);
+    }
 
-        else {
-            //v1
-            pc_buffer[i * 5 + 0] = short(v_temp1[0]);
-            pc_buffer[i * 5 + 1] = short(v_temp1[1]);
-            pc_buffer[i * 5 + 2] = short(v_temp1[2]);
-            pc_buffer[i * 5 + 3] = color_data[idx1] + (color_data[idx1 + 1] << 8);
-            pc_buffer[i * 5 + 4] = color_data[idx1 + 2];
-            
-            //v2
-            pc_buffer[i * 5 + 5] = short(v_temp2[0]);
-            pc_buffer[i * 5 + 6] = short(v_temp2[1]);
-            pc_buffer[i * 5 + 7] = short(v_temp2[2]);
-            pc_buffer[i * 5 + 8] = color_data[idx2] + (color_data[idx2 + 1] << 8);
-            pc_buffer[i * 5 + 9] = color_data[idx2 + 2];
-            
-            //v3
-            pc_buffer[i * 5 + 10] = short(v_temp3[0]);
-            pc_buffer[i * 5 + 11] = short(v_temp3[1]);
-            pc_buffer[i * 5 + 12] = short(v_temp3[2]);
-            pc_buffer[i * 5 + 13] = color_data[idx3] + (color_data[idx3 + 1] << 8);
-            pc_buffer[i * 5 + 14] = color_data[idx3 + 2];
-            
-            //v4
-            pc_buffer[i * 5 + 15] = short(v_temp4[0]);
-            pc_buffer[i * 5 + 16] = short(v_temp4[1]);
-            pc_buffer[i * 5 + 17] = short(v_temp4[2]);
-            pc_buffer[i * 5 + 18] = color_data[idx4] + (color_data[idx4 + 1] << 8);
-            pc_buffer[i * 5 + 19] = color_data[idx4 + 2];
-        }
-    
+    // Same capture range as the cutoff of the point cloud path.
+    params.cull = cutoff;
+    params.z_min = 0;
+    params.z_max = 1.5;
+    params.x_min = -2;
+    params.x_max = 2;
+    params.roi = &roi_records;
+    return params;
 }
-    
-    
-    if (cutoff)
-        return global_count;
 
-    return pts_size;
+// The filters work on the Z16 image of the frame itself, so rs2::pointcloud and the fused kernels both
+// see the filtered depth.
+uint16_t * depthDataOf(const rs2::depth_frame& depth) {
+    if (depth.get_stride_in_bytes() != depth.get_width() * int(sizeof(uint16_t))) {
+        std::cerr << "Depth frame is not a packed Z16 image" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return (uint16_t *)const_cast<void *>(depth.get_data());
 }
 
-// Converting the point cloud to buffer to send the data through the network.
-int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer) {
-
-    const auto vertices = pts.get_vertices();
-    const rs2::texture_coordinate* tex_coords = pts.get_texture_coordinates();
-    const uint8_t* color_data = reinterpret_cast<const uint8_t*>(color.get_data());
+// Size of the depth image after the decimation, the front of the frame buffer.
+int depthWidthOf(const rs2::depth_frame& depth) {
+    return depth.get_width() / depth_chain.decimation;
+}
 
-    const int pts_size = pts.size();
-    const int w = color.get_width();
-    const int h = color.get_height();
-    const int cl_bp = color.get_bytes_per_pixel();
-    const int cl_sb = color.get_stride_in_bytes();
-    const int w_min = w - 1;
-    const int h_min = h - 1;
-    
-    // TODO Optimize return size
-    // inilizing the multi-therding parameters
-    #pragma omp parallel for schedule(static, 10000) num_threads(num_of_threads)
-    for (int i = 0; i < pts_size; i++) {
+int depthHeightOf(const rs2::depth_frame& depth) {
+    return depth.get_height() / depth_chain.decimation;
+}
 
-        if (cutoff)
-        {
-            if (!vertices[i].z) continue;
-            if (!vertices[i].x) continue;
-            if (vertices[i].z > 1.5) continue;
-            if (!(-2 < vertices[i].x < 2)) continue;
-        }
-               
-        int x = std::min(std::max(int(tex_coords[i].u*w + .5f), 0), w_min);
-        int y = std::min(std::max(int(tex_coords[i].v*h + .5f), 0), h_min);
-        
-        int idx = x * cl_bp + y * cl_sb;
+void processDepthFrame(const rs2::depth_frame& depth) {
+    int width = depth.get_width(), height = depth.get_height();
+    processDepth(&depth_chain, depthDataOf(depth), &width, &height, depth.get_units(), num_of_threads);
+}
 
-        // Might be wrong
-        float x_p = tf_mat[0] * vertices[i].x + tf_mat[1] * vertices[i].y + tf_mat[2] * vertices[i].z + tf_mat[3];
-        float y_p = tf_mat[4] * vertices[i].x + tf_mat[5] * vertices[i].y + tf_mat[6] * vertices[i].z + tf_mat[7];
-        float z_p = tf_mat[8] * vertices[i].x + tf_mat[9] * vertices[i].y + tf_mat[10] * vertices[i].z + tf_mat[11];
-        
-        pc_buffer[i * 5    ] = static_cast<short>(x_p * CONV_RATE);
-        pc_buffer[i * 5 + 1] = static_cast<short>(y_p * CONV_RATE);
-        pc_buffer[i * 5 + 2] = static_cast<short>(z_p * CONV_RATE);
-        pc_buffer[i * 5 + 3] = color_data[idx] + (color_data[idx + 1] << 8);
-        pc_buffer[i * 5 + 4] = color_data[idx + 2];
-    }
+depthFilterStats filterDepthFrame(const rs2::depth_frame& depth) {
+    return filterDepth(&depth_filter, depthDataOf(depth), depthWidthOf(depth), depthHeightOf(depth),
+                       depth.get_units(), num_of_threads);
+}
 
-    return pts_size;
+// Converting the Z16 depth image to buffer in one fused pass: deprojection, transform, culling and packing.
+// Only pixels with depth (and inside the capture range with cutoff and the region of interest) become points,
+// in raster order.
+int copyDepthXYZRGBToBuffer(const rs2::depth_frame& depth, const rs2::video_frame& color, short * pc_buffer) {
+    const depthConvertParams params = depthConvertParamsFor(depth, color);
+    const depthConvertKernel kernel = depthConvertKernelOf(use_simd ? convert_kernel : CONVERT_SCALAR);
 
+    return convertDepth(kernel, params, depthWidthOf(depth) * depthHeightOf(depth), pc_buffer, num_of_threads);
 }
 
 int sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer) {
     int size;
-    
-    // Clean Buffer
-    memset(buffer, 0, BUF_SIZE);
+
+    // The buffers of the previous frame may still be referenced by a zero copy send.
+    waitFrameSent(&sender);
 
     // Getting the network buffer loaded with data
     if (use_simd)
     {
-        size = copyPointCloudXYZRGBToBufferSIMD(pts, color, &buffer[0] + sizeof(short));
+        size = copyPointCloudXYZRGBToBufferSIMD(pts, color, buffer);
     }else
     {
-        size = copyPointCloudXYZRGBToBuffer(pts, color, &buffer[0] + sizeof(short));
+        size = copyPointCloudXYZRGBToBuffer(pts, color, buffer);
     }
-    
+
+    return sendRecords(buffer, size, color);
+}
+
+int sendXYZRGBDepth(rs2::depth_frame depth, rs2::video_frame color, short * buffer) {
+    // The buffers of the previous frame may still be referenced by a zero copy send.
+    waitFrameSent(&sender);
+
+    int size = copyDepthXYZRGBToBuffer(depth, color, buffer);
+    return sendRecords(buffer, size, color);
+}
+
+// Packs the size records of buffer in the negotiated format and sends them, returns the bytes of the frame.
+int sendRecords(short * buffer, int size, const rs2::video_frame& color) {
+    ssize_t sent = 0;
+
     // Size in bytes of the payload
-    size = 5 * size * sizeof(short);
-    
+    raw_size = 5 * size * sizeof(short);
+
+    if (framed)
+    {
+        // Pack the records into the negotiated wire format behind a frameHeader and the quantExtension.
+        timestamp encode_start = TIME_NOW;
+        last_quant = quantExtensionOf(quant, buffer, size);
+        int wire_size = packFrameIov(buffer, size, wire_format, color.get_frame_number(),
+                                     uint64_t(color.get_timestamp() * 1000), wire_buffer, frame_iov, num_of_threads,
+                                     &last_quant);
+        encode_ms = timeMilli(TIME_NOW - encode_start).count();
 
-    // Sending the callback to the server with the size of the data.
-    if (send_buffer)
-    {   
-        // Include the number of bytes in the payload
-        memcpy(buffer, &size, sizeof(int));
-        send(client_sock, (char *)buffer, size + sizeof(int), 0);
+        if (send_buffer)
+        {
+            // sendFrameIov advances the iovecs, keep frame_iov intact for the round trip check.
+            struct iovec iov[2] = {frame_iov[0], frame_iov[1]};
+            sent = sendFrameIov(&sender, iov, 2);
+        }
+        size = wire_size;
+    }
+    else
+    {
+        size = raw_size;
+
+        // Sending the length prefix and the records to the client.
+        if (send_buffer)
+            sent = sendLegacyFrame(&sender, buffer, size / (5 * sizeof(short)));
+    }
+
+    if (sent < 0)
+    {
+        std::cerr << "Send failure" << std::endl;
+        exit(EXIT_FAILURE);
     }
     
     return size;
@@ -13,12 +13,23 @@
 #include <immintrin.h>
 #include <xmmintrin.h>
 #include <thread>
+#include <atomic>
+
+#include "Meta/frame.h"
+#include "Meta/net.h"
+#include "Meta/pipeline.h"
+#include "Meta/fanout.h"
+#include "Meta/convert.h"
+#include "Meta/roi.h"
+#include "Meta/voxel.h"
+#include "Meta/postprocess.h"
 
 #define TIME_NOW    std::chrono::high_resolution_clock::now()
 #define BUF_SIZE    5000000
-#define CONV_RATE   1000.0
 #define DOWNSAMPLE  1
 #define PORT        8000
+#define NUM_SLOTS   6
+#define REPORT_FRAMES 30
 
 // create a type alias for the type high_resolution_clock clockTime
 typedef std::chrono::high_resolution_clock clockTime;
@@ -28,12 +39,43 @@ typedef std::chrono::time_point<clockTime> timePoint;
 typedef std::chrono::duration<double, std::milli> timeMilli;
 
 // inilizing the variables
-int loop_count = 1;
-int client_sock = 0;
 int sockfd = 0;
 
-// inilizing the buffer
-short * buffer;
+// One frame in flight: the camera frames, the records and the frame packed for every wire mode in use.
+struct frameSlot {
+    rs2::points pts;
+    rs2::frame color;
+    rs2::frame depth;
+    short * records;
+    uint16_t * culled_depth;        // depth image inside the region of interest, allocated on first use
+    uint8_t * decimated_color;      // color aligned to the decimated depth image, allocated on first use
+    uint8_t * wire[NUM_FORMATS];    // allocated the first time a subscriber asks for the format
+    int legacy_size;                // bare int length prefix of the unframed mode
+    int num_points;
+    sharedFrame frame;
+};
+
+// Slots are owned by one stage at a time until they are published, then by the subscribers sending them.
+// Beyond the triple buffer of the stages there is room for every subscriber queue to hold recent frames.
+frameSlot slots[NUM_SLOTS];
+frameRing<frameSlot *> free_ring, captured_ring;
+
+// Every subscriber connection, fed from the encoded frames.
+fanoutHub hub;
+int queue_depth = 2;
+bool drop_newest = false;
+
+stageStats capture_stats = {"capture"};
+stageStats encode_stats = {"encode"};
+stageStats send_stats = {"send"};
+bool zerocopy = false;
+
+// Keyframe / delta coding for FORMAT_DELTA subscribers, only touched by the encode stage.
+temporalEncoder temporal;
+int key_interval = 30;
+int depth_threshold = 10;
+int color_threshold = 16;
+char * filename = NULL;
 
 // inilizing the variables
 bool timer = false;
@@ -46,27 +88,46 @@ float tf_mat[] =  {-0.69888007, -0.32213748,  0.63858757, -2.22900000,
                     -0.00653159, -0.88991947, -0.45607091,  0.36400000,
                      0.00000000,  0.00000000,  0.00000000,  1.00000000};
 
-
-
-// creates the SSE resigistries with values from the tf_mat array and a zero value.                 
-__m128 ss_a = _mm_set_ps(0, tf_mat[8], tf_mat[4], tf_mat[0]);
-__m128 ss_b = _mm_set_ps(0, tf_mat[9], tf_mat[5], tf_mat[1]);
-__m128 ss_c = _mm_set_ps(0, tf_mat[10], tf_mat[6], tf_mat[2]);
-__m128 ss_d = _mm_set_ps(0, tf_mat[11], tf_mat[7], tf_mat[3]);
-
-
-// This Function handles the signal.
+// Record conversion kernel, the widest one the CPU supports (Meta/convert.h).
+int convert_kernel = CONVERT_SCALAR;
+
+// Quantization of the records (Meta/quantize.h) from -Q and -O. The kernels convert with quant_tf, tf_mat
+// followed by the origin shift. Framed subscribers get it with every frame, unframed ones assume 1 mm.
+quantizer quant;
+float quant_tf[16];
+
+// Region of interest after tf_mat in meters (Meta/roi.h), from -r or REQUEST_ROI, the same region after
+// quant_tf for the point cloud kernels and in record units for the fused depth kernels. Only the encode
+// stage uses them.
+char * roi_filename = NULL;
+roiSet stage_roi;
+roiSet roi_quant;
+roiSet roi_records;
+depthRayTable roi_rays;
+
+// Voxel-grid downsampling of the records (Meta/voxel.h), 0 sends every point. With a point budget the voxel
+// size follows the scene from frame to frame. Only the encode stage uses them.
+float voxel_size = 0;
+int point_budget = 0;
+voxelGrid voxel_grid;
+
+// Post-processing chain on the Z16 image in the capture stage (Meta/postprocess.h). A decimated image can't
+// go through rs2::pointcloud: the color is aligned to depth first and the encode stage converts the image with
+// the fused depth kernels and depth_rays.
+depthChain depth_chain;
+depthRayTable depth_rays;
+
+
+// This Function handles the signal, stopping the hub ends the event loop in main which stops the stages.
 void sigintHandler(int dummy) {
-    close(client_sock);
-    close(sockfd);
-    free(buffer);
+    stopFanoutHub(&hub);
 }
 
 
 // Function to get Arguments from the terminal
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hts")) != -1) {
+    while ((c = getopt(argc, argv, "htsZq:kI:D:C:f:r:v:B:x:n:N:T:P:Q:O:")) != -1) {
         switch(c) {
             
             case 't':
@@ -75,21 +136,120 @@ void parseArgs(int argc, char** argv) {
             case 's':
                 save = true;
                 break;
+            case 'Z':
+                zerocopy = true;
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                if (queue_depth < 1 || queue_depth > MAX_SUB_QUEUE) {
+                    std::cerr << "Invalid queue depth " << queue_depth << ", has to be 1 to " << MAX_SUB_QUEUE << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                drop_newest = true;
+                break;
+            case 'I':
+                key_interval = atoi(optarg);
+                break;
+            case 'D':
+                depth_threshold = atoi(optarg);
+                break;
+            case 'C':
+                color_threshold = atoi(optarg);
+                break;
+            case 'f':
+                filename = optarg;
+                break;
+            case 'r':
+                roi_filename = optarg;
+                break;
+            case 'v':
+                voxel_size = atof(optarg);
+                break;
+            case 'B':
+                point_budget = atoi(optarg);
+                break;
+            case 'x':
+                depth_chain.decimation = atoi(optarg);
+                if (depth_chain.decimation != 2 && depth_chain.decimation != 4) {
+                    std::cerr << "Decimation factor has to be 2 or 4" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                depth_chain.min_distance = atof(optarg);
+                if (depth_chain.min_distance <= 0) {
+                    std::cerr << "Minimum distance has to be positive" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                depth_chain.max_distance = atof(optarg);
+                if (depth_chain.max_distance <= 0) {
+                    std::cerr << "Maximum distance has to be positive" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                depth_chain.alpha = atof(optarg);
+                if (depth_chain.alpha <= 0 || depth_chain.alpha > 1) {
+                    std::cerr << "Temporal filter weight has to be in (0, 1]" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                depth_chain.persistence = atoi(optarg);
+                if (depth_chain.persistence < 1 || depth_chain.persistence > DEPTH_HISTORY_FRAMES) {
+                    std::cerr << "Persistence has to be 1 to " << DEPTH_HISTORY_FRAMES << " frames" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+                quant.step_mm = atof(optarg);
+                if (!validQuantStep(quant.step_mm)) {
+                    std::cerr << "Quantization step has to be 0.25, 0.5, 1, 2, 4 or 8 mm" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                if (sscanf(optarg, "%f,%f,%f", &quant.origin[0], &quant.origin[1], &quant.origin[2]) != 3) {
+                    std::cerr << "Quantization origin has to be x,y,z in meters" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
             case 'h':
                 std::cout << "\nMetaStream camera server" << std::endl;
                 std::cout << "Usage: Meta-camera-server <port> [options]\n" << std::endl;
                 std::cout << "Options:" << std::endl;
                 std::cout << " -h (help)    Display command line options" << std::endl;
-                std::cout << " -t (timer)   Displays the runtime of certain functions" << std::endl;
+                std::cout << " -t (timer)   Reports stage occupancy and FPS every 30 frames" << std::endl;
                 std::cout << " -s (save)    Saves 20 frames in a .ply format" << std::endl;
+                std::cout << " -Z (zerocopy) Send frames with MSG_ZEROCOPY" << std::endl;
+                std::cout << " -q <frames>  Frames queued per subscriber before dropping (default 2, max 8)" << std::endl;
+                std::cout << " -k (keep)    Drop new frames of a full subscriber queue instead of the oldest" << std::endl;
+                std::cout << " -I <frames>  Keyframe interval of delta coded subscribers (default 30), not with -r, -v, -B or -x" << std::endl;
+                std::cout << " -D <mm>      Coordinate change a delta frame still treats as unchanged (default 10)" << std::endl;
+                std::cout << " -C <level>   Color change a delta frame still treats as unchanged (default 16)" << std::endl;
+                std::cout << " -f (file)    Replay frames from a .bag file instead of the camera" << std::endl;
+                std::cout << " -r <file>    Only send the points inside the region of interest of the file" << std::endl;
+                std::cout << " -v <mm>      Send one averaged point per voxel of this size (not for depth subscribers)" << std::endl;
+                std::cout << " -B <points>  Adapt the voxel size to send about this many points per frame" << std::endl;
+                std::cout << " -x <factor>  Decimate the depth image by 2 or 4 with the median of every block" << std::endl;
+                std::cout << " -n <meters>  Drop pixels closer than the distance" << std::endl;
+                std::cout << " -N <meters>  Drop pixels farther than the distance" << std::endl;
+                std::cout << " -T <alpha>   Temporal filter, weight of the new frame in (0, 1]" << std::endl;
+                std::cout << " -P <frames>  Keep the last depth of a pixel that had depth in that many of the last 8 frames with -T" << std::endl;
+                std::cout << " -Q <mm>      Quantization step of the coordinates, 0.25 to 8 (default 1, framed subscribers only)" << std::endl;
+                std::cout << " -O <x,y,z>   Origin of the quantized coordinates in meters after the transform (default 0,0,0)" << std::endl;
                 exit(0);
         }
     }
 }
 
 
-// Create TCP socket with specific port and IP address for client.
+// Create the listening TCP socket, subscribers are accepted by the fan-out hub.
 void initSocket(int port) {
     struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
@@ -107,294 +267,450 @@ void initSocket(int port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sockfd, 3) < 0) {
+    if (listen(sockfd, SOMAXCONN) < 0) {
         std::cerr << "\nListen failed" << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    std::cout << "Waiting for client..." << std::endl;
+    std::cout << "Waiting for clients..." << std::endl;
+}
 
-    if ((client_sock = accept(sockfd, NULL, NULL)) < 0) {
-        std::cerr << "\nConnection failed" << std::endl;
-        exit(EXIT_FAILURE);
+
+// Header extension of a depth frame, for the decimated image with decimation.
+depthExtension depthExtensionOf(const rs2::depth_frame& depth);
+int downsampleRecords(short * pc_buffer, int num_points);
+
+// Converting the point cloud to buffer to send the data through the network,
+// with the widest conversion kernel of Meta/convert.h the CPU supports.
+// With a region of interest only the points inside it are converted, compacted in raster order.
+// With a voxel size the records are then reduced in place to one point per voxel.
+int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer)
+{
+    int num_points = pts.size();
+    convertParams params;
+    params.vertices = reinterpret_cast<const float*>(pts.get_vertices());
+    params.tex_coords = reinterpret_cast<const float*>(pts.get_texture_coordinates());
+    params.color = reinterpret_cast<const uint8_t*>(color.get_data());
+    params.w = color.get_width();
+    params.h = color.get_height();
+    params.cl_bp = color.get_bytes_per_pixel();
+    params.cl_sb = color.get_stride_in_bytes();
+    params.tf = quant_tf;
+    params.conv_rate = quantRate(quant);
+    params.z_min = params.x_min = -INFINITY;
+    params.z_max = params.x_max = INFINITY;
+    params.roi = &roi_quant;
+
+    if (roiActive(&stage_roi))
+        num_points = convertPointsInRange(convert_kernel, params, pts.size(), pc_buffer, 7);
+    else
+        convertPoints(convertKernelOf(convert_kernel), params, pts.size(), pc_buffer, 7);
+
+    // returning the buffer size
+    return downsampleRecords(pc_buffer, num_points);
+}
+
+// Reduces the records in place to one point per voxel with a voxel size, returns the number of records left.
+int downsampleRecords(short * pc_buffer, int num_points)
+{
+    if (voxel_size > 0) {
+        num_points = voxelDownsample(&voxel_grid, pc_buffer, num_points,
+                                     std::max(1, int(voxel_size / quant.step_mm + 0.5f)), pc_buffer, 7);
+
+        // the voxels of a surface go with 1 / size^2, the step is limited so a single frame can't swing it
+        if (point_budget > 0) {
+            voxel_size *= std::min(1.25f, std::max(0.8f, sqrtf(float(num_points) / point_budget)));
+            voxel_size = std::min(std::max(voxel_size, 1.0f), 1000.0f);
+        }
     }
 
-    std::cout << "Established connection with client_sock: " << client_sock << std::endl;
+    return num_points;
 }
 
+// Converting the decimated depth image to buffer in one fused pass of the depth kernels, with the color
+// aligned to it, the region of interest and then the voxel grid as for the point cloud.
+int copyDepthXYZRGBToBuffer(const rs2::depth_frame& depth, const uint8_t * color, int cl_bp, short * pc_buffer)
+{
+    depthExtension ext = depthExtensionOf(depth);
+    memcpy(ext.tf, quant_tf, sizeof(ext.tf));
+    depthConvertParams params = depthConvertParamsOf(ext, &depth_rays, (const uint16_t *)depth.get_data(),
+                                                     color, cl_bp, quantRate(quant));
+    params.roi = &roi_records;
+
+    int num_points = convertDepth(depthConvertKernelOf(convert_kernel), params, ext.width * ext.height, pc_buffer, 7);
+    return downsampleRecords(pc_buffer, num_points);
+}
 
-// Converting the point cloud to buffer to send the data through the network.
-int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer)
+// Converting the point cloud straight into SoA planes (FORMAT_SOA) in the wire buffer, with the SoA layout
+// of the same conversion kernel, so SoA subscribers get exactly the points of the record formats.
+int copyPointCloudXYZRGBToSoA(rs2::points& pts, const rs2::video_frame& color, uint8_t * payload)
 {
-    // Getting the vertices of the point object.
-    const auto vert = pts.get_vertices();
-    // Getting the texture of the coordinate points.
-    const rs2::texture_coordinate* tcrd = pts.get_texture_coordinates();
-    // reinterpreting the pointer returned by get_data(). 
-    const uint8_t* color_data = reinterpret_cast<const uint8_t*>(color.get_data());
-
-    //getting the size of the point cloud.
-    const int pts_size = pts.size();
-
-    // getting the information from the video frames.
-    const int w = color.get_width();
-    const int h = color.get_height();
-    const int cl_bp = color.get_bytes_per_pixel();
-    const int cl_sb = color.get_stride_in_bytes();
-    const int w_min = (w - 1);
-    const int h_min = (h - 1);
-    
-
-    const float conv_rate = CONV_RATE;
-    const float point5f = .5f;
-    const float w_f = float(w);
-    const float h_f = float(h);
-    
-    // creates the SSE resigistries with a single value.    
-    const __m128 _conv_rate = _mm_broadcast_ss(&conv_rate);
-    const __m128 _f5 = _mm_broadcast_ss(&point5f);
-    const __m128 _w = _mm_broadcast_ss(&w_f);
-    const __m128 _h = _mm_broadcast_ss(&h_f);
-    
-    // setting the 128-bit integer register to zero.
-    const __m128i _zero = _mm_setzero_si128();
-
-    // creates a vector of four 32-bit integers with all elements set to the same value
-    const __m128i _w_min = _mm_set1_epi32(w_min);
-    const __m128i _h_min = _mm_set1_epi32(h_min);
-    
-    // inilizing the multi-therding parameters
-    #pragma omp parallel for schedule(static, 10000) num_threads(7)
-    for (int i = 0; i < pts_size; i += 4) {
-        
-        int i1 = i;
-        int i2 = i+1;
-        int i3 = i+2;
-        int i4 = i+3;
-        
-        // aligning the arrays of four single-precision floating-point numbers to 16 byte boundary.
-        __attribute__((aligned(16))) float v_temp1[4];
-        __attribute__((aligned(16))) float v_temp2[4];
-        __attribute__((aligned(16))) float v_temp3[4];
-        __attribute__((aligned(16))) float v_temp4[4];
-       
-       // aligning the arrays of four single-precision floating-point numbers to 16 byte boundary.
-        __attribute__((aligned(16))) int idx[4];
-        __attribute__((aligned(16))) int idy[4];
-
-       // creates a new 128 byte vector variable with four 32-bit floating-point values.
-        __m128 _x = _mm_set_ps(tcrd[i1].u, tcrd[i2].u, tcrd[i3].u, tcrd[i4].u); 
-        __m128 _y = _mm_set_ps(tcrd[i1].v, tcrd[i2].v, tcrd[i3].v, tcrd[i4].v); 
-
-        // Multiplies the first two vectors and add the result to third vector.
-        _x = _mm_fmadd_ps(_x, _w, _f5); 
-        _y = _mm_fmadd_ps(_y, _h, _f5);
-
-        // Converting the 128 floating-point vector to integer vector.
-        __m128i _xi = _mm_cvttps_epi32(_x);
-        __m128i _yi = _mm_cvttps_epi32(_y);
-
-        // Getting the maxium values of the both the varabiles.
-        _xi = _mm_max_epi32(_xi, _zero);    
-        _yi = _mm_max_epi32(_yi, _zero);
-        _xi = _mm_min_epi32(_xi, _w_min);   
-        _yi = _mm_min_epi32(_yi, _h_min);
-        
-        // Storing the integer vector into unaligned memory location.
-        _mm_storeu_si128((__m128i_u*)idx, _xi);
-        _mm_storeu_si128((__m128i_u*)idy, _yi);
-
-        int idx1 = idx[3]*cl_bp + idy[3]*cl_sb;
-        int idx2 = idx[2]*cl_bp + idy[2]*cl_sb;
-        int idx3 = idx[1]*cl_bp + idy[1]*cl_sb;
-        int idx4 = idx[0]*cl_bp + idy[0]*cl_sb;
-
-
-       // creates the intermediate 128 bit SSE resigistries with a single value.  
-        __m128 ss_x1 = _mm_broadcast_ss(&vert[i].x);
-        __m128 ss_y1 = _mm_broadcast_ss(&vert[i].y);
-        __m128 ss_z1 = _mm_broadcast_ss(&vert[i].z);
-
-        __m128 ss_x2 = _mm_broadcast_ss(&vert[i2].x);
-        __m128 ss_y2 = _mm_broadcast_ss(&vert[i2].y);
-        __m128 ss_z2 = _mm_broadcast_ss(&vert[i2].z);
-
-        __m128 ss_x3 = _mm_broadcast_ss(&vert[i3].x);
-        __m128 ss_y3 = _mm_broadcast_ss(&vert[i3].y);
-        __m128 ss_z3 = _mm_broadcast_ss(&vert[i3].z);
-
-        __m128 ss_x4 = _mm_broadcast_ss(&vert[i4].x);
-        __m128 ss_y4 = _mm_broadcast_ss(&vert[i4].y);
-        __m128 ss_z4 = _mm_broadcast_ss(&vert[i4].z);
-
-       
-       // Multiplies the first two vectors and add the result to third vector.
-        __m128 _v1 = _mm_fmadd_ps(ss_x1, ss_a, ss_d);
-        _v1 = _mm_fmadd_ps(ss_y1, ss_b, _v1);
-        _v1 = _mm_fmadd_ps(ss_z1, ss_c, _v1);
-
-        __m128 _v2 = _mm_fmadd_ps(ss_x2, ss_a, ss_d);
-        _v2 = _mm_fmadd_ps(ss_y2, ss_b, _v2);
-        _v2 = _mm_fmadd_ps(ss_z2, ss_c, _v2);
-
-        __m128 _v3 = _mm_fmadd_ps(ss_x3, ss_a, ss_d);
-        _v3 = _mm_fmadd_ps(ss_y3, ss_b, _v3);
-        _v3 = _mm_fmadd_ps(ss_z3, ss_c, _v3);
-
-        __m128 _v4 = _mm_fmadd_ps(ss_x4, ss_a, ss_d);
-        _v4 = _mm_fmadd_ps(ss_y4, ss_b, _v4);
-        _v4 = _mm_fmadd_ps(ss_z4, ss_c, _v4);
-       
-        // Multipling the two vectors.
-        _v1 = _mm_mul_ps(_v1, _conv_rate); 
-        _v2 = _mm_mul_ps(_v2, _conv_rate); 
-        _v3 = _mm_mul_ps(_v3, _conv_rate); 
-        _v4 = _mm_mul_ps(_v4, _conv_rate); 
-        
-        // Copying the values from one array to other array.
-        _mm_store_ps(v_temp1, _v1);
-        _mm_store_ps(v_temp2, _v2);
-        _mm_store_ps(v_temp3, _v3);
-        _mm_store_ps(v_temp4, _v4);
-
-        //v1
-        pc_buffer[i * 5 + 0] = short(v_temp1[0]);
-        pc_buffer[i * 5 + 1] = short(v_temp1[1]);
-        pc_buffer[i * 5 + 2] = short(v_temp1[2]);
-        pc_buffer[i * 5 + 3] = color_data[idx1] + (color_data[idx1 + 1] << 8);
-        pc_buffer[i * 5 + 4] = color_data[idx1 + 2];
-        
-        //v2
-        pc_buffer[i * 5 + 5] = short(v_temp2[0]);
-        pc_buffer[i * 5 + 6] = short(v_temp2[1]);
-        pc_buffer[i * 5 + 7] = short(v_temp2[2]);
-        pc_buffer[i * 5 + 8] = color_data[idx2] + (color_data[idx2 + 1] << 8);
-        pc_buffer[i * 5 + 9] = color_data[idx2 + 2];
-        
-        //v3
-        pc_buffer[i * 5 + 10] = short(v_temp3[0]);
-        pc_buffer[i * 5 + 11] = short(v_temp3[1]);
-        pc_buffer[i * 5 + 12] = short(v_temp3[2]);
-        pc_buffer[i * 5 + 13] = color_data[idx3] + (color_data[idx3 + 1] << 8);
-        pc_buffer[i * 5 + 14] = color_data[idx3 + 2];
-        
-        //v4
-        pc_buffer[i * 5 + 15] = short(v_temp4[0]);
-        pc_buffer[i * 5 + 16] = short(v_temp4[1]);
-        pc_buffer[i * 5 + 17] = short(v_temp4[2]);
-        pc_buffer[i * 5 + 18] = color_data[idx4] + (color_data[idx4 + 1] << 8);
-        pc_buffer[i * 5 + 19] = color_data[idx4 + 2];
+    convertParams params;
+    params.vertices = reinterpret_cast<const float*>(pts.get_vertices());
+    params.tex_coords = reinterpret_cast<const float*>(pts.get_texture_coordinates());
+    params.color = reinterpret_cast<const uint8_t*>(color.get_data());
+    params.w = color.get_width();
+    params.h = color.get_height();
+    params.cl_bp = color.get_bytes_per_pixel();
+    params.cl_sb = color.get_stride_in_bytes();
+    params.tf = quant_tf;
+    params.conv_rate = quantRate(quant);
+
+    convertPointsToSoA(convert_kernel, params, pts.size(), payload, 7);
+
+    return pts.size();
+}
 
+// Capture stage: grabs frames, runs the post-processing chain and computes the textured point cloud into a
+// free slot, or with decimation the color aligned to the decimated image.
+// Waits while every slot is still queued or being sent, librealsense drops the frames meanwhile.
+void captureStage(rs2::pipeline * pipe) {
+    rs2::pointcloud pc;
+    rs2::align align_to_depth(RS2_STREAM_DEPTH);
+    frameSlot * slot;
+
+    while (popRing(&free_ring, &slot)) {
+        //It waits to execute the pipeline untill a frame.
+        auto frames = pipe->wait_for_frames();
+        timePoint start = TIME_NOW;
+
+        // The alignment reprojects the full depth image, so it goes before the post-processing.
+        if (depth_chain.decimation > 1)
+            frames = align_to_depth.process(frames);
+
+        // Getting the color and the depth data of the frames
+        auto depth = frames.get_depth_frame();
+        rs2::video_frame color = frames.get_color_frame();
+        slot->color = color;
+        slot->depth = depth;
+
+        // The chain works on the Z16 image of the frame itself, the decimated image ends up at its start.
+        if (depthChainActive(&depth_chain)) {
+            if (depth.get_stride_in_bytes() != depth.get_width() * int(sizeof(uint16_t))) {
+                std::cerr << "Depth frame is not a packed Z16 image" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            int width = depth.get_width(), height = depth.get_height();
+            processDepth(&depth_chain, (uint16_t *)const_cast<void *>(depth.get_data()), &width, &height,
+                         depth.get_units(), 7);
+        }
+
+        if (depth_chain.decimation > 1) {
+            if (color.get_bytes_per_pixel() < 3) {
+                std::cerr << "Color frame has less than 3 bytes per pixel" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (!slot->decimated_color)
+                slot->decimated_color = (uint8_t *)malloc(size_t(color.get_width()) * color.get_height() *
+                                                          color.get_bytes_per_pixel());
+            decimateColor((const uint8_t *)color.get_data(), color.get_width(), color.get_height(),
+                          color.get_bytes_per_pixel(), color.get_stride_in_bytes(), depth_chain.decimation,
+                          slot->decimated_color, 7);
+        }
+        else {
+            // It's been used caluclate the point cloud from the depth data and map the colour to it.
+            slot->pts = pc.calculate(depth);
+            pc.map_to(slot->color);
+        }
+
+        addStageTime(&capture_stats, start, TIME_NOW);
+        if (!pushRing(&captured_ring, slot))
+            break;
     }
-    
-    // returning the buffer size
-    return pts_size;
 }
 
-// Function which saves the buffer and sends it to client through socket connection.
-void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer) {
-    // Add size of buffer to beginning of message
-    int size = copyPointCloudXYZRGBToBuffer(pts, color, &buffer[0] + sizeof(short));
-    size = 5 * size * sizeof(short);
-    memcpy(buffer, &size, sizeof(int));
-    
-    // Sending the buffer to client through socket connection.
-    send(client_sock, (char *)buffer, size + sizeof(int), 0);
+// Header extension of a depth frame: intrinsics and depth unit of the stream and the camera transform.
+depthExtension depthExtensionOf(const rs2::depth_frame& depth) {
+    const rs2_intrinsics intr = depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    depthExtension ext;
+    memset(&ext, 0, sizeof(ext));
+
+    ext.width = uint16_t(intr.width);
+    ext.height = uint16_t(intr.height);
+    ext.model = intr.model;
+    ext.fx = intr.fx;
+    ext.fy = intr.fy;
+    ext.ppx = intr.ppx;
+    ext.ppy = intr.ppy;
+    memcpy(ext.coeffs, intr.coeffs, sizeof(ext.coeffs));
+    ext.depth_scale = depth.get_units();
+    memcpy(ext.tf, tf_mat, sizeof(ext.tf));
+
+    // The post-processing chain leaves a decimated image in the frame.
+    return depth_chain.decimation > 1 ? decimateExtension(ext, depth_chain.decimation) : ext;
+}
+
+// Called by the hub once no subscriber uses the frame of a slot anymore.
+void releaseSlot(sharedFrame * frame) {
+    pushRing(&free_ring, (frameSlot *)frame->owner);
+}
+
+// Encode stage: converts the point cloud of a slot and packs it once for every wire mode a subscriber uses.
+void encodeStage() {
+    frameSlot * slot;
+
+    while (popRing(&captured_ring, &slot)) {
+        timePoint start = TIME_NOW;
+        rs2::video_frame color(slot->color);
+        const unsigned modes = hub.modes_in_use;
+        const uint64_t frame_number = color.get_frame_number();
+        const uint64_t timestamp_us = uint64_t(color.get_timestamp() * 1000);
+        sharedFrame * frame = &slot->frame;
+        frame->modes = 0;
+
+        if (takeRoi(&hub, &stage_roi)) {
+            quantizeRoi(stage_roi, quant, &roi_quant, &roi_records);
+            std::cout << "Region of interest: " << stage_roi.num_volumes << " volumes" << std::endl;
+        }
+
+        // Depth subscribers get the Z16 image and the colors of the valid pixels, deprojection happens on their side.
+        const unsigned depth_mode = 1u << (FORMAT_DEPTH16 + 1);
+        const unsigned delta_mode = 1u << (FORMAT_DELTA + 1);
+        const unsigned record_modes = modes & ~depth_mode;
+
+        for (int format = 0; format < NUM_FORMATS; format++) {
+            if ((modes & (1u << (format + 1))) && !slot->wire[format])
+                slot->wire[format] = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(BUF_SIZE / 5));
+        }
+
+        if (modes & depth_mode) {
+            rs2::depth_frame depth(slot->depth);
+            const depthExtension ext = depthExtensionOf(depth);
+            uint8_t * wire = slot->wire[FORMAT_DEPTH16];
+            const uint16_t * depth_data = (const uint16_t *)depth.get_data();
+            int valid_points;
+
+            // pixels outside the region of interest are sent as missing depth
+            if (roiActive(&stage_roi)) {
+                if (!slot->culled_depth)
+                    slot->culled_depth = (uint16_t *)malloc(sizeof(short) * BUF_SIZE);
+                cullDepthROI(stage_roi, ext, &roi_rays, depth_data, slot->culled_depth, 7);
+                depth_data = slot->culled_depth;
+            }
+            if (depth_chain.decimation > 1)
+                packDepth(depth_data, ext.width, ext.height, NULL, slot->decimated_color, ext.width, ext.height,
+                          color.get_bytes_per_pixel(), ext.width * color.get_bytes_per_pixel(),
+                          wire + frameHeaderBytes(FORMAT_DEPTH16), &valid_points);
+            else
+                packDepth(depth_data, ext.width, ext.height,
+                          reinterpret_cast<const float *>(slot->pts.get_texture_coordinates()),
+                          (const uint8_t *)color.get_data(), color.get_width(), color.get_height(),
+                          color.get_bytes_per_pixel(), color.get_stride_in_bytes(),
+                          wire + frameHeaderBytes(FORMAT_DEPTH16), &valid_points);
+            writeDepthFrameHeader(wire, ext, valid_points, frame_number, timestamp_us);
+            frame->iov[FORMAT_DEPTH16 + 1][0].iov_base = wire;
+            frame->iov[FORMAT_DEPTH16 + 1][0].iov_len = frameHeaderBytes(FORMAT_DEPTH16) + depthPayloadBytes(ext, valid_points);
+            frame->iovcnt[FORMAT_DEPTH16 + 1] = 1;
+            frame->modes |= depth_mode;
+        }
+
+        if (record_modes == 1u << (FORMAT_SOA + 1) && !roiActive(&stage_roi) && voxel_size <= 0 &&
+            depth_chain.decimation == 1) {
+            // Only SoA subscribers: the converter writes the planes directly behind the header, no intermediate records.
+            uint8_t * wire = slot->wire[FORMAT_SOA];
+            const int header_bytes = frameHeaderBytes(FORMAT_SOA, true);
+            slot->num_points = copyPointCloudXYZRGBToSoA(slot->pts, color, wire + header_bytes);
+            size_t payload_bytes = soaPayloadBytes(slot->num_points);
+            const quantExtension quant_ext = quantExtensionOfSoA(quant, wire + header_bytes, slot->num_points);
+            writeFrameHeader(wire, FORMAT_SOA, slot->num_points, payload_bytes, frame_number, timestamp_us, 0, &quant_ext);
+            frame->iov[FORMAT_SOA + 1][0].iov_base = wire;
+            frame->iov[FORMAT_SOA + 1][0].iov_len = header_bytes + payload_bytes;
+            frame->iovcnt[FORMAT_SOA + 1] = 1;
+            frame->modes |= record_modes;
+        }
+        else if (record_modes) {
+            if (depth_chain.decimation > 1)
+                slot->num_points = copyDepthXYZRGBToBuffer(rs2::depth_frame(slot->depth), slot->decimated_color,
+                                                           color.get_bytes_per_pixel(), slot->records);
+            else
+                slot->num_points = copyPointCloudXYZRGBToBuffer(slot->pts, color, slot->records);
+
+            // Step, origin and bounding box of the records for the header of every framed format.
+            const quantExtension quant_ext = quantExtensionOf(quant, slot->records, slot->num_points);
+
+            // Unframed subscribers get the length prefix and the records.
+            if (modes & 1u) {
+                slot->legacy_size = slot->num_points * 5 * sizeof(short);
+                frame->iov[0][0].iov_base = &slot->legacy_size;
+                frame->iov[0][0].iov_len = sizeof(int);
+                frame->iov[0][1].iov_base = slot->records;
+                frame->iov[0][1].iov_len = slot->legacy_size;
+                frame->iovcnt[0] = 2;
+            }
+
+            // Pack the records into every negotiated wire format behind a frameHeader.
+            for (int format = 0; format < NUM_FORMATS; format++) {
+                if (!recordFormat(format) || !(modes & (1u << (format + 1)))) continue;
+                packFrameIov(slot->records, slot->num_points, format, frame_number, timestamp_us,
+                             slot->wire[format], frame->iov[format + 1], 1, &quant_ext);
+                frame->iovcnt[format + 1] = 2;
+            }
+
+            // Delta subscribers get a keyframe or the pixels that changed against the acknowledged one.
+            if (modes & delta_mode) {
+                // compacted records change their count from frame to frame, every frame becomes a keyframe
+                static bool warned_delta = false;
+                if (!warned_delta && (roiActive(&stage_roi) || voxel_size > 0 || depth_chain.decimation > 1)) {
+                    std::cerr << "Delta subscriber with a region of interest, voxel downsampling or decimation: "
+                              << "the point count changes every frame, only keyframes are sent" << std::endl;
+                    warned_delta = true;
+                }
+                uint8_t * wire = slot->wire[FORMAT_DELTA];
+                const int header_bytes = frameHeaderBytes(FORMAT_DELTA, true);
+                acknowledgeKeyframe(&temporal, hub.key_acked);
+                size_t payload_bytes = encodeTemporal(&temporal, slot->records, slot->num_points, frame_number,
+                                                      hub.key_request.exchange(false), wire + header_bytes,
+                                                      &frame->keyframe, &frame->key_number);
+                writeFrameHeader(wire, FORMAT_DELTA, slot->num_points, payload_bytes, frame_number, timestamp_us,
+                                 frame->keyframe ? FRAME_FLAG_KEY : 0, &quant_ext);
+                frame->iov[FORMAT_DELTA + 1][0].iov_base = wire;
+                frame->iov[FORMAT_DELTA + 1][0].iov_len = header_bytes + payload_bytes;
+                frame->iovcnt[FORMAT_DELTA + 1] = 1;
+            }
+            frame->modes |= record_modes;
+        }
+
+        // Hand the camera frames back to librealsense, only the converted data is needed from here on.
+        slot->pts = rs2::points();
+        slot->color = rs2::frame();
+        slot->depth = rs2::frame();
+
+        addStageTime(&encode_stats, start, TIME_NOW);
+
+        // Nobody is subscribed, the slot goes straight back.
+        if (!frame->modes) {
+            pushRing(&free_ring, slot);
+            continue;
+        }
+        if (!publishFrame(&hub, frame))
+            break;
+    }
+}
+
+// Prints the occupancy of every stage, the published frame rate and what every subscriber got.
+void printStageReport(double window_ms) {
+    stageStats * stages[] = {&capture_stats, &encode_stats, &send_stats};
+    long frames;
+
+    for (stageStats * stats : stages) {
+        double occupancy = takeStageOccupancy(stats, window_ms, &frames);
+        std::cout << stats->name << ": " << 100.0 * occupancy << " % busy, "
+                  << (frames ? occupancy * window_ms / frames : 0) << " ms/frame" << std::endl;
+    }
+    std::cout << "FPS: " << 1000.0 * hub.published_frames / window_ms << std::endl;
+
+    // encode stage counters, read racy but only for reporting
+    if (temporal.key_frames + temporal.delta_frames) {
+        std::cout << "delta coding: " << temporal.key_frames << " key, " << temporal.delta_frames << " delta frames, "
+                  << temporal.coded_bytes / (temporal.key_frames + temporal.delta_frames) / 1000 << " KB/frame vs "
+                  << temporal.raw_bytes / (temporal.key_frames + temporal.delta_frames) / 1000 << " KB raw, saving "
+                  << 100 * (1 - temporal.coded_bytes / temporal.raw_bytes) << " % (per frame "
+                  << 100 * temporal.min_saving << " - " << 100 * temporal.max_saving << " %)" << std::endl;
+        temporal.key_frames = temporal.delta_frames = 0;
+        temporal.raw_bytes = temporal.coded_bytes = 0;
+        temporal.min_saving = 1;
+        temporal.max_saving = 0;
+    }
+    printSubscriberStats(&hub);
+    std::cout << std::endl;
+    hub.published_frames = 0;
+}
+
+// Called by the hub after every event loop round.
+void reportTick(fanoutHub * hub) {
+    static timePoint window_start = TIME_NOW;
+
+    if (timer && hub->published_frames >= REPORT_FRAMES) {
+        timePoint now = TIME_NOW;
+        printStageReport(timeMilli(now - window_start).count());
+        window_start = now;
+    }
 }
 
 int main (int argc, char** argv) {
+    initDepthChain(&depth_chain, false);
+    quant = defaultQuantizer();
     parseArgs(argc, argv);
 
-    double frame_total, pc_total;
-    char pull_request[1] = {0};
-    buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
-    timePoint frame_start, frame_end, grab_frame_start, grab_frame_end_calculate_start, calculate_end;
+    quantizeTransform(quant, tf_mat, quant_tf);
+    if (!isDefaultQuantizer(quant))
+        std::cout << "Quantization: " << quant.step_mm << " mm around " << quant.origin[0] << ", " << quant.origin[1]
+                  << ", " << quant.origin[2] << " m, unframed subscribers would misread the records" << std::endl;
+
+    if (roi_filename && !loadRoiFile(roi_filename, &stage_roi))
+        exit(EXIT_FAILURE);
+    quantizeRoi(stage_roi, quant, &roi_quant, &roi_records);
+
+    if (point_budget > 0 && voxel_size <= 0)
+        voxel_size = 10;
+
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        slots[i].records = (short *)malloc(sizeof(short) * BUF_SIZE);
+        slots[i].frame.owner = &slots[i];
+        pushRing(&free_ring, &slots[i]);
+    }
+    // the delta threshold is given in millimeters, the encoder compares record units
+    initTemporalEncoder(&temporal, BUF_SIZE / 5, key_interval, int(depth_threshold / quant.step_mm + 0.5f),
+                        color_threshold);
+    convert_kernel = bestConvertKernel();
+    std::cout << "Conversion kernel: " << convert_kernel_names[convert_kernel] << std::endl;
+    depth_chain.avx2 = convertKernelSupported(CONVERT_AVX2);
 
-    // Defining the object to save the point cloud.
-    rs2::pointcloud pc;
     // defining the pipeline
     rs2::pipeline pipe;
-    
+    rs2::config cfg;
+
+    // A recorded .bag replays in place of the camera, e.g. to measure the delta coding on the samples.
+    if (filename) {
+        std::cout << "Reading Frames from File: " << filename << std::endl;
+        cfg.enable_device_from_file(filename);
+    }
+
     // Passing the configuration object to the pipeline. 
-    rs2::pipeline_profile selection = pipe.start();
+    rs2::pipeline_profile selection = pipe.start(cfg);
 
-     // Getting the active profiles in the pipelines and details of the devices information. 
-    rs2::device selected_device = selection.get_device();
-    auto depth_sensor = selected_device.first<rs2::depth_sensor>();
+    if (!filename) {
+        // Getting the active profiles in the pipelines and details of the devices information. 
+        rs2::device selected_device = selection.get_device();
+        auto depth_sensor = selected_device.first<rs2::depth_sensor>();
 
-    
-    if (depth_sensor.supports(RS2_OPTION_EMITTER_ENABLED))
-        depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 0.f);
+        if (depth_sensor.supports(RS2_OPTION_EMITTER_ENABLED))
+            depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 0.f);
+    }
 
     initSocket(PORT);
+    initFanoutHub(&hub, sockfd, queue_depth, drop_newest, zerocopy, releaseSlot, &send_stats);
      
     // establishing and terminting the camera Signal.
     signal(SIGINT, sigintHandler);
 
-    
-    while (1) {
-        if (timer)
-            frame_start = TIME_NOW;
-        
-        // Wait for pull request
-        if (recv(client_sock, pull_request, 1, 0) < 0) {
-            std::cout << "Client disconnected" << std::endl;
-            break;
-        }
-        if (pull_request[0] == 'Z') {          
-            if (timer) {
-                grab_frame_start = TIME_NOW;
-            }
-            
-            //It waits to execute the pipeline untill a frame. 
-            auto frames = pipe.wait_for_frames();
-           
-            // Getting the color and the depth data of the frames   
-            auto depth = frames.get_depth_frame();
-            auto color = frames.get_color_frame();
-            
-            // starting the time counter for the system. 
-            if (timer) {
-                grab_frame_end_calculate_start = TIME_NOW;
-            }
+    // Capture and encode overlap on their own threads, this thread serves every subscriber.
+    std::thread capture_thread(captureStage, &pipe);
+    std::thread encode_thread(encodeStage);
 
-            // It's been used caluclate the point cloud from the depth data.
-            auto pts = pc.calculate(depth);
-            // Mapping the colour to the point cloud to get the colored point cloud.
-            pc.map_to(color);                       
-            
-            // ending the counter.
-            if (timer) {
-                calculate_end = TIME_NOW;
-            }
+    runFanoutHub(&hub, reportTick);
 
-            std::thread frame_thread(sendXYZRGBPointcloud, pts, color, buffer);
-            frame_thread.detach();
-        }
-        else {                                     // Did not receive a correct pull request
-            std::cerr << "Faulty pull request" << std::endl;
-            exit(EXIT_FAILURE);
-        }
-       
-        // printing the results of time counters.
-        if (timer) {
-            frame_end = TIME_NOW;
-            double temp_frame = timeMilli(grab_frame_end_calculate_start - grab_frame_start).count();
-            double temp_pc = timeMilli(calculate_end - grab_frame_end_calculate_start).count();
-            frame_total += temp_frame;
-            pc_total += temp_pc;
-            std::cout << "Grab frame average: " << frame_total / loop_count << " ms" << std::endl;
-            std::cout << "Calculate pc average: " << pc_total / loop_count << " ms" << std::endl;
-            std::cout << "Loop count: " << loop_count << "\n\n" << std::endl;
-            loop_count++;
-            
-            std::cout << "Frame: " << timeMilli(frame_end - frame_start).count() << " ms" << std::endl;
-            // std::cout << "FPS: " << 1000.0 / timeMilli(frame_end - frame_start).count() << "\n" << std::endl;
-        }
-    }
-   // closing the socket and freeing the buffer
-    close(client_sock);
+    // Stopping the stages, the capture stage leaves after its current frame.
+    closeRing(&free_ring);
+    closeRing(&captured_ring);
+    closeRing(&hub.published);
+    encode_thread.join();
+    capture_thread.join();
+    pipe.stop();
+
+   // closing the sockets and freeing the buffers
+    closeFanoutHub(&hub);
     close(sockfd);
-    free(buffer);
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        free(slots[i].records);
+        free(slots[i].culled_depth);
+        free(slots[i].decimated_color);
+        for (int format = 0; format < NUM_FORMATS; format++)
+            free(slots[i].wire[format]);
+    }
+    freeTemporalEncoder(&temporal);
+    freeRayTable(&roi_rays);
+    freeRayTable(&depth_rays);
+    freeDepthChain(&depth_chain);
     return 0;
-}
\ No newline at end of file
+}
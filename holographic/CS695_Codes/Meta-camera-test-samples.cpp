@@ -10,6 +10,8 @@
 
 #include <librealsense2/rs.hpp>
 
+#include "Meta/convert.h"
+
 #define TIME_NOW    std::chrono::high_resolution_clock::now()
 #define BUF_SIZE    4000000
 #define CONV_RATE   1000
@@ -19,13 +21,19 @@ typedef std::chrono::duration<double, std::milli> timeMilli;
 typedef std::chrono::time_point<clockTime> timestamp;
 
 char *filename = "samples.bag";
+
+// The samples are converted in camera space.
+float identity_mat[] = {1, 0, 0, 0,
+                        0, 1, 0, 0,
+                        0, 0, 1, 0,
+                        0, 0, 0, 1};
 timestamp time_start, time_end;
 
 // Defineing the function with all the parameters.
 void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer);
 
 // This Function handles the signal.
-oid sigintHandler(int dummy) {
+void sigintHandler(int dummy) {
     std::cout << "\n Exiting \n " << std::endl;
     exit(0);
 }
@@ -150,38 +158,22 @@ int main (int argc, char** argv) {
 }
 
 
-// Function which uses the values of the adjacent pixels values and find the color of the data. 
-std::tuple<uint8_t, uint8_t, uint8_t> get_texcolor(rs2::video_frame texture, rs2::texture_coordinate texcoords) {
-    const int w = texture.get_width(), h = texture.get_height();
-    int x = std::min(std::max(int(texcoords.u*w + .5f), 0), w - 1);
-    int y = std::min(std::max(int(texcoords.v*h + .5f), 0), h - 1);
-    int idx = x * texture.get_bytes_per_pixel() + y * texture.get_stride_in_bytes();
-    const auto texture_data = reinterpret_cast<const uint8_t*>(texture.get_data());
-
-    return std::tuple<uint8_t, uint8_t, uint8_t>(texture_data[idx], texture_data[idx + 1], texture_data[idx + 2]);
-}
-
-
-// Converting the point cloud to buffer to send the data through the network.
+// Converting the point cloud to buffer to send the data through the network, with the widest kernel of
+// Meta/convert.h the CPU supports. Points that don't fit into the buffer are dropped.
 int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer) {
-
-    auto vertices = pts.get_vertices();
-    auto tex_coords = pts.get_texture_coordinates();
-    int size = 0;
-
-    for (size_t i = 0; i < pts.size() && (5 * size + 2) < BUF_SIZE; i++) {
-        
-            std::tuple<uint8_t, uint8_t, uint8_t> current_color = get_texcolor(color, tex_coords[i]);
-
-            pc_buffer[size * 5 + 0] = static_cast<short>(vertices[i].x * CONV_RATE);
-            pc_buffer[size * 5 + 1] = static_cast<short>(vertices[i].y * CONV_RATE);
-            pc_buffer[size * 5 + 2] = static_cast<short>(vertices[i].z * CONV_RATE);
-            pc_buffer[size * 5 + 3] = (short)std::get<0>(current_color) + (short)(std::get<1>(current_color) << 8);
-            pc_buffer[size * 5 + 4] = std::get<2>(current_color);
-
-            size++;
-        
-    }
+    convertParams params;
+    params.vertices = reinterpret_cast<const float*>(pts.get_vertices());
+    params.tex_coords = reinterpret_cast<const float*>(pts.get_texture_coordinates());
+    params.color = reinterpret_cast<const uint8_t*>(color.get_data());
+    params.w = color.get_width();
+    params.h = color.get_height();
+    params.cl_bp = color.get_bytes_per_pixel();
+    params.cl_sb = color.get_stride_in_bytes();
+    params.tf = identity_mat;
+    params.conv_rate = CONV_RATE;
+
+    const int size = std::min(int(pts.size()), BUF_SIZE / 5 - 1);
+    convertPoints(convertKernelOf(bestConvertKernel()), params, size, pc_buffer, 1);
 
     return size;
 }
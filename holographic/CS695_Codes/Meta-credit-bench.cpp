@@ -0,0 +1,255 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "Meta/net.h"
+
+/*
+ * Loopback benchmark of pull mode against credit based push mode.
+ *
+ * A producer thread plays the camera server: it emits a new frame every
+ * 1000 / fps ms and sends it when the consumer asked for one, exactly like the
+ * request loop of Meta-camera-optimized. The consumer plays the stitcher. Every
+ * request it sends goes through a delay line holding it back for the injected
+ * RTT, so pull mode pays the RTT once per frame while push mode only pays it
+ * once per window. Build with:
+ *   g++ -O2 -std=c++17 -fopenmp -mavx2 -mfma Meta-credit-bench.cpp -o Meta-credit-bench
+ */
+
+typedef std::chrono::high_resolution_clock clockTime;
+typedef std::chrono::time_point<clockTime> timePoint;
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+int camera_fps = 30;
+int num_points = 640 * 480;
+int num_frames = 60;
+int credit_window = 4;
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hf:n:c:r:")) != -1) {
+        switch (c) {
+            case 'f':
+                camera_fps = atoi(optarg);
+                break;
+            case 'n':
+                num_frames = atoi(optarg);
+                break;
+            case 'c':
+                credit_window = atoi(optarg);
+                break;
+            case 'r':
+                num_points = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                std::cout << "\nPull vs credit based push over loopback with injected RTT" << std::endl;
+                std::cout << "Usage: Meta-credit-bench [options]" << std::endl;
+                std::cout << " -f <fps>         Camera frame rate (default 30)" << std::endl;
+                std::cout << " -n <frames>      Frames measured per run (default 60)" << std::endl;
+                std::cout << " -c <frames>      Credit window of the push mode (default 4)" << std::endl;
+                std::cout << " -r <points>      Points per frame (default 640x480)" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+// Requests of the consumer waiting out the injected RTT before they reach the producer.
+struct delayLine {
+    int sock;
+    double delay_ms;
+    bool closed = false;
+    std::deque<std::pair<timePoint, std::vector<uint8_t>>> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+void delayLineThread(delayLine * line) {
+    std::unique_lock<std::mutex> lock(line->mutex);
+
+    while (true) {
+        line->cv.wait(lock, [line] { return line->closed || !line->queue.empty(); });
+        if (line->queue.empty()) return;
+
+        timePoint due = line->queue.front().first;
+        std::vector<uint8_t> bytes = line->queue.front().second;
+        line->queue.pop_front();
+        lock.unlock();
+        std::this_thread::sleep_until(due);
+        send(line->sock, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+        lock.lock();
+    }
+}
+
+void delayedSend(delayLine * line, const void * bytes, size_t n) {
+    std::lock_guard<std::mutex> lock(line->mutex);
+    const uint8_t * p = (const uint8_t *)bytes;
+    timePoint due = clockTime::now() + std::chrono::microseconds(long(line->delay_ms * 1000));
+    line->queue.emplace_back(due, std::vector<uint8_t>(p, p + n));
+    line->cv.notify_one();
+}
+
+// Camera server side: serves pull requests and credit grants until the consumer disconnects.
+void producer(int sock) {
+    std::vector<short> records(size_t(num_points) * 5, 1);
+    std::vector<uint8_t> header(sizeof(frameHeader));
+    frameSender sender;
+    initFrameSender(&sender, sock, false);
+
+    const auto period = std::chrono::microseconds(1000000 / camera_fps);
+    timePoint next_frame = clockTime::now();
+    long credits = 0;
+    uint64_t frame_number = 0;
+    char request;
+
+    while (true) {
+        ssize_t received = recv(sock, &request, 1, credits > 0 ? MSG_DONTWAIT : 0);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            break;
+
+        if (received == 1) {
+            uint32_t grant;
+            if (request == REQUEST_PULL)
+                credits++;
+            else if (request == REQUEST_CREDIT && readCreditGrant(sock, &grant))
+                credits += grant;
+            else
+                break;
+            continue;
+        }
+
+        // wait_for_frames: the next frame the camera produces
+        timePoint now = clockTime::now();
+        while (next_frame <= now)
+            next_frame += period;
+        std::this_thread::sleep_until(next_frame);
+
+        struct iovec iov[2];
+        packFrameIov(records.data(), num_points, FORMAT_XYZRGB16, frame_number++, 0, header.data(), iov);
+        if (sendFrameIov(&sender, iov, 2) < 0)
+            break;
+        credits--;
+    }
+}
+
+// Stitcher side: reads num_frames frames in pull (window 0) or push mode and returns the achieved FPS.
+double consumer(int sock, delayLine * line, int window) {
+    std::vector<uint8_t> payload(size_t(num_points) * 10);
+    frameHeader header;
+
+    auto readAll = [sock](void * p, size_t n) {
+        size_t total = 0;
+        while (total < n) {
+            ssize_t r = recv(sock, (uint8_t *)p + total, n - total, 0);
+            if (r < 1) {
+                std::cerr << "Receive failure" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            total += r;
+        }
+    };
+    auto request = [line, window](uint32_t credits) {
+        if (window == 0) {
+            char pull = REQUEST_PULL;
+            delayedSend(line, &pull, 1);
+        } else {
+            uint8_t grant[5] = {REQUEST_CREDIT};
+            memcpy(grant + 1, &credits, sizeof(credits));
+            delayedSend(line, grant, sizeof(grant));
+        }
+    };
+
+    request(window ? window : 1);
+
+    timePoint start;
+    for (int i = 0; i <= num_frames; i++) {
+        // the first frame only fills the pipeline and is not measured
+        if (i == 1) start = clockTime::now();
+        readAll(&header, sizeof(header));
+        readAll(payload.data(), header.payload_bytes);
+        request(1);
+    }
+
+    return num_frames / (timeMilli(clockTime::now() - start).count() / 1000);
+}
+
+// Runs one producer/consumer pair over a fresh loopback connection.
+double runMode(double rtt_ms, int window) {
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_sock, 1) < 0 ||
+        getsockname(listen_sock, (struct sockaddr *)&addr, &len) < 0) {
+        std::cerr << "Loopback socket failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int consumer_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connect(consumer_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Connection failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int producer_sock = accept(listen_sock, NULL, NULL);
+    int one = 1;
+    setsockopt(consumer_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    delayLine line;
+    line.sock = consumer_sock;
+    line.delay_ms = rtt_ms;
+
+    std::thread producer_thread(producer, producer_sock);
+    std::thread line_thread(delayLineThread, &line);
+
+    double fps = consumer(consumer_sock, &line, window);
+
+    {
+        std::lock_guard<std::mutex> lock(line.mutex);
+        line.closed = true;
+        line.queue.clear();
+        line.cv.notify_one();
+    }
+    line_thread.join();
+    shutdown(consumer_sock, SHUT_RDWR);
+    producer_thread.join();
+
+    close(consumer_sock);
+    close(producer_sock);
+    close(listen_sock);
+    return fps;
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+    const double rtts[] = {0, 5, 10, 20, 40, 80};
+
+    std::cout << "Camera " << camera_fps << " FPS, " << num_points << " points (" << num_points * 10 / 1e6
+              << " MB) per frame, " << num_frames << " frames per run" << std::endl;
+    std::cout << std::setw(10) << "RTT ms" << std::setw(14) << "pull FPS" << std::setw(14) << "push FPS"
+              << "  (window " << credit_window << ")" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+
+    for (double rtt : rtts) {
+        double pull_fps = runMode(rtt, 0);
+        double push_fps = runMode(rtt, credit_window);
+        std::cout << std::setw(10) << rtt << std::setw(14) << pull_fps << std::setw(14) << push_fps << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,673 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <thread>
+#include <sys/socket.h>
+
+#include <omp.h>
+
+#include "Meta/frame.h"
+#include "Meta/convert.h"
+#include "Meta/roi.h"
+#include "Meta/depthfilter.h"
+#include "Meta/postprocess.h"
+#include "Meta/quantize.h"
+#include "Meta/net.h"
+
+/*
+ * Standalone benchmark of the stitcher side point kernels, of the camera side conversion
+ * kernels (Meta/convert.h) in both output layouts, of the depth filter (Meta/depthfilter.h) and
+ * of the depth post-processing chain (Meta/postprocess.h), of the quantizer and of the native stitch (Meta/quantize.h) on synthetic camera frames,
+ * and the stitch gather of Meta-multicamera-client by camera count, sending over a local socket. Every variant is checked bit for bit against the scalar one;
+ * Meta-camera-optimized -b does the same for the conversion kernels on replayed .bag frames. No camera or PCL is needed, build with:
+ *   g++ -O3 -std=c++17 -fopenmp -mavx2 -mfma Meta-kernel-bench.cpp -o Meta-kernel-bench
+ */
+
+#define CONV_RATE 1000
+
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+// Same memory layout as pcl::PointXYZRGB (x, y, z, padding, bgra, padding).
+struct benchPoint {
+    float x, y, z, pad;
+    uint8_t b, g, r, a;
+    float pad2[3];
+};
+
+int width = 1280;
+int height = 720;
+int iterations = 50;
+int max_threads = omp_get_max_threads();
+
+// Camera transform of the first camera in Meta-multicamera-optimized.
+float tf_mat[] = {-0.69888007, -0.32213748,  0.63858757, -2.22900000,
+                  -0.71520905,  0.32290986, -0.61984291,  2.91800000,
+                  -0.00653159, -0.88991947, -0.45607091,  0.36400000,
+                   0.00000000,  0.00000000,  0.00000000,  1.00000000};
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hw:e:i:t:")) != -1) {
+        switch (c) {
+            case 'w':
+                width = atoi(optarg);
+                break;
+            case 'e':
+                height = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 't':
+                max_threads = std::max(atoi(optarg), 1);
+                break;
+            default:
+            case 'h':
+                std::cout << "\nBenchmark of the point decode kernels on synthetic frames" << std::endl;
+                std::cout << "Usage: Meta-kernel-bench [options]" << std::endl;
+                std::cout << " -w <width>       Frame width (default 1280)" << std::endl;
+                std::cout << " -e <height>      Frame height (default 720)" << std::endl;
+                std::cout << " -i <iterations>  Frames decoded per kernel (default 50)" << std::endl;
+                std::cout << " -t <threads>     Largest thread count of the cutoff scaling table (default all cores)" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+// Fills the buffer with a synthetic depth frame: a tilted plane with a ripple, in 5-short records.
+void makeFrame(short * buffer, int w, int h) {
+    for (int v = 0; v < h; v++) {
+        for (int u = 0; u < w; u++) {
+            short * p = buffer + (v * w + u) * 5;
+            float z = 1.2f + 0.3f * u / w + 0.02f * ((u * 7 + v * 3) % 11);
+            p[0] = short((u - w / 2) * z / 640.f * CONV_RATE);
+            p[1] = short((v - h / 2) * z / 640.f * CONV_RATE);
+            p[2] = short(z * CONV_RATE);
+            p[3] = short((u & 0xFF) | ((v & 0xFF) << 8));
+            p[4] = short((u + v) & 0xFF);
+        }
+    }
+}
+
+// Fills vertices, texture coordinates and an RGB8 color frame like a textured rs2::points of the same
+// frame. A few texture coordinates fall outside of the color frame, as they do next to its borders.
+void makePointCloud(float * vertices, float * tex_coords, uint8_t * color, int w, int h) {
+    for (int v = 0; v < h; v++) {
+        for (int u = 0; u < w; u++) {
+            const int i = v * w + u;
+            float z = 1.2f + 0.3f * u / w + 0.02f * ((u * 7 + v * 3) % 11);
+            vertices[i * 3 + 0] = (u - w / 2) * z / 640.f;
+            vertices[i * 3 + 1] = (v - h / 2) * z / 640.f;
+            vertices[i * 3 + 2] = (i % 13) ? z : 0;
+            tex_coords[i * 2 + 0] = (u + 0.37f * ((i % 5) - 2) * w / 100) / w;
+            tex_coords[i * 2 + 1] = (v + 0.21f * ((i % 7) - 3) * h / 100) / h;
+        }
+    }
+    for (int i = 0; i < w * h * 3; i++)
+        color[i] = uint8_t(i * 31 + (i >> 9));
+}
+
+// AoS decode as done by convertBufferToPointCloudXYZRGB, followed by a separate transform pass
+// as done by pcl::transformPointCloud.
+void decodeAoS(const short * buffer, int size, int downsample, const float * m, benchPoint * points) {
+    int count = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (i % downsample == 0) {
+            points[count].x = (float)buffer[i * 5 + 0] / CONV_RATE;
+            points[count].y = (float)buffer[i * 5 + 1] / CONV_RATE;
+            points[count].z = (float)buffer[i * 5 + 2] / CONV_RATE;
+            points[count].r = (uint8_t)(buffer[i * 5 + 3] & 0xFF);
+            points[count].g = (uint8_t)(buffer[i * 5 + 3] >> 8);
+            points[count].b = (uint8_t)(buffer[i * 5 + 4] & 0xFF);
+            count++;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        const float x = points[i].x, y = points[i].y, z = points[i].z;
+        points[i].x = m[0] * x + m[1] * y + m[2] * z + m[3];
+        points[i].y = m[4] * x + m[5] * y + m[6] * z + m[7];
+        points[i].z = m[8] * x + m[9] * y + m[10] * z + m[11];
+    }
+}
+
+// Cutoff as Meta-camera-optimized did it before the two-pass compaction: one shared counter taken with an
+// atomic capture for every point in range, so the order of the records depends on the thread schedule.
+int convertInRangeAtomic(const convertParams & p, int num_points, short * records, int num_threads) {
+    int global_count = 0;
+
+    #pragma omp parallel for schedule(static, 10000) num_threads(num_threads)
+    for (int i = 0; i < num_points; i++) {
+        if (!pointInRange(p, p.vertices + size_t(i) * 3)) continue;
+
+        int count;
+        #pragma omp atomic capture
+        count = global_count++;
+
+        convertPointScalar(p, i, records + size_t(count) * 5);
+    }
+
+    return global_count;
+}
+
+// Runs fn iterations times and prints the time per frame and the point throughput.
+template <typename F>
+double bench(const char * name, int num_points, F fn) {
+    fn();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+        fn();
+    double ms = timeMilli(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << ms << " ms" << std::setw(10) << std::setprecision(1)
+              << num_points / ms / 1000 << " Mpts/s" << std::endl;
+    return ms;
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+
+    const int num_points = width * height;
+    short * records = (short *)malloc(sizeof(short) * 5 * num_points);
+    short * unpacked = (short *)malloc(sizeof(short) * 5 * num_points);
+    uint8_t * soa = (uint8_t *)aligned_alloc(SOA_ALIGN, soaPayloadBytes(num_points));
+    std::vector<benchPoint> aos_points(num_points), soa_points(num_points);
+
+    makeFrame(records, width, height);
+    packSoA(records, num_points, soa);
+
+    std::cout << "Frame " << width << "x" << height << " (" << num_points << " points), "
+              << iterations << " iterations per kernel" << std::endl;
+    std::cout << "AoS payload " << num_points * 10 << " bytes, SoA payload " << soaPayloadBytes(num_points) << " bytes" << std::endl;
+
+    double aos_ms = bench("AoS decode + transform", num_points, [&]() {
+        decodeAoS(records, num_points, 1, tf_mat, &aos_points[0]);
+    });
+    double soa_ms = bench("SoA fused decode/transform", num_points, [&]() {
+        decodeSoA(soa, num_points, tf_mat, CONV_RATE, &soa_points[0]);
+    });
+    bench("SoA -> AoS records", num_points, [&]() {
+        unpackSoA(soa, num_points, unpacked);
+    });
+    bench("AoS records -> SoA", num_points, [&]() {
+        packSoA(records, num_points, soa);
+    });
+
+    // Both paths have to produce the same cloud up to float rounding of the fused multiply-add.
+    int mismatch = 0;
+    for (int i = 0; i < num_points; i++) {
+        const benchPoint & a = aos_points[i];
+        const benchPoint & s = soa_points[i];
+        if (std::abs(a.x - s.x) > 1e-4f || std::abs(a.y - s.y) > 1e-4f || std::abs(a.z - s.z) > 1e-4f ||
+            a.r != s.r || a.g != s.g || a.b != s.b)
+            mismatch++;
+    }
+    if (memcmp(records, unpacked, sizeof(short) * 5 * num_points) != 0)
+        mismatch++;
+
+    std::cout << "SoA speedup: " << std::setprecision(2) << aos_ms / soa_ms << "x, mismatches: " << mismatch << std::endl;
+
+    // Camera side: every conversion kernel the CPU supports has to write exactly the scalar records.
+    std::vector<float> vertices(num_points * 3), tex_coords(num_points * 2);
+    std::vector<uint8_t> color(num_points * 3);
+    makePointCloud(&vertices[0], &tex_coords[0], &color[0], width, height);
+
+    convertParams params;
+    params.vertices = &vertices[0];
+    params.tex_coords = &tex_coords[0];
+    params.color = &color[0];
+    params.w = width;
+    params.h = height;
+    params.cl_bp = 3;
+    params.cl_sb = width * 3;
+    params.tf = tf_mat;
+    params.conv_rate = CONV_RATE;
+    params.z_min = params.x_min = -INFINITY;
+    params.z_max = params.x_max = INFINITY;
+    params.roi = NULL;
+    double scalar_ms = 0;
+    double record_ms[NUM_CONVERT_KERNELS] = {0};
+    convertPoints(convertPointsScalar, params, num_points, records, 1);
+
+    std::cout << "\nConversion kernels, selected: " << convert_kernel_names[bestConvertKernel()] << std::endl;
+    for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+        if (!convertKernelSupported(k)) {
+            std::cout << convert_kernel_names[k] << ": not supported by this CPU" << std::endl;
+            continue;
+        }
+        memset(unpacked, 0, sizeof(short) * 5 * num_points);
+        double ms = bench(convert_kernel_names[k], num_points, [&]() {
+            convertPoints(convertKernelOf(k), params, num_points, unpacked, 1);
+        });
+        if (k == CONVERT_SCALAR) scalar_ms = ms;
+        record_ms[k] = ms;
+        const bool exact = memcmp(records, unpacked, sizeof(short) * 5 * num_points) == 0;
+        if (!exact) mismatch++;
+        std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x scalar, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    // The same kernels writing the SoA planes of FORMAT_SOA, against the records and a packSoA pass.
+    std::cout << "\nConversion kernels, SoA layout" << std::endl;
+    for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+        if (!convertKernelSupported(k)) continue;
+        const std::string name = std::string(convert_kernel_names[k]) + " soa";
+        memset(soa, 0, soaPayloadBytes(num_points));
+        double ms = bench(name.c_str(), num_points, [&]() {
+            convertPointsToSoA(k, params, num_points, soa, 1);
+        });
+        unpackSoA(soa, num_points, unpacked);
+        const bool exact = memcmp(records, unpacked, sizeof(short) * 5 * num_points) == 0;
+        if (!exact) mismatch++;
+        std::cout << "  " << std::setprecision(2) << record_ms[k] / ms << "x records, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    // Fused depth kernels on the Z16 image of the same scene, with the capture range culling on.
+    std::vector<uint16_t> depth(num_points);
+    for (int i = 0; i < num_points; i++)
+        depth[i] = (i % 13) ? uint16_t(vertices[i * 3 + 2] * 1000) : 0;
+
+    depthExtension ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.width = uint16_t(width);
+    ext.height = uint16_t(height);
+    ext.model = DEPTH_MODEL_INVERSE_BROWN_CONRADY;
+    ext.fx = ext.fy = 640;
+    ext.ppx = width / 2.f;
+    ext.ppy = height / 2.f;
+    ext.depth_scale = 0.001f;
+    memcpy(ext.tf, tf_mat, sizeof(ext.tf));
+
+    depthRayTable rays;
+    memset(&rays, 0, sizeof(rays));
+    depthConvertParams depth_params = depthConvertParamsOf(ext, &rays, &depth[0], &color[0], 3, CONV_RATE);
+    depth_params.cull = true;
+    depth_params.z_max = 1.5f;
+    depth_params.x_min = -2;
+    depth_params.x_max = 2;
+
+    // Region of interest: a box around the middle of the transformed scene and a rotated box next to it.
+    double middle[3] = {0, 0, 0};
+    for (int i = 0; i < num_points; i++)
+        for (int c = 0; c < 3; c++)
+            middle[c] += (tf_mat[c * 4] * vertices[i * 3] + tf_mat[c * 4 + 1] * vertices[i * 3 + 1] +
+                          tf_mat[c * 4 + 2] * vertices[i * 3 + 2] + tf_mat[c * 4 + 3]) / num_points;
+    const float roi_min[3] = {float(middle[0] - .4), float(middle[1] - .4), float(middle[2] - .3)};
+    const float roi_max[3] = {float(middle[0] + .2), float(middle[1] + .4), float(middle[2] + .3)};
+    const float obb_center[3] = {float(middle[0] + .4), float(middle[1]), float(middle[2])};
+    const float obb_half[3] = {.25f, .3f, .2f};
+    float obb_rotation[9];
+    roiRotation(30, 0, 15, obb_rotation);
+    roiSet roi, roi_records;
+    memset(&roi, 0, sizeof(roi));
+    addRoiAABB(&roi, roi_min, roi_max);
+    addRoiBox(&roi, obb_center, obb_half, obb_rotation);
+    scaleRoi(roi, CONV_RATE, &roi_records);
+
+    auto benchDepthKernels = [&]() {
+        const int reference_points = convertDepth(depthToRecordsScalar, depth_params, num_points, records, 1);
+        std::cout << reference_points << " of " << num_points << " pixels in range" << std::endl;
+        for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+            if (k == CONVERT_SSE || !convertKernelSupported(k)) continue;
+            int num_valid = 0;
+            double ms = bench(convert_kernel_names[k], num_points, [&]() {
+                num_valid = convertDepth(depthConvertKernelOf(k), depth_params, num_points, unpacked, 1);
+            });
+            if (k == CONVERT_SCALAR) scalar_ms = ms;
+            const bool exact = num_valid == reference_points && memcmp(records, unpacked, sizeof(short) * 5 * num_valid) == 0;
+            if (!exact) mismatch++;
+            std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x scalar, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+        }
+    };
+
+    std::cout << "\nFused depth kernels, aligned color: ";
+    benchDepthKernels();
+
+    // Same with the color frame registered by the kernels, through a D435-like depth to color extrinsic
+    // and a distorted color camera, per pixel and per 4x4 cell.
+    const float rotation[9] = {0.99998f, 0.0052f, -0.0031f, -0.0052f, 0.99998f, 0.0012f, 0.0031f, -0.0012f, 0.99999f};
+    const float translation[3] = {0.0148f, 0.0002f, 0.0004f};
+    const float coeffs[5] = {0.12f, -0.25f, 0.001f, -0.0007f, 0.1f};
+    colorRegistration reg;
+    memset(&reg, 0, sizeof(reg));
+    for (int step : {1, 4}) {
+        updateColorRegistration(&reg, ext, rotation, translation, width, height, 610, 610, width / 2.f - 3,
+                                height / 2.f + 2, DEPTH_MODEL_BROWN_CONRADY, coeffs, 3, width * 3, step);
+        depth_params.reg = &reg;
+        updateRegistrationMap(depth_params, &reg, height, 1);
+        std::cout << "\nFused depth kernels, registered color, step " << step << ": ";
+        benchDepthKernels();
+    }
+
+    // The region of interest instead of the capture range, aligned color.
+    depth_params.reg = NULL;
+    depth_params.cull = false;
+    depth_params.roi = &roi_records;
+    std::cout << "\nFused depth kernels, region of interest: ";
+    benchDepthKernels();
+    freeColorRegistration(&reg);
+    freeRayTable(&rays);
+
+    // Depth filter on a smooth tilted plane with a step, a column of flying pixels in the step, holes and
+    // speckles. The ripple of the scene above jumps by more than the threshold from pixel to pixel.
+    // The AVX2 kernels have to drop exactly the pixels of the scalar ones.
+    std::vector<uint16_t> noisy(num_points), filtered(num_points), reference(num_points);
+    for (int i = 0; i < num_points; i++) {
+        const int u = i % width;
+        noisy[i] = uint16_t((u > width / 2 ? 900 : 1200) + 300 * u / width + (u + i / width) % 3);
+        if (u == width / 2) noisy[i] = 1050;
+        if (i % 13 == 0) noisy[i] = 0;
+        if (i % 97 == 0) noisy[i] = uint16_t(500 + i % 3000);
+    }
+    const char * filter_names[] = {"flying pixels", "outliers", "both"};
+    for (int pass = 0; pass < 3; pass++) {
+        const float jump = pass == 1 ? 0 : 3;
+        const float std_mul = pass == 0 ? -1 : 1;
+        depthFilter scalar_filter, avx2_filter;
+        initDepthFilter(&scalar_filter, jump, std_mul, false);
+        initDepthFilter(&avx2_filter, jump, std_mul, true);
+
+        reference = noisy;
+        const depthFilterStats removed = filterDepth(&scalar_filter, &reference[0], width, height, 0.001f, 1);
+        std::cout << "\nDepth filter, " << filter_names[pass] << ": " << removed.flying + removed.outliers << " of "
+                  << removed.valid << " pixels removed" << std::endl;
+
+        double ms = bench("scalar", num_points, [&]() {
+            filtered = noisy;
+            filterDepth(&scalar_filter, &filtered[0], width, height, 0.001f, 1);
+        });
+        scalar_ms = ms;
+        if (convertKernelSupported(CONVERT_AVX2)) {
+            ms = bench("avx2", num_points, [&]() {
+                filtered = noisy;
+                filterDepth(&avx2_filter, &filtered[0], width, height, 0.001f, 1);
+            });
+            const bool exact = filtered == reference;
+            if (!exact) mismatch++;
+            std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x scalar, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+        }
+        freeDepthFilter(&scalar_filter);
+        freeDepthFilter(&avx2_filter);
+    }
+
+    // Post-processing chain on the Z16 image of the conversion scene, every stage and the whole chain. The
+    // temporal filter sees the same frame every iteration, so both kernels end on the same history. The
+    // decimated image then goes through the selected fused kernel with the intrinsics of decimateExtension.
+    const char * chain_names[] = {"decimation 2", "decimation 4", "threshold", "temporal", "decimation 2 + all"};
+    std::vector<uint16_t> processed(num_points), processed_reference(num_points);
+    std::vector<uint8_t> decimated_color(num_points * 3);
+    memset(&rays, 0, sizeof(rays));
+    for (int pass = 0; pass < 5; pass++) {
+        depthChain scalar_chain, avx2_chain;
+        initDepthChain(&scalar_chain, false);
+        scalar_chain.decimation = pass == 0 || pass == 4 ? 2 : pass == 1 ? 4 : 1;
+        if (pass == 2 || pass == 4) {
+            scalar_chain.min_distance = 1.3f;
+            scalar_chain.max_distance = 1.6f;
+        }
+        if (pass == 3 || pass == 4) {
+            scalar_chain.alpha = 0.4f;
+            scalar_chain.persistence = 3;
+        }
+        avx2_chain = scalar_chain;
+        avx2_chain.avx2 = true;
+
+        int out_w = width, out_h = height;
+        std::cout << "\nDepth post-processing, " << chain_names[pass] << std::endl;
+        double ms = bench("scalar", num_points, [&]() {
+            processed_reference = depth;
+            out_w = width;
+            out_h = height;
+            processDepth(&scalar_chain, &processed_reference[0], &out_w, &out_h, 0.001f, 1);
+        });
+        scalar_ms = ms;
+        if (convertKernelSupported(CONVERT_AVX2)) {
+            ms = bench("avx2", num_points, [&]() {
+                processed = depth;
+                int w = width, h = height;
+                processDepth(&avx2_chain, &processed[0], &w, &h, 0.001f, 1);
+            });
+            const bool exact = memcmp(&processed[0], &processed_reference[0], sizeof(uint16_t) * out_w * out_h) == 0;
+            if (!exact) mismatch++;
+            std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x scalar, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+        }
+
+        if (scalar_chain.decimation > 1) {
+            const depthExtension decimated_ext = decimateExtension(ext, scalar_chain.decimation);
+            decimateColor(&color[0], width, height, 3, width * 3, scalar_chain.decimation, &decimated_color[0], 1);
+            const depthConvertParams decimated_params = depthConvertParamsOf(decimated_ext, &rays, &processed_reference[0],
+                                                                             &decimated_color[0], 3, CONV_RATE);
+            int num_valid = 0;
+            bench("  conversion", out_w * out_h, [&]() {
+                num_valid = convertDepth(depthConvertKernelOf(bestConvertKernel()), decimated_params, out_w * out_h, unpacked, 1);
+            });
+            std::cout << "  " << out_w << "x" << out_h << " image, " << num_valid << " points" << std::endl;
+        }
+        freeDepthChain(&scalar_chain);
+        freeDepthChain(&avx2_chain);
+    }
+    freeRayTable(&rays);
+
+    // Cutoff: the two-pass compaction against the shared atomic counter, from 1 to max_threads threads.
+    // The compacted records have to be the same for every thread count and kernel.
+    params.z_min = 0;
+    params.z_max = 1.5f;
+    params.x_min = -2;
+    params.x_max = 2;
+    const int cutoff_points = convertPointsInRange(CONVERT_SCALAR, params, num_points, records, 1);
+    std::cout << "\nCutoff compaction, " << cutoff_points << " of " << num_points << " points in range (ms per frame)" << std::endl;
+    std::cout << std::left << std::setw(10) << "threads" << std::right << std::setw(10) << "atomic";
+    for (int k = 0; k < NUM_CONVERT_KERNELS; k++)
+        if (convertKernelSupported(k)) std::cout << std::setw(10) << convert_kernel_names[k];
+    std::cout << std::endl;
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        auto time = [&](auto fn) {
+            fn();
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++)
+                fn();
+            return timeMilli(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+        };
+
+        int num_valid = 0;
+        std::cout << std::left << std::setw(10) << threads << std::right << std::fixed << std::setprecision(3);
+        std::cout << std::setw(10) << time([&]() { num_valid = convertInRangeAtomic(params, num_points, unpacked, threads); });
+        if (num_valid != cutoff_points) mismatch++;
+
+        for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+            if (!convertKernelSupported(k)) continue;
+            std::cout << std::setw(10) << time([&]() { num_valid = convertPointsInRange(k, params, num_points, unpacked, threads); });
+            if (num_valid != cutoff_points || memcmp(records, unpacked, sizeof(short) * 5 * num_valid) != 0) {
+                std::cout << " MISMATCH";
+                mismatch++;
+            }
+        }
+        std::cout << std::endl;
+
+        if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+    }
+
+    // Region of interest of the point cloud path, the planes are tested after the transform.
+    params.z_min = params.x_min = -INFINITY;
+    params.z_max = params.x_max = INFINITY;
+    params.roi = &roi;
+    const int roi_points = convertPointsInRange(CONVERT_SCALAR, params, num_points, records, 1);
+    std::cout << "\nRegion of interest, " << roi.num_volumes << " volumes: " << roi_points << " of " << num_points
+              << " points inside" << std::endl;
+    for (int k = 0; k < NUM_CONVERT_KERNELS; k++) {
+        if (!convertKernelSupported(k)) continue;
+        int num_valid = 0;
+        double ms = bench(convert_kernel_names[k], num_points, [&]() {
+            num_valid = convertPointsInRange(k, params, num_points, unpacked, 1);
+        });
+        if (k == CONVERT_SCALAR) scalar_ms = ms;
+        const bool exact = num_valid == roi_points && memcmp(records, unpacked, sizeof(short) * 5 * num_valid) == 0;
+        if (!exact) mismatch++;
+        std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x scalar, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    // Quantizer: the SIMD quantization and bounding box against the scalar ones, and what the step does
+    // to the size of the compressed frames of the transformed cloud.
+    std::vector<uint8_t> frame(frameBufferBytes(num_points));
+    std::cout << "\nQuantizer, compressed frames of the transformed cloud" << std::endl;
+    for (float step = 0.5f; step <= 4; step *= 2) {
+        quantizer q = defaultQuantizer();
+        q.step_mm = step;
+        q.origin[2] = 1.f;
+
+        bench(("quantize " + std::to_string(step).substr(0, 3) + " mm").c_str(), num_points, [&]() {
+            quantizePoints(&soa_points[0], num_points, q, records);
+        });
+        const float rate = quantRate(q);
+        bool exact = true;
+        for (int i = 0; i < num_points && exact; i++)
+            exact = records[i * 5 + 0] == quantizeCoordinate(soa_points[i].x, q.origin[0], rate) &&
+                    records[i * 5 + 1] == quantizeCoordinate(soa_points[i].y, q.origin[1], rate) &&
+                    records[i * 5 + 2] == quantizeCoordinate(soa_points[i].z, q.origin[2], rate);
+
+        const quantExtension ext = quantExtensionOf(q, records, num_points);
+        for (int c = 0; c < 3 && exact; c++) {
+            short lo = 32767, hi = -32768;
+            for (int i = 0; i < num_points; i++) {
+                lo = std::min(lo, records[i * 5 + c]);
+                hi = std::max(hi, records[i * 5 + c]);
+            }
+            exact = ext.box_min[c] == lo && ext.box_max[c] == hi;
+        }
+        if (!exact) mismatch++;
+
+        const size_t bytes = packFrame(records, num_points, FORMAT_COMPRESSED, 0, 0, &frame[0], 1, &ext);
+        std::cout << "  " << std::fixed << std::setprecision(2) << double(bytes) / num_points << " B/pt compressed, "
+                  << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    // Native stitch: camera records straight to stitched records against the round trip through points
+    // (decode, transform, quantize) that Meta-multicamera-optimized did with PCL.
+    makeFrame(records, width, height);
+    std::vector<short> stitched(size_t(num_points) * 5);
+    float record_tf[16];
+    recordTransform(defaultQuantizer(), tf_mat, defaultQuantizer(), record_tf);
+    std::cout << "\nNative stitch, camera records to stitched records" << std::endl;
+
+    for (int pass = 0; pass < 3; pass++) {
+        const int downsample = pass == 1 ? 3 : 1;
+        const roiSet * cull = pass == 2 ? &roi_records : NULL;
+        const int samples = (num_points + downsample - 1) / downsample;
+        std::cout << (pass == 2 ? "region of interest" : "downsample " + std::to_string(downsample)) << std::endl;
+
+        int reference = 0, kept = 0;
+        if (pass < 2) {
+            scalar_ms = bench("points round trip", num_points, [&]() {
+                decodeAoS(records, num_points, downsample, tf_mat, &aos_points[0]);
+                quantizePoints(&aos_points[0], samples, defaultQuantizer(), unpacked);
+            });
+        }
+        double ms = bench("scalar", num_points, [&]() {
+            reference = transformRecordsScalar(records, 0, samples, downsample, record_tf, cull, &stitched[0]);
+        });
+        if (pass == 2) scalar_ms = ms;
+        std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x" << std::endl;
+
+        ms = bench("selected", num_points, [&]() {
+            kept = transformRecords(records, num_points, downsample, record_tf, cull, unpacked);
+        });
+        const bool exact = kept == reference && memcmp(&stitched[0], unpacked, sizeof(short) * 5 * kept) == 0;
+        if (!exact) mismatch++;
+        std::cout << "  " << std::setprecision(2) << scalar_ms / ms << "x, " << kept << " of " << samples
+                  << " points, " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    // Stitch gather of Meta-multicamera-client: the per-point copy it did against the iovec send without
+    // downsampling and the per-camera compaction with it, the frames go through a socketpair to a drain thread.
+    const int max_cameras = 8;
+    std::vector<std::vector<short>> cameras(max_cameras, std::vector<short>(size_t(num_points) * 5));
+    for (std::vector<short> & camera : cameras)
+        makeFrame(camera.data(), width, height);
+    std::vector<short> gathered(size_t(max_cameras) * num_points * 5 + 2), compacted(gathered.size());
+
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+        std::cerr << "socketpair failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::thread drain([&]() {
+        std::vector<uint8_t> sink(1 << 20);
+        while (read(socks[1], sink.data(), sink.size()) > 0) {}
+    });
+    frameSender sender;
+    initFrameSender(&sender, socks[0], false);
+
+    std::cout << "\nStitch gather, " << num_points << " points per camera" << std::endl;
+    for (int num_cameras = 1; num_cameras <= max_cameras; num_cameras *= 2) {
+        const int total = num_cameras * num_points;
+        std::cout << num_cameras << (num_cameras == 1 ? " camera" : " cameras") << std::endl;
+
+        auto copyPerPoint = [&](int downsample) {
+            int size = 0;
+            for (int c = 0; c < num_cameras; c++)
+                for (int j = 0; j < num_points * 5; j += 5 * downsample) {
+                    memcpy(&gathered[2 + size], &cameras[c][j], 5 * sizeof(short));
+                    size += 5;
+                }
+            return size;
+        };
+        auto sendGathered = [&](std::vector<short> & buf, int size) {
+            size *= sizeof(short);
+            memcpy(buf.data(), &size, sizeof(int));
+            struct iovec iov = {buf.data(), size + sizeof(int)};
+            sendFrameIov(&sender, &iov, 1);
+        };
+
+        bench("per-point copy + send", total, [&]() {
+            sendGathered(gathered, copyPerPoint(1));
+        });
+        bench("iovec per camera", total, [&]() {
+            int size = num_cameras * num_points * 5 * sizeof(short);
+            struct iovec iov[max_cameras + 1];
+            iov[0].iov_base = &size;
+            iov[0].iov_len = sizeof(int);
+            for (int c = 0; c < num_cameras; c++) {
+                iov[1 + c].iov_base = cameras[c].data();
+                iov[1 + c].iov_len = num_points * 5 * sizeof(short);
+            }
+            sendFrameIov(&sender, iov, 1 + num_cameras);
+        });
+
+        int reference = 0, compacted_size = 0;
+        bench("per-point copy, ds 2", total, [&]() {
+            reference = copyPerPoint(2);
+        });
+        bench("compaction, ds 2", total, [&]() {
+            const int samples = (num_points + 1) / 2;
+            #pragma omp parallel for schedule(dynamic, 1) num_threads(num_cameras)
+            for (int c = 0; c < num_cameras; c++)
+                strideRecords(cameras[c].data(), num_points, 2, &compacted[2 + size_t(c) * samples * 5]);
+            compacted_size = num_cameras * samples * 5;
+        });
+        const bool exact = compacted_size == reference &&
+                           memcmp(&gathered[2], &compacted[2], sizeof(short) * reference) == 0;
+        if (!exact) mismatch++;
+        std::cout << "  " << (exact ? "bit exact" : "MISMATCH") << std::endl;
+    }
+
+    shutdown(socks[0], SHUT_WR);
+    drain.join();
+    close(socks[0]);
+    close(socks[1]);
+
+    free(records);
+    free(unpacked);
+    free(soa);
+
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,6 +20,11 @@
 #include <chrono>
 #include <thread>
 
+#include "Meta/frame.h"
+#include "Meta/net.h"
+#include "Meta/pipeline.h"
+#include "Meta/sync.h"
+
 typedef pcl::PointCloud<pcl::PointXYZ> pointCloudXYZ;
 typedef pcl::PointCloud<pcl::PointXYZRGB> pointCloudXYZRGB;
 typedef std::chrono::high_resolution_clock clockTime;
@@ -32,6 +37,7 @@ const int CLIENT_PORT = 8000;
 const int SERVER_PORT = 9000;
 const int BUF_SIZE = 5000000;
 const int STITCHED_BUF_SIZE = 32000000;
+const int NUM_CAMERA_FRAMES = SYNC_DEPTH + 2;
 const float CONV_RATE = 1000.0;
 const char PULL_XYZ = 'Y';
 const char PULL_XYZRGB = 'Z';
@@ -47,15 +53,54 @@ bool timer = false;
 bool save = false;
 bool visual = false;
 bool clean = true;
+int wire_format = FORMAT_XYZRGB16;
+int credit_window = 0;
+// Frame synchronization (Meta/sync.h): SYNC_WAIT with -w, frames matched within sync_window_ms.
+int sync_policy = SYNC_LATEST;
+double sync_window_ms = 20;
+double sync_wait_ms = 0;
+long unity_credits = 0;
+// Format the VR client asked for with REQUEST_FORMAT, -1 for the bare int length framing.
+int unity_format = -1;
+int octree_depth = 10;
+int octree_budget = 0;
+uint64_t unity_frame_number = 0;
+std::vector<uint8_t> octree_buf;
 int downsample = 1;
 int framecount = 0;
 int server_sockfd = 0;
 int client_sockfd = 0;
+// Copying sendmsg sender for client_sockfd, the stitched frames point into the frames of the cameras.
+frameSender unity_sender;
 int sockfd_array[NUM_CAMERAS];
 short *pc_buf[NUM_CAMERAS];
 short * stitched_buf;
+uint8_t *wire_buf[NUM_CAMERAS];
+// Unit-depth rays per camera for depth frames, rebuilt when the intrinsics of a camera change.
+depthRayTable depth_rays[NUM_CAMERAS];
+// Keyframes per camera for delta coded frames.
+temporalDecoder temporal[NUM_CAMERAS];
+// Quantizer of the last frame per camera, from its header extension.
+quantizer frame_quant[NUM_CAMERAS];
+// Capture time of the last frame per camera, from its header.
+uint64_t frame_time[NUM_CAMERAS];
 Eigen::Matrix4f transform[NUM_CAMERAS];
+// Receiver workers, one per camera socket for the lifetime of the process.
 std::thread Meta_thread[NUM_CAMERAS];
+
+// Frame of one camera: the records for runStitching, the transformed cloud for visualize.
+struct cameraFrame {
+    short * records;
+    int size;                   // shorts in records
+    pointCloudXYZRGB cloud;
+};
+
+// Every receiver worker reads into its own pool of frames and pushes every complete one into the jitter
+// buffer of its camera, the stitch loop holds stitch_frames[i] until the synchronizer hands it a newer
+// frame of camera i.
+cameraFrame camera_frames[NUM_CAMERAS][NUM_CAMERA_FRAMES];
+frameSync<cameraFrame> frame_sync;
+cameraFrame * stitch_frames[NUM_CAMERAS];
 pcl::visualization::PCLVisualizer viewer("Pointcloud Viewer by Guan");
 
 
@@ -72,7 +117,7 @@ void sigintHandler(int dummy) {
 
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hftsvd:n")) != -1) {
+    while ((c = getopt(argc, argv, "hftsvd:nzp:c:o:b:m:w:")) != -1) {
         switch(c) {
             
             case 'n':
@@ -97,6 +142,50 @@ void parseArgs(int argc, char** argv) {
             case 'd':
                 downsample = atoi(optarg);
                 break;
+
+            case 'z':
+                wire_format = FORMAT_COMPRESSED;
+                break;
+
+            case 'p':
+                wire_format = atoi(optarg);
+                if (!validFormat(wire_format) || wire_format == FORMAT_OCTREE) {
+                    std::cerr << "Unknown wire format " << wire_format << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                credit_window = atoi(optarg);
+                if (credit_window < 0) {
+                    std::cerr << "Invalid credit window " << credit_window << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                octree_depth = atoi(optarg);
+                if (octree_depth < 1 || octree_depth > OCTREE_MAX_DEPTH) {
+                    std::cerr << "Invalid octree depth " << octree_depth << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                octree_budget = atoi(optarg);
+                break;
+            case 'm':
+                sync_window_ms = atof(optarg);
+                if (sync_window_ms < 0) {
+                    std::cerr << "Invalid sync window " << sync_window_ms << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                sync_policy = SYNC_WAIT;
+                sync_wait_ms = atof(optarg);
+                if (sync_wait_ms < 0) {
+                    std::cerr << "Invalid sync wait " << sync_wait_ms << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
             case 'h':
                 std::cout << "\nMulticamera pointcloud stitching" << std::endl;
@@ -108,6 +197,16 @@ void parseArgs(int argc, char** argv) {
                 std::cout << " -s (save)        Saves 20 frames in a .ply format" << std::endl;
                 std::cout << " -v (visualize)   Visualizes the pointclouds using PCL visualizer" << std::endl;
                 std::cout << " -d (downsample)  Downsamples the pointcloud by the specified integer" << std::endl;
+                std::cout << " -p <format>      Wire format requested from the camera servers (see Meta/frame.h)" << std::endl;
+                std::cout << "                  -p 7 only sends delta frames while the point count stays the same, a camera server\n"
+                             "                  with a region of interest (-r), voxel downsampling (-v, -B) or decimation (-x) sends\n"
+                             "                  keyframes only" << std::endl;
+                std::cout << " -z (compressed)  Request the lossless compressed stream, same as -p 3" << std::endl;
+                std::cout << " -c <frames>      Push mode: grant the camera servers a window of frames instead of pulling each one" << std::endl;
+                std::cout << " -o <depth>       Octree depth of the stitched cloud when the VR client asks for FORMAT_OCTREE (default 10)" << std::endl;
+                std::cout << " -b <KB>          Octree byte budget per frame, deeper levels are dropped to fit (default unlimited)" << std::endl;
+                std::cout << " -w <ms>          Stitch frames matched on capture time, waiting up to ms for late cameras (default newest frames)" << std::endl;
+                std::cout << " -m <ms>          Capture time window of matched frames with -w (default 20)" << std::endl;
                 exit(0);
         }
     }
@@ -178,6 +277,65 @@ void sendPullRequest(int sockfd, char pull_char) {
     }
 }
 
+// Selects the wire format for this connection, every frame is then preceded by a frameHeader.
+void sendFormatRequest(int sockfd, char format) {
+    char request[2] = {REQUEST_FORMAT, format};
+    if (send(sockfd, request, 2, 0) < 2) {
+        std::cerr << "Format request failure from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Asks a camera server for more frames: a pull request in pull mode, a grant of credits in push mode.
+void requestFrames(int sockfd, uint32_t credits) {
+    if (credit_window == 0) {
+        sendPullRequest(sockfd, PULL_XYZRGB);
+        return;
+    }
+    if (!sendCreditGrant(sockfd, credits)) {
+        std::cerr << "Credit request failure from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits until the VR client wants a frame. It either pulls each frame with 'Z' or grants
+// credits in advance, requests are only read while no credit is left. A REQUEST_FORMAT
+// for FORMAT_OCTREE switches the client to framed octree frames.
+void waitForUnityRequest() {
+    char pull_request[1] = {0};
+
+    while (unity_credits == 0) {
+        if (recv(client_sockfd, pull_request, 1, 0) < 1) {
+            std::cout << "Client disconnected" << std::endl;
+            exit(0);
+        }
+        if (pull_request[0] == REQUEST_PULL) {
+            unity_credits++;
+        }
+        else if (pull_request[0] == REQUEST_CREDIT) {
+            uint32_t grant;
+            if (!readCreditGrant(client_sockfd, &grant)) {
+                std::cerr << "Faulty credit request" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            unity_credits += grant;
+        }
+        else if (pull_request[0] == REQUEST_FORMAT) {
+            uint8_t format;
+            if (recv(client_sockfd, &format, 1, MSG_WAITALL) < 1 || format != FORMAT_OCTREE) {
+                std::cerr << "Unsupported format request from the VR client" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            unity_format = format;
+        }
+        else {
+            std::cerr << "Faulty pull request" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unity_credits--;
+}
+
 
 void readNBytes(int sockfd, unsigned int n, void * buffer) {
     int total_bytes, bytes_read;
@@ -193,66 +351,150 @@ void readNBytes(int sockfd, unsigned int n, void * buffer) {
     }
 }
 
-pointCloudXYZRGB::Ptr convertBufferToPointCloudXYZRGB(short * buffer, int size) {
-    int count = 0;
-    pointCloudXYZRGB::Ptr new_cloud(new pointCloudXYZRGB);
-
-    new_cloud->width = size / downsample;
-    new_cloud->height = 1;
-    new_cloud->is_dense = false;
-    new_cloud->points.resize(new_cloud->width);
-
-    for (int i = 0; i < size; i++) {
-        if (i % downsample == 0) {
-            new_cloud->points[count].x = (float)buffer[i * 5 + 0] / CONV_RATE;
-            new_cloud->points[count].y = (float)buffer[i * 5 + 1] / CONV_RATE;
-            new_cloud->points[count].z = (float)buffer[i * 5 + 2] / CONV_RATE;
-            new_cloud->points[count].r = (uint8_t)(buffer[i * 5 + 3] & 0xFF);
-            new_cloud->points[count].g = (uint8_t)(buffer[i * 5 + 3] >> 8);
-            new_cloud->points[count].b = (uint8_t)(buffer[i * 5 + 4] & 0xFF);
-            count++;
+// Reads one frame from the camera server and unpacks it into 5-short records in cloud_buf.
+// When direct is given, SoA and depth frames are left in wire_buf[thread_num] for a fused decode and their
+// header is copied to direct, the depth extension of a depth frame to depth.
+// Returns the size of the unpacked buffer in bytes, or TEMPORAL_MISSING_KEY for a delta frame coded against
+// a keyframe this connection never got.
+int readOneFrame(int thread_num, int sockfd, short * cloud_buf, frameHeader * direct, depthExtension * depth) {
+    frameHeader header;
+    readNBytes(sockfd, sizeof(frameHeader), (void *)&header);
+
+    if (!validFrameHeader(header) || header.payload_bytes > framePayloadBound(BUF_SIZE / 5)) {
+        std::cerr << "Bad frame header from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    uint8_t extension[MAX_HEADER_BYTES];
+    if (header.header_bytes > sizeof(frameHeader))
+        readNBytes(sockfd, header.header_bytes - sizeof(frameHeader), (void *)extension);
+    if (!frameQuantizer(header, extension, &frame_quant[thread_num])) {
+        std::cerr << "Bad quantizer from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    frame_time[thread_num] = header.timestamp_us;
+
+    // Raw records need no unpacking, so read them straight into place.
+    uint8_t * payload = header.format == FORMAT_XYZRGB16 ? (uint8_t *)cloud_buf : wire_buf[thread_num];
+    readNBytes(sockfd, header.payload_bytes, (void *)payload);
+
+    if (direct && header.format == FORMAT_SOA) {
+        if (header.num_points > BUF_SIZE / 5 || header.payload_bytes != soaPayloadBytes(header.num_points)) {
+            std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
         }
+        *direct = header;
+        return header.num_points * 5 * sizeof(short);
     }
-    
-    return new_cloud;
-}
 
+    if (direct && depth && header.format == FORMAT_DEPTH16) {
+        if (header.num_points > BUF_SIZE / 5 || header.header_bytes < frameHeaderBytes(FORMAT_DEPTH16)) {
+            std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        memcpy(depth, extension, sizeof(depthExtension));
+        if (header.payload_bytes != depthPayloadBytes(*depth, header.num_points)) {
+            std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        *direct = header;
+        return header.num_points * 5 * sizeof(short);
+    }
 
-int convertPointCloudXYZRGBToBuffer(pointCloudXYZRGB::Ptr cloud, short * buffer) {
-    int size = 0;
+    if (header.format == FORMAT_DELTA) {
+        const bool keyframe = header.flags & FRAME_FLAG_KEY;
+        int num_points = decodeTemporal(&temporal[thread_num], payload, header.payload_bytes, keyframe, cloud_buf);
+        if (num_points == TEMPORAL_MISSING_KEY)
+            return TEMPORAL_MISSING_KEY;
+        if (num_points < 0) {
+            std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (keyframe && !sendKeyAck(sockfd, header.frame_number)) {
+            std::cerr << "Keyframe acknowledgement failure from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return num_points * 5 * sizeof(short);
+    }
 
-    for (int i = 0; i < cloud->width; i++) {
-        buffer[size * 5 + 0] = static_cast<short>(cloud->points[i].x * CONV_RATE);
-        buffer[size * 5 + 1] = static_cast<short>(cloud->points[i].y * CONV_RATE);
-        buffer[size * 5 + 2] = static_cast<short>(cloud->points[i].z * CONV_RATE);
-        buffer[size * 5 + 3] = static_cast<short>(cloud->points[i].r) + static_cast<short>(cloud->points[i].g << 8);
-        buffer[size * 5 + 4] = static_cast<short>(cloud->points[i].b);
-      
-        size++;
+    int num_points = unpackFrame(header, payload, cloud_buf, BUF_SIZE / 5, 1, extension, &depth_rays[thread_num]);
+    if (num_points < 0) {
+        std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
     }
 
+    return num_points * 5 * sizeof(short);
+}
+
+// readOneFrame until a frame decodes, delta frames without their keyframe are skipped.
+int readFrame(int thread_num, int sockfd, short * cloud_buf, frameHeader * direct = NULL, depthExtension * depth = NULL) {
+    int size;
+    while ((size = readOneFrame(thread_num, sockfd, cloud_buf, direct, depth)) == TEMPORAL_MISSING_KEY)
+        requestFrames(sockfd, 1);
     return size;
 }
 
+void convertBufferToPointCloudXYZRGB(short * buffer, int size, const quantizer & q, pointCloudXYZRGB * cloud) {
+    cloud->width = (size + downsample - 1) / downsample;
+    cloud->height = 1;
+    cloud->is_dense = false;
+    cloud->points.resize(cloud->width);
+
+    if (cloud->width > 0)
+        dequantizeRecords(buffer, size, downsample, q, &cloud->points[0]);
+}
+
 
-void updateCloudXYZRGB(int thread_num, int sockfd, pointCloudXYZRGB::Ptr cloud) {
+int convertPointCloudXYZRGBToBuffer(pointCloudXYZRGB::Ptr cloud, short * buffer) {
+    // The VR client takes legacy 1 mm records, points out of range saturate instead of wrapping around.
+    if (cloud->width > 0)
+        quantizePoints(&cloud->points[0], int(cloud->width), defaultQuantizer(), buffer);
+
+    return int(cloud->width);
+}
+
+
+void updateCloudXYZRGB(int thread_num, int sockfd, pointCloudXYZRGB * cloud) {
     double update_total, convert_total;
     timePoint loop_start, loop_end, read_start, read_end_convert_start, convert_end;
 
     if (timer)
         read_start = std::chrono::high_resolution_clock::now();
 
-    int size;
-
-    readNBytes(sockfd, sizeof(int), (void *)&size);
-    readNBytes(sockfd, size, (void *)pc_buf[thread_num]);
-    sendPullRequest(sockfd, PULL_XYZRGB);
+    // SoA and depth frames are decoded straight from the wire unless the cloud is downsampled.
+    frameHeader header;
+    depthExtension depth;
+    header.format = FORMAT_XYZRGB16;
+    int size = readFrame(thread_num, sockfd, pc_buf[thread_num], downsample == 1 ? &header : NULL, &depth);
+    requestFrames(sockfd, 1);
 
     if (timer)
         read_end_convert_start = std::chrono::high_resolution_clock::now();
 
-    *cloud = *convertBufferToPointCloudXYZRGB(pc_buf[thread_num], size / sizeof(short) / 5);
-    pcl::transformPointCloud(*cloud, *cloud, transform[thread_num]);
+    if (header.format == FORMAT_SOA) {
+        // Planes are decoded with the camera transform fused in, so there is no separate transform pass.
+        Eigen::Matrix<float, 4, 4, Eigen::RowMajor> tf = transform[thread_num];
+        cloud->width = header.num_points;
+        cloud->height = 1;
+        cloud->is_dense = false;
+        cloud->points.resize(cloud->width);
+        float m[16];
+        dequantizeTransform(frame_quant[thread_num], tf.data(), m);
+        decodeSoA(wire_buf[thread_num], header.num_points, m, quantRate(frame_quant[thread_num]), &cloud->points[0]);
+    } else if (header.format == FORMAT_DEPTH16) {
+        // Depth pixels are deprojected with the cached rays, the camera and stitching transforms are fused.
+        Eigen::Matrix<float, 4, 4, Eigen::RowMajor> tf = transform[thread_num];
+        cloud->width = header.num_points;
+        cloud->height = 1;
+        cloud->is_dense = false;
+        cloud->points.resize(cloud->width);
+        if (decodeDepth(depth, wire_buf[thread_num], header.num_points, &depth_rays[thread_num], tf.data(), &cloud->points[0]) < 0) {
+            std::cerr << "Corrupt depth frame from sockfd: " << sockfd << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        convertBufferToPointCloudXYZRGB(pc_buf[thread_num], size / sizeof(short) / 5, frame_quant[thread_num], cloud);
+        pcl::transformPointCloud(*cloud, *cloud, transform[thread_num]);
+    }
 
     if (timer) {
         convert_end = std::chrono::high_resolution_clock::now();
@@ -260,71 +502,165 @@ void updateCloudXYZRGB(int thread_num, int sockfd, pointCloudXYZRGB::Ptr cloud)
     }
 }
 
-void send_stitchedXYZRGB(pointCloudXYZRGB::Ptr stitched_cloud) {
-    char pull_request[1] = {0};
-
-
-    if (recv(client_sockfd, pull_request, 1, 0) < 0) {
+// Sends a whole frame of len bytes to the VR client, short writes included, and exits once the client is gone.
+void sendToUnity(const void * frame, size_t len) {
+    struct iovec iov;
+    iov.iov_base = (void *)frame;
+    iov.iov_len = len;
+    if (sendFrameIov(&unity_sender, &iov, 1) < 0) {
         std::cout << "Client disconnected" << std::endl;
         exit(0);
     }
-    if (pull_request[0] == 'Z') {          
-        int size = convertPointCloudXYZRGBToBuffer(stitched_cloud, &stitched_buf[0] + sizeof(short));
-        size = 5 * size * sizeof(short);
-        memcpy(stitched_buf, &size, sizeof(int));
-        
-        write(client_sockfd, (char *)stitched_buf, size + sizeof(int));
-    }
-    else {                                      
-        std::cerr << "Faulty pull request" << std::endl;
-        exit(EXIT_FAILURE);
+}
+
+// Codes points as a progressive octree frame and sends it to the VR client. With a byte budget the
+// deepest levels that do not fit are dropped, so the client gets a coarser cloud instead of a late one.
+template <typename PointT>
+void sendOctreeFrame(const PointT * points, int num_points) {
+    if (octree_buf.empty())
+        octree_buf.resize(sizeof(short) * STITCHED_BUF_SIZE);
+
+    size_t max_bytes = octree_buf.size() - sizeof(frameHeader);
+    if (octree_budget > 0)
+        max_bytes = std::min(max_bytes, size_t(octree_budget) * 1024 - sizeof(frameHeader));
+
+    int decoded_points;
+    size_t bytes = encodeOctree(points, num_points, octree_depth, &octree_buf[sizeof(frameHeader)], max_bytes, &decoded_points);
+    writeFrameHeader(&octree_buf[0], FORMAT_OCTREE, decoded_points, bytes, unity_frame_number++, 0);
+
+    if (timer)
+        std::cout << "Octree: " << num_points << " points, " << int(octree_buf[sizeof(frameHeader) + 5]) << " levels, "
+                  << bytes << " bytes (" << std::fixed << std::setprecision(2) << double(bytes) / std::max(num_points, 1)
+                  << " B/pt)" << std::endl;
+
+    sendToUnity(&octree_buf[0], sizeof(frameHeader) + bytes);
+}
+
+void send_stitchedXYZRGB(pointCloudXYZRGB::Ptr stitched_cloud) {
+    // Wait for pull request or credit
+    waitForUnityRequest();
+
+    if (unity_format == FORMAT_OCTREE) {
+        sendOctreeFrame(&stitched_cloud->points[0], int(stitched_cloud->size()));
+        return;
     }
+
+    int size = convertPointCloudXYZRGBToBuffer(stitched_cloud, &stitched_buf[0] + sizeof(short));
+    size = 5 * size * sizeof(short);
+    memcpy(stitched_buf, &size, sizeof(int));
+    
+    sendToUnity(stitched_buf, size + sizeof(int));
 }
 
-void readCloud(int thread_num, int * size) {
+void readCloud(int thread_num, cameraFrame * frame) {
     int sockfd = sockfd_array[thread_num];
 
-    readNBytes(sockfd, sizeof(int), (void *)size);
-    readNBytes(sockfd, *size, (void *)pc_buf[thread_num]);
-    *size /= sizeof(short);
+    frame->size = readFrame(thread_num, sockfd, frame->records) / sizeof(short);
+    // The stitched frame mixes the cameras, so every camera is brought to the legacy 1 mm records.
+    if (!isDefaultQuantizer(frame_quant[thread_num]))
+        requantizeRecords(frame->records, frame->size / 5, frame_quant[thread_num], defaultQuantizer());
+
+    requestFrames(sockfd, 1);
+}
+
+// Receiver worker of one camera, runs for the lifetime of the process. It keeps reading frames into the
+// pool of the camera and pushes every complete one with its capture time, so a slow camera only delays its
+// own part of the stitched frame (up to -w with SYNC_WAIT) and no thread or buffer is created per frame.
+void receiveCamera(int thread_num, bool as_records) {
+    cameraFrame * frame = &camera_frames[thread_num][0];
+
+    while (true) {
+        if (as_records)
+            readCloud(thread_num, frame);
+        else
+            updateCloudXYZRGB(thread_num, sockfd_array[thread_num], &frame->cloud);
+
+        frame = pushSyncFrame(&frame_sync, thread_num, frame, frame_time[thread_num]);
+    }
+}
+
+void startReceivers(bool as_records) {
+    initFrameSync(&frame_sync, NUM_CAMERAS, &camera_frames[0][0], stitch_frames, sync_policy, sync_window_ms,
+                  sync_wait_ms);
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        // Workers block in read() and end with the process.
+        Meta_thread[i] = std::thread(receiveCamera, i, as_records);
+        Meta_thread[i].detach();
+    }
+}
+
+// Waits for the next set of frames by the sync policy (Meta/sync.h), cameras without a new frame in the set
+// keep contributing the frame the stitch loop already holds.
+void collectFrames() {
+    bool fresh[NUM_CAMERAS];
+    takeSyncSet(&frame_sync, stitch_frames, fresh);
+}
 
-    sendPullRequest(sockfd, PULL_XYZRGB);
+// Prints the capture time skew of the stitched frames, the latency the sync policy added and how many frames
+// every receiver worker delivered and the stitch loop never took.
+void printReceiverStats() {
+    printSyncStats(&frame_sync);
 }
 
+// Stitches the newest frame of every camera and sends it to the VR client. Without downsampling nothing is
+// copied: the length prefix and the records of every camera go out as one iovec each. Downsampled frames are
+// compacted one camera per thread into stitched_buf, at offsets taken from the frame sizes.
 void sendStitchToUnity() {
-    int stitch_size = 0;
-    int increment = 5 * downsample;
-    int buf_len[8];
-    char pull_request[1] = {0};
     short * Meta_buf = stitched_buf + 2;
+    struct iovec iov[NUM_CAMERAS + 1];
+    int num_parts = 0;
+    int stitch_size = 0;
 
-    for (int i = 0; i < NUM_CAMERAS; i++) {
-        Meta_thread[i] = std::thread(readCloud, i, &buf_len[i]);
+    collectFrames();
+
+    if (downsample == 1) {
+        for (int i = 0; i < NUM_CAMERAS; i++) {
+            const cameraFrame * frame = stitch_frames[i];
+            if (frame->size == 0) continue;
+            iov[1 + num_parts].iov_base = frame->records;
+            iov[1 + num_parts].iov_len = frame->size * sizeof(short);
+            num_parts++;
+            stitch_size += frame->size;
+        }
+    }
+    else {
+        int offset[NUM_CAMERAS + 1];
+        offset[0] = 0;
+        for (int i = 0; i < NUM_CAMERAS; i++)
+            offset[i + 1] = offset[i] + 5 * ((stitch_frames[i]->size / 5 + downsample - 1) / downsample);
+
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(NUM_CAMERAS)
+        for (int i = 0; i < NUM_CAMERAS; i++)
+            strideRecords(stitch_frames[i]->records, stitch_frames[i]->size / 5, downsample, Meta_buf + offset[i]);
+
+        stitch_size = offset[NUM_CAMERAS];
+        iov[1].iov_base = Meta_buf;
+        iov[1].iov_len = stitch_size * sizeof(short);
+        num_parts = 1;
     }
 
-    for (int i = 0; i < NUM_CAMERAS; i++) {
-        Meta_thread[i].join();
+    waitForUnityRequest();
 
-        for (int j = 0; j < buf_len[i]; j += increment) {
-            memcpy((void *)(Meta_buf + stitch_size), (void *)(pc_buf[i] + j), 5 * sizeof(short));
-            stitch_size += 5;
+    if (unity_format == FORMAT_OCTREE) {
+        std::vector<octreePoint> points(stitch_size / 5);
+        int count = 0;
+        for (int k = 1; k <= num_parts; k++) {
+            const int n = int(iov[k].iov_len / (5 * sizeof(short)));
+            recordsToOctreePoints((const short *)iov[k].iov_base, n, CONV_RATE, points.data() + count);
+            count += n;
         }
+        sendOctreeFrame(points.data(), int(points.size()));
+        return;
     }
 
     stitch_size *= sizeof(short);
-    memcpy(stitched_buf, &stitch_size, sizeof(int));
-
-    if (recv(client_sockfd, pull_request, 1, 0) < 0) {
+    iov[0].iov_base = &stitch_size;
+    iov[0].iov_len = sizeof(int);
+    if (sendFrameIov(&unity_sender, iov, 1 + num_parts) < 0) {
         std::cout << "Client disconnected" << std::endl;
         exit(0);
     }
-    if (pull_request[0] == 'Z') {          
-        write(client_sockfd, (char *)stitched_buf, stitch_size + sizeof(int));
-    }
-    else {                                      
-        std::cerr << "Faulty pull request" << std::endl;
-        exit(EXIT_FAILURE);
-    }
 }
 
 
@@ -345,6 +681,10 @@ void runStitching() {
             total += temp;
             std::cout << "Stitching: " << total / loop_count << " ms, ";
             std::cout << "Frame: " << loop_count;
+            if (loop_count % 100 == 0) {
+                std::cout << std::endl;
+                printReceiverStats();
+            }
             loop_count++;
         }
     }
@@ -353,7 +693,6 @@ void runStitching() {
 void visualize() {
     double total;
     timePoint stitch_start, stitch_end;
-    std::vector <pointCloudXYZRGB::Ptr, Eigen::aligned_allocator <pointCloudXYZRGB::Ptr>> cloud_ptr(NUM_CAMERAS);
     pointCloudXYZRGB::Ptr stitched_cloud(new pointCloudXYZRGB);
     pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> cloud_handler(stitched_cloud);
 
@@ -361,27 +700,16 @@ void visualize() {
     viewer.addPointCloud(stitched_cloud, cloud_handler, "cloud");
     viewer.setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 2, "cloud");
 
-    for (int i = 0; i < NUM_CAMERAS; i++) {
-        cloud_ptr[i] = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB);
-        sendPullRequest(sockfd_array[i], PULL_XYZRGB);
-    }
-
-    
     while (!viewer.wasStopped()) {
+        collectFrames();
+
         if (timer)
             stitch_start = std::chrono::high_resolution_clock::now();
    
         stitched_cloud->clear();
 
-        
-        for (int i = 0; i < NUM_CAMERAS; i++) {
-            Meta_thread[i] = std::thread(updateCloudXYZRGB, i, sockfd_array[i], cloud_ptr[i]);
-        }
-        
-        for (int i = 0; i < NUM_CAMERAS; i++) {
-            Meta_thread[i].join();
-            *stitched_cloud += *cloud_ptr[i];
-        }
+        for (int i = 0; i < NUM_CAMERAS; i++)
+            *stitched_cloud += stitch_frames[i]->cloud;
 
         if (timer)
             stitch_end = std::chrono::high_resolution_clock::now();
@@ -394,6 +722,8 @@ void visualize() {
             double temp = timeMilli(stitch_end - stitch_start).count();
             total += temp;
             std::cout << "Stitch average: " << total / loop_count << " ms" << std::endl;
+            if (loop_count % 100 == 0)
+                printReceiverStats();
             loop_count++;
         }
 
@@ -465,15 +795,29 @@ transform[0] << -0.69888007, -0.32213748,  0.63858757, -2.22900000,
 //                  0.00000000,  0.00000000,  0.00000000,  1.00000000;
 
     for (int i = 0; i < NUM_CAMERAS; i++) {
-        pc_buf[i] = (short *)malloc(sizeof(short) * BUF_SIZE);
+        // The visualizer decodes every frame into a cloud, runStitching forwards the records of the frames.
+        if (visual)
+            pc_buf[i] = (short *)malloc(sizeof(short) * BUF_SIZE);
+        else
+            for (int k = 0; k < NUM_CAMERA_FRAMES; k++)
+                camera_frames[i][k].records = (short *)malloc(sizeof(short) * BUF_SIZE);
+        wire_buf[i] = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(BUF_SIZE / 5));
+        initTemporalDecoder(&temporal[i], BUF_SIZE / 5);
         sockfd_array[i] = initSocket(CLIENT_PORT + i, IP_ADDRESS[i]);
+        sendFormatRequest(sockfd_array[i], wire_format);
+        // The first request: one pull, or the whole credit window in push mode.
+        requestFrames(sockfd_array[i], credit_window);
     }
 
-    if (!visual)
+    if (!visual) {
         initServerSocket();
+        initFrameSender(&unity_sender, client_sockfd, false);
+    }
 
     signal(SIGINT, sigintHandler);
 
+    startReceivers(!visual);
+
     if (visual)
         visualize();
     else
@@ -1,7 +1,6 @@
 #include <librealsense2/rs.hpp>
 #include <pcl/point_cloud.h>
 #include <pcl/visualization/pcl_visualizer.h>
-#include <pcl/common/transforms.h>
 #include <pcl/io/ply_io.h>
 #include <pcl/filters/voxel_grid.h>
 //#include "Meta/client.h"
@@ -19,6 +18,14 @@
 #include <signal.h>
 #include <chrono>
 #include <thread>
+#include <atomic>
+
+#include "Meta/frame.h"
+#include "Meta/net.h"
+#include "Meta/roi.h"
+#include "Meta/pipeline.h"
+#include "Meta/reactor.h"
+#include "Meta/sync.h"
 
 // create a type alias for the point cloud for RGB data.
 typedef pcl::PointCloud<pcl::PointXYZ> pointCloudXYZ;
@@ -38,6 +45,7 @@ const int CLIENT_PORT = 8000;
 const int SERVER_PORT = 9000;
 const int BUF_SIZE = 5000000;
 const int STITCHED_BUF_SIZE = 32000000;
+const int NUM_CAMERA_FRAMES = SYNC_DEPTH + 2;
 const float CONV_RATE = 1000.0;
 const char PULL_XYZ = 'Y';
 const char PULL_XYZRGB = 'Z';
@@ -60,17 +68,89 @@ bool fast = false;
 bool timer = false;
 bool save = false;
 bool visual = false;
+bool use_reactor = false;
+int wire_format = FORMAT_XYZRGB16;
+int credit_window = 0;
+// Frame synchronization (Meta/sync.h): SYNC_WAIT with -w, frames matched within sync_window_ms.
+int sync_policy = SYNC_LATEST;
+double sync_window_ms = 20;
+double sync_wait_ms = 0;
+long unity_credits = 0;
+// Format the VR client asked for with REQUEST_FORMAT, -1 for the bare int length framing.
+std::atomic<int> unity_format(-1);
+int octree_depth = 10;
+int octree_budget = 0;
+uint64_t unity_frame_number = 0;
+std::vector<uint8_t> octree_buf;
 int downsample = 1;
 int framecount = 0;
 int server_sockfd = 0;
 int client_sockfd = 0;
+// Copying sendmsg sender for client_sockfd.
+frameSender unity_sender;
 int sockfd_array[NUM_CAMERAS];
+// Records sent to the VR client behind their int length, stitched_points of them.
 short * stitched_buf;
+short * stitched_records;
+int stitched_points = 0;
+// Records a frame is unpacked into in reactor mode, and the payload of the frame a receiver worker reads.
+short * pc_buf[NUM_CAMERAS];
+uint8_t *wire_buf[NUM_CAMERAS];
+// Unit-depth rays per camera for depth frames, rebuilt when the intrinsics of a camera change.
+depthRayTable depth_rays[NUM_CAMERAS];
+// Keyframes per camera for delta coded frames.
+temporalDecoder temporal[NUM_CAMERAS];
+// Quantizer of the last frame per camera, from its header extension.
+quantizer frame_quant[NUM_CAMERAS];
+// Capture time of the last frame a receiver worker read per camera, from its header.
+uint64_t frame_time[NUM_CAMERAS];
+// World-space region of interest (Meta/roi.h), from -r or the VR client. Every camera culls to it before
+// sending and the stitcher culls what still arrives from outside, e.g. frames requested before a change,
+// with stitch_roi: the same region in the units of the stitched records.
+char * roi_filename = NULL;
+roiSet stage_roi;
+// A change of stage_roi bumps roi_generation, every receiver worker then copies it to camera_roi and sends
+// it to its camera, the worker being the only writer of its socket.
+std::mutex roi_mutex;
+std::atomic<int> roi_generation(0);
+roiSet camera_roi[NUM_CAMERAS];
+roiSet stitch_roi;
 
 // Declaring the 4X4 matrics which can be used for transformation.
 Eigen::Matrix4f transform[NUM_CAMERAS];
-// Declaring the threading for cameras.
+// Declaring the threading for cameras: one receiver worker per camera socket for the lifetime of the process.
 std::thread Meta_thread[NUM_CAMERAS];
+// An unpacked frame of a camera: records in the quantizer the camera sent, before the camera transform.
+struct cameraRecords {
+    short * records;
+    int num_points;
+    quantizer q;
+};
+// Every worker unpacks into its own pool of record frames and pushes every complete one into the jitter
+// buffer of its camera, the stitch loop holds stitch_records[i] until the synchronizer hands it a newer frame
+// of camera i. The stitch loop transforms them straight into stitched_records, PCL only sees the stitched
+// cloud for the viewer and the PLY files.
+cameraRecords camera_records[NUM_CAMERAS][NUM_CAMERA_FRAMES];
+frameSync<cameraRecords> records_sync;
+cameraRecords * stitch_records[NUM_CAMERAS];
+// Reactor mode (-e): one thread receives every camera and the requests of the VR client (Meta/reactor.h)
+// and the stitch loop decodes the frames the synchronizer takes. Each camera reassembles into its own pool
+// of wire frames, the stitch loop holds stitch_wire[i] until it takes a newer one of camera i.
+receiveReactor reactor;
+wireFrame wire_frames[NUM_CAMERAS][NUM_CAMERA_FRAMES];
+frameSync<wireFrame> wire_sync;
+wireFrame * stitch_wire[NUM_CAMERAS];
+// Set by the reactor for a closed camera or by the stitch loop for a corrupt one, the reactor then closes it.
+std::atomic<bool> camera_lost[NUM_CAMERAS];
+// Newest FORMAT_DELTA keyframe the stitch loop decoded per camera, the reactor acknowledges it.
+std::atomic<uint64_t> key_ack[NUM_CAMERAS];
+uint64_t key_ack_sent[NUM_CAMERAS];
+int reactor_roi_sent[NUM_CAMERAS];
+// Bytes of an incomplete VR client request, credits are handed to the stitch loop through unity_cv.
+uint8_t unity_request[1 + ROI_MAX_BYTES];
+int unity_request_len = 0;
+std::mutex unity_mutex;
+std::condition_variable unity_cv;
 // declaring the point cloud Visualizer for displaying point clouds.
 pcl::visualization::PCLVisualizer viewer("Pointcloud Stitching");
 
@@ -88,7 +168,7 @@ void sigintHandler(int dummy) {
 // Function to get Arguments from the terminal
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hftsvd:n")) != -1) {
+    while ((c = getopt(argc, argv, "hftsvd:nzp:c:o:b:r:em:w:")) != -1) {
         switch(c) {
             
             case 'n':
@@ -113,6 +193,56 @@ void parseArgs(int argc, char** argv) {
             case 'd':
                 downsample = atoi(optarg);
                 break;
+
+            case 'z':
+                wire_format = FORMAT_COMPRESSED;
+                break;
+
+            case 'p':
+                wire_format = atoi(optarg);
+                if (!validFormat(wire_format) || wire_format == FORMAT_OCTREE) {
+                    std::cerr << "Unknown wire format " << wire_format << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                credit_window = atoi(optarg);
+                if (credit_window < 0) {
+                    std::cerr << "Invalid credit window " << credit_window << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                octree_depth = atoi(optarg);
+                if (octree_depth < 1 || octree_depth > OCTREE_MAX_DEPTH) {
+                    std::cerr << "Invalid octree depth " << octree_depth << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                octree_budget = atoi(optarg);
+                break;
+            case 'r':
+                roi_filename = optarg;
+                break;
+            case 'e':
+                use_reactor = true;
+                break;
+            case 'm':
+                sync_window_ms = atof(optarg);
+                if (sync_window_ms < 0) {
+                    std::cerr << "Invalid sync window " << sync_window_ms << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                sync_policy = SYNC_WAIT;
+                sync_wait_ms = atof(optarg);
+                if (sync_wait_ms < 0) {
+                    std::cerr << "Invalid sync wait " << sync_wait_ms << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
             case 'h':
                 std::cout << "\nMulticamera pointcloud stitching" << std::endl;
@@ -124,6 +254,18 @@ void parseArgs(int argc, char** argv) {
                 std::cout << " -s (save)        Saves 20 frames in a .ply format" << std::endl;
                 std::cout << " -v (visualize)   Visualizes the pointclouds using PCL visualizer" << std::endl;
                 std::cout << " -d (downsample)  Downsamples the stitched pointcloud by the specified integer" << std::endl;
+                std::cout << " -p <format>      Wire format requested from the camera servers (see Meta/frame.h)" << std::endl;
+                std::cout << "                  -p 7 only sends delta frames while the point count stays the same, a camera server\n"
+                             "                  with a region of interest (-r), voxel downsampling (-v, -B) or decimation (-x) sends\n"
+                             "                  keyframes only" << std::endl;
+                std::cout << " -z (compressed)  Request the lossless compressed stream, same as -p 3" << std::endl;
+                std::cout << " -c <frames>      Push mode: grant the camera servers a window of frames instead of pulling each one" << std::endl;
+                std::cout << " -o <depth>       Octree depth of the stitched cloud when the VR client asks for FORMAT_OCTREE (default 10)" << std::endl;
+                std::cout << " -b <KB>          Octree byte budget per frame, deeper levels are dropped to fit (default unlimited)" << std::endl;
+                std::cout << " -r <file>        Only stitch the points inside the world-space region of interest of the file" << std::endl;
+                std::cout << " -e (reactor)     Receive every camera on one epoll thread and decode in the stitch loop" << std::endl;
+                std::cout << " -w <ms>          Stitch frames matched on capture time, waiting up to ms for late cameras (default newest frames)" << std::endl;
+                std::cout << " -m <ms>          Capture time window of matched frames with -w (default 20)" << std::endl;
                 exit(0);
         }
     }
@@ -205,6 +347,107 @@ void sendPullRequest(int sockfd, char pull_char) {
     }
 }
 
+// Selects the wire format for this connection, every frame is then preceded by a frameHeader.
+void sendFormatRequest(int sockfd, char format) {
+    char request[2] = {REQUEST_FORMAT, format};
+    if (send(sockfd, request, 2, 0) < 2) {
+        std::cerr << "Format request failure from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Asks a camera server for more frames: a pull request in pull mode, a grant of credits in push mode.
+// Returns false on a socket error.
+bool sendFrameRequest(int sockfd, uint32_t credits) {
+    if (credit_window == 0) {
+        const uint8_t pull = PULL_XYZRGB;
+        return sendRequestBytes(sockfd, &pull, 1);
+    }
+    return sendCreditGrant(sockfd, credits);
+}
+
+void requestFrames(int sockfd, uint32_t credits) {
+    if (!sendFrameRequest(sockfd, credits)) {
+        std::cerr << "Frame request failure from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A world-space region in the coordinates of the records of a camera (before transform).
+void cameraRoiOf(int thread_num, const roiSet & world_roi, roiSet * roi) {
+    Eigen::Matrix<float, 4, 4, Eigen::RowMajor> tf = transform[thread_num];
+    transformRoi(world_roi, tf.data(), roi);
+}
+
+// Sends camera_roi to a camera server, in the coordinates of its records (before transform).
+void sendRoiToCamera(int thread_num) {
+    roiSet roi;
+    cameraRoiOf(thread_num, camera_roi[thread_num], &roi);
+
+    if (!sendRoiRequest(sockfd_array[thread_num], roi)) {
+        std::cerr << "Region of interest failure from sockfd: " << sockfd_array[thread_num] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits until the VR client wants a frame. It either pulls each frame with 'Z' or grants
+// credits in advance, requests are only read while no credit is left. A REQUEST_FORMAT
+// for FORMAT_OCTREE switches the client to framed octree frames, a REQUEST_ROI moves the stage.
+void waitForUnityRequest() {
+    if (use_reactor) {
+        // the reactor reads the requests (applyUnityRequests)
+        std::unique_lock<std::mutex> lock(unity_mutex);
+        unity_cv.wait(lock, [] { return unity_credits > 0; });
+        unity_credits--;
+        return;
+    }
+
+    char pull_request[1] = {0};
+
+    while (unity_credits == 0) {
+        if (recv(client_sockfd, pull_request, 1, 0) < 1) {
+            std::cout << "Client disconnected" << std::endl;
+            exit(0);
+        }
+        if (pull_request[0] == REQUEST_PULL) {
+            unity_credits++;
+        }
+        else if (pull_request[0] == REQUEST_CREDIT) {
+            uint32_t grant;
+            if (!readCreditGrant(client_sockfd, &grant)) {
+                std::cerr << "Faulty credit request" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            unity_credits += grant;
+        }
+        else if (pull_request[0] == REQUEST_FORMAT) {
+            uint8_t format;
+            if (recv(client_sockfd, &format, 1, MSG_WAITALL) < 1 || format != FORMAT_OCTREE) {
+                std::cerr << "Unsupported format request from the VR client" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            unity_format = format;
+        }
+        else if (pull_request[0] == REQUEST_ROI) {
+            roiSet roi;
+            if (!readRoiRequest(client_sockfd, &roi)) {
+                std::cerr << "Faulty region of interest from the VR client" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            // the receiver workers pick it up before their next frame
+            std::lock_guard<std::mutex> lock(roi_mutex);
+            stage_roi = roi;
+            roi_generation++;
+            std::cout << "Region of interest: " << stage_roi.num_volumes << " volumes" << std::endl;
+        }
+        else {
+            std::cerr << "Faulty pull request" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    unity_credits--;
+}
+
 // Function to Read the data form the server 
 void readNBytes(int sockfd, unsigned int n, void * buffer) {
     int total_bytes, bytes_read;
@@ -221,108 +464,491 @@ void readNBytes(int sockfd, unsigned int n, void * buffer) {
     }
 }
 
-// Function to convert the Buffer data which we got from server into pointcloud.
-pointCloudXYZRGB::Ptr convertBufferToPointCloudXYZRGB(short * buffer, int size) {
-    int count = 0;
-    pointCloudXYZRGB::Ptr new_cloud(new pointCloudXYZRGB);
+// Unpacks a frame of a camera into 5-short records in cloud_buf (which may be the payload itself for raw
+// records). Returns the size of the unpacked buffer in bytes, TEMPORAL_MISSING_KEY for a delta frame coded
+// against a keyframe the camera never delivered or -1 for a corrupt frame.
+int unpackCameraFrame(int thread_num, const frameHeader & header, const uint8_t * extension, const uint8_t * payload,
+                      short * cloud_buf) {
+    if (!frameQuantizer(header, extension, &frame_quant[thread_num]))
+        return -1;
+
+    if (header.format == FORMAT_DELTA) {
+        const bool keyframe = header.flags & FRAME_FLAG_KEY;
+        int num_points = decodeTemporal(&temporal[thread_num], payload, header.payload_bytes, keyframe, cloud_buf);
+        if (num_points < 0)
+            return num_points == TEMPORAL_MISSING_KEY ? TEMPORAL_MISSING_KEY : -1;
+        return num_points * 5 * sizeof(short);
+    }
 
-    new_cloud->width = size / downsample;
-    new_cloud->height = 1;
-    new_cloud->is_dense = false;
-    new_cloud->points.resize(new_cloud->width);
+    int num_points = unpackFrame(header, payload, cloud_buf, BUF_SIZE / 5, 1, extension, &depth_rays[thread_num]);
+    if (num_points < 0)
+        return -1;
 
-    for (int i = 0; i < size; i++) {
-        if (i % downsample == 0) {
-            new_cloud->points[count].x = (float)buffer[i * 5 + 0] / CONV_RATE;
-            new_cloud->points[count].y = (float)buffer[i * 5 + 1] / CONV_RATE;
-            new_cloud->points[count].z = (float)buffer[i * 5 + 2] / CONV_RATE;
-            new_cloud->points[count].r = (uint8_t)(buffer[i * 5 + 3] & 0xFF);
-            new_cloud->points[count].g = (uint8_t)(buffer[i * 5 + 3] >> 8);
-            new_cloud->points[count].b = (uint8_t)(buffer[i * 5 + 4] & 0xFF);
-            count++;
-        }
-    }
-    
-    return new_cloud;
+    return num_points * 5 * sizeof(short);
 }
 
-// Converting the point cloud to buffer to send through network.
-int convertPointCloudXYZRGBToBuffer(pointCloudXYZRGB::Ptr cloud, short * buffer) {
-    int size = 0;
+// Reads one frame from the camera server and unpacks it into 5-short records in cloud_buf, in the
+// quantizer of the frame (frame_quant[thread_num]). Returns the size of the unpacked buffer in bytes, or
+// TEMPORAL_MISSING_KEY for a delta frame coded against a keyframe this connection never got.
+int readOneFrame(int thread_num, int sockfd, short * cloud_buf) {
+    frameHeader header;
+    readNBytes(sockfd, sizeof(frameHeader), (void *)&header);
 
-    for (int i = 0; i < cloud->width; i++) {
-        buffer[size * 5 + 0] = static_cast<short>(cloud->points[i].x * CONV_RATE);
-        buffer[size * 5 + 1] = static_cast<short>(cloud->points[i].y * CONV_RATE);
-        buffer[size * 5 + 2] = static_cast<short>(cloud->points[i].z * CONV_RATE);
-        buffer[size * 5 + 3] = static_cast<short>(cloud->points[i].r) + static_cast<short>(cloud->points[i].g << 8);
-        buffer[size * 5 + 4] = static_cast<short>(cloud->points[i].b);
-      
-        size++;
+    if (!validFrameHeader(header) || header.payload_bytes > framePayloadBound(BUF_SIZE / 5)) {
+        std::cerr << "Bad frame header from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    uint8_t extension[MAX_HEADER_BYTES];
+    if (header.header_bytes > sizeof(frameHeader))
+        readNBytes(sockfd, header.header_bytes - sizeof(frameHeader), (void *)extension);
+    frame_time[thread_num] = header.timestamp_us;
+
+    // Raw records need no unpacking, so read them straight into place.
+    uint8_t * payload = header.format == FORMAT_XYZRGB16 ? (uint8_t *)cloud_buf : wire_buf[thread_num];
+    readNBytes(sockfd, header.payload_bytes, (void *)payload);
+
+    int size = unpackCameraFrame(thread_num, header, extension, payload, cloud_buf);
+    if (size == TEMPORAL_MISSING_KEY)
+        return TEMPORAL_MISSING_KEY;
+    if (size < 0) {
+        std::cerr << "Corrupt frame from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (header.format == FORMAT_DELTA && (header.flags & FRAME_FLAG_KEY) && !sendKeyAck(sockfd, header.frame_number)) {
+        std::cerr << "Keyframe acknowledgement failure from sockfd: " << sockfd << std::endl;
+        exit(EXIT_FAILURE);
     }
 
     return size;
 }
 
-// Reads from the buffer and converts the data into a new XYZRGB pointcloud.
-void updateCloudXYZRGB(int thread_num, int sockfd, pointCloudXYZRGB::Ptr cloud) {
-    double update_total, convert_total;
-    timePoint loop_start, loop_end, read_start, read_end_convert_start, convert_end;
+// readOneFrame until a frame decodes, delta frames without their keyframe are skipped.
+int readFrame(int thread_num, int sockfd, short * cloud_buf) {
+    int size;
+    while ((size = readOneFrame(thread_num, sockfd, cloud_buf)) == TEMPORAL_MISSING_KEY)
+        requestFrames(sockfd, 1);
+    return size;
+}
+
+// Reads the next frame of a camera into the records of frame.
+void updateCameraRecords(int thread_num, int sockfd, cameraRecords * frame) {
+    timePoint read_start, read_end;
 
     if (timer)
         read_start = std::chrono::high_resolution_clock::now();
 
-    short * cloud_buf = (short *)malloc(sizeof(short) * BUF_SIZE);
-    int size;
+    // reading the data from the server, raw records land in place.
+    int size = readFrame(thread_num, sockfd, frame->records);
+    frame->num_points = size / sizeof(short) / 5;
+    frame->q = frame_quant[thread_num];
 
-   // reading the data from the server.
-    readNBytes(sockfd, sizeof(int), (void *)&size);
-    readNBytes(sockfd, size, (void *)&cloud_buf[0]);
-    
-    // Sending the pullback request to server.
-    sendPullRequest(sockfd, PULL_XYZRGB);
+    // Asking the server for the next frame.
+    requestFrames(sockfd, 1);
 
-    if (timer)
-        read_end_convert_start = std::chrono::high_resolution_clock::now();
+    if (timer) {
+        read_end = std::chrono::high_resolution_clock::now();
+        std::cout << "updateRecords " << thread_num << ": " << timeMilli(read_end - read_start).count() << " ms" << std::endl;
+    }
+}
 
-    // converting the buffer which we got form the server into point cloud.
-    *cloud = *convertBufferToPointCloudXYZRGB(&cloud_buf[0], size / sizeof(short) / 5);
-    pcl::transformPointCloud(*cloud, *cloud, transform[thread_num]);
+// Receiver worker of one camera, runs for the lifetime of the process. It keeps reading frames into the
+// record frames of the camera and pushes every complete one with its capture time, so a slow camera only
+// delays its own part of the stitched cloud (up to -w with SYNC_WAIT) and no thread or buffer is created
+// per frame.
+void receiveCamera(int thread_num) {
+    cameraRecords * frame = &camera_records[thread_num][0];
+    int roi_sent = roi_generation;
+
+    while (true) {
+        // A region the VR client sent since the last frame.
+        if (roi_sent != roi_generation) {
+            {
+                std::lock_guard<std::mutex> lock(roi_mutex);
+                camera_roi[thread_num] = stage_roi;
+                roi_sent = roi_generation;
+            }
+            sendRoiToCamera(thread_num);
+        }
 
-    free(cloud_buf);
+        updateCameraRecords(thread_num, sockfd_array[thread_num], frame);
 
-    if (timer) {
-        convert_end = std::chrono::high_resolution_clock::now();
-        std::cout << "updateCloud " << thread_num << ": " << timeMilli(convert_end - read_end_convert_start).count() << " ms" << std::endl;
+        frame = pushSyncFrame(&records_sync, thread_num, frame, frame_time[thread_num]);
     }
 }
-// this function is to send the buffer data to VR client. 
-void send_stitchedXYZRGB(pointCloudXYZRGB::Ptr stitched_cloud) {
-    char pull_request[1] = {0};
 
-    // Wait for pull request
-    if (recv(client_sockfd, pull_request, 1, 0) < 0) {
-        std::cout << "Client disconnected" << std::endl;
-        exit(0);
+void startReceivers() {
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        for (int k = 0; k < NUM_CAMERA_FRAMES; k++) {
+            camera_records[i][k].records = (short *)malloc(sizeof(short) * BUF_SIZE);
+            camera_records[i][k].num_points = 0;
+            camera_records[i][k].q = defaultQuantizer();
+        }
     }
-    if (pull_request[0] == 'Z') {         
-        int size = convertPointCloudXYZRGBToBuffer(stitched_cloud, &stitched_buf[0] + sizeof(short));
-        size = 5 * size * sizeof(short);
-        memcpy(stitched_buf, &size, sizeof(int));
-        
-        write(client_sockfd, (char *)stitched_buf, size + sizeof(int));
+    initFrameSync(&records_sync, NUM_CAMERAS, &camera_records[0][0], stitch_records, sync_policy, sync_window_ms,
+                  sync_wait_ms);
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        // Workers block in read() and end with the process.
+        Meta_thread[i] = std::thread(receiveCamera, i);
+        Meta_thread[i].detach();
     }
-    else {                                      // Did not receive a correct pull request
-        std::cerr << "Faulty pull request" << std::endl;
+}
+
+// Waits for the next set of frames by the sync policy (Meta/sync.h), cameras without a new frame in the set
+// keep contributing the frame the stitch loop already holds.
+void collectRecords() {
+    bool fresh[NUM_CAMERAS];
+    takeSyncSet(&records_sync, stitch_records, fresh);
+}
+
+// Prints the capture time skew of the stitched frames, the latency the sync policy added and how many frames
+// every camera delivered and the stitch loop never took.
+void printReceiverStats() {
+    if (use_reactor)
+        printSyncStats(&wire_sync);
+    else
+        printSyncStats(&records_sync);
+}
+
+// Reactor mode: a complete frame of a camera goes into its jitter buffer with its capture time, and the
+// camera is asked for the next frame right away.
+void onCameraFrame(receiveReactor * r, cameraConn * conn) {
+    // The stitch loop decodes the frames it takes, so keyframes the next delta frames refer to are kept.
+    const frameHeader & header = conn->frame->header;
+    const bool keyframe = header.format == FORMAT_DELTA && (header.flags & FRAME_FLAG_KEY);
+    conn->frame = pushSyncFrame(&wire_sync, conn->index, conn->frame, header.timestamp_us, keyframe);
+
+    if (!sendFrameRequest(conn->sock, 1))
+        closeCameraConn(r, conn, "Frame request failure");
+}
+
+// Reactor mode: the other cameras keep streaming, the stitch loop drops the cloud of this one.
+void onCameraClose(receiveReactor * r, cameraConn * conn, const char * reason) {
+    std::cerr << reason << " from camera " << conn->index << std::endl;
+    camera_lost[conn->index] = true;
+    setSyncCameraActive(&wire_sync, conn->index, false);
+
+    if (r->open_conns == 0) {
+        std::cerr << "No camera left" << std::endl;
         exit(EXIT_FAILURE);
     }
 }
 
+// Reactor mode: everything the other threads left for the camera sockets. Cameras the stitch loop found
+// corrupt are closed, a region of interest the VR client sent and new keyframe acknowledgements are sent.
+void onReactorWake(receiveReactor * r) {
+    for (cameraConn * conn : r->conns) {
+        const int i = conn->index;
+        if (conn->sock < 0)
+            continue;
+        if (camera_lost[i]) {
+            closeCameraConn(r, conn, "Corrupt frame");
+            continue;
+        }
+
+        if (reactor_roi_sent[i] != roi_generation) {
+            roiSet roi;
+            {
+                std::lock_guard<std::mutex> lock(roi_mutex);
+                cameraRoiOf(i, stage_roi, &roi);
+                reactor_roi_sent[i] = roi_generation;
+            }
+            if (!sendRoiRequest(conn->sock, roi)) {
+                closeCameraConn(r, conn, "Region of interest failure");
+                continue;
+            }
+        }
+
+        const uint64_t ack = key_ack[i];
+        if (ack != key_ack_sent[i]) {
+            if (!sendKeyAck(conn->sock, ack)) {
+                closeCameraConn(r, conn, "Keyframe acknowledgement failure");
+                continue;
+            }
+            key_ack_sent[i] = ack;
+        }
+    }
+}
+
+// Reactor mode: applies the complete requests in the len bytes at request, returns the bytes they took.
+// Requests are the ones waitForUnityRequest reads in the other modes.
+int applyUnityRequests(receiveReactor * r, const uint8_t * request, int len) {
+    int pos = 0;
+    while (pos < len) {
+        const uint8_t * next = request + pos;
+        const int left = len - pos;
+
+        if (next[0] == REQUEST_PULL || next[0] == REQUEST_CREDIT) {
+            uint32_t grant = 1;
+            if (next[0] == REQUEST_CREDIT) {
+                if (left < 5) break;
+                memcpy(&grant, next + 1, sizeof(grant));
+            }
+            std::lock_guard<std::mutex> lock(unity_mutex);
+            unity_credits += grant;
+            unity_cv.notify_one();
+            pos += next[0] == REQUEST_CREDIT ? 5 : 1;
+        }
+        else if (next[0] == REQUEST_FORMAT) {
+            if (left < 2) break;
+            if (next[1] != FORMAT_OCTREE) {
+                std::cerr << "Unsupported format request from the VR client" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            unity_format = next[1];
+            pos += 2;
+        }
+        else if (next[0] == REQUEST_ROI) {
+            roiSet roi;
+            const int used = readRoi(next + 1, left - 1, &roi);
+            if (used == 0) break;
+            if (used < 0) {
+                std::cerr << "Faulty region of interest from the VR client" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            {
+                std::lock_guard<std::mutex> lock(roi_mutex);
+                stage_roi = roi;
+                roi_generation++;
+            }
+            std::cout << "Region of interest: " << roi.num_volumes << " volumes" << std::endl;
+            // sent to the cameras right away, the stitch loop picks it up before its next decode
+            onReactorWake(r);
+            pos += 1 + used;
+        }
+        else {
+            std::cerr << "Faulty pull request" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pos;
+}
+
+// Reactor mode: the VR client connection is readable.
+void onUnityReadable(receiveReactor * r) {
+    while (true) {
+        ssize_t received = recv(client_sockfd, unity_request + unity_request_len,
+                                sizeof(unity_request) - unity_request_len, MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (received < 1) {
+            std::cout << "Client disconnected" << std::endl;
+            exit(0);
+        }
+        unity_request_len += received;
+
+        const int used = applyUnityRequests(r, unity_request, unity_request_len);
+        memmove(unity_request, unity_request + used, unity_request_len - used);
+        unity_request_len -= used;
+    }
+}
+
+// Reactor mode: prints what every camera delivered, once a second with -t.
+void onReactorTick(receiveReactor * r) {
+    static timePoint last = clockTime::now();
+    const double window_ms = timeMilli(clockTime::now() - last).count();
+    if (timer && window_ms >= 1000) {
+        printConnStats(r, window_ms);
+        last = clockTime::now();
+    }
+}
+
+// Reactor mode: connects the camera sockets to one reactor thread, which runs for the lifetime of the process.
+void startReactor() {
+    const size_t max_payload = framePayloadBound(BUF_SIZE / 5);
+    initReceiveReactor(&reactor, NULL);
+    reactor.on_frame = onCameraFrame;
+    reactor.on_close = onCameraClose;
+    reactor.on_wake = onReactorWake;
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        for (int k = 0; k < NUM_CAMERA_FRAMES; k++)
+            wire_frames[i][k].payload = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(BUF_SIZE / 5));
+    }
+    initFrameSync(&wire_sync, NUM_CAMERAS, &wire_frames[0][0], stitch_wire, sync_policy, sync_window_ms, sync_wait_ms);
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        stitch_records[i] = &camera_records[i][0];
+        stitch_records[i]->num_points = 0;
+        camera_lost[i] = false;
+        key_ack[i] = key_ack_sent[i] = UINT64_MAX;
+        reactor_roi_sent[i] = roi_generation;
+
+        if (!addCameraConn(&reactor, sockfd_array[i], i, &wire_frames[i][0], max_payload)) {
+            std::cerr << "Couldn't add camera " << i << " to the reactor" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!visual)
+        watchReactorFd(&reactor, client_sockfd, onUnityReadable);
+
+    Meta_thread[0] = std::thread(runReceiveReactor, &reactor, onReactorTick);
+    Meta_thread[0].detach();
+}
+
+// Reactor mode: unpacks the frame the stitch loop took from camera i into its records, raw records stay in
+// the payload. A delta frame against a missing keyframe leaves the camera out until the next keyframe, a
+// corrupt frame gets the camera closed by the reactor.
+void decodeWireFrame(int i, const wireFrame * frame, cameraRecords * records) {
+    records->records = frame->header.format == FORMAT_XYZRGB16 ? (short *)frame->payload : pc_buf[i];
+    records->num_points = 0;
+
+    int size = unpackCameraFrame(i, frame->header, frame->extension, frame->payload, records->records);
+    if (size == TEMPORAL_MISSING_KEY)
+        return;
+    if (size < 0) {
+        std::cerr << "Corrupt frame from camera " << i << std::endl;
+        camera_lost[i] = true;
+        setSyncCameraActive(&wire_sync, i, false);
+        wakeReactor(&reactor);
+        return;
+    }
+    records->num_points = size / sizeof(short) / 5;
+    records->q = frame_quant[i];
+
+    if (frame->header.format == FORMAT_DELTA && (frame->header.flags & FRAME_FLAG_KEY)) {
+        key_ack[i] = frame->header.frame_number;
+        wakeReactor(&reactor);
+    }
+}
+
+// Reactor mode: waits for the next set of frames by the sync policy and unpacks the new ones in parallel.
+// Lost cameras stop contributing to the stitched cloud.
+void collectWireFrames() {
+    bool fresh[NUM_CAMERAS];
+    takeSyncSet(&wire_sync, stitch_wire, fresh);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(NUM_CAMERAS)
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        if (fresh[i] && !camera_lost[i])
+            decodeWireFrame(i, stitch_wire[i], stitch_records[i]);
+    }
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        if (camera_lost[i])
+            stitch_records[i]->num_points = 0;
+    }
+}
+
+// Transforms the records of every camera straight into stitched_records behind the first base points: int16
+// to float to int16 with the camera transform and the change of quantizer fused (Meta/quantize.h), one camera
+// per thread at offsets taken from the point counts, downsampled on the way. Points outside the stage are
+// dropped. Returns the number of stitched points.
+int stitchRecords(int base) {
+    // The VR client takes legacy 1 mm records, points out of range saturate instead of wrapping around.
+    const quantizer out_q = defaultQuantizer();
+    const int capacity = (STITCHED_BUF_SIZE - sizeof(int) / sizeof(short)) / 5;
+
+    static int roi_synced = -1;
+    if (roi_synced != roi_generation) {
+        std::lock_guard<std::mutex> lock(roi_mutex);
+        roiSet meters;
+        quantizeRoi(stage_roi, out_q, &meters, &stitch_roi);
+        roi_synced = roi_generation;
+    }
+
+    // Every camera gets the room of all its samples, an accumulated cloud (-n) starts over once it is full.
+    int offset[NUM_CAMERAS + 1], num_points[NUM_CAMERAS], kept[NUM_CAMERAS];
+    int total = base;
+    for (int i = 0; i < NUM_CAMERAS; i++)
+        total += (stitch_records[i]->num_points + downsample - 1) / downsample;
+    offset[0] = total > capacity ? 0 : base;
+
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        const int samples = std::min((stitch_records[i]->num_points + downsample - 1) / downsample, capacity - offset[i]);
+        num_points[i] = std::min(stitch_records[i]->num_points, samples * downsample);
+        offset[i + 1] = offset[i] + samples;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(NUM_CAMERAS)
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        Eigen::Matrix<float, 4, 4, Eigen::RowMajor> tf = transform[i];
+        float m[16];
+        recordTransform(stitch_records[i]->q, tf.data(), out_q, m);
+        kept[i] = transformRecords(stitch_records[i]->records, num_points[i], downsample, m, &stitch_roi,
+                                   stitched_records + size_t(offset[i]) * 5);
+    }
+
+    // Closes the gaps culled points left, nothing moves without a region of interest.
+    int count = offset[0];
+    for (int i = 0; i < NUM_CAMERAS; i++) {
+        if (count != offset[i])
+            memmove(stitched_records + size_t(count) * 5, stitched_records + size_t(offset[i]) * 5, sizeof(short) * 5 * kept[i]);
+        count += kept[i];
+    }
+    return count;
+}
+
+// The stitched records as a PCL cloud, for the viewer, the PLY files and octree frames.
+void updateStitchedCloud(pointCloudXYZRGB::Ptr cloud) {
+    cloud->width = stitched_points;
+    cloud->height = 1;
+    cloud->is_dense = false;
+    cloud->points.resize(cloud->width);
+
+    if (stitched_points > 0)
+        dequantizeRecords(stitched_records, stitched_points, 1, defaultQuantizer(), &cloud->points[0]);
+}
+
+// Sends a whole frame of len bytes to the VR client, short writes included, and exits once the client is gone.
+void sendToUnity(const void * frame, size_t len) {
+    struct iovec iov;
+    iov.iov_base = (void *)frame;
+    iov.iov_len = len;
+    if (sendFrameIov(&unity_sender, &iov, 1) < 0) {
+        std::cout << "Client disconnected" << std::endl;
+        exit(0);
+    }
+}
+
+// Codes points as a progressive octree frame and sends it to the VR client. With a byte budget the
+// deepest levels that do not fit are dropped, so the client gets a coarser cloud instead of a late one.
+template <typename PointT>
+void sendOctreeFrame(const PointT * points, int num_points) {
+    if (octree_buf.empty())
+        octree_buf.resize(sizeof(short) * STITCHED_BUF_SIZE);
+
+    size_t max_bytes = octree_buf.size() - sizeof(frameHeader);
+    if (octree_budget > 0)
+        max_bytes = std::min(max_bytes, size_t(octree_budget) * 1024 - sizeof(frameHeader));
+
+    int decoded_points;
+    size_t bytes = encodeOctree(points, num_points, octree_depth, &octree_buf[sizeof(frameHeader)], max_bytes, &decoded_points);
+    writeFrameHeader(&octree_buf[0], FORMAT_OCTREE, decoded_points, bytes, unity_frame_number++, 0);
+
+    if (timer)
+        std::cout << "Octree: " << num_points << " points, " << int(octree_buf[sizeof(frameHeader) + 5]) << " levels, "
+                  << bytes << " bytes (" << std::fixed << std::setprecision(2) << double(bytes) / std::max(num_points, 1)
+                  << " B/pt)" << std::endl;
+
+    sendToUnity(&octree_buf[0], sizeof(frameHeader) + bytes);
+}
+
+// this function is to send the buffer data to VR client. The records are in place already, only octree
+// frames need the cloud.
+void send_stitchedXYZRGB(pointCloudXYZRGB::Ptr stitched_cloud) {
+    // Wait for pull request or credit
+    waitForUnityRequest();
+
+    if (unity_format == FORMAT_OCTREE) {
+        updateStitchedCloud(stitched_cloud);
+        sendOctreeFrame(&stitched_cloud->points[0], int(stitched_cloud->size()));
+        return;
+    }
+
+    int size = 5 * stitched_points * sizeof(short);
+    memcpy(stitched_buf, &size, sizeof(int));
+    
+    sendToUnity(stitched_buf, size + sizeof(int));
+}
+
 // Function in which we are runing the stichting to combine frames from multiple cameras.
 void runStitching() {
     double total;
     timePoint loop_start, loop_end, stitch_start, stitch_end_viewer_start;
     
-    std::vector <pointCloudXYZRGB::Ptr, Eigen::aligned_allocator <pointCloudXYZRGB::Ptr>> cloud_ptr(NUM_CAMERAS);
     pointCloudXYZRGB::Ptr stitched_cloud(new pointCloudXYZRGB);
     pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> cloud_handler(stitched_cloud);
 
@@ -340,37 +966,31 @@ void runStitching() {
     
     std::cout << "0" << std::endl;
 
-    // sending the point cloud size as pull back to server.
-    for (int i = 0; i < NUM_CAMERAS; i++) {
-        cloud_ptr[i] = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB);
-        sendPullRequest(sockfd_array[i], PULL_XYZRGB);
-    }
-
     std::cout << "1" << std::endl;
 
    
     while (1) {
+        // Sleeps until a camera has something new, instead of spawning and joining a thread per camera.
+        if (use_reactor)
+            collectWireFrames();
+        else
+            collectRecords();
+
         if (timer)
             loop_start = std::chrono::high_resolution_clock::now();
 
-        if (clean) stitched_cloud->clear();
-
         if (timer)
             stitch_start = std::chrono::high_resolution_clock::now();
-       
-        
-        for (int i = 0; i < NUM_CAMERAS; i++) {
-            Meta_thread[i] = std::thread(updateCloudXYZRGB, i, sockfd_array[i], cloud_ptr[i]);
-        }
-        
-        for (int i = 0; i < NUM_CAMERAS; i++) {
-            Meta_thread[i].join();
-            *stitched_cloud += *cloud_ptr[i];
-        }
+
+        // Without -n every frame starts from an empty stitched cloud.
+        stitched_points = stitchRecords(clean ? 0 : stitched_points);
 
         if (timer)
             stitch_end_viewer_start = std::chrono::high_resolution_clock::now();
 
+        if (visual || save)
+            updateStitchedCloud(stitched_cloud);
+
         // updating the point cloud.
         if (visual) {
             viewer.updatePointCloud(stitched_cloud, "cloud");
@@ -388,7 +1008,9 @@ void runStitching() {
         if (timer) {
             double temp = timeMilli(stitch_end_viewer_start - stitch_start).count();
             total += temp;
-            std::cout << "Stitch average: " << total / loop_count << " ms" << std::endl;
+            std::cout << "Stitch average: " << total / loop_count << " ms, " << stitched_points << " points" << std::endl;
+            if (loop_count % 100 == 0)
+                printReceiverStats();
             loop_count++;
         }
         // saving the files in plfy format.
@@ -407,7 +1029,11 @@ int main(int argc, char** argv) {
 
     parseArgs(argc, argv);
 
+    if (roi_filename && !loadRoiFile(roi_filename, &stage_roi))
+        exit(EXIT_FAILURE);
+
     stitched_buf = (short *)malloc(sizeof(short) * STITCHED_BUF_SIZE);
+    stitched_records = stitched_buf + sizeof(int) / sizeof(short);
 
     /* Reminder: how transformation matrices work :
                  |-------> This column is the translation, which represents the location of the camera with respect to the origin
@@ -458,11 +1084,29 @@ transform[7] <<  0.08929624, -0.21535297,  0.97244500, -2.95700000,
                  0.00000000,  0.00000000,  0.00000000,  1.00000000;
 
     sockfd_array[0] = initSocket(CLIENT_PORT, "localhost");
+    if (use_reactor)
+        pc_buf[0] = (short *)malloc(sizeof(short) * BUF_SIZE);
+    else
+        wire_buf[0] = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(BUF_SIZE / 5));
+    initTemporalDecoder(&temporal[0], BUF_SIZE / 5);
+    sendFormatRequest(sockfd_array[0], wire_format);
+    camera_roi[0] = stage_roi;
+    if (roiActive(&stage_roi))
+        sendRoiToCamera(0);
+    // The first request: one pull, or the whole credit window in push mode.
+    requestFrames(sockfd_array[0], credit_window);
     
-    if (!visual) initServerSocket();
+    if (!visual) {
+        initServerSocket();
+        initFrameSender(&unity_sender, client_sockfd, false);
+    }
     
     signal(SIGINT, sigintHandler);
     
+    if (use_reactor)
+        startReactor();
+    else
+        startReceivers();
     runStitching();
 
     close(sockfd_array[0]); 
@@ -0,0 +1,266 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "Meta/frame.h"
+
+/*
+ * Encode / decode throughput of the octree coder on recorded frames.
+ *
+ * Reads the binary or ascii PLY files the stitcher saves with -s
+ * (pointclouds/stitched_cloud_<n>.ply), codes every frame and prints the
+ * encode and decode rate, the coded size against the 10 bytes per point of
+ * the legacy records and what a receiver gets when it stops after each level.
+ * Without files a synthetic room scene is coded instead. Build with:
+ *   g++ -O2 -std=c++17 -fopenmp -mavx2 -mfma Meta-octree-bench.cpp -o Meta-octree-bench
+ */
+
+typedef std::chrono::high_resolution_clock clockTime;
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+int octree_depth = 10;
+int num_repeats = 5;
+int octree_budget = 0;
+int synthetic_points = 500000;
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "ho:n:b:r:")) != -1) {
+        switch (c) {
+            case 'o':
+                octree_depth = atoi(optarg);
+                if (octree_depth < 1 || octree_depth > OCTREE_MAX_DEPTH) {
+                    std::cerr << "Invalid octree depth " << octree_depth << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                num_repeats = std::max(atoi(optarg), 1);
+                break;
+            case 'b':
+                octree_budget = atoi(optarg);
+                break;
+            case 'r':
+                synthetic_points = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                std::cout << "\nOctree coder throughput on recorded frames" << std::endl;
+                std::cout << "Usage: Meta-octree-bench [options] [frame.ply ...]" << std::endl;
+                std::cout << " -o <depth>       Octree depth (default 10)" << std::endl;
+                std::cout << " -n <runs>        Timed runs per frame (default 5)" << std::endl;
+                std::cout << " -b <KB>          Byte budget per frame (default unlimited)" << std::endl;
+                std::cout << " -r <points>      Points of the synthetic frame used without files (default 500000)" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+// Reads the x, y, z and color properties of the vertex element of a PLY file. Colors are either
+// red / green / blue bytes or the packed float rgb field PCL writes for PointXYZRGB.
+bool readPLY(const std::string & filename, std::vector<octreePoint> & points) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+
+    struct plyProperty { std::string name, type; size_t offset; };
+    std::vector<plyProperty> properties;
+    std::string line, format;
+    size_t num_vertices = 0, stride = 0;
+    bool in_vertex = false;
+
+    auto typeBytes = [](const std::string & type) -> size_t {
+        if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+        if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+        if (type == "double" || type == "float64") return 8;
+        return 4;
+    };
+
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::istringstream words(line);
+        std::string key;
+        words >> key;
+
+        if (key == "format") {
+            words >> format;
+        }
+        else if (key == "element") {
+            std::string name;
+            size_t count;
+            words >> name >> count;
+            in_vertex = name == "vertex";
+            if (in_vertex) num_vertices = count;
+            // only elements before the vertices would shift them, PCL writes the vertices first
+        }
+        else if (key == "property" && in_vertex) {
+            plyProperty prop;
+            words >> prop.type >> prop.name;
+            if (prop.type == "list") return false;
+            prop.offset = stride;
+            stride += typeBytes(prop.type);
+            properties.push_back(prop);
+        }
+        else if (key == "end_header") {
+            break;
+        }
+    }
+
+    if (format != "binary_little_endian" && format != "ascii") return false;
+
+    auto readValue = [&](const uint8_t * p, const plyProperty & prop) -> double {
+        const std::string & t = prop.type;
+        if (t == "uchar" || t == "uint8") return p[0];
+        if (t == "char" || t == "int8") return int8_t(p[0]);
+        if (t == "short" || t == "int16") { int16_t v; memcpy(&v, p, 2); return v; }
+        if (t == "ushort" || t == "uint16") { uint16_t v; memcpy(&v, p, 2); return v; }
+        if (t == "int" || t == "int32") { int32_t v; memcpy(&v, p, 4); return v; }
+        if (t == "uint" || t == "uint32") { uint32_t v; memcpy(&v, p, 4); return v; }
+        if (t == "double" || t == "float64") { double v; memcpy(&v, p, 8); return v; }
+        float v; memcpy(&v, p, 4); return v;
+    };
+
+    points.resize(num_vertices);
+    std::vector<uint8_t> vertex(stride + 4);
+    std::vector<double> values(properties.size());
+    std::vector<uint32_t> packed(properties.size());
+
+    for (size_t i = 0; i < num_vertices; i++) {
+        if (format == "ascii") {
+            for (size_t k = 0; k < properties.size(); k++) {
+                if (!(file >> values[k])) return false;
+                packed[k] = uint32_t(values[k]);
+            }
+        }
+        else {
+            if (!file.read((char *)vertex.data(), stride)) return false;
+            for (size_t k = 0; k < properties.size(); k++) {
+                values[k] = readValue(&vertex[properties[k].offset], properties[k]);
+                // packed colors keep their bits in the field, whatever its type
+                memcpy(&packed[k], &vertex[properties[k].offset], 4);
+            }
+        }
+
+        octreePoint & p = points[i];
+        p.x = p.y = p.z = NAN;
+        p.r = p.g = p.b = 0;
+        for (size_t k = 0; k < properties.size(); k++) {
+            const std::string & name = properties[k].name;
+            if (name == "x") p.x = float(values[k]);
+            else if (name == "y") p.y = float(values[k]);
+            else if (name == "z") p.z = float(values[k]);
+            else if (name == "red") p.r = uint8_t(values[k]);
+            else if (name == "green") p.g = uint8_t(values[k]);
+            else if (name == "blue") p.b = uint8_t(values[k]);
+            else if (name == "rgb" || name == "rgba") {
+                p.r = uint8_t(packed[k] >> 16);
+                p.g = uint8_t(packed[k] >> 8);
+                p.b = uint8_t(packed[k]);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Floor, walls and a few objects of a 4 x 3 x 4 m room with smooth color gradients.
+void syntheticFrame(int num_points, std::vector<octreePoint> & points) {
+    points.resize(num_points);
+    srand(1);
+
+    for (int i = 0; i < num_points; i++) {
+        float u = rand() / float(RAND_MAX), v = rand() / float(RAND_MAX);
+        octreePoint & p = points[i];
+        switch (i % 4) {
+            case 0: p.x = 4 * u - 2; p.y = 0;          p.z = 4 * v;      break;     // floor
+            case 1: p.x = 4 * u - 2; p.y = 3 * v;      p.z = 4;          break;     // back wall
+            case 2: p.x = -2;        p.y = 3 * v;      p.z = 4 * u;      break;     // side wall
+            default: {                                                               // sphere
+                float theta = 2 * float(M_PI) * u, phi = acosf(2 * v - 1);
+                p.x = .5f * sinf(phi) * cosf(theta);
+                p.y = 1 + .5f * cosf(phi);
+                p.z = 2 + .5f * sinf(phi) * sinf(theta);
+            }
+        }
+        p.r = uint8_t(60 + 40 * u + (i % 4) * 30);
+        p.g = uint8_t(80 + 60 * v);
+        p.b = uint8_t(120 + (i % 4) * 25);
+    }
+}
+
+void benchFrame(const std::string & name, const std::vector<octreePoint> & points) {
+    const int n = int(points.size());
+    const size_t out_bytes = OCTREE_HEADER_BYTES + 4 * OCTREE_MAX_DEPTH + size_t(n) * 4 * (octree_depth + 1) + 1024;
+    std::vector<uint8_t> out(out_bytes);
+    std::vector<octreePoint> decoded(std::max(n, 1));
+    const size_t max_bytes = octree_budget > 0 ? std::min(out_bytes, size_t(octree_budget) * 1024) : out_bytes;
+
+    size_t bytes = 0;
+    int decoded_points = 0, num_decoded = 0;
+    double encode_ms = 1e30, decode_ms = 1e30;
+
+    for (int r = 0; r < num_repeats; r++) {
+        auto start = clockTime::now();
+        bytes = encodeOctree(points.data(), n, octree_depth, out.data(), max_bytes, &decoded_points);
+        auto mid = clockTime::now();
+        num_decoded = decodeOctree(out.data(), bytes, OCTREE_MAX_DEPTH, decoded.data(), n);
+        auto end = clockTime::now();
+        encode_ms = std::min(encode_ms, timeMilli(mid - start).count());
+        decode_ms = std::min(decode_ms, timeMilli(end - mid).count());
+    }
+
+    if (num_decoded != decoded_points) {
+        std::cerr << name << ": decoded " << num_decoded << " points, expected " << decoded_points << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const int levels = out[5];
+    float size;
+    memcpy(&size, &out[24], sizeof(size));
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << name << ": " << n << " points, " << levels << " of " << octree_depth << " levels, "
+              << bytes << " bytes (" << double(bytes) / std::max(n, 1) << " B/pt, "
+              << double(n) * 10 / std::max(bytes, size_t(1)) << "x smaller than records)" << std::endl;
+    std::cout << "  encode " << encode_ms << " ms (" << n / encode_ms / 1000 << " Mpts/s), decode "
+              << decode_ms << " ms (" << num_decoded / decode_ms / 1000 << " Mpts/s)" << std::endl;
+
+    // what a receiver has after each level
+    std::cout << "  " << std::setw(6) << "level" << std::setw(10) << "cell mm" << std::setw(12) << "points"
+              << std::setw(12) << "bytes" << std::setw(10) << "B/pt" << std::endl;
+    size_t prefix = OCTREE_HEADER_BYTES + 4 * levels;
+    for (int l = 1; l <= levels; l++) {
+        prefix += getU32(&out[OCTREE_HEADER_BYTES + 4 * (l - 1)]);
+        int level_points = decodeOctree(out.data(), prefix, l, decoded.data(), n);
+        std::cout << "  " << std::setw(6) << l << std::setw(10) << size / (1 << l) * 1000 << std::setw(12) << level_points
+                  << std::setw(12) << prefix << std::setw(10) << double(prefix) / std::max(n, 1) << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+    std::vector<octreePoint> points;
+
+    if (optind == argc) {
+        syntheticFrame(synthetic_points, points);
+        benchFrame("synthetic", points);
+        return 0;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!readPLY(argv[i], points)) {
+            std::cerr << "Could not read " << argv[i] << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        benchFrame(argv[i], points);
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Meta/frame.h"
+#include "Meta/net.h"
+#include "Meta/reactor.h"
+
+/*
+ * Loopback stress test of the receive reactor (Meta/reactor.h).
+ *
+ * Every emulated camera server runs on its own thread and listens on a
+ * loopback port. It serves pull requests and credit grants like
+ * Meta-camera-optimized, but writes each frame in chunks of random size
+ * (down to single bytes), so the reactor has to reassemble headers and
+ * payloads from arbitrary pieces. The records of a frame are a function of
+ * camera and frame number, so the receiver checks every frame it gets.
+ *
+ * With fault injection the first camera sends a corrupt header and the
+ * second one disconnects in the middle of a frame after a third of the run;
+ * both have to be closed alone while every other camera delivers all its
+ * frames. One thread receives everything; its CPU time is reported against
+ * the wall time. Build with:
+ *   g++ -O2 -std=c++17 -fopenmp -mavx2 -mfma Meta-reactor-bench.cpp -o Meta-reactor-bench
+ */
+
+typedef std::chrono::high_resolution_clock clockTime;
+typedef std::chrono::time_point<clockTime> timePoint;
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+int num_cameras = 8;
+int num_points = 640 * 480;
+int num_frames = 100;
+int credit_window = 0;
+int wire_format = FORMAT_XYZRGB16;
+bool inject_faults = true;
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hc:r:n:w:p:x")) != -1) {
+        switch (c) {
+            case 'c':
+                num_cameras = std::max(atoi(optarg), 1);
+                break;
+            case 'r':
+                num_points = std::max(atoi(optarg), 1);
+                break;
+            case 'n':
+                num_frames = std::max(atoi(optarg), 3);
+                break;
+            case 'w':
+                credit_window = std::max(atoi(optarg), 0);
+                break;
+            case 'p':
+                wire_format = atoi(optarg);
+                // every record format but the lossy RGB565 one, the frames are checked bit for bit
+                if (!recordFormat(wire_format) || wire_format == FORMAT_XYZ16_RGB565) {
+                    std::cerr << "Unsupported wire format " << wire_format << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'x':
+                inject_faults = false;
+                break;
+            default:
+            case 'h':
+                std::cout << "\nLoopback stress test of the receive reactor with emulated camera servers" << std::endl;
+                std::cout << "Usage: Meta-reactor-bench [options]" << std::endl;
+                std::cout << " -c <cameras>     Emulated camera servers (default 8)" << std::endl;
+                std::cout << " -r <points>      Points per frame (default 640x480)" << std::endl;
+                std::cout << " -n <frames>      Frames per camera (default 100)" << std::endl;
+                std::cout << " -w <frames>      Credit window, 0 pulls every frame (default 0)" << std::endl;
+                std::cout << " -p <format>      Record wire format (see Meta/frame.h, default 0)" << std::endl;
+                std::cout << " -x               No fault injection" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+// Records of frame frame_number of camera camera.
+void makeRecords(int camera, uint64_t frame_number, short * records) {
+    for (int i = 0; i < num_points; i++) {
+        short * p = records + size_t(i) * 5;
+        p[0] = short(i * 7 + frame_number);
+        p[1] = short(camera * 1000 + i % 1000);
+        p[2] = short(frame_number * 3 + i);
+        p[3] = short((i & 0xFF) | ((camera & 0xFF) << 8));
+        p[4] = short(frame_number & 0xFF);
+    }
+}
+
+// Writes n bytes in chunks of random size. Returns false once the receiver is gone.
+bool sendChunked(int sock, const uint8_t * bytes, size_t n, std::mt19937 & rng) {
+    size_t total = 0;
+    while (total < n) {
+        // mostly large pieces, every eighth one tiny so headers get split as well
+        size_t chunk = rng() % 8 == 0 ? 1 + rng() % 16 : 1 + rng() % 65536;
+        ssize_t sent = send(sock, bytes + total, std::min(chunk, n - total), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 1)
+            return false;
+        total += sent;
+    }
+    return true;
+}
+
+// Camera server side: serves requests until it has sent num_frames frames, then disconnects.
+// Camera 0 and 1 misbehave after a third of the run when faults are injected.
+void cameraServer(int listen_sock, int camera) {
+    int sock = accept(listen_sock, NULL, NULL);
+    close(listen_sock);
+    if (sock < 0) return;
+
+    std::vector<short> records(size_t(num_points) * 5);
+    uint8_t * frame = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(num_points));
+    std::mt19937 rng(camera + 1);
+    long credits = 0;
+
+    for (uint64_t frame_number = 0; frame_number < uint64_t(num_frames);) {
+        if (credits == 0) {
+            uint8_t request;
+            if (recv(sock, &request, 1, MSG_WAITALL) != 1)
+                break;
+            uint32_t grant;
+            if (request == REQUEST_PULL)
+                credits++;
+            else if (request == REQUEST_CREDIT && readCreditGrant(sock, &grant))
+                credits += grant;
+            else
+                break;
+            continue;
+        }
+
+        makeRecords(camera, frame_number, records.data());
+        size_t bytes = packFrame(records.data(), num_points, wire_format, frame_number, 0, frame);
+
+        if (inject_faults && frame_number == uint64_t(num_frames / 3)) {
+            if (camera == 0)
+                frame[0] ^= 0xFF;           // magic of the next header
+            if (camera == 1) {
+                sendChunked(sock, frame, bytes / 2, rng);
+                break;                      // gone in the middle of the payload
+            }
+        }
+
+        if (!sendChunked(sock, frame, bytes, rng))
+            break;
+        credits--;
+        frame_number++;
+    }
+
+    // Closing with requests still unread would reset the connection and could discard the last frame
+    // on the receiver, so only the sending side is shut down and the rest is drained.
+    shutdown(sock, SHUT_WR);
+    uint8_t drain[256];
+    while (recv(sock, drain, sizeof(drain), 0) > 0) {}
+    close(sock);
+    free(frame);
+}
+
+// Receiver state of one camera.
+struct cameraState {
+    wireFrame frame;
+    std::vector<short> expected, unpacked;
+    uint64_t next_number;
+    long received, corrupt;
+    double bytes;
+    const char * closed;
+};
+
+std::vector<cameraState> cameras;
+long mismatch = 0;
+
+// A pull request, or a grant of credits in push mode. Returns false on a socket error.
+bool requestFrames(int sock, uint32_t credits) {
+    const uint8_t pull = REQUEST_PULL;
+    return credit_window == 0 ? sendRequestBytes(sock, &pull, 1) : sendCreditGrant(sock, credits);
+}
+
+// Checks the frame against the records it has to hold and asks for the next one.
+void onFrame(receiveReactor * reactor, cameraConn * conn) {
+    cameraState & cam = cameras[conn->index];
+    const frameHeader & header = conn->frame->header;
+
+    int n = unpackFrame(header, conn->frame->payload, cam.unpacked.data(), num_points, 1, conn->frame->extension);
+    makeRecords(conn->index, header.frame_number, cam.expected.data());
+    if (n != num_points || header.frame_number != cam.next_number ||
+        memcmp(cam.unpacked.data(), cam.expected.data(), sizeof(short) * 5 * num_points) != 0)
+        cam.corrupt++;
+    cam.next_number = header.frame_number + 1;
+    cam.received++;
+    cam.bytes += header.header_bytes + header.payload_bytes;
+
+    if (!requestFrames(conn->sock, 1))
+        closeCameraConn(reactor, conn, "Request failure");
+}
+
+void onClose(receiveReactor *, cameraConn * conn, const char * reason) {
+    cameras[conn->index].closed = reason;
+}
+
+double threadCpuMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+
+    std::vector<std::thread> servers;
+    std::vector<int> socks;
+    for (int c = 0; c < num_cameras; c++) {
+        int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+
+        if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_sock, 1) < 0 ||
+            getsockname(listen_sock, (struct sockaddr *)&addr, &len) < 0) {
+            std::cerr << "Loopback socket failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        servers.emplace_back(cameraServer, listen_sock, c);
+
+        int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            std::cerr << "Connection failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        socks.push_back(sock);
+    }
+
+    const size_t max_payload = framePayloadBound(num_points);
+    receiveReactor reactor;
+    initReceiveReactor(&reactor, NULL);
+    reactor.on_frame = onFrame;
+    reactor.on_close = onClose;
+
+    cameras.resize(num_cameras);
+    for (int c = 0; c < num_cameras; c++) {
+        cameraState & cam = cameras[c];
+        cam.frame.payload = (uint8_t *)aligned_alloc(SOA_ALIGN, frameBufferBytes(num_points));
+        cam.expected.resize(size_t(num_points) * 5);
+        cam.unpacked.resize(size_t(num_points) * 5);
+        cam.next_number = 0;
+        cam.received = cam.corrupt = 0;
+        cam.bytes = 0;
+        cam.closed = NULL;
+
+        // The first request: one pull, or the whole credit window in push mode.
+        if (!requestFrames(socks[c], credit_window) || !addCameraConn(&reactor, socks[c], c, &cam.frame, max_payload)) {
+            std::cerr << "Camera setup failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::cout << num_cameras << " cameras, " << num_points << " points, " << num_frames << " frames each, "
+              << (credit_window ? "push mode" : "pull mode") << ", format " << wire_format << std::endl;
+
+    const double cpu_start = threadCpuMs();
+    const timePoint start = clockTime::now();
+    runReceiveReactor(&reactor);
+    const double wall_ms = timeMilli(clockTime::now() - start).count();
+    const double cpu_ms = threadCpuMs() - cpu_start;
+
+    long total_frames = 0;
+    double total_bytes = 0;
+    for (int c = 0; c < num_cameras; c++) {
+        const cameraState & cam = cameras[c];
+        const bool faulty = inject_faults && c < 2;
+        // a faulty camera delivers the frames before the fault, a healthy one all of them and then disconnects
+        const long expected = faulty ? num_frames / 3 : num_frames;
+        const bool ok = cam.received == expected && cam.corrupt == 0 &&
+                        cam.closed && strcmp(cam.closed, c == 0 && faulty ? "Bad frame header" : "Camera disconnected") == 0;
+        if (!ok) mismatch++;
+
+        std::cout << "camera " << c << ": " << cam.received << " frames, " << cam.corrupt << " corrupt, closed: "
+                  << (cam.closed ? cam.closed : "no") << (ok ? "" : "  MISMATCH") << std::endl;
+        total_frames += cam.received;
+        total_bytes += cam.bytes;
+    }
+
+    std::cout << std::fixed << std::setprecision(1) << total_frames * 1000.0 / wall_ms << " frames/s, "
+              << total_bytes / 1000.0 / wall_ms << " MB/s on one thread, " << 100.0 * cpu_ms / wall_ms
+              << "% of a core (including the frame checks)" << std::endl;
+
+    for (std::thread & server : servers)
+        server.join();
+    closeReceiveReactor(&reactor);
+    for (cameraState & cam : cameras)
+        free(cam.frame.payload);
+
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <atomic>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "Meta/sync.h"
+
+/*
+ * Emulated comparison of the frame sync policies of the stitchers (Meta/sync.h).
+ *
+ * Every emulated camera captures at its own phase within the phase spread and
+ * delivers each frame after a fixed latency plus random network jitter; one
+ * camera can run at a lower frame rate. The stitch loop takes sets with both
+ * policies in turn, spending the stitch time on each, and the capture time
+ * skew of the sets, the latency the policy added, how stale the stitched
+ * frames were and the frames dropped are reported per policy. The frames are
+ * checked to stay untouched while the stitch loop holds them and to move
+ * forward in capture time per camera, and every KEEP_INTERVAL-th frame, pushed
+ * with keep like a keyframe, to be taken. Build with:
+ *   g++ -O2 -std=c++17 Meta-sync-bench.cpp -o Meta-sync-bench -pthread
+ */
+
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+#define KEEP_INTERVAL   10
+
+int num_cameras = 4;
+double fps = 30;
+double slow_fps = 0;
+double spread_ms = 10;
+double jitter_ms = 10;
+double latency_ms = 5;
+double window_ms = 20;
+double wait_ms = 30;
+double stitch_ms = 8;
+double duration_s = 5;
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hc:f:s:p:j:m:w:k:d:")) != -1) {
+        switch (c) {
+            case 'c':
+                num_cameras = std::max(atoi(optarg), 1);
+                break;
+            case 'f':
+                fps = std::max(atof(optarg), 1.0);
+                break;
+            case 's':
+                slow_fps = std::max(atof(optarg), 0.0);
+                break;
+            case 'p':
+                spread_ms = std::max(atof(optarg), 0.0);
+                break;
+            case 'j':
+                jitter_ms = std::max(atof(optarg), 0.0);
+                break;
+            case 'm':
+                window_ms = std::max(atof(optarg), 0.0);
+                break;
+            case 'w':
+                wait_ms = std::max(atof(optarg), 0.0);
+                break;
+            case 'k':
+                stitch_ms = std::max(atof(optarg), 0.0);
+                break;
+            case 'd':
+                duration_s = std::max(atof(optarg), 0.5);
+                break;
+            default:
+            case 'h':
+                std::cout << "\nEmulated comparison of the frame sync policies of the stitchers" << std::endl;
+                std::cout << "Usage: Meta-sync-bench [options]" << std::endl;
+                std::cout << " -c <cameras>     Emulated cameras (default 4)" << std::endl;
+                std::cout << " -f <fps>         Frame rate of the cameras (default 30)" << std::endl;
+                std::cout << " -s <fps>         Frame rate of the last camera, 0 for the same (default 0)" << std::endl;
+                std::cout << " -p <ms>          Spread of the capture phases of the cameras (default 10)" << std::endl;
+                std::cout << " -j <ms>          Network jitter on top of 5 ms latency (default 10)" << std::endl;
+                std::cout << " -m <ms>          Capture time window of matched frames (default 20)" << std::endl;
+                std::cout << " -w <ms>          Longest wait for late cameras with SYNC_WAIT (default 30)" << std::endl;
+                std::cout << " -k <ms>          Stitch time per set (default 8)" << std::endl;
+                std::cout << " -d <s>           Run time per policy (default 5)" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+struct benchFrame {
+    uint64_t capture_us;
+    uint64_t check;             // ~capture_us once the frame is complete
+    long number;
+};
+
+std::atomic<bool> running;
+long corrupt = 0;
+
+// Camera side: captures on the period of the camera, delivers after latency and jitter.
+void emulateCamera(frameSync<benchFrame> * sync, benchFrame * first, int camera, syncClock::time_point t0) {
+    const double period_ms = 1000.0 / (slow_fps > 0 && camera == num_cameras - 1 ? slow_fps : fps);
+    const double phase_ms = num_cameras > 1 ? spread_ms * camera / (num_cameras - 1) : 0;
+    std::mt19937 rng(camera + 1);
+    std::uniform_real_distribution<double> jitter(0, jitter_ms);
+    benchFrame * frame = first;
+
+    for (long k = 0; running; k++) {
+        const syncClock::time_point capture = t0 + std::chrono::microseconds(int64_t((phase_ms + k * period_ms) * 1000));
+        // frames are delivered in order, jitter only delays
+        std::this_thread::sleep_until(capture + std::chrono::microseconds(int64_t((latency_ms + jitter(rng)) * 1000)));
+
+        frame->capture_us = std::chrono::duration_cast<std::chrono::microseconds>(capture.time_since_epoch()).count();
+        frame->check = ~frame->capture_us;
+        frame->number = k;
+        frame = pushSyncFrame(sync, camera, frame, frame->capture_us, k % KEEP_INTERVAL == 0);
+    }
+}
+
+void runPolicy(int policy) {
+    std::vector<benchFrame> items(size_t(num_cameras) * (SYNC_DEPTH + 2));
+    std::vector<benchFrame *> held(num_cameras);
+    std::vector<uint64_t> last(num_cameras, 0);
+    std::vector<long> last_number(num_cameras, -1);
+    bool fresh[64];
+    frameSync<benchFrame> sync;
+    initFrameSync(&sync, num_cameras, items.data(), held.data(), policy, window_ms, wait_ms);
+
+    running = true;
+    const syncClock::time_point t0 = syncClock::now();
+    std::vector<std::thread> cameras;
+    for (int c = 0; c < num_cameras; c++)
+        cameras.emplace_back(emulateCamera, &sync, &items[size_t(c) * (SYNC_DEPTH + 2)], c, t0);
+
+    double stale_sum = 0, stale_max = 0;
+    long stitched = 0;
+    while (timeMilli(syncClock::now() - t0).count() < duration_s * 1000) {
+        takeSyncSet(&sync, held.data(), fresh);
+
+        // how old the oldest stitched frame is when the stitch starts
+        uint64_t oldest = UINT64_MAX;
+        for (int c = 0; c < num_cameras; c++) {
+            if (fresh[c]) {
+                if (held[c]->capture_us <= last[c] && last[c]) corrupt++;
+                // no kept frame between the last one and this one
+                const long number = held[c]->number;
+                const long next_keep = last_number[c] < 0 ? 0 : (last_number[c] / KEEP_INTERVAL + 1) * KEEP_INTERVAL;
+                if (next_keep < number) corrupt++;
+                last[c] = held[c]->capture_us;
+                last_number[c] = number;
+            }
+            if (last[c]) oldest = std::min(oldest, last[c]);
+        }
+        if (oldest != UINT64_MAX) {
+            const double stale_ms = (syncNowUs() - oldest) / 1000.0;
+            stale_sum += stale_ms;
+            stale_max = std::max(stale_max, stale_ms);
+            stitched++;
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(int64_t(stitch_ms * 1000)));
+        for (int c = 0; c < num_cameras; c++) {
+            if (last[c] && (held[c]->capture_us != last[c] || held[c]->check != ~last[c]))
+                corrupt++;
+        }
+    }
+
+    running = false;
+    for (std::thread & camera : cameras)
+        camera.join();
+
+    const syncStats & stats = sync.stats;
+    const double sets = std::max(stats.sets, 1L);
+    std::cout << std::setw(8) << (policy == SYNC_WAIT ? "wait" : "latest") << std::fixed << std::setprecision(1)
+              << std::setw(8) << stats.sets / duration_s
+              << std::setw(8) << stats.skew_ms_sum / sets << std::setw(8) << stats.skew_ms_max
+              << std::setw(8) << stats.wait_ms_sum / sets << std::setw(8) << stats.wait_ms_max
+              << std::setw(8) << stale_sum / std::max(stitched, 1L) << std::setw(8) << stale_max
+              << std::setw(8) << stats.dropped << std::setw(8) << stats.late << std::endl;
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+    if (num_cameras > 64) num_cameras = 64;
+
+    std::cout << num_cameras << " cameras at " << fps << " fps";
+    if (slow_fps > 0) std::cout << " (the last at " << slow_fps << ")";
+    std::cout << ", phases " << spread_ms << " ms apart, " << latency_ms << " + " << jitter_ms << " ms delivery, window " << window_ms << " ms, wait up to "
+              << wait_ms << " ms, stitch " << stitch_ms << " ms" << std::endl;
+    std::cout << "  policy  sets/s   skew ms (avg max)  wait ms (avg max) stale ms (avg max) dropped   late" << std::endl;
+
+    runPolicy(SYNC_LATEST);
+    runPolicy(SYNC_WAIT);
+
+    if (corrupt)
+        std::cout << corrupt << " frames changed while held, went back in time or skipped a kept one  MISMATCH" << std::endl;
+    return corrupt ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include <omp.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/filters/voxel_grid.h>
+
+#include "Meta/voxel.h"
+
+/*
+ * Voxel-grid downsampling of the camera server (Meta/voxel.h) against pcl::VoxelGrid on a synthetic
+ * camera frame. Prints the time per frame of both, the number of voxels, and how far the centroids of the
+ * voxels both found are apart. Build with:
+ *   g++ -O3 -std=c++17 -fopenmp -mavx2 -mfma Meta-voxel-bench.cpp -o Meta-voxel-bench \
+ *       $(pkg-config --cflags --libs pcl_filters-1.10)
+ */
+
+#define CONV_RATE 1000
+
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+int width = 1280;
+int height = 720;
+int iterations = 20;
+int max_threads = omp_get_max_threads();
+int voxel_size = 0;
+
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hw:e:i:t:v:")) != -1) {
+        switch (c) {
+            case 'w':
+                width = atoi(optarg);
+                break;
+            case 'e':
+                height = atoi(optarg);
+                break;
+            case 'i':
+                iterations = std::max(atoi(optarg), 1);
+                break;
+            case 't':
+                max_threads = std::max(atoi(optarg), 1);
+                break;
+            case 'v':
+                voxel_size = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                std::cout << "\nVoxel-grid downsampling against pcl::VoxelGrid" << std::endl;
+                std::cout << "Usage: Meta-voxel-bench [options]" << std::endl;
+                std::cout << " -w <pixels>      Frame width (default 1280)" << std::endl;
+                std::cout << " -e <pixels>      Frame height (default 720)" << std::endl;
+                std::cout << " -i <runs>        Timed runs per size (default 20)" << std::endl;
+                std::cout << " -t <threads>     Most threads to run with (default all)" << std::endl;
+                std::cout << " -v <mm>          Only this voxel size (default 5, 10, 20 and 40)" << std::endl;
+                exit(0);
+        }
+    }
+}
+
+// Fills the buffer with the scene of Meta-kernel-bench: a tilted plane with a ripple, in 5-short records.
+void makeFrame(short * buffer, int w, int h) {
+    for (int v = 0; v < h; v++) {
+        for (int u = 0; u < w; u++) {
+            short * p = buffer + (v * w + u) * 5;
+            float z = 1.2f + 0.3f * u / w + 0.02f * ((u * 7 + v * 3) % 11);
+            p[0] = short((u - w / 2) * z / 640.f * CONV_RATE);
+            p[1] = short((v - h / 2) * z / 640.f * CONV_RATE);
+            p[2] = short(z * CONV_RATE);
+            p[3] = short((u & 0xFF) | ((v & 0xFF) << 8));
+            p[4] = short((u + v) & 0xFF);
+        }
+    }
+}
+
+// Runs fn iterations times and prints the time per frame and the point throughput.
+template <typename F>
+double bench(const char * name, int num_points, F fn) {
+    fn();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+        fn();
+    double ms = timeMilli(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << ms << " ms" << std::setw(10) << std::setprecision(1)
+              << num_points / ms / 1000 << " Mpts/s" << std::endl;
+    return ms;
+}
+
+// Floor of a coordinate in record units over the voxel size, the voxel both grids put it in.
+uint64_t benchKey(double x, double y, double z, int size) {
+    return (uint64_t(int64_t(floor(x / size)) + (1 << 20)) << 42) |
+           (uint64_t(int64_t(floor(y / size)) + (1 << 20)) << 21) |
+            uint64_t(int64_t(floor(z / size)) + (1 << 20));
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+
+    const int num_points = width * height;
+    std::vector<short> records(size_t(num_points) * 5), out(size_t(num_points) * 5);
+    makeFrame(&records[0], width, height);
+
+    // the same frame as PCL sees it in the stitcher, in meters
+    pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
+    cloud->width = num_points;
+    cloud->height = 1;
+    cloud->points.resize(num_points);
+    for (int i = 0; i < num_points; i++) {
+        const short * p = &records[size_t(i) * 5];
+        cloud->points[i].x = (float)p[0] / CONV_RATE;
+        cloud->points[i].y = (float)p[1] / CONV_RATE;
+        cloud->points[i].z = (float)p[2] / CONV_RATE;
+        cloud->points[i].r = (uint8_t)(p[3] & 0xFF);
+        cloud->points[i].g = (uint8_t)(p[3] >> 8);
+        cloud->points[i].b = (uint8_t)(p[4] & 0xFF);
+    }
+
+    std::cout << "Frame " << width << "x" << height << " (" << num_points << " points), "
+              << iterations << " iterations per run" << std::endl;
+
+    std::vector<int> sizes = {5, 10, 20, 40};
+    if (voxel_size > 0)
+        sizes = {voxel_size};
+
+    voxelGrid grid;
+    memset(&grid, 0, sizeof(grid));
+    pcl::PointCloud<pcl::PointXYZRGB> filtered;
+
+    for (int size : sizes) {
+        std::cout << "\nVoxel size " << size << " mm" << std::endl;
+
+        pcl::VoxelGrid<pcl::PointXYZRGB> voxel_filter;
+        voxel_filter.setInputCloud(cloud);
+        voxel_filter.setLeafSize(size / float(CONV_RATE), size / float(CONV_RATE), size / float(CONV_RATE));
+        voxel_filter.setDownsampleAllData(true);
+        const double pcl_ms = bench("pcl::VoxelGrid", num_points, [&] { voxel_filter.filter(filtered); });
+
+        int num_voxels = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            std::string name = "voxelDownsample " + std::to_string(threads) + "T";
+            const double ms = bench(name.c_str(), num_points, [&] {
+                num_voxels = voxelDownsample(&grid, &records[0], num_points, size, &out[0], threads);
+            });
+            std::cout << "  " << std::setprecision(2) << pcl_ms / ms << "x pcl::VoxelGrid" << std::endl;
+        }
+
+        // centroids of the voxels found by both, PCL's float grid may put a few border points elsewhere
+        std::unordered_map<uint64_t, const short *> ours;
+        for (int i = 0; i < num_voxels; i++)
+            ours[benchKey(out[i * 5], out[i * 5 + 1], out[i * 5 + 2], size)] = &out[size_t(i) * 5];
+
+        int matched = 0;
+        double sum_distance = 0, max_distance = 0;
+        for (const pcl::PointXYZRGB & point : filtered.points) {
+            const double x = point.x * CONV_RATE, y = point.y * CONV_RATE, z = point.z * CONV_RATE;
+            auto it = ours.find(benchKey(x, y, z, size));
+            if (it == ours.end()) continue;
+            const short * p = it->second;
+            const double distance = sqrt((x - p[0]) * (x - p[0]) + (y - p[1]) * (y - p[1]) + (z - p[2]) * (z - p[2]));
+            sum_distance += distance;
+            max_distance = std::max(max_distance, distance);
+            matched++;
+        }
+
+        std::cout << "Voxels: " << num_voxels << ", pcl::VoxelGrid " << filtered.size() << ", matched "
+                  << matched << ", centroid distance mean " << std::setprecision(3)
+                  << (matched ? sum_distance / matched : 0) << " mm, max " << max_distance << " mm" << std::endl;
+    }
+
+    freeVoxelGrid(&grid);
+    return 0;
+}
@@ -0,0 +1,338 @@
+#ifndef META_CODEC_H
+#define META_CODEC_H
+
+/*
+ * Lossless codec for the quantized XYZRGB point stream.
+ *
+ * Input is the usual network buffer of 5 shorts per point
+ * (x, y, z, r | g << 8, b). Points are split into independent blocks so
+ * that encode and decode can run with one OpenMP thread per block.
+ *
+ * Each block goes through two stages:
+ *   1. Prediction: every channel is predicted from the previous point in
+ *      depth-image scan order. XYZ residuals are zig-zag mapped and written
+ *      as varints (1-3 bytes), RGB residuals as one zig-zag byte each.
+ *   2. Entropy: the geometry and color residual streams are coded with a
+ *      byte-wise order-0 rANS coder, one frequency table per stream.
+ *
+ * Stream layout (all integers little endian):
+ *   u32 magic 'MZC1' | u32 num_points | u32 block_points | u32 num_blocks
+ *   u32 block_bytes[num_blocks] | blocks...
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+
+#define CODEC_MAGIC         0x31435a4d      // "MZC1"
+#define CODEC_BLOCK_POINTS  65536
+#define CODEC_HEADER_BYTES  16
+
+#define RANS_PROB_BITS      12
+#define RANS_PROB_SCALE     (1 << RANS_PROB_BITS)
+#define RANS_L              (1u << 23)
+
+#define STREAM_RAW          0
+#define STREAM_RANS         1
+
+// Worst case number of bytes produced by encodeXYZRGB for num_points points.
+inline size_t codecBound(int num_points) {
+    size_t num_blocks = (num_points + CODEC_BLOCK_POINTS - 1) / CODEC_BLOCK_POINTS;
+    // per block: point count + 2 stream headers + 2 frequency tables + payload
+    return CODEC_HEADER_BYTES + num_blocks * (4 + 2 * (9 + 512)) + size_t(num_points) * 12 + 64;
+}
+
+inline void putU32(uint8_t * p, uint32_t v) { memcpy(p, &v, 4); }
+inline uint32_t getU32(const uint8_t * p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+inline uint16_t zigzag16(int16_t v) { return uint16_t((v << 1) ^ (v >> 15)); }
+inline int16_t unzigzag16(uint16_t v) { return int16_t((v >> 1) ^ -(v & 1)); }
+inline uint8_t zigzag8(int8_t v) { return uint8_t((v << 1) ^ (v >> 7)); }
+inline int8_t unzigzag8(uint8_t v) { return int8_t((v >> 1) ^ -(v & 1)); }
+
+// Scales the symbol histogram so that it sums to RANS_PROB_SCALE while keeping every used symbol non-zero.
+inline void normalizeFreqs(const uint32_t * counts, uint32_t total, uint32_t * freqs) {
+    int sum = 0, max_sym = 0;
+
+    for (int s = 0; s < 256; s++) {
+        freqs[s] = 0;
+        if (counts[s]) {
+            freqs[s] = uint32_t((uint64_t(counts[s]) * RANS_PROB_SCALE) / total);
+            if (freqs[s] == 0) freqs[s] = 1;
+        }
+        if (counts[s] > counts[max_sym]) max_sym = s;
+        sum += freqs[s];
+    }
+
+    if (sum < RANS_PROB_SCALE) {
+        freqs[max_sym] += RANS_PROB_SCALE - sum;
+        return;
+    }
+
+    // Take the excess from the largest symbols one step at a time.
+    while (sum > RANS_PROB_SCALE) {
+        int s_big = 0;
+        for (int s = 1; s < 256; s++)
+            if (freqs[s] > freqs[s_big]) s_big = s;
+        freqs[s_big]--;
+        sum--;
+    }
+}
+
+// Codes one byte stream into out. Falls back to a raw copy when rANS does not pay off.
+// Layout: u8 mode | u32 raw_len | (mode == RANS: u16 freqs[256] | u32 coded_len) | payload
+inline size_t encodeStream(const uint8_t * in, uint32_t len, uint8_t * out, std::vector<uint8_t> & scratch) {
+    uint32_t counts[256] = {0};
+    uint32_t freqs[256], cum[257];
+
+    for (uint32_t i = 0; i < len; i++) counts[in[i]]++;
+
+    out[0] = STREAM_RAW;
+    putU32(out + 1, len);
+
+    if (len > 0) {
+        normalizeFreqs(counts, len, freqs);
+        cum[0] = 0;
+        for (int s = 0; s < 256; s++) cum[s + 1] = cum[s] + freqs[s];
+
+        // rANS encodes back to front, so fill the scratch buffer from its end. A symbol costs at most
+        // RANS_PROB_BITS bits, so incompressible input can grow to 1.5x before the raw fallback kicks in.
+        const size_t scratch_bytes = size_t(len) + len / 2 + 16;
+        if (scratch.size() < scratch_bytes) scratch.resize(scratch_bytes);
+        uint8_t * end = scratch.data() + scratch.size();
+        uint8_t * ptr = end;
+        uint32_t x = RANS_L;
+
+        for (int64_t i = int64_t(len) - 1; i >= 0; i--) {
+            const uint32_t f = freqs[in[i]];
+            const uint32_t x_max = ((RANS_L >> RANS_PROB_BITS) << 8) * f;
+            while (x >= x_max) {
+                *--ptr = uint8_t(x & 0xff);
+                x >>= 8;
+            }
+            x = ((x / f) << RANS_PROB_BITS) + (x % f) + cum[in[i]];
+        }
+        ptr -= 4;
+        putU32(ptr, x);
+
+        uint32_t coded_len = uint32_t(end - ptr);
+        if (coded_len + 512 + 4 < len) {
+            out[0] = STREAM_RANS;
+            for (int s = 0; s < 256; s++) {
+                uint16_t f = uint16_t(freqs[s]);
+                memcpy(out + 5 + 2 * s, &f, 2);
+            }
+            putU32(out + 5 + 512, coded_len);
+            memcpy(out + 9 + 512, ptr, coded_len);
+            return 9 + 512 + coded_len;
+        }
+    }
+
+    memcpy(out + 5, in, len);
+    return 5 + len;
+}
+
+// Decodes one stream written by encodeStream. Returns the number of input bytes consumed, 0 on error.
+inline size_t decodeStream(const uint8_t * in, size_t avail, uint8_t * out, uint32_t max_len, uint32_t * out_len) {
+    if (avail < 5) return 0;
+
+    const uint8_t mode = in[0];
+    const uint32_t len = getU32(in + 1);
+    if (len > max_len) return 0;
+    *out_len = len;
+
+    if (mode == STREAM_RAW) {
+        if (avail < 5 + size_t(len)) return 0;
+        memcpy(out, in + 5, len);
+        return 5 + len;
+    }
+
+    if (mode != STREAM_RANS || avail < 9 + 512) return 0;
+
+    uint32_t freqs[256], cum[256];
+    uint8_t slot_to_sym[RANS_PROB_SCALE];
+    uint32_t total = 0;
+
+    for (int s = 0; s < 256; s++) {
+        uint16_t f;
+        memcpy(&f, in + 5 + 2 * s, 2);
+        freqs[s] = f;
+        cum[s] = total;
+        if (total + f > RANS_PROB_SCALE) return 0;
+        memset(slot_to_sym + total, s, f);
+        total += f;
+    }
+    if (total != RANS_PROB_SCALE) return 0;
+
+    const uint32_t coded_len = getU32(in + 5 + 512);
+    if (coded_len < 4 || avail < 9 + 512 + size_t(coded_len)) return 0;
+
+    const uint8_t * ptr = in + 9 + 512;
+    const uint8_t * end = ptr + coded_len;
+    uint32_t x = getU32(ptr);
+    ptr += 4;
+
+    for (uint32_t i = 0; i < len; i++) {
+        const uint32_t slot = x & (RANS_PROB_SCALE - 1);
+        const uint8_t s = slot_to_sym[slot];
+        out[i] = s;
+        x = freqs[s] * (x >> RANS_PROB_BITS) + slot - cum[s];
+        while (x < RANS_L && ptr < end)
+            x = (x << 8) | *ptr++;
+    }
+
+    return 9 + 512 + coded_len;
+}
+
+// Compresses one block of points. Returns the number of bytes written to out.
+inline size_t encodeBlock(const short * pc_buffer, int npts, uint8_t * out) {
+    thread_local std::vector<uint8_t> geo, col, scratch;
+    if (geo.size() < size_t(npts) * 9) geo.resize(size_t(npts) * 9);
+    if (col.size() < size_t(npts) * 3) col.resize(size_t(npts) * 3);
+
+    uint8_t * g = geo.data();
+    uint8_t * c = col.data();
+    uint32_t geo_len = 0;
+    short prev[5] = {0, 0, 0, 0, 0};
+
+    for (int i = 0; i < npts; i++) {
+        const short * p = pc_buffer + i * 5;
+
+        for (int k = 0; k < 3; k++) {
+            uint16_t v = zigzag16(int16_t(uint16_t(p[k]) - uint16_t(prev[k])));
+            while (v >= 0x80) {
+                g[geo_len++] = uint8_t(v | 0x80);
+                v >>= 7;
+            }
+            g[geo_len++] = uint8_t(v);
+        }
+
+        c[i * 3 + 0] = zigzag8(int8_t(uint8_t(p[3]) - uint8_t(prev[3])));
+        c[i * 3 + 1] = zigzag8(int8_t(uint8_t(uint16_t(p[3]) >> 8) - uint8_t(uint16_t(prev[3]) >> 8)));
+        c[i * 3 + 2] = zigzag8(int8_t(uint8_t(p[4]) - uint8_t(prev[4])));
+
+        memcpy(prev, p, sizeof(prev));
+    }
+
+    putU32(out, npts);
+    size_t size = 4;
+    size += encodeStream(g, geo_len, out + size, scratch);
+    size += encodeStream(c, uint32_t(npts) * 3, out + size, scratch);
+    return size;
+}
+
+// Decompresses one block of points into pc_buffer. Returns false on a corrupt block.
+inline bool decodeBlock(const uint8_t * in, size_t avail, int npts, short * pc_buffer) {
+    thread_local std::vector<uint8_t> geo, col;
+    if (geo.size() < size_t(npts) * 9) geo.resize(size_t(npts) * 9);
+    if (col.size() < size_t(npts) * 3) col.resize(size_t(npts) * 3);
+
+    if (avail < 4 || int(getU32(in)) != npts) return false;
+
+    uint32_t geo_len, col_len;
+    size_t used = 4, n;
+    if (!(n = decodeStream(in + used, avail - used, geo.data(), uint32_t(npts) * 9, &geo_len))) return false;
+    used += n;
+    if (!(n = decodeStream(in + used, avail - used, col.data(), uint32_t(npts) * 3, &col_len))) return false;
+    if (col_len != uint32_t(npts) * 3) return false;
+
+    const uint8_t * g = geo.data();
+    const uint8_t * g_end = g + geo_len;
+    const uint8_t * c = col.data();
+    uint16_t prev[3] = {0, 0, 0};
+    uint8_t prev_r = 0, prev_g = 0, prev_b = 0;
+
+    for (int i = 0; i < npts; i++) {
+        short * p = pc_buffer + i * 5;
+
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = 0;
+            int shift = 0;
+            do {
+                if (g == g_end || shift > 14) return false;
+                v |= uint32_t(*g & 0x7f) << shift;
+                shift += 7;
+            } while (*g++ & 0x80);
+            prev[k] = uint16_t(prev[k] + unzigzag16(uint16_t(v)));
+            p[k] = short(prev[k]);
+        }
+
+        prev_r = uint8_t(prev_r + unzigzag8(c[i * 3 + 0]));
+        prev_g = uint8_t(prev_g + unzigzag8(c[i * 3 + 1]));
+        prev_b = uint8_t(prev_b + unzigzag8(c[i * 3 + 2]));
+        p[3] = short(prev_r | (prev_g << 8));
+        p[4] = prev_b;
+    }
+
+    return true;
+}
+
+// Compresses num_points records of pc_buffer into out (at least codecBound bytes). Returns the compressed size.
+inline size_t encodeXYZRGB(const short * pc_buffer, int num_points, uint8_t * out, int num_threads = 1) {
+    const int num_blocks = (num_points + CODEC_BLOCK_POINTS - 1) / CODEC_BLOCK_POINTS;
+    const size_t block_bound = 4 + 2 * (9 + 512) + size_t(CODEC_BLOCK_POINTS) * 12;
+    uint8_t * table = out + CODEC_HEADER_BYTES;
+    uint8_t * data = table + 4 * num_blocks;
+
+    thread_local std::vector<uint8_t> staging;
+    std::vector<uint32_t> block_size(num_blocks);
+    if (num_blocks > 1 && staging.size() < block_bound * num_blocks) staging.resize(block_bound * num_blocks);
+    uint8_t * stage = staging.data();
+
+    // A single block is written in place, otherwise every block is staged then packed back to back.
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads) if(num_blocks > 1)
+    for (int b = 0; b < num_blocks; b++) {
+        const int first = b * CODEC_BLOCK_POINTS;
+        const int npts = std::min(CODEC_BLOCK_POINTS, num_points - first);
+        uint8_t * dst = num_blocks > 1 ? stage + b * block_bound : data;
+        block_size[b] = uint32_t(encodeBlock(pc_buffer + size_t(first) * 5, npts, dst));
+    }
+
+    size_t size = data - out;
+    for (int b = 0; b < num_blocks; b++) {
+        if (num_blocks > 1)
+            memcpy(out + size, stage + b * block_bound, block_size[b]);
+        putU32(table + 4 * b, block_size[b]);
+        size += block_size[b];
+    }
+
+    putU32(out + 0, CODEC_MAGIC);
+    putU32(out + 4, num_points);
+    putU32(out + 8, CODEC_BLOCK_POINTS);
+    putU32(out + 12, num_blocks);
+    return size;
+}
+
+// Decompresses a stream written by encodeXYZRGB into pc_buffer. Returns the number of points, or -1 on error.
+inline int decodeXYZRGB(const uint8_t * in, size_t in_size, short * pc_buffer, int max_points, int num_threads = 1) {
+    if (in_size < CODEC_HEADER_BYTES || getU32(in) != CODEC_MAGIC) return -1;
+
+    const int num_points = int(getU32(in + 4));
+    const int block_points = int(getU32(in + 8));
+    const int num_blocks = int(getU32(in + 12));
+
+    if (num_points < 0 || num_points > max_points || block_points <= 0) return -1;
+    if (num_blocks != (num_points + block_points - 1) / block_points) return -1;
+    if (in_size < CODEC_HEADER_BYTES + 4 * size_t(num_blocks)) return -1;
+
+    std::vector<size_t> offset(num_blocks + 1);
+    offset[0] = CODEC_HEADER_BYTES + 4 * size_t(num_blocks);
+    for (int b = 0; b < num_blocks; b++)
+        offset[b + 1] = offset[b] + getU32(in + CODEC_HEADER_BYTES + 4 * b);
+    if (offset[num_blocks] > in_size) return -1;
+
+    bool ok = true;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads) if(num_blocks > 1)
+    for (int b = 0; b < num_blocks; b++) {
+        const int first = b * block_points;
+        const int npts = std::min(block_points, num_points - first);
+        if (!decodeBlock(in + offset[b], offset[b + 1] - offset[b], npts, pc_buffer + size_t(first) * 5))
+            ok = false;
+    }
+
+    return ok ? num_points : -1;
+}
+
+#endif
@@ -0,0 +1,1601 @@
+#ifndef META_CONVERT_H
+#define META_CONVERT_H
+
+/*
+ * Conversion of camera frames into 5-short wire records, either from a textured
+ * librealsense point cloud (convertPoints) or straight from the Z16 depth
+ * image (convertDepth, see below).
+ *
+ * Every point of the cloud is transformed with a row-major 4x4 matrix, scaled to
+ * millimeters and colored from the color frame at its texture coordinate.
+ * There is a scalar kernel and SSE (4-wide), AVX2 (8-wide) and AVX-512
+ * (16-wide) kernels. bestConvertKernel picks the widest one the CPU runs.
+ *
+ * All kernels write exactly the records of convertPointScalar. They
+ * evaluate the transform as fma(z, m2, fma(y, m1, fma(x, m0, m3))) and the
+ * texel as fma(u, w, .5). Both are truncated like cvttps, where NaN and out
+ * of range give INT32_MIN, and coordinates saturate to int16.
+ *
+ * The vector kernels read the vertices and texture coordinates with plain
+ * loads and transpose them in registers. Colors are fetched with a gather
+ * where the ISA has one. The records are interleaved with byte or word
+ * permutes.
+ *
+ * The kernels are templates over the output layout, resolved at compile
+ * time: recordLayout interleaves 5-short records, soaLayout writes the SoA
+ * planes of FORMAT_SOA (Meta/soa.h). The transform and the color lookup
+ * are shared, so both layouts hold the same points. The capture range has
+ * its own kernels (convertPointsInRange) so neither path tests a flag per
+ * point.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <alloca.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#include <omp.h>
+
+#include "depth.h"
+#include "roi.h"
+#include "soa.h"
+
+#define CONVERT_BLOCK       10240           // points per OpenMP block, a multiple of every kernel width
+
+enum {
+    CONVERT_SCALAR,
+    CONVERT_SSE,
+    CONVERT_AVX2,
+    CONVERT_AVX512,
+    NUM_CONVERT_KERNELS
+};
+
+static const char * const convert_kernel_names[NUM_CONVERT_KERNELS] = {"scalar", "sse", "avx2", "avx512"};
+
+struct convertParams {
+    const float * vertices;     // x, y, z per point (rs2::vertex)
+    const float * tex_coords;   // u, v per point (rs2::texture_coordinate)
+    const uint8_t * color;      // cl_sb bytes per row, cl_bp bytes per pixel, r g b first
+    int w, h, cl_bp, cl_sb;
+    const float * tf;           // row-major 4x4 transform, the last row is ignored
+    float conv_rate;
+    float z_min, z_max;         // capture range of convertPointsInRange: z_min < z <= z_max and
+    float x_min, x_max;         // x_min < x <= x_max in camera space, meters
+    const roiSet * roi;         // region of convertPointsInRange after tf, meters, NULL keeps every point
+};
+
+typedef void (*convertKernel)(const convertParams & p, int begin, int end, short * records);
+
+// float to int32 truncation with the semantics of cvttps: NaN and out of range values give INT32_MIN.
+inline int truncToInt(float v) {
+    return v >= -2147483648.f && v < 2147483648.f ? int(v) : INT32_MIN;
+}
+
+inline short saturateShort(int v) {
+    return short(std::min(std::max(v, -32768), 32767));
+}
+
+inline void convertPointScalar(const convertParams & p, int i, short * record) {
+    const float * v = p.vertices + size_t(i) * 3;
+    const float * t = p.tex_coords + size_t(i) * 2;
+    const float * m = p.tf;
+
+    const int x = std::min(std::max(truncToInt(fmaf(t[0], float(p.w), .5f)), 0), p.w - 1);
+    const int y = std::min(std::max(truncToInt(fmaf(t[1], float(p.h), .5f)), 0), p.h - 1);
+    const uint8_t * c = p.color + x * p.cl_bp + y * p.cl_sb;
+
+    const float x_p = fmaf(v[2], m[2], fmaf(v[1], m[1], fmaf(v[0], m[0], m[3])));
+    const float y_p = fmaf(v[2], m[6], fmaf(v[1], m[5], fmaf(v[0], m[4], m[7])));
+    const float z_p = fmaf(v[2], m[10], fmaf(v[1], m[9], fmaf(v[0], m[8], m[11])));
+
+    record[0] = saturateShort(truncToInt(x_p * p.conv_rate));
+    record[1] = saturateShort(truncToInt(y_p * p.conv_rate));
+    record[2] = saturateShort(truncToInt(z_p * p.conv_rate));
+    record[3] = short(c[0] | (c[1] << 8));
+    record[4] = c[2];
+}
+
+// Output layouts of the kernels.
+struct recordLayout {
+    short * records;
+};
+
+// The planes have to be SOA_ALIGN aligned as soaPlanesOf makes them, the vector kernels write them with
+// aligned stores. Plain stores, the socket reads the payload right after and finds it in the cache.
+struct soaLayout {
+    soaPlanes planes;
+};
+
+inline void storeRecord(const recordLayout & out, int i, const short * record) {
+    memcpy(out.records + size_t(i) * 5, record, 5 * sizeof(short));
+}
+
+inline void storeRecord(const soaLayout & out, int i, const short * record) {
+    out.planes.x[i] = record[0];
+    out.planes.y[i] = record[1];
+    out.planes.z[i] = record[2];
+    out.planes.r[i] = uint8_t(record[3]);
+    out.planes.g[i] = uint8_t(uint16_t(record[3]) >> 8);
+    out.planes.b[i] = uint8_t(record[4]);
+}
+
+template <typename Layout>
+inline void convertPointsScalarTo(const convertParams & p, int begin, int end, const Layout & out) {
+    for (int i = begin; i < end; i++) {
+        short record[5];
+        convertPointScalar(p, i, record);
+        storeRecord(out, i, record);
+    }
+}
+
+// Records are converted in place.
+inline void convertPointsScalarTo(const convertParams & p, int begin, int end, const recordLayout & out) {
+    for (int i = begin; i < end; i++)
+        convertPointScalar(p, i, out.records + size_t(i) * 5);
+}
+
+inline void convertPointsScalar(const convertParams & p, int begin, int end, short * records) {
+    convertPointsScalarTo(p, begin, end, recordLayout{records});
+}
+
+// pshufb masks that interleave 8 points held as five int16 vectors (x, y, z, r|g<<8, b) into
+// 5 x 16 bytes of records: [output chunk][field][byte], 0x80 clears the byte.
+struct recordShuffleMasks {
+    uint8_t m[5][5][16];
+    constexpr recordShuffleMasks() : m() {
+        for (int k = 0; k < 5; k++)
+            for (int f = 0; f < 5; f++)
+                for (int j = 0; j < 8; j++) {
+                    const int word = 8 * k + j;
+                    const bool take = word % 5 == f;
+                    m[k][f][2 * j] = take ? uint8_t(2 * (word / 5)) : 0x80;
+                    m[k][f][2 * j + 1] = take ? uint8_t(2 * (word / 5) + 1) : 0x80;
+                }
+    }
+};
+
+// vpermt2w / vpermw indices that interleave 16 points held as xy = [x | y] and zc = [z | r|g<<8]
+// (32 words each) and b into 3 x 32 words of records. b_mask marks the words taken from b.
+struct recordPermuteIndices {
+    uint16_t two[3][32];
+    uint16_t b[3][32];
+    uint32_t b_mask[3];
+    constexpr recordPermuteIndices() : two(), b(), b_mask() {
+        for (int k = 0; k < 3; k++)
+            for (int j = 0; j < 32; j++) {
+                const int word = 32 * k + j;
+                const int point = (word / 5) & 15, field = word % 5;
+                two[k][j] = field < 2 ? uint16_t(field * 16 + point) : field < 4 ? uint16_t(32 + (field - 2) * 16 + point) : 0;
+                b[k][j] = uint16_t(point);
+                if (field == 4 && word < 80) b_mask[k] |= 1u << j;
+            }
+    }
+};
+
+// Byte indices of the set bits of every 8 bit mask, lowest first: the left-pack permutes of the AVX2 kernels.
+struct leftPackTable {
+    uint64_t idx[256];
+    constexpr leftPackTable() : idx() {
+        for (int mask = 0; mask < 256; mask++) {
+            int n = 0;
+            for (int k = 0; k < 8; k++)
+                if (mask & (1 << k)) idx[mask] |= uint64_t(k) << (8 * n++);
+        }
+    }
+};
+
+alignas(64) static constexpr recordShuffleMasks record_shuffle_masks{};
+alignas(64) static constexpr recordPermuteIndices record_permute_indices{};
+alignas(64) static constexpr leftPackTable left_pack_table{};
+
+// Fetches 4 bytes of color at each offset of off, moving the load back for offsets near the end of the
+// frame so it stays in bounds (cl_last is the last offset a 4 byte load may start at).
+__attribute__((target("sse4.1,fma")))
+inline __m128i loadTexelsSSE(const uint8_t * color, __m128i off, int cl_last) {
+    __attribute__((aligned(16))) int offsets[4];
+    _mm_store_si128((__m128i *)offsets, off);
+    uint32_t texels[4];
+    for (int k = 0; k < 4; k++) {
+        const int base = std::min(offsets[k], cl_last);
+        memcpy(&texels[k], color + base, 4);
+        texels[k] >>= 8 * (offsets[k] - base);
+    }
+    return _mm_loadu_si128((const __m128i *)texels);
+}
+
+// Stores 8 points held as five int16 vectors (x, y, z, r|g<<8, b).
+__attribute__((target("sse4.1,fma")))
+inline void storePointsSSE(const recordLayout & out, int i, const __m128i * fields) {
+    __m128i * records = (__m128i *)(out.records + size_t(i) * 5);
+
+    for (int c = 0; c < 5; c++) {
+        __m128i chunk = _mm_shuffle_epi8(fields[0], _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][0]));
+        for (int f = 1; f < 5; f++)
+            chunk = _mm_or_si128(chunk, _mm_shuffle_epi8(fields[f], _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][f])));
+        _mm_storeu_si128(records + c, chunk);
+    }
+}
+
+__attribute__((target("sse4.1,fma")))
+inline void storePointsSSE(const soaLayout & out, int i, const __m128i * fields) {
+    const __m128i r = _mm_and_si128(fields[3], _mm_set1_epi16(0xFF));
+    const __m128i g = _mm_srli_epi16(fields[3], 8);
+    _mm_store_si128((__m128i *)(out.planes.x + i), fields[0]);
+    _mm_store_si128((__m128i *)(out.planes.y + i), fields[1]);
+    _mm_store_si128((__m128i *)(out.planes.z + i), fields[2]);
+    _mm_storel_epi64((__m128i *)(out.planes.r + i), _mm_packus_epi16(r, r));
+    _mm_storel_epi64((__m128i *)(out.planes.g + i), _mm_packus_epi16(g, g));
+    _mm_storel_epi64((__m128i *)(out.planes.b + i), _mm_packus_epi16(fields[4], fields[4]));
+}
+
+// 8 points per iteration, two groups of 4. SSE has no gather, so the color texels are the only per lane loads.
+template <typename Layout>
+__attribute__((target("sse4.1,fma")))
+inline void convertPointsSSETo(const convertParams & p, int begin, int end, const Layout & out) {
+    const float * m = p.tf;
+    const __m128 m00 = _mm_set1_ps(m[0]), m01 = _mm_set1_ps(m[1]), m02 = _mm_set1_ps(m[2]),  m03 = _mm_set1_ps(m[3]);
+    const __m128 m10 = _mm_set1_ps(m[4]), m11 = _mm_set1_ps(m[5]), m12 = _mm_set1_ps(m[6]),  m13 = _mm_set1_ps(m[7]);
+    const __m128 m20 = _mm_set1_ps(m[8]), m21 = _mm_set1_ps(m[9]), m22 = _mm_set1_ps(m[10]), m23 = _mm_set1_ps(m[11]);
+
+    const __m128 _conv_rate = _mm_set1_ps(p.conv_rate);
+    const __m128 _f5 = _mm_set1_ps(.5f);
+    const __m128 _w = _mm_set1_ps(float(p.w));
+    const __m128 _h = _mm_set1_ps(float(p.h));
+    const __m128i _zero = _mm_setzero_si128();
+    const __m128i _w_min = _mm_set1_epi32(p.w - 1);
+    const __m128i _h_min = _mm_set1_epi32(p.h - 1);
+    const __m128i _cl_bp = _mm_set1_epi32(p.cl_bp);
+    const __m128i _cl_sb = _mm_set1_epi32(p.cl_sb);
+    const __m128i _rg = _mm_set1_epi32(0xFFFF);
+    const __m128i _byte = _mm_set1_epi32(0xFF);
+    const int cl_last = p.cl_sb * p.h - 4;
+
+    const int simd_end = begin + ((end - begin) & ~7);
+
+    for (int i = begin; i < simd_end; i += 8) {
+        __m128i x[2], y[2], z[2], rg[2], b[2];
+
+        for (int k = 0; k < 2; k++) {
+            const float * v = p.vertices + size_t(i + 4 * k) * 3;
+            const float * t = p.tex_coords + size_t(i + 4 * k) * 2;
+
+            // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3 -> x, y, z of the 4 points
+            __m128 a0 = _mm_loadu_ps(v), a1 = _mm_loadu_ps(v + 4), a2 = _mm_loadu_ps(v + 8);
+            __m128 vx = _mm_shuffle_ps(a0, _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+            __m128 vy = _mm_shuffle_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(0, 0, 1, 1)),
+                                       _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 vz = _mm_shuffle_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(1, 1, 2, 2)),
+                                       _mm_shuffle_ps(a2, a2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+            __m128 px = _mm_fmadd_ps(vz, m02, _mm_fmadd_ps(vy, m01, _mm_fmadd_ps(vx, m00, m03)));
+            __m128 py = _mm_fmadd_ps(vz, m12, _mm_fmadd_ps(vy, m11, _mm_fmadd_ps(vx, m10, m13)));
+            __m128 pz = _mm_fmadd_ps(vz, m22, _mm_fmadd_ps(vy, m21, _mm_fmadd_ps(vx, m20, m23)));
+            x[k] = _mm_cvttps_epi32(_mm_mul_ps(px, _conv_rate));
+            y[k] = _mm_cvttps_epi32(_mm_mul_ps(py, _conv_rate));
+            z[k] = _mm_cvttps_epi32(_mm_mul_ps(pz, _conv_rate));
+
+            // u0 v0 u1 v1 | u2 v2 u3 v3 -> clamped pixel offsets in the color frame
+            __m128 t0 = _mm_loadu_ps(t), t1 = _mm_loadu_ps(t + 4);
+            __m128i u = _mm_cvttps_epi32(_mm_fmadd_ps(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)), _w, _f5));
+            __m128i vv = _mm_cvttps_epi32(_mm_fmadd_ps(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1)), _h, _f5));
+            u = _mm_min_epi32(_mm_max_epi32(u, _zero), _w_min);
+            vv = _mm_min_epi32(_mm_max_epi32(vv, _zero), _h_min);
+            __m128i off = _mm_add_epi32(_mm_mullo_epi32(u, _cl_bp), _mm_mullo_epi32(vv, _cl_sb));
+
+            __m128i rgb = loadTexelsSSE(p.color, off, cl_last);
+            rg[k] = _mm_and_si128(rgb, _rg);
+            b[k] = _mm_and_si128(_mm_srli_epi32(rgb, 16), _byte);
+        }
+
+        const __m128i fields[5] = {_mm_packs_epi32(x[0], x[1]), _mm_packs_epi32(y[0], y[1]), _mm_packs_epi32(z[0], z[1]),
+                                   _mm_packus_epi32(rg[0], rg[1]), _mm_packus_epi32(b[0], b[1])};
+        storePointsSSE(out, i, fields);
+    }
+
+    convertPointsScalarTo(p, simd_end, end, out);
+}
+
+__attribute__((target("sse4.1,fma")))
+inline void convertPointsSSE(const convertParams & p, int begin, int end, short * records) {
+    convertPointsSSETo(p, begin, end, recordLayout{records});
+}
+
+// Stores 16 points held as five int16 vectors (x, y, z, r|g<<8, b). The records of points 0-7 are built in
+// the low lane and those of points 8-15 in the high lane with the same in-lane shuffles.
+__attribute__((target("avx2,fma")))
+inline void storePointsAVX2(const recordLayout & out, int i, const __m256i * fields) {
+    __m128i * records = (__m128i *)(out.records + size_t(i) * 5);
+
+    for (int c = 0; c < 5; c++) {
+        __m256i chunk = _mm256_shuffle_epi8(fields[0], _mm256_broadcastsi128_si256(
+                                                _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][0])));
+        for (int f = 1; f < 5; f++)
+            chunk = _mm256_or_si256(chunk, _mm256_shuffle_epi8(fields[f], _mm256_broadcastsi128_si256(
+                                                _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][f]))));
+        _mm_storeu_si128(records + c, _mm256_castsi256_si128(chunk));
+        _mm_storeu_si128(records + 5 + c, _mm256_extracti128_si256(chunk, 1));
+    }
+}
+
+// The colors are narrowed to bytes per 128 bit lane, the qword permute gathers the low half of each lane.
+__attribute__((target("avx2,fma")))
+inline void storePointsAVX2(const soaLayout & out, int i, const __m256i * fields) {
+    const __m256i r = _mm256_and_si256(fields[3], _mm256_set1_epi16(0xFF));
+    const __m256i g = _mm256_srli_epi16(fields[3], 8);
+    _mm256_store_si256((__m256i *)(out.planes.x + i), fields[0]);
+    _mm256_store_si256((__m256i *)(out.planes.y + i), fields[1]);
+    _mm256_store_si256((__m256i *)(out.planes.z + i), fields[2]);
+    _mm_store_si128((__m128i *)(out.planes.r + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08)));
+    _mm_store_si128((__m128i *)(out.planes.g + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(g, g), 0x08)));
+    _mm_store_si128((__m128i *)(out.planes.b + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(fields[4], fields[4]), 0x08)));
+}
+
+// 16 points per iteration, two groups of 8.
+template <typename Layout>
+__attribute__((target("avx2,fma")))
+inline void convertPointsAVX2To(const convertParams & p, int begin, int end, const Layout & out) {
+    const float * m = p.tf;
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+
+    const __m256 _conv_rate = _mm256_set1_ps(p.conv_rate);
+    const __m256 _f5 = _mm256_set1_ps(.5f);
+    const __m256 _w = _mm256_set1_ps(float(p.w));
+    const __m256 _h = _mm256_set1_ps(float(p.h));
+    const __m256i _zero = _mm256_setzero_si256();
+    const __m256i _w_min = _mm256_set1_epi32(p.w - 1);
+    const __m256i _h_min = _mm256_set1_epi32(p.h - 1);
+    const __m256i _cl_bp = _mm256_set1_epi32(p.cl_bp);
+    const __m256i _cl_sb = _mm256_set1_epi32(p.cl_sb);
+    const __m256i _cl_last = _mm256_set1_epi32(p.cl_sb * p.h - 4);
+    const __m256i _rg = _mm256_set1_epi32(0xFFFF);
+    const __m256i _byte = _mm256_set1_epi32(0xFF);
+
+    const int simd_end = begin + ((end - begin) & ~15);
+
+    for (int i = begin; i < simd_end; i += 16) {
+        __m256i x[2], y[2], z[2], rg[2], b[2];
+
+        for (int k = 0; k < 2; k++) {
+            const float * v = p.vertices + size_t(i + 8 * k) * 3;
+            const float * t = p.tex_coords + size_t(i + 8 * k) * 2;
+
+            // points 0-3 in the low lanes and 4-7 in the high lanes, then the 4-wide transpose in both lanes
+            __m256 a0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v)), _mm_loadu_ps(v + 12), 1);
+            __m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v + 4)), _mm_loadu_ps(v + 16), 1);
+            __m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v + 8)), _mm_loadu_ps(v + 20), 1);
+            __m256 vx = _mm256_shuffle_ps(a0, _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+            __m256 vy = _mm256_shuffle_ps(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(0, 0, 1, 1)),
+                                          _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+            __m256 vz = _mm256_shuffle_ps(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(1, 1, 2, 2)),
+                                          _mm256_shuffle_ps(a2, a2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+            __m256 px = _mm256_fmadd_ps(vz, m02, _mm256_fmadd_ps(vy, m01, _mm256_fmadd_ps(vx, m00, m03)));
+            __m256 py = _mm256_fmadd_ps(vz, m12, _mm256_fmadd_ps(vy, m11, _mm256_fmadd_ps(vx, m10, m13)));
+            __m256 pz = _mm256_fmadd_ps(vz, m22, _mm256_fmadd_ps(vy, m21, _mm256_fmadd_ps(vx, m20, m23)));
+            x[k] = _mm256_cvttps_epi32(_mm256_mul_ps(px, _conv_rate));
+            y[k] = _mm256_cvttps_epi32(_mm256_mul_ps(py, _conv_rate));
+            z[k] = _mm256_cvttps_epi32(_mm256_mul_ps(pz, _conv_rate));
+
+            // u, v of points 0-1, 4-5 | 2-3, 6-7 after the in-lane shuffle, the qword permute restores the order
+            __m256 t0 = _mm256_loadu_ps(t), t1 = _mm256_loadu_ps(t + 8);
+            __m256 tu = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0))), 0xD8));
+            __m256 tv = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1))), 0xD8));
+            __m256i u = _mm256_cvttps_epi32(_mm256_fmadd_ps(tu, _w, _f5));
+            __m256i vv = _mm256_cvttps_epi32(_mm256_fmadd_ps(tv, _h, _f5));
+            u = _mm256_min_epi32(_mm256_max_epi32(u, _zero), _w_min);
+            vv = _mm256_min_epi32(_mm256_max_epi32(vv, _zero), _h_min);
+            __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(u, _cl_bp), _mm256_mullo_epi32(vv, _cl_sb));
+
+            // gather 4 bytes per pixel, moving the load back for the very last pixel so it stays in bounds
+            __m256i base = _mm256_min_epi32(off, _cl_last);
+            __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(off, base), 3);
+            __m256i rgb = _mm256_srlv_epi32(_mm256_i32gather_epi32((const int *)p.color, base, 1), shift);
+            rg[k] = _mm256_and_si256(rgb, _rg);
+            b[k] = _mm256_and_si256(_mm256_srli_epi32(rgb, 16), _byte);
+        }
+
+        // 2 x 8 int32 -> 16 int16, packs works per 128 bit lane so the qwords are reordered
+        const __m256i fields[5] = {_mm256_permute4x64_epi64(_mm256_packs_epi32(x[0], x[1]), 0xD8),
+                                   _mm256_permute4x64_epi64(_mm256_packs_epi32(y[0], y[1]), 0xD8),
+                                   _mm256_permute4x64_epi64(_mm256_packs_epi32(z[0], z[1]), 0xD8),
+                                   _mm256_permute4x64_epi64(_mm256_packus_epi32(rg[0], rg[1]), 0xD8),
+                                   _mm256_permute4x64_epi64(_mm256_packus_epi32(b[0], b[1]), 0xD8)};
+        storePointsAVX2(out, i, fields);
+    }
+
+    convertPointsScalarTo(p, simd_end, end, out);
+}
+
+__attribute__((target("avx2,fma")))
+inline void convertPointsAVX2(const convertParams & p, int begin, int end, short * records) {
+    convertPointsAVX2To(p, begin, end, recordLayout{records});
+}
+
+// Stores 16 points from the truncated coordinates x, y, z and the texels rgb (int32 lanes). The records
+// are interleaved with vpermt2w plus a masked vpermw for b (AVX-512BW).
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void storePoints512(const recordLayout & out, int i, __m512i x, __m512i y, __m512i z, __m512i rgb) {
+    // 16 int32 -> 16 int16, saturating for the coordinates and exact for the colors
+    __m256i rg = _mm512_cvtepi32_epi16(_mm512_and_si512(rgb, _mm512_set1_epi32(0xFFFF)));
+    __m512i b = _mm512_castsi256_si512(_mm512_cvtepi32_epi16(_mm512_and_si512(_mm512_srli_epi32(rgb, 16), _mm512_set1_epi32(0xFF))));
+    __m512i xy = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtsepi32_epi16(x)), _mm512_cvtsepi32_epi16(y), 1);
+    __m512i zc = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtsepi32_epi16(z)), rg, 1);
+    short * records = out.records + size_t(i) * 5;
+
+    for (int c = 0; c < 3; c++) {
+        __m512i chunk = _mm512_permutex2var_epi16(xy, _mm512_loadu_si512(record_permute_indices.two[c]), zc);
+        chunk = _mm512_mask_permutexvar_epi16(chunk, record_permute_indices.b_mask[c],
+                                              _mm512_loadu_si512(record_permute_indices.b[c]), b);
+        if (c < 2) _mm512_storeu_si512(records + 32 * c, chunk);
+        else _mm256_storeu_si256((__m256i *)(records + 64), _mm512_castsi512_si256(chunk));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void storePoints512(const soaLayout & out, int i, __m512i x, __m512i y, __m512i z, __m512i rgb) {
+    _mm256_store_si256((__m256i *)(out.planes.x + i), _mm512_cvtsepi32_epi16(x));
+    _mm256_store_si256((__m256i *)(out.planes.y + i), _mm512_cvtsepi32_epi16(y));
+    _mm256_store_si256((__m256i *)(out.planes.z + i), _mm512_cvtsepi32_epi16(z));
+    _mm_store_si128((__m128i *)(out.planes.r + i), _mm512_cvtepi32_epi8(rgb));
+    _mm_store_si128((__m128i *)(out.planes.g + i), _mm512_cvtepi32_epi8(_mm512_srli_epi32(rgb, 8)));
+    _mm_store_si128((__m128i *)(out.planes.b + i), _mm512_cvtepi32_epi8(_mm512_srli_epi32(rgb, 16)));
+}
+
+// 16 points per iteration. Vertices and texture coordinates are transposed with two-source permutes.
+template <typename Layout>
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void convertPointsAVX512To(const convertParams & p, int begin, int end, const Layout & out) {
+    const float * m = p.tf;
+    const __m512 m00 = _mm512_set1_ps(m[0]), m01 = _mm512_set1_ps(m[1]), m02 = _mm512_set1_ps(m[2]),  m03 = _mm512_set1_ps(m[3]);
+    const __m512 m10 = _mm512_set1_ps(m[4]), m11 = _mm512_set1_ps(m[5]), m12 = _mm512_set1_ps(m[6]),  m13 = _mm512_set1_ps(m[7]);
+    const __m512 m20 = _mm512_set1_ps(m[8]), m21 = _mm512_set1_ps(m[9]), m22 = _mm512_set1_ps(m[10]), m23 = _mm512_set1_ps(m[11]);
+
+    const __m512 _conv_rate = _mm512_set1_ps(p.conv_rate);
+    const __m512 _f5 = _mm512_set1_ps(.5f);
+    const __m512 _w = _mm512_set1_ps(float(p.w));
+    const __m512 _h = _mm512_set1_ps(float(p.h));
+    const __m512i _zero = _mm512_setzero_si512();
+    const __m512i _w_min = _mm512_set1_epi32(p.w - 1);
+    const __m512i _h_min = _mm512_set1_epi32(p.h - 1);
+    const __m512i _cl_bp = _mm512_set1_epi32(p.cl_bp);
+    const __m512i _cl_sb = _mm512_set1_epi32(p.cl_sb);
+    const __m512i _cl_last = _mm512_set1_epi32(p.cl_sb * p.h - 4);
+
+    // x, y, z of 16 points: the first 11 / 10 / 10 come from the first 32 floats, the rest from the last 16
+    __attribute__((aligned(64))) int first[3][16], second[3][16];
+    for (int f = 0; f < 3; f++)
+        for (int j = 0; j < 16; j++) {
+            const int src = 3 * j + f;
+            first[f][j] = src < 32 ? src : 0;
+            second[f][j] = src < 32 ? j : 16 + src - 32;
+        }
+    const __m512i first_x = _mm512_load_si512(first[0]), second_x = _mm512_load_si512(second[0]);
+    const __m512i first_y = _mm512_load_si512(first[1]), second_y = _mm512_load_si512(second[1]);
+    const __m512i first_z = _mm512_load_si512(first[2]), second_z = _mm512_load_si512(second[2]);
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+
+    const int simd_end = begin + ((end - begin) & ~15);
+
+    for (int i = begin; i < simd_end; i += 16) {
+        const float * v = p.vertices + size_t(i) * 3;
+        const float * t = p.tex_coords + size_t(i) * 2;
+
+        __m512 a0 = _mm512_loadu_ps(v), a1 = _mm512_loadu_ps(v + 16), a2 = _mm512_loadu_ps(v + 32);
+        __m512 vx = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, first_x, a1), second_x, a2);
+        __m512 vy = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, first_y, a1), second_y, a2);
+        __m512 vz = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, first_z, a1), second_z, a2);
+
+        __m512 px = _mm512_fmadd_ps(vz, m02, _mm512_fmadd_ps(vy, m01, _mm512_fmadd_ps(vx, m00, m03)));
+        __m512 py = _mm512_fmadd_ps(vz, m12, _mm512_fmadd_ps(vy, m11, _mm512_fmadd_ps(vx, m10, m13)));
+        __m512 pz = _mm512_fmadd_ps(vz, m22, _mm512_fmadd_ps(vy, m21, _mm512_fmadd_ps(vx, m20, m23)));
+
+        __m512 t0 = _mm512_loadu_ps(t), t1 = _mm512_loadu_ps(t + 16);
+        __m512i u = _mm512_cvttps_epi32(_mm512_fmadd_ps(_mm512_permutex2var_ps(t0, even, t1), _w, _f5));
+        __m512i vv = _mm512_cvttps_epi32(_mm512_fmadd_ps(_mm512_permutex2var_ps(t0, odd, t1), _h, _f5));
+        u = _mm512_min_epi32(_mm512_max_epi32(u, _zero), _w_min);
+        vv = _mm512_min_epi32(_mm512_max_epi32(vv, _zero), _h_min);
+        __m512i off = _mm512_add_epi32(_mm512_mullo_epi32(u, _cl_bp), _mm512_mullo_epi32(vv, _cl_sb));
+
+        __m512i base = _mm512_min_epi32(off, _cl_last);
+        __m512i shift = _mm512_slli_epi32(_mm512_sub_epi32(off, base), 3);
+        __m512i rgb = _mm512_srlv_epi32(_mm512_i32gather_epi32(base, (const int *)p.color, 1), shift);
+
+        storePoints512(out, i, _mm512_cvttps_epi32(_mm512_mul_ps(px, _conv_rate)),
+                       _mm512_cvttps_epi32(_mm512_mul_ps(py, _conv_rate)),
+                       _mm512_cvttps_epi32(_mm512_mul_ps(pz, _conv_rate)), rgb);
+    }
+
+    convertPointsScalarTo(p, simd_end, end, out);
+}
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void convertPointsAVX512(const convertParams & p, int begin, int end, short * records) {
+    convertPointsAVX512To(p, begin, end, recordLayout{records});
+}
+
+inline bool convertKernelSupported(int kernel) {
+    __builtin_cpu_init();
+    switch (kernel) {
+        case CONVERT_SCALAR: return true;
+        case CONVERT_SSE:    return __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("fma");
+        case CONVERT_AVX2:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case CONVERT_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+    return false;
+}
+
+inline convertKernel convertKernelOf(int kernel) {
+    switch (kernel) {
+        case CONVERT_SSE:    return convertPointsSSE;
+        case CONVERT_AVX2:   return convertPointsAVX2;
+        case CONVERT_AVX512: return convertPointsAVX512;
+    }
+    return convertPointsScalar;
+}
+
+// Widest kernel the CPU supports.
+inline int bestConvertKernel() {
+    int kernel = NUM_CONVERT_KERNELS - 1;
+    while (!convertKernelSupported(kernel)) kernel--;
+    return kernel;
+}
+
+// Converts num_points points into records, CONVERT_BLOCK points per OpenMP block.
+inline void convertPoints(convertKernel kernel, const convertParams & p, int num_points, short * records, int num_threads) {
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int begin = 0; begin < num_points; begin += CONVERT_BLOCK)
+        kernel(p, begin, std::min(begin + CONVERT_BLOCK, num_points), records);
+}
+
+typedef void (*soaConvertKernel)(const convertParams & p, int begin, int end, const soaPlanes & planes);
+
+inline void convertPointsSoAScalar(const convertParams & p, int begin, int end, const soaPlanes & planes) {
+    convertPointsScalarTo(p, begin, end, soaLayout{planes});
+}
+
+__attribute__((target("sse4.1,fma")))
+inline void convertPointsSoASSE(const convertParams & p, int begin, int end, const soaPlanes & planes) {
+    convertPointsSSETo(p, begin, end, soaLayout{planes});
+}
+
+__attribute__((target("avx2,fma")))
+inline void convertPointsSoAAVX2(const convertParams & p, int begin, int end, const soaPlanes & planes) {
+    convertPointsAVX2To(p, begin, end, soaLayout{planes});
+}
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void convertPointsSoAAVX512(const convertParams & p, int begin, int end, const soaPlanes & planes) {
+    convertPointsAVX512To(p, begin, end, soaLayout{planes});
+}
+
+inline soaConvertKernel soaConvertKernelOf(int kernel) {
+    switch (kernel) {
+        case CONVERT_SSE:    return convertPointsSoASSE;
+        case CONVERT_AVX2:   return convertPointsSoAAVX2;
+        case CONVERT_AVX512: return convertPointsSoAAVX512;
+    }
+    return convertPointsSoAScalar;
+}
+
+// Converts num_points points straight into the SoA planes of a FORMAT_SOA payload, the same points as
+// convertPoints. Every block starts on a multiple of CONVERT_BLOCK, which keeps the stores of the vector
+// kernels aligned.
+inline void convertPointsToSoA(int kernel, const convertParams & p, int num_points, uint8_t * payload, int num_threads) {
+    const soaConvertKernel convert = soaConvertKernelOf(kernel);
+    const soaPlanes planes = soaPlanesOf(payload, num_points);
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int begin = 0; begin < num_points; begin += CONVERT_BLOCK)
+        convert(p, begin, std::min(begin + CONVERT_BLOCK, num_points), planes);
+}
+
+/*
+ * Conversion of the points inside the capture range only (cutoff), in two passes over OpenMP blocks:
+ * every block counts its points in range, an exclusive prefix sum over the counts gives each block its
+ * first record, and the blocks then convert their points straight to it. There is no shared counter,
+ * and the records come out in raster order, the same for every number of threads.
+ *
+ * With a region of interest the points also have to lie inside it after the transform. The planes are
+ * tested on the transformed coordinates in meters, before the scaling to records.
+ */
+typedef int (*rangeCountKernel)(const convertParams & p, int begin, int end);
+
+// Writes the points of [begin, end) in range compacted to the start of records and returns their count.
+// The vector kernels store whole groups while there is room for them, records holds capacity records.
+typedef int (*rangeConvertKernel)(const convertParams & p, int begin, int end, short * records, int capacity);
+
+inline bool pointInRange(const convertParams & p, const float * v) {
+    if (!(v[2] > p.z_min && v[2] <= p.z_max && v[0] > p.x_min && v[0] <= p.x_max)) return false;
+    if (!roiActive(p.roi)) return true;
+
+    const float * m = p.tf;
+    return roiContains(*p.roi, fmaf(v[2], m[2], fmaf(v[1], m[1], fmaf(v[0], m[0], m[3]))),
+                       fmaf(v[2], m[6], fmaf(v[1], m[5], fmaf(v[0], m[4], m[7]))),
+                       fmaf(v[2], m[10], fmaf(v[1], m[9], fmaf(v[0], m[8], m[11]))));
+}
+
+inline int countInRangeScalar(const convertParams & p, int begin, int end) {
+    int count = 0;
+    for (int i = begin; i < end; i++)
+        count += pointInRange(p, p.vertices + size_t(i) * 3);
+    return count;
+}
+
+// Writes exactly the points in range, so the capacity the vector kernels need is always enough.
+inline int convertInRangeScalar(const convertParams & p, int begin, int end, short * records, int) {
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+        if (!pointInRange(p, p.vertices + size_t(i) * 3)) continue;
+        convertPointScalar(p, i, records + size_t(count) * 5);
+        count++;
+    }
+    return count;
+}
+
+// x, y and z of 8 points, points 0-3 in the low lanes and 4-7 in the high lanes (see convertPointsAVX2).
+__attribute__((target("avx2,fma")))
+inline void loadVerticesAVX2(const float * v, __m256 * vx, __m256 * vy, __m256 * vz) {
+    __m256 a0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v)), _mm_loadu_ps(v + 12), 1);
+    __m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v + 4)), _mm_loadu_ps(v + 16), 1);
+    __m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(v + 8)), _mm_loadu_ps(v + 20), 1);
+    *vx = _mm256_shuffle_ps(a0, _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+    *vy = _mm256_shuffle_ps(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(0, 0, 1, 1)),
+                            _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    *vz = _mm256_shuffle_ps(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(1, 1, 2, 2)),
+                            _mm256_shuffle_ps(a2, a2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+__attribute__((target("avx2,fma")))
+inline unsigned rangeMaskAVX2(const convertParams & p, __m256 vx, __m256 vz) {
+    __m256 in_z = _mm256_and_ps(_mm256_cmp_ps(vz, _mm256_set1_ps(p.z_min), _CMP_GT_OQ),
+                                _mm256_cmp_ps(vz, _mm256_set1_ps(p.z_max), _CMP_LE_OQ));
+    __m256 in_x = _mm256_and_ps(_mm256_cmp_ps(vx, _mm256_set1_ps(p.x_min), _CMP_GT_OQ),
+                                _mm256_cmp_ps(vx, _mm256_set1_ps(p.x_max), _CMP_LE_OQ));
+    return _mm256_movemask_ps(_mm256_and_ps(in_z, in_x));
+}
+
+// Lanes of mask whose transformed point (wx, wy, wz) lies in the region of interest.
+__attribute__((target("avx2,fma")))
+inline unsigned roiRangeMaskAVX2(const convertParams & p, unsigned mask, __m256 wx, __m256 wy, __m256 wz) {
+    return mask & _mm256_movemask_ps(roiMaskAVX2(*p.roi, wx, wy, wz));
+}
+
+__attribute__((target("avx2,fma")))
+inline int countInRangeAVX2(const convertParams & p, int begin, int end) {
+    const float * m = p.tf;
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+    const bool roi = roiActive(p.roi);
+
+    const int simd_end = begin + ((end - begin) & ~7);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 8) {
+        __m256 vx, vy, vz;
+        loadVerticesAVX2(p.vertices + size_t(i) * 3, &vx, &vy, &vz);
+        unsigned mask = rangeMaskAVX2(p, vx, vz);
+        if (roi && mask)
+            mask = roiRangeMaskAVX2(p, mask, _mm256_fmadd_ps(vz, m02, _mm256_fmadd_ps(vy, m01, _mm256_fmadd_ps(vx, m00, m03))),
+                                    _mm256_fmadd_ps(vz, m12, _mm256_fmadd_ps(vy, m11, _mm256_fmadd_ps(vx, m10, m13))),
+                                    _mm256_fmadd_ps(vz, m22, _mm256_fmadd_ps(vy, m21, _mm256_fmadd_ps(vx, m20, m23))));
+        count += __builtin_popcount(mask);
+    }
+
+    return count + countInRangeScalar(p, simd_end, end);
+}
+
+// 8 points per iteration. The points in range are left-packed with one permute per field and all 8 records
+// are interleaved and stored; only the valid ones count, the rest is overwritten by the next group.
+__attribute__((target("avx2,fma")))
+inline int convertInRangeAVX2(const convertParams & p, int begin, int end, short * records, int capacity) {
+    const float * m = p.tf;
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+
+    const __m256 _conv_rate = _mm256_set1_ps(p.conv_rate);
+    const __m256 _f5 = _mm256_set1_ps(.5f);
+    const __m256 _w = _mm256_set1_ps(float(p.w));
+    const __m256 _h = _mm256_set1_ps(float(p.h));
+    const __m256i _zero = _mm256_setzero_si256();
+    const __m256i _w_min = _mm256_set1_epi32(p.w - 1);
+    const __m256i _h_min = _mm256_set1_epi32(p.h - 1);
+    const __m256i _cl_bp = _mm256_set1_epi32(p.cl_bp);
+    const __m256i _cl_sb = _mm256_set1_epi32(p.cl_sb);
+    const __m256i _cl_last = _mm256_set1_epi32(p.cl_sb * p.h - 4);
+    const __m256i _rg = _mm256_set1_epi32(0xFFFF);
+    const __m256i _byte = _mm256_set1_epi32(0xFF);
+    const bool roi = roiActive(p.roi);
+
+    __m128i masks[5][5];
+    for (int c = 0; c < 5; c++)
+        for (int f = 0; f < 5; f++)
+            masks[c][f] = _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][f]);
+
+    const int simd_end = begin + ((end - begin) & ~7);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 8) {
+        __m256 vx, vy, vz;
+        loadVerticesAVX2(p.vertices + size_t(i) * 3, &vx, &vy, &vz);
+        unsigned mask = rangeMaskAVX2(p, vx, vz);
+        if (mask == 0) continue;
+
+        __m256 wx = _mm256_fmadd_ps(vz, m02, _mm256_fmadd_ps(vy, m01, _mm256_fmadd_ps(vx, m00, m03)));
+        __m256 wy = _mm256_fmadd_ps(vz, m12, _mm256_fmadd_ps(vy, m11, _mm256_fmadd_ps(vx, m10, m13)));
+        __m256 wz = _mm256_fmadd_ps(vz, m22, _mm256_fmadd_ps(vy, m21, _mm256_fmadd_ps(vx, m20, m23)));
+        if (roi && (mask = roiRangeMaskAVX2(p, mask, wx, wy, wz)) == 0) continue;
+
+        __m256i px = _mm256_cvttps_epi32(_mm256_mul_ps(wx, _conv_rate));
+        __m256i py = _mm256_cvttps_epi32(_mm256_mul_ps(wy, _conv_rate));
+        __m256i pz = _mm256_cvttps_epi32(_mm256_mul_ps(wz, _conv_rate));
+
+        const float * t = p.tex_coords + size_t(i) * 2;
+        __m256 t0 = _mm256_loadu_ps(t), t1 = _mm256_loadu_ps(t + 8);
+        __m256 tu = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0))), 0xD8));
+        __m256 tv = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1))), 0xD8));
+        __m256i u = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(_mm256_fmadd_ps(tu, _w, _f5)), _zero), _w_min);
+        __m256i vv = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(_mm256_fmadd_ps(tv, _h, _f5)), _zero), _h_min);
+        __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(u, _cl_bp), _mm256_mullo_epi32(vv, _cl_sb));
+        __m256i base = _mm256_min_epi32(off, _cl_last);
+        __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(off, base), 3);
+        __m256i rgb = _mm256_srlv_epi32(_mm256_i32gather_epi32((const int *)p.color, base, 1), shift);
+
+        __m256i pack = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&left_pack_table.idx[mask]));
+        px = _mm256_permutevar8x32_epi32(px, pack);
+        py = _mm256_permutevar8x32_epi32(py, pack);
+        pz = _mm256_permutevar8x32_epi32(pz, pack);
+        rgb = _mm256_permutevar8x32_epi32(rgb, pack);
+        __m256i rg = _mm256_and_si256(rgb, _rg);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(rgb, 16), _byte);
+
+        const __m128i fields[5] = {_mm_packs_epi32(_mm256_castsi256_si128(px), _mm256_extracti128_si256(px, 1)),
+                                   _mm_packs_epi32(_mm256_castsi256_si128(py), _mm256_extracti128_si256(py, 1)),
+                                   _mm_packs_epi32(_mm256_castsi256_si128(pz), _mm256_extracti128_si256(pz, 1)),
+                                   _mm_packus_epi32(_mm256_castsi256_si128(rg), _mm256_extracti128_si256(rg, 1)),
+                                   _mm_packus_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1))};
+        __m128i chunks[5];
+        for (int c = 0; c < 5; c++) {
+            chunks[c] = _mm_shuffle_epi8(fields[0], masks[c][0]);
+            for (int f = 1; f < 5; f++)
+                chunks[c] = _mm_or_si128(chunks[c], _mm_shuffle_epi8(fields[f], masks[c][f]));
+        }
+
+        const int n = __builtin_popcount(mask);
+        short * out = records + size_t(count) * 5;
+        if (count + 8 <= capacity) {
+            for (int c = 0; c < 5; c++)
+                _mm_storeu_si128((__m128i *)out + c, chunks[c]);
+        }
+        else {
+            // the records behind the last ones of the block belong to the next block
+            memcpy(out, chunks, size_t(n) * 5 * sizeof(short));
+        }
+        count += n;
+    }
+
+    return count + convertInRangeScalar(p, simd_end, end, records + size_t(count) * 5, capacity - count);
+}
+
+// x, y and z of 16 points with two-source permutes (see convertPointsAVX512).
+struct vertexPermutes512 {
+    __m512i first[3], second[3];
+};
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void initVertexPermutes512(vertexPermutes512 * perm) {
+    __attribute__((aligned(64))) int first[3][16], second[3][16];
+    for (int f = 0; f < 3; f++)
+        for (int j = 0; j < 16; j++) {
+            const int src = 3 * j + f;
+            first[f][j] = src < 32 ? src : 0;
+            second[f][j] = src < 32 ? j : 16 + src - 32;
+        }
+    for (int f = 0; f < 3; f++) {
+        perm->first[f] = _mm512_load_si512(first[f]);
+        perm->second[f] = _mm512_load_si512(second[f]);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline __mmask16 rangeMask512(const convertParams & p, __m512 vx, __m512 vz) {
+    return _mm512_cmp_ps_mask(vz, _mm512_set1_ps(p.z_min), _CMP_GT_OQ) & _mm512_cmp_ps_mask(vz, _mm512_set1_ps(p.z_max), _CMP_LE_OQ) &
+           _mm512_cmp_ps_mask(vx, _mm512_set1_ps(p.x_min), _CMP_GT_OQ) & _mm512_cmp_ps_mask(vx, _mm512_set1_ps(p.x_max), _CMP_LE_OQ);
+}
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline int countInRangeAVX512(const convertParams & p, int begin, int end) {
+    const float * m = p.tf;
+    const __m512 m00 = _mm512_set1_ps(m[0]), m01 = _mm512_set1_ps(m[1]), m02 = _mm512_set1_ps(m[2]),  m03 = _mm512_set1_ps(m[3]);
+    const __m512 m10 = _mm512_set1_ps(m[4]), m11 = _mm512_set1_ps(m[5]), m12 = _mm512_set1_ps(m[6]),  m13 = _mm512_set1_ps(m[7]);
+    const __m512 m20 = _mm512_set1_ps(m[8]), m21 = _mm512_set1_ps(m[9]), m22 = _mm512_set1_ps(m[10]), m23 = _mm512_set1_ps(m[11]);
+    const bool roi = roiActive(p.roi);
+
+    vertexPermutes512 perm;
+    initVertexPermutes512(&perm);
+
+    const int simd_end = begin + ((end - begin) & ~15);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 16) {
+        const float * v = p.vertices + size_t(i) * 3;
+        __m512 a0 = _mm512_loadu_ps(v), a1 = _mm512_loadu_ps(v + 16), a2 = _mm512_loadu_ps(v + 32);
+        __m512 vx = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[0], a1), perm.second[0], a2);
+        __m512 vz = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[2], a1), perm.second[2], a2);
+        __mmask16 mask = rangeMask512(p, vx, vz);
+        if (roi && mask) {
+            __m512 vy = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[1], a1), perm.second[1], a2);
+            mask &= roiMask512(*p.roi, _mm512_fmadd_ps(vz, m02, _mm512_fmadd_ps(vy, m01, _mm512_fmadd_ps(vx, m00, m03))),
+                               _mm512_fmadd_ps(vz, m12, _mm512_fmadd_ps(vy, m11, _mm512_fmadd_ps(vx, m10, m13))),
+                               _mm512_fmadd_ps(vz, m22, _mm512_fmadd_ps(vy, m21, _mm512_fmadd_ps(vx, m20, m23))));
+        }
+        count += __builtin_popcount(mask);
+    }
+
+    return count + countInRangeScalar(p, simd_end, end);
+}
+
+// 16 points per iteration, the points in range are packed with vpcompressd and the records are written
+// with masked stores, so capacity is not needed.
+__attribute__((target("avx512f,avx512bw,fma")))
+inline int convertInRangeAVX512(const convertParams & p, int begin, int end, short * records, int capacity) {
+    const float * m = p.tf;
+    const __m512 m00 = _mm512_set1_ps(m[0]), m01 = _mm512_set1_ps(m[1]), m02 = _mm512_set1_ps(m[2]),  m03 = _mm512_set1_ps(m[3]);
+    const __m512 m10 = _mm512_set1_ps(m[4]), m11 = _mm512_set1_ps(m[5]), m12 = _mm512_set1_ps(m[6]),  m13 = _mm512_set1_ps(m[7]);
+    const __m512 m20 = _mm512_set1_ps(m[8]), m21 = _mm512_set1_ps(m[9]), m22 = _mm512_set1_ps(m[10]), m23 = _mm512_set1_ps(m[11]);
+
+    const __m512 _conv_rate = _mm512_set1_ps(p.conv_rate);
+    const __m512 _f5 = _mm512_set1_ps(.5f);
+    const __m512 _w = _mm512_set1_ps(float(p.w));
+    const __m512 _h = _mm512_set1_ps(float(p.h));
+    const __m512i _zero = _mm512_setzero_si512();
+    const __m512i _w_min = _mm512_set1_epi32(p.w - 1);
+    const __m512i _h_min = _mm512_set1_epi32(p.h - 1);
+    const __m512i _cl_bp = _mm512_set1_epi32(p.cl_bp);
+    const __m512i _cl_sb = _mm512_set1_epi32(p.cl_sb);
+    const __m512i _cl_last = _mm512_set1_epi32(p.cl_sb * p.h - 4);
+    const __m512i _rg = _mm512_set1_epi32(0xFFFF);
+    const __m512i _byte = _mm512_set1_epi32(0xFF);
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+    const bool roi = roiActive(p.roi);
+
+    vertexPermutes512 perm;
+    initVertexPermutes512(&perm);
+
+    __m512i two[3], b_idx[3];
+    __mmask32 b_mask[3];
+    for (int c = 0; c < 3; c++) {
+        two[c] = _mm512_loadu_si512(record_permute_indices.two[c]);
+        b_idx[c] = _mm512_loadu_si512(record_permute_indices.b[c]);
+        b_mask[c] = record_permute_indices.b_mask[c];
+    }
+
+    const int simd_end = begin + ((end - begin) & ~15);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 16) {
+        const float * v = p.vertices + size_t(i) * 3;
+        __m512 a0 = _mm512_loadu_ps(v), a1 = _mm512_loadu_ps(v + 16), a2 = _mm512_loadu_ps(v + 32);
+        __m512 vx = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[0], a1), perm.second[0], a2);
+        __m512 vz = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[2], a1), perm.second[2], a2);
+        __mmask16 valid = rangeMask512(p, vx, vz);
+        if (valid == 0) continue;
+        __m512 vy = _mm512_permutex2var_ps(_mm512_permutex2var_ps(a0, perm.first[1], a1), perm.second[1], a2);
+
+        __m512 px = _mm512_fmadd_ps(vz, m02, _mm512_fmadd_ps(vy, m01, _mm512_fmadd_ps(vx, m00, m03)));
+        __m512 py = _mm512_fmadd_ps(vz, m12, _mm512_fmadd_ps(vy, m11, _mm512_fmadd_ps(vx, m10, m13)));
+        __m512 pz = _mm512_fmadd_ps(vz, m22, _mm512_fmadd_ps(vy, m21, _mm512_fmadd_ps(vx, m20, m23)));
+        if (roi && (valid &= roiMask512(*p.roi, px, py, pz)) == 0) continue;
+
+        const float * t = p.tex_coords + size_t(i) * 2;
+        __m512 t0 = _mm512_loadu_ps(t), t1 = _mm512_loadu_ps(t + 16);
+        __m512i u = _mm512_cvttps_epi32(_mm512_fmadd_ps(_mm512_permutex2var_ps(t0, even, t1), _w, _f5));
+        __m512i vv = _mm512_cvttps_epi32(_mm512_fmadd_ps(_mm512_permutex2var_ps(t0, odd, t1), _h, _f5));
+        u = _mm512_min_epi32(_mm512_max_epi32(u, _zero), _w_min);
+        vv = _mm512_min_epi32(_mm512_max_epi32(vv, _zero), _h_min);
+        __m512i off = _mm512_add_epi32(_mm512_mullo_epi32(u, _cl_bp), _mm512_mullo_epi32(vv, _cl_sb));
+
+        __m512i base = _mm512_min_epi32(off, _cl_last);
+        __m512i shift = _mm512_slli_epi32(_mm512_sub_epi32(off, base), 3);
+        __m512i rgb = _mm512_srlv_epi32(_mm512_mask_i32gather_epi32(_zero, valid, base, p.color, 1), shift);
+
+        __m256i x = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, _mm512_cvttps_epi32(_mm512_mul_ps(px, _conv_rate))));
+        __m256i y = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, _mm512_cvttps_epi32(_mm512_mul_ps(py, _conv_rate))));
+        __m256i z = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, _mm512_cvttps_epi32(_mm512_mul_ps(pz, _conv_rate))));
+        rgb = _mm512_maskz_compress_epi32(valid, rgb);
+        __m256i rg = _mm512_cvtepi32_epi16(_mm512_and_si512(rgb, _rg));
+        __m512i b = _mm512_castsi256_si512(_mm512_cvtepi32_epi16(_mm512_and_si512(_mm512_srli_epi32(rgb, 16), _byte)));
+
+        __m512i xy = _mm512_inserti64x4(_mm512_castsi256_si512(x), y, 1);
+        __m512i zc = _mm512_inserti64x4(_mm512_castsi256_si512(z), rg, 1);
+        short * out = records + size_t(count) * 5;
+        const int n = __builtin_popcount(valid);
+
+        for (int c = 0; c < 3; c++) {
+            __m512i chunk = _mm512_permutex2var_epi16(xy, two[c], zc);
+            chunk = _mm512_mask_permutexvar_epi16(chunk, b_mask[c], b_idx[c], b);
+            const int words = std::min(std::max(n * 5 - 32 * c, 0), 32);
+            _mm512_mask_storeu_epi16(out + 32 * c, __mmask32(words == 32 ? ~0u : (1u << words) - 1), chunk);
+        }
+        count += n;
+    }
+
+    return count + convertInRangeScalar(p, simd_end, end, records + size_t(count) * 5, capacity - count);
+}
+
+// There is no SSE kernel for the capture range, CONVERT_SSE runs the scalar one.
+inline rangeCountKernel rangeCountKernelOf(int kernel) {
+    switch (kernel) {
+        case CONVERT_AVX2:   return countInRangeAVX2;
+        case CONVERT_AVX512: return countInRangeAVX512;
+    }
+    return countInRangeScalar;
+}
+
+inline rangeConvertKernel rangeConvertKernelOf(int kernel) {
+    switch (kernel) {
+        case CONVERT_AVX2:   return convertInRangeAVX2;
+        case CONVERT_AVX512: return convertInRangeAVX512;
+    }
+    return convertInRangeScalar;
+}
+
+// Converts the points of num_points inside the capture range with the kernels of kernel (CONVERT_*) and
+// returns their number.
+inline int convertPointsInRange(int kernel, const convertParams & p, int num_points, short * records, int num_threads) {
+    const rangeCountKernel count_kernel = rangeCountKernelOf(kernel);
+    const rangeConvertKernel convert_kernel = rangeConvertKernelOf(kernel);
+    const int num_blocks = (num_points + CONVERT_BLOCK - 1) / CONVERT_BLOCK;
+    int * first = (int *)alloca(sizeof(int) * (num_blocks + 1));
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        #pragma omp for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            const int begin = b * CONVERT_BLOCK;
+            first[b + 1] = count_kernel(p, begin, std::min(begin + CONVERT_BLOCK, num_points));
+        }
+
+        #pragma omp single
+        {
+            first[0] = 0;
+            for (int b = 0; b < num_blocks; b++)
+                first[b + 1] += first[b];
+        }
+
+        // same static schedule, so every thread converts the blocks it just counted
+        #pragma omp for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            const int begin = b * CONVERT_BLOCK;
+            convert_kernel(p, begin, std::min(begin + CONVERT_BLOCK, num_points), records + size_t(first[b]) * 5,
+                           first[b + 1] - first[b]);
+        }
+    }
+
+    return first[num_blocks];
+}
+
+/*
+ * Fused conversion from the Z16 depth image, without rs2::pointcloud and its vertex buffer.
+ *
+ * Every pixel with a depth is deprojected with the cached unit-depth ray of depth.h, optionally culled to
+ * the capture range in camera space, transformed, quantized and packed in one pass. The transform is
+ * pre-scaled to record units, so a coordinate is fma(z, m2, fma(y, m1, fma(x, m0, m3))) truncated like
+ * cvttps and saturated, with x = ray_x * z and z = depth * depth_scale.
+ *
+ * Colors come either from a color frame aligned to depth (cl_bp bytes per pixel, no row padding) or,
+ * with a colorRegistration, from the color frame itself: the point is moved into the color camera with
+ * the depth to color extrinsics and projected with the color intrinsics, like rs2_project_point_to_pixel.
+ * With a registration step s > 1 only the center of every s x s cell is projected, at the mean depth of
+ * the cell (updateRegistrationMap), and the pixels of the cell are offset from it by the focal ratio.
+ *
+ * With a region of interest (roi.h) only the points inside it are written. Its planes are in record units
+ * (scaleRoi by conv_rate) and tested on the transformed coordinates before the truncation.
+ *
+ * Kernels write the valid pixels of [begin, end) compacted to the start of records and return their count.
+ */
+struct colorRegistration {
+    float r[9];                 // depth to color rotation, row major
+    float t[3];                 // depth to color translation, meters
+    float fx, fy;               // color intrinsics, the principal point includes the .5 of the rounding
+    float ppx, ppy;
+    int model;                  // DEPTH_MODEL_* of the color stream, the inverse model projects without distortion
+    float coeffs[5];
+    int w, h, cl_bp, cl_sb;     // color frame
+    int step;                   // 1, 2, 4 or 8 depth pixels per registration cell side
+    int shift;                  // log2(step)
+    int depth_w, cells_w, cells_h;
+    float kx, ky;               // color pixels per depth pixel
+    float * cell_ray_x;         // unit-depth rays of the cell centers
+    float * cell_ray_y;
+    float * map_u;              // projected cell centers of the current frame, color pixels + .5
+    float * map_v;
+};
+
+struct depthConvertParams {
+    const uint16_t * depth;
+    const float * ray_x;        // unit-depth rays of depthRayTable
+    const float * ray_y;
+    const uint8_t * color;      // color frame, aligned to depth unless reg is set
+    int cl_bp;
+    const colorRegistration * reg;
+    float depth_scale;
+    float m[12];                // camera transform times conv_rate, the first three rows
+    bool cull;                  // keep only z_min < z <= z_max and x_min < x <= x_max (camera space, meters)
+    float z_min, z_max, x_min, x_max;
+    const roiSet * roi;         // region after m, record units, NULL keeps every point
+};
+
+typedef int (*depthConvertKernel)(const depthConvertParams & p, int begin, int end, short * records);
+
+// Fills the parameters of the depth frame described by ext with the rays of rays (updated when the
+// intrinsics changed) and the transform ext.tf scaled by conv_rate. Culling and the region of interest start
+// disabled, colors are taken from an aligned color frame until reg is set.
+inline depthConvertParams depthConvertParamsOf(const depthExtension & ext, depthRayTable * rays, const uint16_t * depth,
+                                               const uint8_t * color, int cl_bp, float conv_rate) {
+    updateRayTable(rays, ext);
+
+    depthConvertParams p;
+    memset(&p, 0, sizeof(p));
+    p.depth = depth;
+    p.ray_x = rays->x;
+    p.ray_y = rays->y;
+    p.color = color;
+    p.cl_bp = cl_bp;
+    p.depth_scale = ext.depth_scale;
+    for (int k = 0; k < 12; k++)
+        p.m[k] = ext.tf[k] * conv_rate;
+    return p;
+}
+
+// Sets up the registration of the depth stream described by ext into a color stream. rotation is column
+// major and translation in meters, as in rs2_extrinsics. The registration has to start zeroed. Returns
+// false for a color distortion model without a projection here (f-theta, Kannala-Brandt) or a bad step.
+inline bool updateColorRegistration(colorRegistration * reg, const depthExtension & ext, const float * rotation,
+                                    const float * translation, int color_w, int color_h, float fx, float fy,
+                                    float ppx, float ppy, int model, const float * coeffs, int cl_bp, int cl_sb,
+                                    int step) {
+    if (model != DEPTH_MODEL_NONE && model != DEPTH_MODEL_INVERSE_BROWN_CONRADY &&
+        model != DEPTH_MODEL_MODIFIED_BROWN_CONRADY && model != DEPTH_MODEL_BROWN_CONRADY)
+        return false;
+    if (step != 1 && step != 2 && step != 4 && step != 8)
+        return false;
+
+    for (int row = 0; row < 3; row++)
+        for (int col = 0; col < 3; col++)
+            reg->r[row * 3 + col] = rotation[col * 3 + row];
+    memcpy(reg->t, translation, sizeof(reg->t));
+    reg->fx = fx;
+    reg->fy = fy;
+    reg->ppx = ppx + .5f;
+    reg->ppy = ppy + .5f;
+    reg->model = model;
+    memcpy(reg->coeffs, coeffs, sizeof(reg->coeffs));
+    reg->w = color_w;
+    reg->h = color_h;
+    reg->cl_bp = cl_bp;
+    reg->cl_sb = cl_sb;
+    reg->kx = fx / ext.fx;
+    reg->ky = fy / ext.fy;
+
+    // the cell rays only depend on the depth intrinsics and the step
+    const int cells_w = (ext.width + step - 1) / step, cells_h = (ext.height + step - 1) / step;
+    if (reg->cell_ray_x && reg->step == step && reg->depth_w == ext.width && reg->cells_h == cells_h)
+        return true;
+
+    free(reg->cell_ray_x);
+    free(reg->cell_ray_y);
+    free(reg->map_u);
+    free(reg->map_v);
+    reg->step = step;
+    reg->shift = __builtin_ctz(step);
+    reg->depth_w = ext.width;
+    reg->cells_w = cells_w;
+    reg->cells_h = cells_h;
+
+    const size_t bytes = sizeof(float) * size_t(cells_w) * cells_h;
+    reg->cell_ray_x = (float *)malloc(bytes);
+    reg->cell_ray_y = (float *)malloc(bytes);
+    reg->map_u = (float *)calloc(1, bytes);
+    reg->map_v = (float *)calloc(1, bytes);
+
+    const float center = (step - 1) * .5f;
+    for (int cv = 0; cv < cells_h; cv++)
+        for (int cu = 0; cu < cells_w; cu++)
+            depthRay(ext, float(cu * step) + center, float(cv * step) + center,
+                     &reg->cell_ray_x[cv * cells_w + cu], &reg->cell_ray_y[cv * cells_w + cu]);
+    return true;
+}
+
+inline void freeColorRegistration(colorRegistration * reg) {
+    free(reg->cell_ray_x);
+    free(reg->cell_ray_y);
+    free(reg->map_u);
+    free(reg->map_v);
+    memset(reg, 0, sizeof(*reg));
+}
+
+// Projects a point of the depth camera into the color frame, in color pixels + .5.
+inline void projectToColor(const colorRegistration & reg, float x, float y, float z, float * px, float * py) {
+    const float * r = reg.r;
+    const float cx = fmaf(z, r[2], fmaf(y, r[1], fmaf(x, r[0], reg.t[0])));
+    const float cy = fmaf(z, r[5], fmaf(y, r[4], fmaf(x, r[3], reg.t[1])));
+    const float cz = fmaf(z, r[8], fmaf(y, r[7], fmaf(x, r[6], reg.t[2])));
+    const float iz = 1.f / cz;
+    float nx = cx * iz, ny = cy * iz;
+
+    if (reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY || reg.model == DEPTH_MODEL_BROWN_CONRADY) {
+        // the modified model takes the tangential terms at the radially distorted point
+        const float * c = reg.coeffs;
+        const float r2 = fmaf(nx, nx, ny * ny);
+        const float f = fmaf(fmaf(fmaf(c[4], r2, c[1]), r2, c[0]), r2, 1.f);
+        const float xf = nx * f, yf = ny * f;
+        const float a = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY ? xf : nx;
+        const float b = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY ? yf : ny;
+        const float ab = a * b;
+        nx = fmaf(c[3], fmaf(a + a, a, r2), fmaf(c[2] + c[2], ab, xf));
+        ny = fmaf(c[2], fmaf(b + b, b, r2), fmaf(c[3] + c[3], ab, yf));
+    }
+
+    *px = fmaf(nx, reg.fx, reg.ppx);
+    *py = fmaf(ny, reg.fy, reg.ppy);
+}
+
+// Registers the cells of a frame for a step > 1: each cell center is projected at the mean depth of the
+// valid pixels of the cell. Cells without depth are left as they are, no pixel looks them up.
+inline void updateRegistrationMap(const depthConvertParams & p, colorRegistration * reg, int height, int num_threads) {
+    const int step = reg->step, width = reg->depth_w;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cv = 0; cv < reg->cells_h; cv++) {
+        for (int cu = 0; cu < reg->cells_w; cu++) {
+            uint32_t sum = 0, valid = 0;
+            for (int v = cv * step; v < std::min((cv + 1) * step, height); v++)
+                for (int u = cu * step; u < std::min((cu + 1) * step, width); u++) {
+                    const uint16_t d = p.depth[v * width + u];
+                    sum += d;
+                    valid += d != 0;
+                }
+            if (valid == 0) continue;
+
+            const int cell = cv * reg->cells_w + cu;
+            const float z = float(sum) / float(valid) * p.depth_scale;
+            projectToColor(*reg, reg->cell_ray_x[cell] * z, reg->cell_ray_y[cell] * z, z, &reg->map_u[cell], &reg->map_v[cell]);
+        }
+    }
+}
+
+// Color of the depth pixel i (column u, row v) at camera point x, y, z.
+inline const uint8_t * registeredColor(const depthConvertParams & p, int i, float x, float y, float z) {
+    const colorRegistration * reg = p.reg;
+    if (!reg)
+        return p.color + size_t(i) * p.cl_bp;
+
+    float px, py;
+    if (reg->step == 1) {
+        projectToColor(*reg, x, y, z, &px, &py);
+    }
+    else {
+        const int u = i % reg->depth_w, v = i / reg->depth_w;
+        const int cell = (v >> reg->shift) * reg->cells_w + (u >> reg->shift);
+        const float center = (reg->step - 1) * .5f;
+        px = fmaf(float(u & (reg->step - 1)) - center, reg->kx, reg->map_u[cell]);
+        py = fmaf(float(v & (reg->step - 1)) - center, reg->ky, reg->map_v[cell]);
+    }
+
+    const int cu = std::min(std::max(truncToInt(px), 0), reg->w - 1);
+    const int cv = std::min(std::max(truncToInt(py), 0), reg->h - 1);
+    return p.color + cu * reg->cl_bp + cv * reg->cl_sb;
+}
+
+inline int depthToRecordsScalar(const depthConvertParams & p, int begin, int end, short * records) {
+    const float * m = p.m;
+    int count = 0;
+
+    for (int i = begin; i < end; i++) {
+        if (p.depth[i] == 0) continue;
+
+        const float z = float(p.depth[i]) * p.depth_scale;
+        const float x = p.ray_x[i] * z;
+        const float y = p.ray_y[i] * z;
+        if (p.cull && !(z > p.z_min && z <= p.z_max && x > p.x_min && x <= p.x_max)) continue;
+
+        const float wx = fmaf(z, m[2], fmaf(y, m[1], fmaf(x, m[0], m[3])));
+        const float wy = fmaf(z, m[6], fmaf(y, m[5], fmaf(x, m[4], m[7])));
+        const float wz = fmaf(z, m[10], fmaf(y, m[9], fmaf(x, m[8], m[11])));
+        if (roiActive(p.roi) && !roiContains(*p.roi, wx, wy, wz)) continue;
+
+        const uint8_t * c = registeredColor(p, i, x, y, z);
+        short * record = records + size_t(count) * 5;
+        record[0] = saturateShort(truncToInt(wx));
+        record[1] = saturateShort(truncToInt(wy));
+        record[2] = saturateShort(truncToInt(wz));
+        record[3] = short(c[0] | (c[1] << 8));
+        record[4] = c[2];
+        count++;
+    }
+
+    return count;
+}
+
+// Broadcast registration constants of the AVX2 kernel.
+struct registrationAVX2 {
+    __m256 r[9], t[3], c[5], c2x2, c3x2, fx, fy, ppx, ppy, kx, ky, center, one;
+    __m256i w_min, h_min, cl_bp, cl_sb, cl_last, depth_w, step_mask, cells_w, lane;
+    bool distorted, modified;
+};
+
+__attribute__((target("avx2,fma")))
+inline void initRegistrationAVX2(const colorRegistration & reg, registrationAVX2 * v) {
+    for (int k = 0; k < 9; k++) v->r[k] = _mm256_set1_ps(reg.r[k]);
+    for (int k = 0; k < 3; k++) v->t[k] = _mm256_set1_ps(reg.t[k]);
+    for (int k = 0; k < 5; k++) v->c[k] = _mm256_set1_ps(reg.coeffs[k]);
+    v->c2x2 = _mm256_set1_ps(reg.coeffs[2] + reg.coeffs[2]);
+    v->c3x2 = _mm256_set1_ps(reg.coeffs[3] + reg.coeffs[3]);
+    v->fx = _mm256_set1_ps(reg.fx);
+    v->fy = _mm256_set1_ps(reg.fy);
+    v->ppx = _mm256_set1_ps(reg.ppx);
+    v->ppy = _mm256_set1_ps(reg.ppy);
+    v->kx = _mm256_set1_ps(reg.kx);
+    v->ky = _mm256_set1_ps(reg.ky);
+    v->center = _mm256_set1_ps((reg.step - 1) * .5f);
+    v->one = _mm256_set1_ps(1.f);
+    v->w_min = _mm256_set1_epi32(reg.w - 1);
+    v->h_min = _mm256_set1_epi32(reg.h - 1);
+    v->cl_bp = _mm256_set1_epi32(reg.cl_bp);
+    v->cl_sb = _mm256_set1_epi32(reg.cl_sb);
+    v->cl_last = _mm256_set1_epi32(reg.cl_sb * reg.h - 4);
+    v->depth_w = _mm256_set1_epi32(reg.depth_w);
+    v->step_mask = _mm256_set1_epi32(reg.step - 1);
+    v->cells_w = _mm256_set1_epi32(reg.cells_w);
+    v->lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    v->distorted = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY || reg.model == DEPTH_MODEL_BROWN_CONRADY;
+    v->modified = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY;
+}
+
+// Gathers the colors of the 8 depth pixels starting at i through the registration, see registeredColor.
+__attribute__((target("avx2,fma")))
+inline __m256i registeredColorsAVX2(const colorRegistration & reg, const registrationAVX2 & v, const uint8_t * color,
+                                    int i, __m256 x, __m256 y, __m256 z) {
+    __m256 px, py;
+
+    if (reg.step == 1) {
+        __m256 cx = _mm256_fmadd_ps(z, v.r[2], _mm256_fmadd_ps(y, v.r[1], _mm256_fmadd_ps(x, v.r[0], v.t[0])));
+        __m256 cy = _mm256_fmadd_ps(z, v.r[5], _mm256_fmadd_ps(y, v.r[4], _mm256_fmadd_ps(x, v.r[3], v.t[1])));
+        __m256 cz = _mm256_fmadd_ps(z, v.r[8], _mm256_fmadd_ps(y, v.r[7], _mm256_fmadd_ps(x, v.r[6], v.t[2])));
+        __m256 iz = _mm256_div_ps(v.one, cz);
+        __m256 nx = _mm256_mul_ps(cx, iz), ny = _mm256_mul_ps(cy, iz);
+
+        if (v.distorted) {
+            __m256 r2 = _mm256_fmadd_ps(nx, nx, _mm256_mul_ps(ny, ny));
+            __m256 f = _mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_fmadd_ps(v.c[4], r2, v.c[1]), r2, v.c[0]), r2, v.one);
+            __m256 xf = _mm256_mul_ps(nx, f), yf = _mm256_mul_ps(ny, f);
+            __m256 a = v.modified ? xf : nx, b = v.modified ? yf : ny;
+            __m256 ab = _mm256_mul_ps(a, b);
+            nx = _mm256_fmadd_ps(v.c[3], _mm256_fmadd_ps(_mm256_add_ps(a, a), a, r2), _mm256_fmadd_ps(v.c2x2, ab, xf));
+            ny = _mm256_fmadd_ps(v.c[2], _mm256_fmadd_ps(_mm256_add_ps(b, b), b, r2), _mm256_fmadd_ps(v.c3x2, ab, yf));
+        }
+
+        px = _mm256_fmadd_ps(nx, v.fx, v.ppx);
+        py = _mm256_fmadd_ps(ny, v.fy, v.ppy);
+    }
+    else {
+        // column and row of every lane, a group crosses at most one row end (the kernel needs depth_w >= 8)
+        __m256i u = _mm256_add_epi32(_mm256_set1_epi32(i % reg.depth_w), v.lane);
+        __m256i row = _mm256_set1_epi32(i / reg.depth_w);
+        __m256i wrap = _mm256_cmpgt_epi32(u, _mm256_sub_epi32(v.depth_w, _mm256_set1_epi32(1)));
+        u = _mm256_sub_epi32(u, _mm256_and_si256(wrap, v.depth_w));
+        row = _mm256_sub_epi32(row, wrap);
+
+        const __m128i shift = _mm_cvtsi32_si128(reg.shift);
+        __m256i cell = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(row, shift), v.cells_w), _mm256_srl_epi32(u, shift));
+        __m256 du = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(u, v.step_mask)), v.center);
+        __m256 dv = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(row, v.step_mask)), v.center);
+        px = _mm256_fmadd_ps(du, v.kx, _mm256_i32gather_ps(reg.map_u, cell, 4));
+        py = _mm256_fmadd_ps(dv, v.ky, _mm256_i32gather_ps(reg.map_v, cell, 4));
+    }
+
+    __m256i cu = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(px), _mm256_setzero_si256()), v.w_min);
+    __m256i cv = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(py), _mm256_setzero_si256()), v.h_min);
+    __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(cu, v.cl_bp), _mm256_mullo_epi32(cv, v.cl_sb));
+
+    // gather 4 bytes per pixel, moving the load back for the very last pixel so it stays in bounds
+    __m256i base = _mm256_min_epi32(off, v.cl_last);
+    __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(off, base), 3);
+    return _mm256_srlv_epi32(_mm256_i32gather_epi32((const int *)color, base, 1), shift);
+}
+
+// 8 pixels per iteration. The valid lanes are left-packed with one permute per field, then all 8 records
+// are interleaved and stored; only the valid ones count, the rest is overwritten by the next group.
+__attribute__((target("avx2,fma")))
+inline int depthToRecordsAVX2(const depthConvertParams & p, int begin, int end, short * records) {
+    // the lane to column mapping of the registration cells needs at least a group per row
+    if (p.reg && p.reg->step > 1 && p.reg->depth_w < 8)
+        return depthToRecordsScalar(p, begin, end, records);
+
+    const float * m = p.m;
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+
+    const __m256 scale = _mm256_set1_ps(p.depth_scale);
+    const __m256 z_min = _mm256_set1_ps(p.z_min), z_max = _mm256_set1_ps(p.z_max);
+    const __m256 x_min = _mm256_set1_ps(p.x_min), x_max = _mm256_set1_ps(p.x_max);
+    const __m256i color_idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(p.cl_bp));
+    const __m256i _rg = _mm256_set1_epi32(0xFFFF);
+    const __m256i _byte = _mm256_set1_epi32(0xFF);
+
+    registrationAVX2 reg = {};
+    if (p.reg) initRegistrationAVX2(*p.reg, &reg);
+
+    __m128i masks[5][5];
+    for (int c = 0; c < 5; c++)
+        for (int f = 0; f < 5; f++)
+            masks[c][f] = _mm_load_si128((const __m128i *)record_shuffle_masks.m[c][f]);
+
+    // the 4 byte color gather of the last pixel could read past the frame, leave the last group to the tail
+    const int simd_end = begin + std::max((end - begin - 1) & ~7, 0);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 8) {
+        __m256i d = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(p.depth + i)));
+        __m256 valid = _mm256_castsi256_ps(_mm256_xor_si256(_mm256_cmpeq_epi32(d, _mm256_setzero_si256()), _mm256_set1_epi32(-1)));
+
+        __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(d), scale);
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(p.ray_x + i), z);
+        __m256 y = _mm256_mul_ps(_mm256_loadu_ps(p.ray_y + i), z);
+
+        if (p.cull) {
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(z, z_min, _CMP_GT_OQ), _mm256_cmp_ps(z, z_max, _CMP_LE_OQ)));
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(x, x_min, _CMP_GT_OQ), _mm256_cmp_ps(x, x_max, _CMP_LE_OQ)));
+        }
+
+        __m256 wx = _mm256_fmadd_ps(z, m02, _mm256_fmadd_ps(y, m01, _mm256_fmadd_ps(x, m00, m03)));
+        __m256 wy = _mm256_fmadd_ps(z, m12, _mm256_fmadd_ps(y, m11, _mm256_fmadd_ps(x, m10, m13)));
+        __m256 wz = _mm256_fmadd_ps(z, m22, _mm256_fmadd_ps(y, m21, _mm256_fmadd_ps(x, m20, m23)));
+        if (roiActive(p.roi)) valid = _mm256_and_ps(valid, roiMaskAVX2(*p.roi, wx, wy, wz));
+
+        const unsigned mask = _mm256_movemask_ps(valid);
+        if (mask == 0) continue;
+
+        __m256i px = _mm256_cvttps_epi32(wx);
+        __m256i py = _mm256_cvttps_epi32(wy);
+        __m256i pz = _mm256_cvttps_epi32(wz);
+        __m256i rgb = p.reg ? registeredColorsAVX2(*p.reg, reg, p.color, i, x, y, z)
+                            : _mm256_i32gather_epi32((const int *)(p.color + size_t(i) * p.cl_bp), color_idx, 1);
+
+        __m256i pack = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&left_pack_table.idx[mask]));
+        px = _mm256_permutevar8x32_epi32(px, pack);
+        py = _mm256_permutevar8x32_epi32(py, pack);
+        pz = _mm256_permutevar8x32_epi32(pz, pack);
+        rgb = _mm256_permutevar8x32_epi32(rgb, pack);
+        __m256i rg = _mm256_and_si256(rgb, _rg);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(rgb, 16), _byte);
+
+        const __m128i fields[5] = {_mm_packs_epi32(_mm256_castsi256_si128(px), _mm256_extracti128_si256(px, 1)),
+                                   _mm_packs_epi32(_mm256_castsi256_si128(py), _mm256_extracti128_si256(py, 1)),
+                                   _mm_packs_epi32(_mm256_castsi256_si128(pz), _mm256_extracti128_si256(pz, 1)),
+                                   _mm_packus_epi32(_mm256_castsi256_si128(rg), _mm256_extracti128_si256(rg, 1)),
+                                   _mm_packus_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1))};
+        __m128i * out = (__m128i *)(records + size_t(count) * 5);
+
+        for (int c = 0; c < 5; c++) {
+            __m128i chunk = _mm_shuffle_epi8(fields[0], masks[c][0]);
+            for (int f = 1; f < 5; f++)
+                chunk = _mm_or_si128(chunk, _mm_shuffle_epi8(fields[f], masks[c][f]));
+            _mm_storeu_si128(out + c, chunk);
+        }
+        count += __builtin_popcount(mask);
+    }
+
+    return count + depthToRecordsScalar(p, simd_end, end, records + size_t(count) * 5);
+}
+
+// Broadcast registration constants of the AVX-512 kernel.
+struct registration512 {
+    __m512 r[9], t[3], c[5], c2x2, c3x2, fx, fy, ppx, ppy, kx, ky, center, one;
+    __m512i w_min, h_min, cl_bp, cl_sb, cl_last, depth_w, step_mask, cells_w, lane;
+    bool distorted, modified;
+};
+
+__attribute__((target("avx512f,avx512bw,fma")))
+inline void initRegistration512(const colorRegistration & reg, registration512 * v) {
+    for (int k = 0; k < 9; k++) v->r[k] = _mm512_set1_ps(reg.r[k]);
+    for (int k = 0; k < 3; k++) v->t[k] = _mm512_set1_ps(reg.t[k]);
+    for (int k = 0; k < 5; k++) v->c[k] = _mm512_set1_ps(reg.coeffs[k]);
+    v->c2x2 = _mm512_set1_ps(reg.coeffs[2] + reg.coeffs[2]);
+    v->c3x2 = _mm512_set1_ps(reg.coeffs[3] + reg.coeffs[3]);
+    v->fx = _mm512_set1_ps(reg.fx);
+    v->fy = _mm512_set1_ps(reg.fy);
+    v->ppx = _mm512_set1_ps(reg.ppx);
+    v->ppy = _mm512_set1_ps(reg.ppy);
+    v->kx = _mm512_set1_ps(reg.kx);
+    v->ky = _mm512_set1_ps(reg.ky);
+    v->center = _mm512_set1_ps((reg.step - 1) * .5f);
+    v->one = _mm512_set1_ps(1.f);
+    v->w_min = _mm512_set1_epi32(reg.w - 1);
+    v->h_min = _mm512_set1_epi32(reg.h - 1);
+    v->cl_bp = _mm512_set1_epi32(reg.cl_bp);
+    v->cl_sb = _mm512_set1_epi32(reg.cl_sb);
+    v->cl_last = _mm512_set1_epi32(reg.cl_sb * reg.h - 4);
+    v->depth_w = _mm512_set1_epi32(reg.depth_w);
+    v->step_mask = _mm512_set1_epi32(reg.step - 1);
+    v->cells_w = _mm512_set1_epi32(reg.cells_w);
+    v->lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    v->distorted = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY || reg.model == DEPTH_MODEL_BROWN_CONRADY;
+    v->modified = reg.model == DEPTH_MODEL_MODIFIED_BROWN_CONRADY;
+}
+
+// Gathers the colors of the valid lanes of the 16 depth pixels starting at i through the registration.
+__attribute__((target("avx512f,avx512bw,fma")))
+inline __m512i registeredColors512(const colorRegistration & reg, const registration512 & v, const uint8_t * color,
+                                   int i, __mmask16 valid, __m512 x, __m512 y, __m512 z) {
+    __m512 px, py;
+
+    if (reg.step == 1) {
+        __m512 cx = _mm512_fmadd_ps(z, v.r[2], _mm512_fmadd_ps(y, v.r[1], _mm512_fmadd_ps(x, v.r[0], v.t[0])));
+        __m512 cy = _mm512_fmadd_ps(z, v.r[5], _mm512_fmadd_ps(y, v.r[4], _mm512_fmadd_ps(x, v.r[3], v.t[1])));
+        __m512 cz = _mm512_fmadd_ps(z, v.r[8], _mm512_fmadd_ps(y, v.r[7], _mm512_fmadd_ps(x, v.r[6], v.t[2])));
+        __m512 iz = _mm512_div_ps(v.one, cz);
+        __m512 nx = _mm512_mul_ps(cx, iz), ny = _mm512_mul_ps(cy, iz);
+
+        if (v.distorted) {
+            __m512 r2 = _mm512_fmadd_ps(nx, nx, _mm512_mul_ps(ny, ny));
+            __m512 f = _mm512_fmadd_ps(_mm512_fmadd_ps(_mm512_fmadd_ps(v.c[4], r2, v.c[1]), r2, v.c[0]), r2, v.one);
+            __m512 xf = _mm512_mul_ps(nx, f), yf = _mm512_mul_ps(ny, f);
+            __m512 a = v.modified ? xf : nx, b = v.modified ? yf : ny;
+            __m512 ab = _mm512_mul_ps(a, b);
+            nx = _mm512_fmadd_ps(v.c[3], _mm512_fmadd_ps(_mm512_add_ps(a, a), a, r2), _mm512_fmadd_ps(v.c2x2, ab, xf));
+            ny = _mm512_fmadd_ps(v.c[2], _mm512_fmadd_ps(_mm512_add_ps(b, b), b, r2), _mm512_fmadd_ps(v.c3x2, ab, yf));
+        }
+
+        px = _mm512_fmadd_ps(nx, v.fx, v.ppx);
+        py = _mm512_fmadd_ps(ny, v.fy, v.ppy);
+    }
+    else {
+        // column and row of every lane, a group crosses at most one row end (the kernel needs depth_w >= 16)
+        __m512i u = _mm512_add_epi32(_mm512_set1_epi32(i % reg.depth_w), v.lane);
+        __m512i row = _mm512_set1_epi32(i / reg.depth_w);
+        __mmask16 wrap = _mm512_cmpge_epi32_mask(u, v.depth_w);
+        u = _mm512_mask_sub_epi32(u, wrap, u, v.depth_w);
+        row = _mm512_mask_add_epi32(row, wrap, row, _mm512_set1_epi32(1));
+
+        const __m128i shift = _mm_cvtsi32_si128(reg.shift);
+        __m512i cell = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_srl_epi32(row, shift), v.cells_w), _mm512_srl_epi32(u, shift));
+        __m512 du = _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_and_si512(u, v.step_mask)), v.center);
+        __m512 dv = _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_and_si512(row, v.step_mask)), v.center);
+        // cells without depth were never registered, only gather for the valid lanes
+        px = _mm512_fmadd_ps(du, v.kx, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, cell, reg.map_u, 4));
+        py = _mm512_fmadd_ps(dv, v.ky, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, cell, reg.map_v, 4));
+    }
+
+    __m512i cu = _mm512_min_epi32(_mm512_max_epi32(_mm512_cvttps_epi32(px), _mm512_setzero_si512()), v.w_min);
+    __m512i cv = _mm512_min_epi32(_mm512_max_epi32(_mm512_cvttps_epi32(py), _mm512_setzero_si512()), v.h_min);
+    __m512i off = _mm512_add_epi32(_mm512_mullo_epi32(cu, v.cl_bp), _mm512_mullo_epi32(cv, v.cl_sb));
+
+    __m512i base = _mm512_min_epi32(off, v.cl_last);
+    __m512i shift = _mm512_slli_epi32(_mm512_sub_epi32(off, base), 3);
+    return _mm512_srlv_epi32(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, base, color, 1), shift);
+}
+
+// 16 pixels per iteration, the valid lanes are packed with vpcompressd before the records are interleaved.
+__attribute__((target("avx512f,avx512bw,fma")))
+inline int depthToRecordsAVX512(const depthConvertParams & p, int begin, int end, short * records) {
+    if (p.reg && p.reg->step > 1 && p.reg->depth_w < 16)
+        return depthToRecordsScalar(p, begin, end, records);
+
+    const float * m = p.m;
+    const __m512 m00 = _mm512_set1_ps(m[0]), m01 = _mm512_set1_ps(m[1]), m02 = _mm512_set1_ps(m[2]),  m03 = _mm512_set1_ps(m[3]);
+    const __m512 m10 = _mm512_set1_ps(m[4]), m11 = _mm512_set1_ps(m[5]), m12 = _mm512_set1_ps(m[6]),  m13 = _mm512_set1_ps(m[7]);
+    const __m512 m20 = _mm512_set1_ps(m[8]), m21 = _mm512_set1_ps(m[9]), m22 = _mm512_set1_ps(m[10]), m23 = _mm512_set1_ps(m[11]);
+
+    const __m512 scale = _mm512_set1_ps(p.depth_scale);
+    const __m512 z_min = _mm512_set1_ps(p.z_min), z_max = _mm512_set1_ps(p.z_max);
+    const __m512 x_min = _mm512_set1_ps(p.x_min), x_max = _mm512_set1_ps(p.x_max);
+    const __m512i color_idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                                 _mm512_set1_epi32(p.cl_bp));
+    const __m512i _rg = _mm512_set1_epi32(0xFFFF);
+    const __m512i _byte = _mm512_set1_epi32(0xFF);
+
+    registration512 reg = {};
+    if (p.reg) initRegistration512(*p.reg, &reg);
+
+    __m512i two[3], b_idx[3];
+    __mmask32 b_mask[3];
+    for (int c = 0; c < 3; c++) {
+        two[c] = _mm512_loadu_si512(record_permute_indices.two[c]);
+        b_idx[c] = _mm512_loadu_si512(record_permute_indices.b[c]);
+        b_mask[c] = record_permute_indices.b_mask[c];
+    }
+
+    const int simd_end = begin + std::max((end - begin - 1) & ~15, 0);
+    int count = 0;
+
+    for (int i = begin; i < simd_end; i += 16) {
+        __m512i d = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(p.depth + i)));
+        __mmask16 valid = _mm512_test_epi32_mask(d, d);
+
+        __m512 z = _mm512_mul_ps(_mm512_cvtepi32_ps(d), scale);
+        __m512 x = _mm512_mul_ps(_mm512_loadu_ps(p.ray_x + i), z);
+        __m512 y = _mm512_mul_ps(_mm512_loadu_ps(p.ray_y + i), z);
+
+        if (p.cull) {
+            valid &= _mm512_cmp_ps_mask(z, z_min, _CMP_GT_OQ) & _mm512_cmp_ps_mask(z, z_max, _CMP_LE_OQ);
+            valid &= _mm512_cmp_ps_mask(x, x_min, _CMP_GT_OQ) & _mm512_cmp_ps_mask(x, x_max, _CMP_LE_OQ);
+        }
+        if (valid == 0) continue;
+
+        __m512 wx = _mm512_fmadd_ps(z, m02, _mm512_fmadd_ps(y, m01, _mm512_fmadd_ps(x, m00, m03)));
+        __m512 wy = _mm512_fmadd_ps(z, m12, _mm512_fmadd_ps(y, m11, _mm512_fmadd_ps(x, m10, m13)));
+        __m512 wz = _mm512_fmadd_ps(z, m22, _mm512_fmadd_ps(y, m21, _mm512_fmadd_ps(x, m20, m23)));
+        if (roiActive(p.roi) && (valid &= roiMask512(*p.roi, wx, wy, wz)) == 0) continue;
+
+        __m512i px = _mm512_cvttps_epi32(wx);
+        __m512i py = _mm512_cvttps_epi32(wy);
+        __m512i pz = _mm512_cvttps_epi32(wz);
+        __m512i rgb = p.reg ? registeredColors512(*p.reg, reg, p.color, i, valid, x, y, z)
+                            : _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), valid, color_idx, p.color + size_t(i) * p.cl_bp, 1);
+
+        __m256i cx = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, px));
+        __m256i cy = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, py));
+        __m256i cz = _mm512_cvtsepi32_epi16(_mm512_maskz_compress_epi32(valid, pz));
+        rgb = _mm512_maskz_compress_epi32(valid, rgb);
+        __m256i rg = _mm512_cvtepi32_epi16(_mm512_and_si512(rgb, _rg));
+        __m512i b = _mm512_castsi256_si512(_mm512_cvtepi32_epi16(_mm512_and_si512(_mm512_srli_epi32(rgb, 16), _byte)));
+
+        __m512i xy = _mm512_inserti64x4(_mm512_castsi256_si512(cx), cy, 1);
+        __m512i zc = _mm512_inserti64x4(_mm512_castsi256_si512(cz), rg, 1);
+        short * out = records + size_t(count) * 5;
+
+        for (int c = 0; c < 3; c++) {
+            __m512i chunk = _mm512_permutex2var_epi16(xy, two[c], zc);
+            chunk = _mm512_mask_permutexvar_epi16(chunk, b_mask[c], b_idx[c], b);
+            if (c < 2) _mm512_storeu_si512(out + 32 * c, chunk);
+            else _mm256_storeu_si256((__m256i *)(out + 64), _mm512_castsi512_si256(chunk));
+        }
+        count += __builtin_popcount(valid);
+    }
+
+    return count + depthToRecordsScalar(p, simd_end, end, records + size_t(count) * 5);
+}
+
+// There is no SSE depth kernel, CONVERT_SSE runs the scalar one.
+inline depthConvertKernel depthConvertKernelOf(int kernel) {
+    switch (kernel) {
+        case CONVERT_AVX2:   return depthToRecordsAVX2;
+        case CONVERT_AVX512: return depthToRecordsAVX512;
+    }
+    return depthToRecordsScalar;
+}
+
+// Converts the num_pixels pixels of a depth frame into records and returns the number of points. Every
+// OpenMP block packs its points at the start of its own range of records, the gaps are closed afterwards,
+// so the points stay in raster order whatever the number of threads.
+inline int convertDepth(depthConvertKernel kernel, const depthConvertParams & p, int num_pixels, short * records,
+                        int num_threads) {
+    const int num_blocks = (num_pixels + CONVERT_BLOCK - 1) / CONVERT_BLOCK;
+    int * counts = (int *)alloca(sizeof(int) * std::max(num_blocks, 1));
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int b = 0; b < num_blocks; b++) {
+        const int begin = b * CONVERT_BLOCK;
+        counts[b] = kernel(p, begin, std::min(begin + CONVERT_BLOCK, num_pixels), records + size_t(begin) * 5);
+    }
+
+    int count = 0;
+    for (int b = 0; b < num_blocks; b++) {
+        if (count != b * CONVERT_BLOCK)
+            memmove(records + size_t(count) * 5, records + size_t(b) * CONVERT_BLOCK * 5, size_t(counts[b]) * 5 * sizeof(short));
+        count += counts[b];
+    }
+    return count;
+}
+
+#endif
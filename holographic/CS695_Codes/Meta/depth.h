@@ -0,0 +1,342 @@
+#ifndef META_DEPTH_H
+#define META_DEPTH_H
+
+/*
+ * Depth domain point layout (FORMAT_DEPTH16 in Meta/frame.h).
+ *
+ * Instead of deprojected points the camera sends its Z16 depth image and the
+ * receiver reconstructs XYZ. The header extension (depthExtension) carries
+ * the depth intrinsics, the depth unit and the camera transform tf of the
+ * server, the payload holds
+ *
+ *   width * height uint16 depth values in raster order
+ *   num_points * 3 bytes r, g, b for every pixel with a non-zero depth
+ *
+ * Pixels without depth carry no color and produce no point, so a frame costs
+ * 2 bytes per pixel plus 3 per valid pixel instead of 10 per pixel.
+ *
+ * Rays follow rs2_deproject_pixel_to_point for the distortion models of the
+ * RealSense depth streams. depthRayTable caches the unit-depth ray of every
+ * pixel, decodeDepth then needs one multiply per coordinate for the
+ * deprojection and fuses the camera and stitcher transforms into one matrix.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <immintrin.h>
+#include <omp.h>
+
+#include "quantize.h"
+
+// rs2_distortion values used by the depth streams
+#define DEPTH_MODEL_NONE                    0
+#define DEPTH_MODEL_MODIFIED_BROWN_CONRADY  1
+#define DEPTH_MODEL_INVERSE_BROWN_CONRADY   2
+#define DEPTH_MODEL_BROWN_CONRADY           4
+
+struct depthExtension {
+    uint16_t width;
+    uint16_t height;
+    int32_t  model;             // rs2_distortion of the depth stream
+    float    fx, fy;
+    float    ppx, ppy;
+    float    coeffs[5];
+    float    depth_scale;       // meters per Z16 unit
+    float    tf[16];            // camera to world transform of the server, row major
+};
+
+static_assert(sizeof(depthExtension) == 112, "depthExtension must stay 112 bytes on the wire");
+
+inline size_t depthPlaneBytes(const depthExtension & ext) {
+    return size_t(ext.width) * ext.height * sizeof(uint16_t);
+}
+
+inline size_t depthPayloadBytes(const depthExtension & ext, int num_points) {
+    return depthPlaneBytes(ext) + size_t(num_points) * 3;
+}
+
+// Ray of pixel (u, v) at unit depth, as rs2_deproject_pixel_to_point computes it.
+inline void depthRay(const depthExtension & ext, float u, float v, float * rx, float * ry) {
+    const float * c = ext.coeffs;
+    float x = (u - ext.ppx) / ext.fx;
+    float y = (v - ext.ppy) / ext.fy;
+
+    if (ext.model == DEPTH_MODEL_INVERSE_BROWN_CONRADY) {
+        float r2 = x * x + y * y;
+        float f = 1 + c[0] * r2 + c[1] * r2 * r2 + c[4] * r2 * r2 * r2;
+        float ux = x * f + 2 * c[2] * x * y + c[3] * (r2 + 2 * x * x);
+        float uy = y * f + 2 * c[3] * x * y + c[2] * (r2 + 2 * y * y);
+        x = ux;
+        y = uy;
+    }
+    else if (ext.model == DEPTH_MODEL_BROWN_CONRADY) {
+        // no closed form, iterate the forward model like librealsense does
+        const float xo = x, yo = y;
+        for (int i = 0; i < 10; i++) {
+            float r2 = x * x + y * y;
+            float icdist = 1 / (1 + ((c[4] * r2 + c[1]) * r2 + c[0]) * r2);
+            float xq = x / icdist;
+            float yq = y / icdist;
+            float delta_x = 2 * c[2] * xq * yq + c[3] * (r2 + 2 * xq * xq);
+            float delta_y = 2 * c[3] * xq * yq + c[2] * (r2 + 2 * yq * yq);
+            x = (xo - delta_x) * icdist;
+            y = (yo - delta_y) * icdist;
+        }
+    }
+
+    *rx = x;
+    *ry = y;
+}
+
+// Unit-depth rays of every pixel, rebuilt only when the intrinsics change.
+struct depthRayTable {
+    depthExtension intrinsics;
+    float * x;
+    float * y;
+};
+
+// Makes the table match the intrinsics of ext. The table has to start zeroed.
+inline void updateRayTable(depthRayTable * rays, const depthExtension & ext) {
+    // everything up to depth_scale describes the pixel rays
+    const size_t key_bytes = offsetof(depthExtension, depth_scale);
+    if (rays->x && memcmp(&rays->intrinsics, &ext, key_bytes) == 0)
+        return;
+
+    const int n = ext.width * ext.height;
+    const size_t bytes = (size_t(n) * sizeof(float) + 63) & ~size_t(63);
+    free(rays->x);
+    free(rays->y);
+    rays->x = (float *)aligned_alloc(64, bytes);
+    rays->y = (float *)aligned_alloc(64, bytes);
+    rays->intrinsics = ext;
+
+    for (int v = 0; v < ext.height; v++)
+        for (int u = 0; u < ext.width; u++)
+            depthRay(ext, float(u), float(v), &rays->x[v * ext.width + u], &rays->y[v * ext.width + u]);
+}
+
+inline void freeRayTable(depthRayTable * rays) {
+    free(rays->x);
+    free(rays->y);
+    rays->x = NULL;
+    rays->y = NULL;
+}
+
+// Writes the depth plane and the colors of the valid pixels into payload. tcrd holds one (u, v) texture
+// coordinate per pixel into the color frame, NULL when the color frame is aligned to depth. Returns the payload
+// size, *num_points receives the valid pixels.
+inline size_t packDepth(const uint16_t * depth, int width, int height, const float * tcrd,
+                        const uint8_t * color, int color_w, int color_h, int color_bpp, int color_stride,
+                        uint8_t * payload, int * num_points) {
+    const int n = width * height;
+    memcpy(payload, depth, size_t(n) * sizeof(uint16_t));
+
+    uint8_t * rgb = payload + size_t(n) * sizeof(uint16_t);
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (depth[i] == 0) continue;
+
+        int u = i % width, v = i / width;
+        if (tcrd) {
+            u = std::min(std::max(int(tcrd[i * 2] * color_w + .5f), 0), color_w - 1);
+            v = std::min(std::max(int(tcrd[i * 2 + 1] * color_h + .5f), 0), color_h - 1);
+        }
+        const uint8_t * c = color + u * color_bpp + v * color_stride;
+        rgb[count * 3 + 0] = c[0];
+        rgb[count * 3 + 1] = c[1];
+        rgb[count * 3 + 2] = c[2];
+        count++;
+    }
+
+    *num_points = count;
+    return size_t(n) * sizeof(uint16_t) + size_t(count) * 3;
+}
+
+// Row major a * b of two 4x4 matrices.
+inline void multiplyTransform(const float * a, const float * b, float * out) {
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            out[r * 4 + c] = a[r * 4] * b[c] + a[r * 4 + 1] * b[4 + c] + a[r * 4 + 2] * b[8 + c] + a[r * 4 + 3] * b[12 + c];
+}
+
+// Emits the valid pixels of [begin, end) from point number count on, transformed by the row-major m with
+// the FMA order of the vector kernel. Returns the points emitted so far, or -1 past num_points.
+template <typename Emit>
+inline int decodeDepthPointsScalar(const float * m, float depth_scale, const uint16_t * depth, const uint8_t * rgb,
+                                   const depthRayTable & rays, int begin, int end, int count, int num_points,
+                                   Emit & emit) {
+    for (int i = begin; i < end; i++) {
+        if (depth[i] == 0) continue;
+        if (count == num_points) return -1;
+
+        const float z = depth[i] * depth_scale;
+        const float x = rays.x[i] * z, y = rays.y[i] * z;
+        emit(count, fmaf(m[0], x, fmaf(m[1], y, fmaf(m[2], z, m[3]))),
+             fmaf(m[4], x, fmaf(m[5], y, fmaf(m[6], z, m[7]))),
+             fmaf(m[8], x, fmaf(m[9], y, fmaf(m[10], z, m[11]))), rgb + count * 3);
+        count++;
+    }
+    return count;
+}
+
+// Same for 8 pixels per iteration over [begin, end), a multiple of 8 long: the depth is scaled, multiplied
+// with the cached rays and transformed with FMAs, the valid lanes are then emitted.
+template <typename Emit>
+__attribute__((target("avx2,fma")))
+inline int decodeDepthPointsAVX2(const float * m, float depth_scale, const uint16_t * depth, const uint8_t * rgb,
+                                 const depthRayTable & rays, int begin, int end, int count, int num_points,
+                                 Emit & emit) {
+    const __m256 scale = _mm256_set1_ps(depth_scale);
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+
+    for (int i = begin; i < end; i += 8) {
+        __m256i d = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(depth + i)));
+        unsigned valid = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(d, _mm256_setzero_si256()))) & 0xFF;
+        if (valid == 0) continue;
+        if (count + __builtin_popcount(valid) > num_points) return -1;
+
+        __attribute__((aligned(32))) float px[8], py[8], pz[8];
+        __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(d), scale);
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(rays.x + i), z);
+        __m256 y = _mm256_mul_ps(_mm256_loadu_ps(rays.y + i), z);
+
+        _mm256_store_ps(px, _mm256_fmadd_ps(m00, x, _mm256_fmadd_ps(m01, y, _mm256_fmadd_ps(m02, z, m03))));
+        _mm256_store_ps(py, _mm256_fmadd_ps(m10, x, _mm256_fmadd_ps(m11, y, _mm256_fmadd_ps(m12, z, m13))));
+        _mm256_store_ps(pz, _mm256_fmadd_ps(m20, x, _mm256_fmadd_ps(m21, y, _mm256_fmadd_ps(m22, z, m23))));
+
+        for (; valid; valid &= valid - 1) {
+            const int k = __builtin_ctz(valid);
+            emit(count, px[k], py[k], pz[k], rgb + count * 3);
+            count++;
+        }
+    }
+    return count;
+}
+
+// Reconstructs the valid pixels of a depth frame transformed by tf * ext.tf (tf row major, NULL for
+// identity), in raster order, handing point i to emit(i, x, y, z, rgb). The AVX2 kernel runs when the CPU
+// has it, the scalar one takes the tail. Returns the number of points, or -1 when the depth plane does not
+// match num_points.
+template <typename Emit>
+int decodeDepthPoints(const depthExtension & ext, const uint8_t * payload, int num_points, depthRayTable * rays,
+                      const float * tf, Emit emit) {
+    float m[16];
+    if (tf)
+        multiplyTransform(tf, ext.tf, m);
+    else
+        memcpy(m, ext.tf, sizeof(m));
+
+    updateRayTable(rays, ext);
+
+    const uint16_t * depth = (const uint16_t *)payload;
+    const uint8_t * rgb = payload + depthPlaneBytes(ext);
+    const int n = ext.width * ext.height;
+
+    int count = 0, i = 0;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        i = n & ~7;
+        count = decodeDepthPointsAVX2(m, ext.depth_scale, depth, rgb, *rays, 0, i, 0, num_points, emit);
+        if (count < 0) return -1;
+    }
+    count = decodeDepthPointsScalar(m, ext.depth_scale, depth, rgb, *rays, i, n, count, num_points, emit);
+
+    return count == num_points ? count : -1;
+}
+
+// decodeDepthPoints into points with x, y, z, r, g, b members.
+template <typename PointT>
+int decodeDepth(const depthExtension & ext, const uint8_t * payload, int num_points, depthRayTable * rays,
+                const float * tf, PointT * points) {
+    return decodeDepthPoints(ext, payload, num_points, rays, tf,
+                             [points](int i, float x, float y, float z, const uint8_t * rgb) {
+                                 PointT & p = points[i];
+                                 p.x = x;
+                                 p.y = y;
+                                 p.z = z;
+                                 p.r = rgb[0];
+                                 p.g = rgb[1];
+                                 p.b = rgb[2];
+                             });
+}
+
+// Reconstructs a depth frame straight into records in 1 / conv_rate meters after ext.tf, saturated like the
+// kernels (quantizeCoordinate). rays is the cached table of the camera. Returns the number of points, or -1
+// when the payload is inconsistent.
+inline int unpackDepth(const depthExtension & ext, const uint8_t * payload, int num_points, float conv_rate,
+                       depthRayTable * rays, short * records) {
+    return decodeDepthPoints(ext, payload, num_points, rays, NULL,
+                             [records, conv_rate](int i, float x, float y, float z, const uint8_t * rgb) {
+                                 short * p = records + size_t(i) * 5;
+                                 p[0] = quantizeCoordinate(x, 0, conv_rate);
+                                 p[1] = quantizeCoordinate(y, 0, conv_rate);
+                                 p[2] = quantizeCoordinate(z, 0, conv_rate);
+                                 p[3] = short(rgb[0] | (rgb[1] << 8));
+                                 p[4] = rgb[2];
+                             });
+}
+
+inline void cullDepthROIScalar(const roiSet & roi, const depthRayTable & rays, const float * tf, float depth_scale,
+                               const uint16_t * depth, uint16_t * out, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        const float z = float(depth[i]) * depth_scale;
+        const float x = rays.x[i] * z, y = rays.y[i] * z;
+        const float wx = fmaf(tf[0], x, fmaf(tf[1], y, fmaf(tf[2], z, tf[3])));
+        const float wy = fmaf(tf[4], x, fmaf(tf[5], y, fmaf(tf[6], z, tf[7])));
+        const float wz = fmaf(tf[8], x, fmaf(tf[9], y, fmaf(tf[10], z, tf[11])));
+        out[i] = roiContains(roi, wx, wy, wz) ? depth[i] : 0;
+    }
+}
+
+// Culls the pixels of [begin, end) 8 at a time, returns where the scalar tail starts.
+__attribute__((target("avx2,fma")))
+inline int cullDepthROIAVX2(const roiSet & roi, const depthRayTable & rays, const float * tf, float depth_scale,
+                             const uint16_t * depth, uint16_t * out, int begin, int end) {
+    const __m256 scale = _mm256_set1_ps(depth_scale);
+    const __m256 m00 = _mm256_set1_ps(tf[0]), m01 = _mm256_set1_ps(tf[1]), m02 = _mm256_set1_ps(tf[2]),  m03 = _mm256_set1_ps(tf[3]);
+    const __m256 m10 = _mm256_set1_ps(tf[4]), m11 = _mm256_set1_ps(tf[5]), m12 = _mm256_set1_ps(tf[6]),  m13 = _mm256_set1_ps(tf[7]);
+    const __m256 m20 = _mm256_set1_ps(tf[8]), m21 = _mm256_set1_ps(tf[9]), m22 = _mm256_set1_ps(tf[10]), m23 = _mm256_set1_ps(tf[11]);
+    const int simd_end = begin + ((end - begin) & ~7);
+
+    for (int i = begin; i < simd_end; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(depth + i));
+        __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(d)), scale);
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(rays.x + i), z);
+        __m256 y = _mm256_mul_ps(_mm256_loadu_ps(rays.y + i), z);
+
+        __m256 wx = _mm256_fmadd_ps(m00, x, _mm256_fmadd_ps(m01, y, _mm256_fmadd_ps(m02, z, m03)));
+        __m256 wy = _mm256_fmadd_ps(m10, x, _mm256_fmadd_ps(m11, y, _mm256_fmadd_ps(m12, z, m13)));
+        __m256 wz = _mm256_fmadd_ps(m20, x, _mm256_fmadd_ps(m21, y, _mm256_fmadd_ps(m22, z, m23)));
+
+        // 8 x 32 bit lane mask -> 8 x 16 bit
+        __m256i inside = _mm256_castps_si256(roiMaskAVX2(roi, wx, wy, wz));
+        __m128i keep = _mm_packs_epi32(_mm256_castsi256_si128(inside), _mm256_extracti128_si256(inside, 1));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(d, keep));
+    }
+    return simd_end;
+}
+
+// Zeroes the depth of the pixels whose point lies outside the region, so a depth image only carries the
+// stage. tf is the row-major camera transform and roi in meters after it.
+inline void cullDepthROI(const roiSet & roi, const depthExtension & ext, depthRayTable * rays, const uint16_t * depth,
+                         uint16_t * out, int num_threads) {
+    updateRayTable(rays, ext);
+    const int num_pixels = ext.width * ext.height;
+    const int block = 10240;
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int begin = 0; begin < num_pixels; begin += block) {
+        const int end = std::min(begin + block, num_pixels);
+        const int tail = avx2 ? cullDepthROIAVX2(roi, *rays, ext.tf, ext.depth_scale, depth, out, begin, end) : begin;
+        cullDepthROIScalar(roi, *rays, ext.tf, ext.depth_scale, depth, out, tail, end);
+    }
+}
+
+#endif
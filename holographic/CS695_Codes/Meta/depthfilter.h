@@ -0,0 +1,326 @@
+#ifndef META_DEPTHFILTER_H
+#define META_DEPTHFILTER_H
+
+/*
+ * Flying-pixel and outlier removal on the Z16 depth image, before it is deprojected.
+ *
+ * At depth discontinuities the camera mixes foreground and background into pixels that float
+ * between the two surfaces, and the stereo matcher leaves speckles of wrong depth. Both are cheaper
+ * to find in the image, where the neighbours of a pixel are the pixels around it, than in the point
+ * cloud. filterDepth zeroes the depth of these pixels in place, so they produce no point in any of
+ * the conversion paths. Two passes, each of them optional:
+ *
+ *   1. flying pixels: a pixel is dropped when its depth jumps to both neighbours along one of the
+ *      four directions through it (horizontal, vertical and the diagonals). The jump threshold is
+ *      jump_ratio of the depth of the pixel and at least DEPTH_FILTER_MIN_JUMP. A pixel at the edge
+ *      of a real surface has a continuous neighbour on one side and stays, a missing neighbour
+ *      (no depth or outside of the image) never counts as a jump.
+ *   2. outliers, the image-space analogue of pcl::StatisticalOutlierRemoval: the mean relative depth
+ *      deviation of every pixel to the valid pixels of its 3x3 neighbourhood, in 1/65536, and the mean
+ *      and standard deviation of it over the frame. Pixels above mean + std_mul * stddev are dropped,
+ *      and so are pixels without a valid neighbour.
+ *
+ * The deviations are integers and their sums are exact, so the AVX2 kernels (16 pixels per step)
+ * drop exactly the pixels of the scalar ones for any number of threads.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#include <omp.h>
+
+#define DEPTH_FILTER_MIN_JUMP   0.01f       // meters, the jump threshold of close pixels
+#define DEPTH_DEVIATION_MAX     65535       // deviation of a pixel without a valid neighbour
+
+struct depthFilter {
+    bool flying;                // pass 1
+    uint16_t jump_ratio;        // jump threshold as a fraction of the depth, times 65536
+    bool outliers;              // pass 2
+    float std_mul;
+    bool avx2;                  // run the AVX2 kernels, the caller checks the CPU
+    int max_pixels;
+    uint16_t * edges;           // depth after pass 1
+    uint16_t * deviation;       // mean relative deviation of every pixel, times 65536
+};
+
+// Pixels of one filterDepth call.
+struct depthFilterStats {
+    long valid;                 // with depth before the filter
+    long flying;                // dropped by pass 1
+    long outliers;              // dropped by pass 2
+};
+
+// jump_percent <= 0 disables the flying-pixel pass and std_mul < 0 the outlier pass.
+inline void initDepthFilter(depthFilter * f, float jump_percent, float std_mul, bool avx2) {
+    memset(f, 0, sizeof(depthFilter));
+    f->flying = jump_percent > 0;
+    f->jump_ratio = uint16_t(std::min(jump_percent / 100 * 65536, 65535.f));
+    f->outliers = std_mul >= 0;
+    f->std_mul = std_mul;
+    f->avx2 = avx2;
+}
+
+inline void freeDepthFilter(depthFilter * f) {
+    free(f->edges);
+    free(f->deviation);
+    f->edges = f->deviation = NULL;
+    f->max_pixels = 0;
+}
+
+inline bool depthFilterActive(const depthFilter * f) {
+    return f->flying || f->outliers;
+}
+
+// Neighbours (du, dv) of the four directions through a pixel, one on each side.
+static const int depth_directions[4][4] = {{-1, 0, 1, 0}, {0, -1, 0, 1}, {-1, -1, 1, 1}, {1, -1, -1, 1}};
+
+inline bool depthJump(const uint16_t * in, int width, int height, int u, int v, int d, int threshold) {
+    if (u < 0 || v < 0 || u >= width || v >= height) return false;
+    const int n = in[v * width + u];
+    return n != 0 && abs(d - n) > threshold;
+}
+
+// Pass 1 over the pixels [begin, end) of row v of in, into out.
+inline void flyingRowScalar(const uint16_t * in, int width, int height, int v, int begin, int end, uint16_t jump_ratio,
+                            uint16_t min_jump, uint16_t * out, long * valid, long * flying) {
+    for (int u = begin; u < end; u++) {
+        const int d = in[v * width + u];
+        out[v * width + u] = uint16_t(d);
+        if (!d) continue;
+        (*valid)++;
+
+        const int threshold = std::max(int((uint32_t(d) * jump_ratio) >> 16), int(min_jump));
+        for (const int * n : depth_directions) {
+            if (depthJump(in, width, height, u + n[0], v + n[1], d, threshold) &&
+                depthJump(in, width, height, u + n[2], v + n[3], d, threshold)) {
+                out[v * width + u] = 0;
+                (*flying)++;
+                break;
+            }
+        }
+    }
+}
+
+// Deviation of pixel (u, v) of in, 0 without depth.
+inline uint16_t pixelDeviation(const uint16_t * in, int width, int height, int u, int v) {
+    const int d = in[v * width + u];
+    if (!d) return 0;
+
+    int sum = 0, count = 0;
+    for (int dv = -1; dv <= 1; dv++) {
+        for (int du = -1; du <= 1; du++) {
+            if ((!du && !dv) || u + du < 0 || v + dv < 0 || u + du >= width || v + dv >= height) continue;
+            const int n = in[(v + dv) * width + u + du];
+            if (!n) continue;
+            sum += abs(d - n);
+            count++;
+        }
+    }
+    if (!count) return DEPTH_DEVIATION_MAX;
+
+    const float q = float(sum) / float(count * d) * 65536.f;
+    return q < 65535.f ? uint16_t(q) : DEPTH_DEVIATION_MAX;
+}
+
+// Pass 2 over the pixels [begin, end) of row v, with the sums of the deviations for the statistics.
+inline void deviationRowScalar(const uint16_t * in, int width, int height, int v, int begin, int end, uint16_t * out,
+                               long * valid, int64_t * sum, int64_t * sum_sq) {
+    for (int u = begin; u < end; u++) {
+        const int m = pixelDeviation(in, width, height, u, v);
+        out[v * width + u] = uint16_t(m);
+        *valid += in[v * width + u] != 0;
+        *sum += m;
+        *sum_sq += int64_t(m) * m;
+    }
+}
+
+__attribute__((target("avx2")))
+inline int popcount16(__m256i mask) {
+    return __builtin_popcount(_mm256_movemask_epi8(mask)) / 2;
+}
+
+// Neighbour n of d that does not jump: without depth, or within the threshold t.
+__attribute__((target("avx2")))
+inline __m256i noJumpAVX2(__m256i d, __m256i n, __m256i t) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i diff = _mm256_or_si256(_mm256_subs_epu16(d, n), _mm256_subs_epu16(n, d));
+    return _mm256_or_si256(_mm256_cmpeq_epi16(n, zero), _mm256_cmpeq_epi16(_mm256_subs_epu16(diff, t), zero));
+}
+
+// Pass 1 of an inner row (0 < v < height - 1), 16 pixels per step and the border columns scalar.
+__attribute__((target("avx2")))
+inline void flyingRowAVX2(const uint16_t * in, int width, int height, int v, uint16_t jump_ratio, uint16_t min_jump,
+                          uint16_t * out, long * valid, long * flying) {
+    const uint16_t * up = in + (v - 1) * width;
+    const uint16_t * row = in + v * width;
+    const uint16_t * down = in + (v + 1) * width;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ratio = _mm256_set1_epi16(short(jump_ratio));
+    const __m256i least = _mm256_set1_epi16(short(min_jump));
+
+    int u = 1;
+    for (; u + 17 <= width; u += 16) {
+        const __m256i d = _mm256_loadu_si256((const __m256i *)(row + u));
+        const __m256i t = _mm256_max_epu16(_mm256_mulhi_epu16(d, ratio), least);
+
+        #define LOAD_NEIGHBOUR(r, du) _mm256_loadu_si256((const __m256i *)((r) + u + (du)))
+        __m256i keep = _mm256_or_si256(noJumpAVX2(d, LOAD_NEIGHBOUR(row, -1), t), noJumpAVX2(d, LOAD_NEIGHBOUR(row, 1), t));
+        keep = _mm256_and_si256(keep, _mm256_or_si256(noJumpAVX2(d, LOAD_NEIGHBOUR(up, 0), t),
+                                                      noJumpAVX2(d, LOAD_NEIGHBOUR(down, 0), t)));
+        keep = _mm256_and_si256(keep, _mm256_or_si256(noJumpAVX2(d, LOAD_NEIGHBOUR(up, -1), t),
+                                                      noJumpAVX2(d, LOAD_NEIGHBOUR(down, 1), t)));
+        keep = _mm256_and_si256(keep, _mm256_or_si256(noJumpAVX2(d, LOAD_NEIGHBOUR(up, 1), t),
+                                                      noJumpAVX2(d, LOAD_NEIGHBOUR(down, -1), t)));
+        #undef LOAD_NEIGHBOUR
+
+        const __m256i has_depth = _mm256_xor_si256(_mm256_cmpeq_epi16(d, zero), _mm256_set1_epi8(-1));
+        _mm256_storeu_si256((__m256i *)(out + v * width + u), _mm256_and_si256(d, keep));
+        *valid += popcount16(has_depth);
+        *flying += popcount16(_mm256_andnot_si256(keep, has_depth));
+    }
+
+    flyingRowScalar(in, width, height, v, 0, 1, jump_ratio, min_jump, out, valid, flying);
+    flyingRowScalar(in, width, height, v, u, width, jump_ratio, min_jump, out, valid, flying);
+}
+
+// Pass 2 of an inner row. The absolute differences are summed in 32 bits and divided in float like
+// pixelDeviation, so the deviations are the same.
+__attribute__((target("avx2")))
+inline void deviationRowAVX2(const uint16_t * in, int width, int height, int v, uint16_t * out, long * valid,
+                             int64_t * sum, int64_t * sum_sq) {
+    const uint16_t * up = in + (v - 1) * width;
+    const uint16_t * row = in + v * width;
+    const uint16_t * down = in + (v + 1) * width;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low32 = _mm256_set1_epi64x(0xFFFFFFFF);
+    const __m256 scale = _mm256_set1_ps(65536.f);
+    const __m256 most = _mm256_set1_ps(65535.f);
+    __m256i sums = zero, squares = zero;
+
+    int u = 1;
+    for (; u + 17 <= width; u += 16) {
+        const __m256i d = _mm256_loadu_si256((const __m256i *)(row + u));
+        __m256i sum_lo = zero, sum_hi = zero, count = zero;
+
+        const uint16_t * rows[3] = {up, row, down};
+        for (int r = 0; r < 3; r++) {
+            for (int du = -1; du <= 1; du++) {
+                if (r == 1 && !du) continue;
+                const __m256i n = _mm256_loadu_si256((const __m256i *)(rows[r] + u + du));
+                const __m256i missing = _mm256_cmpeq_epi16(n, zero);
+                const __m256i diff = _mm256_andnot_si256(missing, _mm256_or_si256(_mm256_subs_epu16(d, n),
+                                                                                  _mm256_subs_epu16(n, d)));
+                sum_lo = _mm256_add_epi32(sum_lo, _mm256_unpacklo_epi16(diff, zero));
+                sum_hi = _mm256_add_epi32(sum_hi, _mm256_unpackhi_epi16(diff, zero));
+                count = _mm256_sub_epi16(count, _mm256_xor_si256(missing, _mm256_set1_epi8(-1)));
+            }
+        }
+
+        // mean of the lanes of pixels 0-3, 8-11 and 4-7, 12-15, in the order packus puts back
+        const __m256i no_depth = _mm256_cmpeq_epi16(d, zero);
+        __m256i m[2];
+        for (int h = 0; h < 2; h++) {
+            const __m256i d32 = h ? _mm256_unpackhi_epi16(d, zero) : _mm256_unpacklo_epi16(d, zero);
+            const __m256i count32 = h ? _mm256_unpackhi_epi16(count, zero) : _mm256_unpacklo_epi16(count, zero);
+            const __m256 q = _mm256_mul_ps(_mm256_div_ps(_mm256_cvtepi32_ps(h ? sum_hi : sum_lo),
+                                                         _mm256_cvtepi32_ps(_mm256_mullo_epi32(count32, d32))), scale);
+            // min_ps returns its second operand for the NaN of a pixel without neighbours
+            m[h] = _mm256_andnot_si256(_mm256_cmpeq_epi32(d32, zero), _mm256_cvttps_epi32(_mm256_min_ps(q, most)));
+
+            sums = _mm256_add_epi64(sums, _mm256_add_epi64(_mm256_and_si256(m[h], low32), _mm256_srli_epi64(m[h], 32)));
+            squares = _mm256_add_epi64(squares, _mm256_mul_epu32(m[h], m[h]));
+            squares = _mm256_add_epi64(squares, _mm256_mul_epu32(_mm256_srli_epi64(m[h], 32), _mm256_srli_epi64(m[h], 32)));
+        }
+        _mm256_storeu_si256((__m256i *)(out + v * width + u), _mm256_packus_epi32(m[0], m[1]));
+        *valid += 16 - popcount16(no_depth);
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, sums);
+    *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, squares);
+    *sum_sq += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    deviationRowScalar(in, width, height, v, 0, 1, out, valid, sum, sum_sq);
+    deviationRowScalar(in, width, height, v, u, width, out, valid, sum, sum_sq);
+}
+
+// Runs the enabled passes over the width x height image and zeroes the dropped pixels of depth in place.
+// depth_scale is the depth unit in meters.
+inline depthFilterStats filterDepth(depthFilter * f, uint16_t * depth, int width, int height, float depth_scale,
+                                    int num_threads) {
+    depthFilterStats stats = {0, 0, 0};
+    const int num_pixels = width * height;
+    if (!depthFilterActive(f) || num_pixels <= 0)
+        return stats;
+
+    if (num_pixels > f->max_pixels) {
+        freeDepthFilter(f);
+        f->edges = (uint16_t *)malloc(sizeof(uint16_t) * num_pixels);
+        f->deviation = (uint16_t *)malloc(sizeof(uint16_t) * num_pixels);
+        f->max_pixels = num_pixels;
+    }
+
+    // The passes read the image before them, pass 1 writes to edges and the last pass back to depth.
+    const uint16_t * in = depth;
+    if (f->flying) {
+        const uint16_t min_jump = uint16_t(std::min(DEPTH_FILTER_MIN_JUMP / depth_scale, 65535.f));
+        long valid = 0, flying = 0;
+
+        #pragma omp parallel for schedule(static) num_threads(num_threads) reduction(+:valid, flying)
+        for (int v = 0; v < height; v++) {
+            if (f->avx2 && v > 0 && v < height - 1)
+                flyingRowAVX2(depth, width, height, v, f->jump_ratio, min_jump, f->edges, &valid, &flying);
+            else
+                flyingRowScalar(depth, width, height, v, 0, width, f->jump_ratio, min_jump, f->edges, &valid, &flying);
+        }
+
+        stats.valid = valid;
+        stats.flying = flying;
+        in = f->edges;
+    }
+
+    if (!f->outliers) {
+        memcpy(depth, in, sizeof(uint16_t) * num_pixels);
+        return stats;
+    }
+
+    long valid = 0;
+    int64_t sum = 0, sum_sq = 0;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads) reduction(+:valid, sum, sum_sq)
+    for (int v = 0; v < height; v++) {
+        if (f->avx2 && v > 0 && v < height - 1)
+            deviationRowAVX2(in, width, height, v, f->deviation, &valid, &sum, &sum_sq);
+        else
+            deviationRowScalar(in, width, height, v, 0, width, f->deviation, &valid, &sum, &sum_sq);
+    }
+
+    if (!f->flying)
+        stats.valid = valid;
+    if (!valid)
+        return stats;
+
+    // Pixels without depth have a deviation of 0, which is never above the threshold.
+    const double mean = double(sum) / valid;
+    const double stddev = sqrt(std::max(double(sum_sq) / valid - mean * mean, 0.0));
+    const double limit = mean + f->std_mul * stddev;
+    const uint16_t threshold = uint16_t(std::min(floor(limit), double(DEPTH_DEVIATION_MAX)));
+    long outliers = 0;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads) reduction(+:outliers)
+    for (int i = 0; i < num_pixels; i++) {
+        const bool drop = f->deviation[i] > threshold;
+        outliers += drop;
+        depth[i] = drop ? 0 : in[i];
+    }
+
+    stats.outliers = outliers;
+    return stats;
+}
+
+#endif
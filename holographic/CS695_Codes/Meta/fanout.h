@@ -0,0 +1,586 @@
+#ifndef META_FANOUT_H
+#define META_FANOUT_H
+
+/*
+ * Fan-out of one camera stream to any number of subscribers.
+ *
+ * The hub runs an epoll loop over the listen socket, an eventfd that wakes it
+ * and every subscriber connection, all of them non-blocking. The producer
+ * encodes a frame once for every wire mode in use into a sharedFrame and
+ * publishes it; the hub hands a reference to each subscriber with a credit
+ * left and gives the frame back to its owner when the last reference is
+ * released. Subscribers never cause a copy or a second encode of a frame.
+ *
+ * Subscribers are isolated from each other. Each one has its own wire mode,
+ * credits, request parser and a bounded queue of frames it has not started
+ * yet. When the queue is full the oldest queued frame is dropped and its
+ * credit refunded (or, with drop_newest, the new frame is skipped), so a slow
+ * subscriber only ever loses its own frames. A subscriber that makes no
+ * progress on a frame for STALL_MS is disconnected so it cannot pin frames.
+ *
+ * With zero copy a sent frame stays pinned until the peer has consumed it, so
+ * a subscriber only starts a new frame while fewer than MAX_ZC_PENDING of its
+ * frames wait for completion. That keeps a slow reader from holding the slot
+ * pool, at the cost of less pipelining on that connection.
+ *
+ * Requests are the ones of a single consumer (REQUEST_FORMAT, REQUEST_CREDIT,
+ * REQUEST_PULL), parsed incrementally as the bytes arrive. A subscriber is
+ * unframed (wire mode 0) until it sends REQUEST_FORMAT, after that its wire
+ * mode is format + 1.
+ *
+ * FORMAT_DELTA subscribers also acknowledge keyframes (REQUEST_KEY_ACK). Once
+ * every one of them has acknowledged the newest published keyframe the hub
+ * reports it in key_acked, and a subscriber switching to FORMAT_DELTA raises
+ * key_request so that the producer starts a new keyframe.
+ *
+ * Any subscriber can replace the region of interest of the stream
+ * (REQUEST_ROI). The newest one waits in the hub until the producer picks it
+ * up with takeRoi before its next frame.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+#include "frame.h"
+#include "net.h"
+#include "pipeline.h"
+
+#define NUM_WIRE_MODES      (NUM_FORMATS + 1)
+#define MAX_SUB_QUEUE       8
+#define MAX_ZC_PENDING      2           // sent frames per subscriber the kernel may still read
+#define STALL_MS            2000
+#define REQUEST_BYTES       (1 + ROI_MAX_BYTES)     // the longest request
+#define MAX_EVENTS          64
+
+// One encoded frame shared by every subscriber it is sent to.
+struct sharedFrame {
+    unsigned modes;                             // bit m is set when the frame is encoded for wire mode m
+    struct iovec iov[NUM_WIRE_MODES][2];
+    int iovcnt[NUM_WIRE_MODES];
+    void * owner;                               // producer data the frame belongs to
+    uint64_t seq;                               // publish order, set by the hub
+    bool keyframe;                              // FORMAT_DELTA encoding is a keyframe
+    uint64_t key_number;                        // frame number of its keyframe
+    int refs;                                   // only touched by the hub thread
+};
+
+struct subscriber {
+    int sock;                                   // -1 once closed, freed at the end of the poll round
+    frameSender sender;
+    int mode;
+    long credits;
+    uint64_t last_seq;                          // newest frame handed to this subscriber
+    bool has_key_ack;
+    uint64_t key_ack;                           // newest FORMAT_DELTA keyframe acknowledged
+
+    sharedFrame * queue[MAX_SUB_QUEUE];         // frames not started yet
+    int head, count;
+
+    sharedFrame * current;                      // frame being sent and what is left of it
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    sharedFrame * zc_frames[MAX_ZC_PENDING];    // sent frames the kernel may still read (zero copy)
+    uint32_t zc_marks[MAX_ZC_PENDING];
+    int zc_head, zc_count;
+
+    uint8_t request[REQUEST_BYTES];
+    int request_len;
+
+    bool want_out;                              // EPOLLOUT armed
+    std::chrono::steady_clock::time_point last_progress;
+    long sent, dropped;                         // since the last report
+};
+
+struct fanoutHub {
+    int epfd;
+    int listen_sock;
+    int wake_fd;
+    int queue_depth;
+    bool drop_newest;
+    bool zerocopy;
+    void (*release)(sharedFrame *);             // hands a frame back to the producer
+    stageStats * send_stats;
+
+    std::atomic<unsigned> modes_in_use;         // wire modes the producer has to encode for
+    std::atomic<bool> running;
+    std::atomic<uint64_t> key_acked;            // newest keyframe every FORMAT_DELTA subscriber has, UINT64_MAX for none
+    std::atomic<bool> key_request;              // a FORMAT_DELTA subscriber needs a keyframe
+    std::mutex roi_mutex;
+    roiSet roi;                                 // newest REQUEST_ROI, guarded by roi_mutex
+    std::atomic<bool> roi_changed;
+    frameRing<sharedFrame *> published;
+
+    sharedFrame * latest;
+    uint64_t next_seq;
+    bool has_last_key;
+    uint64_t last_key;                          // newest published FORMAT_DELTA keyframe
+    long published_frames;                      // since the last report
+    std::vector<subscriber *> subs;
+};
+
+inline void releaseFrame(fanoutHub * hub, sharedFrame * frame) {
+    if (--frame->refs == 0)
+        hub->release(frame);
+}
+
+inline void updateModes(fanoutHub * hub) {
+    unsigned modes = 0;
+    for (subscriber * sub : hub->subs)
+        if (sub->sock >= 0)
+            modes |= 1u << sub->mode;
+    hub->modes_in_use = modes;
+}
+
+// Reports the newest keyframe in key_acked once every FORMAT_DELTA subscriber has acknowledged it.
+inline void updateKeyAck(fanoutHub * hub) {
+    if (!hub->has_last_key) return;
+
+    for (subscriber * sub : hub->subs)
+        if (sub->sock >= 0 && sub->mode == FORMAT_DELTA + 1 && (!sub->has_key_ack || sub->key_ack != hub->last_key))
+            return;
+    hub->key_acked = hub->last_key;
+}
+
+// Closes the connection and drops every frame reference it holds. The subscriber is freed by pollFanoutHub.
+inline void closeSubscriber(fanoutHub * hub, subscriber * sub, const char * reason) {
+    if (sub->sock < 0) return;
+
+    std::cout << reason << ": " << sub->sock << std::endl;
+    epoll_ctl(hub->epfd, EPOLL_CTL_DEL, sub->sock, NULL);
+    close(sub->sock);
+    sub->sock = -1;
+
+    if (sub->current)
+        releaseFrame(hub, sub->current);
+    for (int i = 0; i < sub->count; i++)
+        releaseFrame(hub, sub->queue[(sub->head + i) % MAX_SUB_QUEUE]);
+    for (int i = 0; i < sub->zc_count; i++)
+        releaseFrame(hub, sub->zc_frames[(sub->zc_head + i) % MAX_ZC_PENDING]);
+    sub->current = NULL;
+    sub->count = 0;
+    sub->zc_count = 0;
+
+    updateModes(hub);
+}
+
+// Releases the frames whose zero copy sends the kernel has completed.
+inline void reapSubscriber(fanoutHub * hub, subscriber * sub) {
+    if (!sub->sender.zerocopy) return;
+
+    reapZeroCopy(&sub->sender);
+    while (sub->zc_count && int32_t(sub->sender.zc_done - sub->zc_marks[sub->zc_head]) >= 0) {
+        releaseFrame(hub, sub->zc_frames[sub->zc_head]);
+        sub->zc_head = (sub->zc_head + 1) % MAX_ZC_PENDING;
+        sub->zc_count--;
+    }
+}
+
+inline void armOutput(fanoutHub * hub, subscriber * sub, bool want) {
+    if (sub->sock < 0 || want == sub->want_out) return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.ptr = sub;
+    epoll_ctl(hub->epfd, EPOLL_CTL_MOD, sub->sock, &ev);
+    sub->want_out = want;
+}
+
+// Sends as much of the queued frames as the socket takes without blocking.
+inline void flushSubscriber(fanoutHub * hub, subscriber * sub) {
+    stageTime start = std::chrono::high_resolution_clock::now();
+    long finished = 0;
+
+    reapSubscriber(hub, sub);
+
+    while (sub->sock >= 0) {
+        if (!sub->current) {
+            if (sub->count == 0 || sub->zc_count == MAX_ZC_PENDING)
+                break;
+
+            sharedFrame * frame = sub->queue[sub->head];
+            sub->head = (sub->head + 1) % MAX_SUB_QUEUE;
+            sub->count--;
+
+            sub->current = frame;
+            memcpy(sub->iov, frame->iov[sub->mode], sizeof(sub->iov));
+            memset(&sub->msg, 0, sizeof(sub->msg));
+            sub->msg.msg_iov = sub->iov;
+            sub->msg.msg_iovlen = frame->iovcnt[sub->mode];
+            sub->last_progress = std::chrono::steady_clock::now();
+        }
+
+        ssize_t sent = sendIovNow(&sub->sender, &sub->msg);
+        if (sent < 0) {
+            closeSubscriber(hub, sub, "Subscriber disconnected");
+            break;
+        }
+        if (sent == 0)
+            break;
+
+        sub->last_progress = std::chrono::steady_clock::now();
+        if (sub->msg.msg_iovlen > 0)
+            continue;
+
+        // The whole frame is out, with zero copy the kernel may still be reading it.
+        if (sub->sender.zerocopy) {
+            int tail = (sub->zc_head + sub->zc_count) % MAX_ZC_PENDING;
+            sub->zc_frames[tail] = sub->current;
+            sub->zc_marks[tail] = sub->sender.zc_calls;
+            sub->zc_count++;
+        }
+        else {
+            releaseFrame(hub, sub->current);
+        }
+        sub->current = NULL;
+        sub->sent++;
+        finished++;
+    }
+
+    armOutput(hub, sub, sub->current || (sub->count > 0 && sub->zc_count < MAX_ZC_PENDING));
+    if (finished)
+        addStageTime(hub->send_stats, start, std::chrono::high_resolution_clock::now(), finished);
+}
+
+// Queues frame for sub if it has a credit and the frame is encoded in its wire mode.
+inline void queueFrame(fanoutHub * hub, subscriber * sub, sharedFrame * frame) {
+    if (sub->sock < 0 || sub->credits <= 0 || frame->seq <= sub->last_seq || !(frame->modes & (1u << sub->mode)))
+        return;
+
+    if (sub->count == hub->queue_depth) {
+        sub->dropped++;
+        if (hub->drop_newest)
+            return;
+
+        releaseFrame(hub, sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % MAX_SUB_QUEUE;
+        sub->count--;
+        sub->credits++;
+    }
+
+    sub->queue[(sub->head + sub->count) % MAX_SUB_QUEUE] = frame;
+    sub->count++;
+    sub->credits--;
+    sub->last_seq = frame->seq;
+    frame->refs++;
+
+    flushSubscriber(hub, sub);
+}
+
+// Reads and applies every complete request the subscriber has sent.
+inline void readRequests(fanoutHub * hub, subscriber * sub) {
+    while (sub->sock >= 0) {
+        ssize_t received = recv(sub->sock, sub->request + sub->request_len, REQUEST_BYTES - sub->request_len, MSG_DONTWAIT);
+        if (received == 0) {
+            closeSubscriber(hub, sub, "Subscriber disconnected");
+            return;
+        }
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            closeSubscriber(hub, sub, "Subscriber disconnected");
+            return;
+        }
+        sub->request_len += received;
+
+        int pos = 0;
+        while (pos < sub->request_len) {
+            const uint8_t * request = sub->request + pos;
+            const int left = sub->request_len - pos;
+
+            if (request[0] == REQUEST_PULL) {
+                sub->credits++;
+                pos += 1;
+            }
+            else if (request[0] == REQUEST_CREDIT) {
+                if (left < 5) break;
+                uint32_t grant;
+                memcpy(&grant, request + 1, sizeof(grant));
+                sub->credits += grant;
+                pos += 5;
+            }
+            else if (request[0] == REQUEST_FORMAT) {
+                if (left < 2) break;
+                // the camera frames give every record format, depth and delta frames, octrees are built by the stitcher
+                if (!recordFormat(request[1]) && request[1] != FORMAT_DEPTH16 && request[1] != FORMAT_DELTA) {
+                    closeSubscriber(hub, sub, "Faulty format request");
+                    return;
+                }
+                // queued frames may not be encoded for the new mode, they are dropped and their credits refunded
+                for (int i = 0; i < sub->count; i++)
+                    releaseFrame(hub, sub->queue[(sub->head + i) % MAX_SUB_QUEUE]);
+                sub->credits += sub->count;
+                sub->count = 0;
+
+                sub->mode = request[1] + 1;
+                sub->has_key_ack = false;
+                if (request[1] == FORMAT_DELTA)
+                    hub->key_request = true;
+                updateModes(hub);
+                std::cout << "Wire format of " << sub->sock << ": " << int(request[1]) << std::endl;
+                pos += 2;
+            }
+            else if (request[0] == REQUEST_KEY_ACK) {
+                if (left < 9) break;
+                memcpy(&sub->key_ack, request + 1, sizeof(uint64_t));
+                sub->has_key_ack = true;
+                updateKeyAck(hub);
+                pos += 9;
+            }
+            else if (request[0] == REQUEST_ROI) {
+                roiSet roi;
+                const int used = readRoi(request + 1, left - 1, &roi);
+                if (used == 0) break;
+                if (used < 0) {
+                    closeSubscriber(hub, sub, "Faulty region of interest");
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(hub->roi_mutex);
+                    hub->roi = roi;
+                }
+                hub->roi_changed = true;
+                std::cout << "Region of interest of " << sub->sock << ": " << roi.num_volumes << " volumes" << std::endl;
+                pos += 1 + used;
+            }
+            else {
+                closeSubscriber(hub, sub, "Faulty pull request");
+                return;
+            }
+        }
+
+        memmove(sub->request, sub->request + pos, sub->request_len - pos);
+        sub->request_len -= pos;
+    }
+
+    // A subscriber that was waiting for credits gets the newest frame right away.
+    if (hub->latest)
+        queueFrame(hub, sub, hub->latest);
+}
+
+inline void acceptSubscribers(fanoutHub * hub) {
+    while (true) {
+        int sock = accept4(hub->listen_sock, NULL, NULL, SOCK_NONBLOCK);
+        if (sock < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                std::cerr << "Accept failed: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        subscriber * sub = new subscriber();
+        sub->sock = sock;
+        initFrameSender(&sub->sender, sock, hub->zerocopy);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = sub;
+        if (epoll_ctl(hub->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            std::cerr << "epoll_ctl failed: " << strerror(errno) << std::endl;
+            close(sock);
+            delete sub;
+            continue;
+        }
+
+        hub->subs.push_back(sub);
+        updateModes(hub);
+        std::cout << "Established connection with subscriber: " << sock << " (" << hub->subs.size() << " connected)" << std::endl;
+    }
+}
+
+// Takes the frames published since the last round and offers them to every subscriber.
+inline void drainPublished(fanoutHub * hub) {
+    uint64_t value;
+    while (read(hub->wake_fd, &value, sizeof(value)) < 0 && errno == EINTR) {}
+
+    sharedFrame * frame;
+    while (tryPopRing(&hub->published, &frame)) {
+        frame->seq = ++hub->next_seq;
+        frame->refs = 1;                        // held by the hub as the latest frame
+        if (hub->latest)
+            releaseFrame(hub, hub->latest);
+        hub->latest = frame;
+        hub->published_frames++;
+
+        if ((frame->modes & (1u << (FORMAT_DELTA + 1))) && frame->keyframe) {
+            hub->has_last_key = true;
+            hub->last_key = frame->key_number;
+        }
+
+        for (size_t i = 0; i < hub->subs.size(); i++)
+            queueFrame(hub, hub->subs[i], frame);
+    }
+}
+
+// Sets up the hub on a listening socket. release is called on the hub thread when a frame is no longer used.
+inline void initFanoutHub(fanoutHub * hub, int listen_sock, int queue_depth, bool drop_newest, bool zerocopy,
+                          void (*release)(sharedFrame *), stageStats * send_stats) {
+    hub->listen_sock = listen_sock;
+    hub->queue_depth = std::min(std::max(queue_depth, 1), MAX_SUB_QUEUE);
+    hub->drop_newest = drop_newest;
+    hub->zerocopy = zerocopy;
+    hub->release = release;
+    hub->send_stats = send_stats;
+    hub->modes_in_use = 0;
+    hub->running = true;
+    hub->key_acked = UINT64_MAX;
+    hub->key_request = false;
+    hub->roi_changed = false;
+    hub->latest = NULL;
+    hub->next_seq = 0;
+    hub->has_last_key = false;
+    hub->published_frames = 0;
+
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+
+    if ((hub->epfd = epoll_create1(0)) < 0 || (hub->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        std::cerr << "\nepoll setup failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // the listen socket is tagged with NULL, the eventfd with its own address
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(hub->epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    ev.data.ptr = &hub->wake_fd;
+    epoll_ctl(hub->epfd, EPOLL_CTL_ADD, hub->wake_fd, &ev);
+}
+
+// Hands a frame to the hub, callable from any thread. Returns false once the hub is closed.
+inline bool publishFrame(fanoutHub * hub, sharedFrame * frame) {
+    if (!pushRing(&hub->published, frame))
+        return false;
+
+    uint64_t one = 1;
+    return write(hub->wake_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+// Copies the region of interest a subscriber sent since the last call into roi. Returns false when there is none.
+inline bool takeRoi(fanoutHub * hub, roiSet * roi) {
+    if (!hub->roi_changed.exchange(false))
+        return false;
+    std::lock_guard<std::mutex> lock(hub->roi_mutex);
+    *roi = hub->roi;
+    return true;
+}
+
+// Makes runFanoutHub return, async signal safe.
+inline void stopFanoutHub(fanoutHub * hub) {
+    hub->running = false;
+    uint64_t one = 1;
+    if (write(hub->wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+// One round of the event loop, waiting at most timeout_ms for events.
+inline void pollFanoutHub(fanoutHub * hub, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(hub->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            acceptSubscribers(hub);
+            continue;
+        }
+        if (events[i].data.ptr == &hub->wake_fd) {
+            drainPublished(hub);
+            continue;
+        }
+
+        subscriber * sub = (subscriber *)events[i].data.ptr;
+        if (sub->sock < 0)
+            continue;
+
+        if (events[i].events & EPOLLERR) {
+            // Zero copy completions are reported as errors, anything else is a broken connection.
+            int err = 0;
+            socklen_t len = sizeof(err);
+            reapSubscriber(hub, sub);
+            if (getsockopt(sub->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                closeSubscriber(hub, sub, "Subscriber disconnected");
+                continue;
+            }
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP))
+            readRequests(hub, sub);
+        if (sub->sock >= 0)
+            flushSubscriber(hub, sub);
+    }
+
+    // Subscribers stuck on a frame would pin it forever.
+    auto now = std::chrono::steady_clock::now();
+    for (subscriber * sub : hub->subs) {
+        if (sub->sock >= 0 && (sub->current || sub->zc_count) &&
+            std::chrono::duration<double, std::milli>(now - sub->last_progress).count() > STALL_MS)
+            closeSubscriber(hub, sub, "Subscriber stalled");
+    }
+
+    for (size_t i = 0; i < hub->subs.size();) {
+        if (hub->subs[i]->sock < 0) {
+            delete hub->subs[i];
+            hub->subs.erase(hub->subs.begin() + i);
+        }
+        else i++;
+    }
+
+    // a subscriber that left may have been the last one missing the newest keyframe
+    updateKeyAck(hub);
+}
+
+// Runs the event loop until stopFanoutHub is called.
+inline void runFanoutHub(fanoutHub * hub, void (*tick)(fanoutHub *) = NULL) {
+    while (hub->running) {
+        pollFanoutHub(hub, 100);
+        if (tick)
+            tick(hub);
+    }
+}
+
+// Prints what every subscriber got since the last report and resets the counters.
+inline void printSubscriberStats(fanoutHub * hub) {
+    for (subscriber * sub : hub->subs) {
+        std::cout << "subscriber " << sub->sock << ": " << sub->sent << " sent, " << sub->dropped << " dropped, "
+                  << sub->count + (sub->current ? 1 : 0) << " queued" << std::endl;
+        sub->sent = 0;
+        sub->dropped = 0;
+    }
+}
+
+// Disconnects every subscriber and returns every frame still held. The producer must have stopped publishing.
+inline void closeFanoutHub(fanoutHub * hub) {
+    for (subscriber * sub : hub->subs) {
+        closeSubscriber(hub, sub, "Closing subscriber");
+        delete sub;
+    }
+    hub->subs.clear();
+
+    sharedFrame * frame;
+    while (tryPopRing(&hub->published, &frame))
+        hub->release(frame);
+    if (hub->latest)
+        releaseFrame(hub, hub->latest);
+    hub->latest = NULL;
+
+    close(hub->epfd);
+    close(hub->wake_fd);
+}
+
+#endif
@@ -0,0 +1,406 @@
+#ifndef META_FRAME_H
+#define META_FRAME_H
+
+/*
+ * Versioned frame header and packed point layouts for the camera -> stitcher link.
+ *
+ * Producers still fill the usual buffer of 5 shorts per point
+ * (x, y, z, r | g << 8, b) and packFrame converts it to the wire format
+ * negotiated for the connection. A consumer selects the format by sending
+ * REQUEST_FORMAT followed by one format byte; from then on every frame on
+ * that connection starts with a frameHeader instead of the bare int length.
+ *
+ * Frames are requested either with the 1-byte pull request 'Z' (one frame per
+ * request) or with REQUEST_CREDIT followed by a little endian uint32 count,
+ * which grants the producer that many frames to push without waiting. A pull
+ * request is the same as a grant of one credit. REQUEST_ROI followed by a
+ * region of interest from Meta/roi.h replaces the region the producer culls
+ * its points to.
+ *
+ *   FORMAT_XYZRGB16    10 bytes/pt  legacy 5 x int16 records
+ *   FORMAT_XYZ16_RGB24  9 bytes/pt  x, y, z int16 + r, g, b bytes
+ *   FORMAT_XYZ16_RGB565 8 bytes/pt  x, y, z int16 + rgb565
+ *   FORMAT_COMPRESSED   variable    lossless stream from Meta/codec.h
+ *   FORMAT_SOA          variable    aligned X, Y, Z, R, G, B planes from Meta/soa.h
+ *   FORMAT_DEPTH16      variable    Z16 depth image + colors of valid pixels from Meta/depth.h,
+ *                                   reconstructed on the receiver from the intrinsics in the header
+ *   FORMAT_OCTREE       variable    progressive octree from Meta/octree.h, lossy, num_points is the
+ *                                   number of occupied cells of the deepest level sent
+ *   FORMAT_DELTA        variable    keyframes and delta frames from Meta/temporal.h, keyframes carry
+ *                                   FRAME_FLAG_KEY and are acknowledged with REQUEST_KEY_ACK + u64 number
+ *
+ * FORMAT_DEPTH16 is produced from the camera frames and FORMAT_OCTREE from
+ * the stitched cloud, not from records, and FORMAT_DELTA needs the state of
+ * earlier frames, so packFrame only builds the formats for which recordFormat
+ * is true.
+ *
+ * Frames of records (quantFormat) may carry FRAME_FLAG_QUANT with a
+ * quantExtension from Meta/quantize.h right behind the frameHeader: step and
+ * origin of the coordinates and the bounding box of the frame. Without it the
+ * records are in millimeters around the world origin.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "codec.h"
+#include "soa.h"
+#include "depth.h"
+#include "octree.h"
+#include "temporal.h"
+#include "quantize.h"
+
+#define FRAME_MAGIC         0x3146534d      // "MSF1"
+#define FRAME_VERSION       1
+#define REQUEST_FORMAT      'F'
+#define REQUEST_CREDIT      'C'
+#define REQUEST_PULL        'Z'
+#define REQUEST_KEY_ACK     'A'
+#define REQUEST_ROI         'R'
+
+#define FORMAT_XYZRGB16     0
+#define FORMAT_XYZ16_RGB24  1
+#define FORMAT_XYZ16_RGB565 2
+#define FORMAT_COMPRESSED   3
+#define FORMAT_SOA          4
+#define FORMAT_DEPTH16      5
+#define FORMAT_OCTREE       6
+#define FORMAT_DELTA        7
+#define NUM_FORMATS         8
+
+#define FRAME_FLAG_KEY      0x01            // FORMAT_DELTA keyframe
+#define FRAME_FLAG_QUANT    0x02            // a quantExtension follows the frameHeader
+
+#define MAX_HEADER_BYTES    256             // largest header_bytes a receiver accepts
+
+struct frameHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_bytes;      // size of the header including any extension that follows it
+    uint8_t  format;
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t num_points;
+    uint32_t payload_bytes;
+    uint32_t reserved2;
+    uint64_t frame_number;
+    uint64_t timestamp_us;      // capture time of the frame in microseconds
+};
+
+static_assert(sizeof(frameHeader) == 40, "frameHeader must stay 40 bytes on the wire");
+
+inline bool validFormat(int format) {
+    return format >= 0 && format < NUM_FORMATS;
+}
+
+// Formats packFrame can build from 5-short records.
+inline bool recordFormat(int format) {
+    return validFormat(format) && format != FORMAT_DEPTH16 && format != FORMAT_OCTREE && format != FORMAT_DELTA;
+}
+
+// Formats whose payload holds quantized records and may carry a quantExtension.
+inline bool quantFormat(int format) {
+    return recordFormat(format) || format == FORMAT_DELTA;
+}
+
+// Bytes per point of a fixed size format, 0 for the variable size formats.
+inline int formatPointBytes(int format) {
+    switch (format) {
+        case FORMAT_XYZRGB16:     return 10;
+        case FORMAT_XYZ16_RGB24:  return 9;
+        case FORMAT_XYZ16_RGB565: return 8;
+        default:                  return 0;
+    }
+}
+
+// Largest header extension plus payload packFrame can produce for num_points points.
+inline size_t framePayloadBound(int num_points) {
+    return std::max({codecBound(num_points), size_t(2 * SOA_HEADER_BYTES) + soaPayloadBytes(num_points),
+                     sizeof(depthExtension) + size_t(num_points) * 5, temporalPayloadBound(num_points)}) +
+           sizeof(quantExtension);
+}
+
+// Size of a frame buffer able to hold any frame of num_points points, rounded up for aligned_alloc(SOA_ALIGN, ...).
+inline size_t frameBufferBytes(int num_points) {
+    return (sizeof(frameHeader) + framePayloadBound(num_points) + SOA_ALIGN - 1) & ~size_t(SOA_ALIGN - 1);
+}
+
+// Header size used for a format, SoA frames pad the header so that the payload keeps its alignment
+// and depth frames append their depthExtension. quant adds the quantExtension of FRAME_FLAG_QUANT.
+inline int frameHeaderBytes(int format, bool quant = false) {
+    const int bytes = int(sizeof(frameHeader)) + (quant && quantFormat(format) ? int(sizeof(quantExtension)) : 0);
+    if (format == FORMAT_SOA) return (bytes + SOA_HEADER_BYTES - 1) / SOA_HEADER_BYTES * SOA_HEADER_BYTES;
+    if (format == FORMAT_DEPTH16) return int(sizeof(frameHeader) + sizeof(depthExtension));
+    return bytes;
+}
+
+// Writes the header of a frame whose payload already sits at out + frameHeaderBytes(format, quant != NULL).
+// quant describes the records of the frame, it is only sent for the formats of quantFormat.
+inline void writeFrameHeader(uint8_t * out, int format, int num_points, size_t payload_bytes,
+                             uint64_t frame_number, uint64_t timestamp_us, uint8_t flags = 0,
+                             const quantExtension * quant = NULL) {
+    if (!quantFormat(format))
+        quant = NULL;
+
+    frameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FRAME_MAGIC;
+    header.version = FRAME_VERSION;
+    header.header_bytes = uint16_t(frameHeaderBytes(format, quant != NULL));
+    header.format = uint8_t(format);
+    header.flags = quant ? flags | FRAME_FLAG_QUANT : flags;
+    header.num_points = uint32_t(num_points);
+    header.payload_bytes = uint32_t(payload_bytes);
+    header.frame_number = frame_number;
+    header.timestamp_us = timestamp_us;
+    memset(out, 0, header.header_bytes);
+    memcpy(out, &header, sizeof(header));
+    if (quant)
+        memcpy(out + sizeof(header), quant, sizeof(quantExtension));
+}
+
+// Quantization of the records of a received frame from the header_bytes - sizeof(frameHeader) bytes of
+// extension behind its frameHeader, the legacy one without FRAME_FLAG_QUANT. False when the
+// extension is missing or describes a step the receivers do not know.
+inline bool frameQuantizer(const frameHeader & header, const uint8_t * extension, quantizer * q,
+                           quantExtension * ext = NULL) {
+    *q = defaultQuantizer();
+    if (!(header.flags & FRAME_FLAG_QUANT))
+        return true;
+
+    quantExtension quant;
+    if (!quantFormat(header.format) || !extension || header.header_bytes < sizeof(frameHeader) + sizeof(quant))
+        return false;
+    memcpy(&quant, extension, sizeof(quant));
+    if (!validQuantStep(quant.step_mm))
+        return false;
+
+    q->step_mm = quant.step_mm;
+    memcpy(q->origin, quant.origin, sizeof(q->origin));
+    if (ext)
+        *ext = quant;
+    return true;
+}
+
+inline bool validFrameHeader(const frameHeader & header) {
+    return header.magic == FRAME_MAGIC && header.version == FRAME_VERSION &&
+           header.header_bytes >= sizeof(frameHeader) && header.header_bytes <= MAX_HEADER_BYTES &&
+           validFormat(header.format);
+}
+
+// Writes the header of a depth frame whose payload already sits at out + frameHeaderBytes(FORMAT_DEPTH16).
+inline void writeDepthFrameHeader(uint8_t * out, const depthExtension & ext, int num_points,
+                                  uint64_t frame_number, uint64_t timestamp_us) {
+    writeFrameHeader(out, FORMAT_DEPTH16, num_points, depthPayloadBytes(ext, num_points), frame_number, timestamp_us);
+    memcpy(out + sizeof(frameHeader), &ext, sizeof(ext));
+}
+
+// Packs 10-byte records to 9 bytes by dropping the always-zero high byte of b.
+// Each record is moved with one 16-byte load/store; the overlapping tail is overwritten by the next record.
+inline void packXYZ16RGB24(const short * records, int num_points, uint8_t * out) {
+    const uint8_t * in = reinterpret_cast<const uint8_t *>(records);
+    int i = 0;
+
+    for (; i + 2 < num_points; i++)
+        _mm_storeu_si128((__m128i *)(out + i * 9), _mm_loadu_si128((const __m128i *)(in + i * 10)));
+
+    for (; i < num_points; i++)
+        memcpy(out + i * 9, in + i * 10, 9);
+}
+
+inline void unpackXYZ16RGB24(const uint8_t * in, int num_points, short * records) {
+    uint8_t * out = reinterpret_cast<uint8_t *>(records);
+    const __m128i keep = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 2 < num_points; i++) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + i * 9)), keep);
+        _mm_storeu_si128((__m128i *)(out + i * 10), v);
+    }
+
+    for (; i < num_points; i++) {
+        memcpy(out + i * 10, in + i * 9, 9);
+        out[i * 10 + 9] = 0;
+    }
+}
+
+// Packs 10-byte records to 8 bytes, the color is reduced to rgb565 in 16-bit lane 3.
+inline void packXYZ16RGB565(const short * records, int num_points, uint8_t * out) {
+    const uint8_t * in = reinterpret_cast<const uint8_t *>(records);
+    const __m128i mask_r = _mm_set1_epi16(short(0xF800));
+    const __m128i mask_g = _mm_set1_epi16(0x07E0);
+    const __m128i mask_b = _mm_set1_epi16(0x001F);
+    const __m128i lane_3 = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 1 < num_points; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 10));
+
+        // lane 3 holds r | g << 8 and lane 4 holds b
+        __m128i r = _mm_and_si128(_mm_slli_epi16(v, 8), mask_r);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask_g);
+        __m128i b = _mm_and_si128(_mm_srli_epi16(_mm_srli_si128(v, 2), 3), mask_b);
+        __m128i c = _mm_or_si128(_mm_or_si128(r, g), b);
+
+        _mm_storel_epi64((__m128i *)(out + i * 8), _mm_or_si128(_mm_andnot_si128(lane_3, v), _mm_and_si128(lane_3, c)));
+    }
+
+    for (; i < num_points; i++) {
+        const short * p = records + i * 5;
+        uint16_t rg = uint16_t(p[3]);
+        uint16_t c = ((rg << 8) & 0xF800) | ((rg >> 5) & 0x07E0) | ((uint16_t(p[4]) >> 3) & 0x001F);
+        memcpy(out + i * 8, p, 6);
+        memcpy(out + i * 8 + 6, &c, 2);
+    }
+}
+
+inline void unpackXYZ16RGB565(const uint8_t * in, int num_points, short * records) {
+    uint8_t * out = reinterpret_cast<uint8_t *>(records);
+    const __m128i mask_r = _mm_set1_epi16(0x00F8);
+    const __m128i mask_g = _mm_set1_epi16(short(0xFC00));
+    const __m128i mask_b = _mm_set1_epi16(0x00F8);
+    const __m128i lane_3 = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, 0);
+    const __m128i lane_4 = _mm_setr_epi16(0, 0, 0, 0, -1, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 1 < num_points; i++) {
+        // lanes 0-2 are x, y, z and lane 3 the rgb565 color, the upper half is zero
+        __m128i v = _mm_loadl_epi64((const __m128i *)(in + i * 8));
+
+        __m128i r = _mm_and_si128(_mm_srli_epi16(v, 8), mask_r);
+        __m128i g = _mm_and_si128(_mm_slli_epi16(v, 5), mask_g);
+        __m128i b = _mm_slli_si128(_mm_and_si128(_mm_slli_epi16(v, 3), mask_b), 2);
+
+        // r | g replaces the color in lane 3, b goes to the empty lane 4
+        v = _mm_or_si128(_mm_andnot_si128(lane_3, v), _mm_and_si128(lane_3, _mm_or_si128(r, g)));
+        v = _mm_or_si128(v, _mm_and_si128(lane_4, b));
+        _mm_storeu_si128((__m128i *)(out + i * 10), v);
+    }
+
+    for (; i < num_points; i++) {
+        short * p = records + i * 5;
+        uint16_t c;
+        memcpy(p, in + i * 8, 6);
+        memcpy(&c, in + i * 8 + 6, 2);
+        p[3] = short(((c >> 8) & 0xF8) | ((c << 5) & 0xFC00));
+        p[4] = short((c << 3) & 0xF8);
+    }
+}
+
+// Copies every stride-th record to out and returns the number copied. Like the unpacking above, every
+// record is one unaligned 16 byte move whose tail the next record overwrites; the last two records are
+// copied exactly, so neither buffer is touched past its records.
+inline int strideRecords(const short * records, int num_points, int stride, short * out) {
+    const int samples = (num_points + stride - 1) / stride;
+    int i = 0;
+
+    for (; i + 2 < samples; i++)
+        _mm_storeu_si128((__m128i *)(out + size_t(i) * 5), _mm_loadu_si128((const __m128i *)(records + size_t(i) * stride * 5)));
+
+    for (; i < samples; i++)
+        memcpy(out + size_t(i) * 5, records + size_t(i) * stride * 5, 5 * sizeof(short));
+    return samples;
+}
+
+// Writes header and payload of one frame into out (sizeof(frameHeader) + framePayloadBound bytes, 64-byte aligned for SoA),
+// with the quantExtension quant when it is given. Returns the number of bytes to send.
+inline size_t packFrame(const short * records, int num_points, int format, uint64_t frame_number,
+                        uint64_t timestamp_us, uint8_t * out, int num_threads = 1,
+                        const quantExtension * quant = NULL) {
+    const int header_bytes = frameHeaderBytes(format, quant != NULL);
+    uint8_t * payload = out + header_bytes;
+    size_t payload_bytes = 0;
+
+    switch (format) {
+        case FORMAT_XYZRGB16:
+            payload_bytes = size_t(num_points) * 10;
+            memcpy(payload, records, payload_bytes);
+            break;
+        case FORMAT_XYZ16_RGB24:
+            packXYZ16RGB24(records, num_points, payload);
+            payload_bytes = size_t(num_points) * 9;
+            break;
+        case FORMAT_XYZ16_RGB565:
+            packXYZ16RGB565(records, num_points, payload);
+            payload_bytes = size_t(num_points) * 8;
+            break;
+        case FORMAT_COMPRESSED:
+            payload_bytes = encodeXYZRGB(records, num_points, payload, num_threads);
+            break;
+        case FORMAT_SOA:
+            packSoA(records, num_points, payload);
+            payload_bytes = soaPayloadBytes(num_points);
+            break;
+    }
+
+    writeFrameHeader(out, format, num_points, payload_bytes, frame_number, timestamp_us, 0, quant);
+    return header_bytes + payload_bytes;
+}
+
+// Converts the payload of a received frame back to 5-short records. Depth frames also need the
+// header extension (the header_bytes - sizeof(frameHeader) bytes behind the frameHeader). FORMAT_DELTA
+// frames depend on earlier frames and go through decodeTemporal instead. The records keep the
+// quantization of the frame, see frameQuantizer; depth and octree frames give millimeters. Receivers pass
+// the ray table of the camera for depth frames, without one the rays are computed for this frame only.
+// Returns the number of points, or -1 when the payload does not match the header.
+inline int unpackFrame(const frameHeader & header, const uint8_t * payload, short * records,
+                       int max_points, int num_threads = 1, const uint8_t * extension = NULL,
+                       depthRayTable * rays = NULL) {
+    const int num_points = int(header.num_points);
+    if (num_points < 0 || num_points > max_points) return -1;
+
+    if (header.format == FORMAT_DEPTH16) {
+        depthExtension ext;
+        if (!extension || header.header_bytes < sizeof(frameHeader) + sizeof(ext)) return -1;
+        memcpy(&ext, extension, sizeof(ext));
+        if (header.payload_bytes != depthPayloadBytes(ext, num_points)) return -1;
+        // records are in millimeters
+        if (rays)
+            return unpackDepth(ext, payload, num_points, 1000.f, rays, records);
+        depthRayTable frame_rays;
+        memset(&frame_rays, 0, sizeof(frame_rays));
+        int n = unpackDepth(ext, payload, num_points, 1000.f, &frame_rays, records);
+        freeRayTable(&frame_rays);
+        return n;
+    }
+
+    if (header.format == FORMAT_OCTREE) {
+        // cell centers in millimeters
+        octreePoint * points = (octreePoint *)malloc(sizeof(octreePoint) * std::max(num_points, 1));
+        int n = decodeOctree(payload, header.payload_bytes, OCTREE_MAX_DEPTH, points, num_points);
+        octreePointsToRecords(points, std::max(n, 0), 1000.f, records);
+        free(points);
+        return n == num_points ? n : -1;
+    }
+
+    if (header.format == FORMAT_COMPRESSED) {
+        int n = decodeXYZRGB(payload, header.payload_bytes, records, max_points, num_threads);
+        return n == num_points ? n : -1;
+    }
+
+    if (header.format == FORMAT_SOA) {
+        if (header.payload_bytes != soaPayloadBytes(num_points)) return -1;
+        unpackSoA(payload, num_points, records);
+        return num_points;
+    }
+
+    if (size_t(header.payload_bytes) != size_t(num_points) * formatPointBytes(header.format)) return -1;
+
+    switch (header.format) {
+        case FORMAT_XYZRGB16:
+            if ((const void *)payload != (const void *)records)
+                memcpy(records, payload, header.payload_bytes);
+            break;
+        case FORMAT_XYZ16_RGB24:
+            unpackXYZ16RGB24(payload, num_points, records);
+            break;
+        case FORMAT_XYZ16_RGB565:
+            unpackXYZ16RGB565(payload, num_points, records);
+            break;
+    }
+
+    return num_points;
+}
+
+#endif
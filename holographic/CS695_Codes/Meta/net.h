@@ -0,0 +1,279 @@
+#ifndef META_NET_H
+#define META_NET_H
+
+/*
+ * Send path for point cloud frames.
+ *
+ * A frame is sent as a header iovec followed by one or more payload iovecs
+ * with sendmsg, so the length prefix or frameHeader never has to be copied
+ * in front of the payload. sendFrameIov keeps calling sendmsg until every
+ * byte is out, advancing the iovecs on short writes.
+ *
+ * With zero copy enabled (SO_ZEROCOPY + MSG_ZEROCOPY) the kernel sends
+ * straight from the user pages and reports on the socket error queue when it
+ * is done with them. Every sendmsg call gets one completion id, so the
+ * sender counts calls and completions and waitFrameSent blocks until both
+ * match. A producer has to call it before writing into a buffer (or header)
+ * that is still part of an earlier frame.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <iostream>
+
+#include "frame.h"
+#include "roi.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY         60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY        0x4000000
+#endif
+
+struct frameSender {
+    int sock;
+    bool zerocopy;
+    uint32_t zc_calls;          // sendmsg calls issued with MSG_ZEROCOPY
+    uint32_t zc_done;           // calls the kernel has released the pages of
+    uint32_t zc_copied;         // completions where the kernel fell back to copying
+    int legacy_size;            // bare int length prefix, kept here so it outlives a zero copy send
+};
+
+// Sets up the sender for a connected socket, falling back to copying sends if SO_ZEROCOPY is not supported.
+inline void initFrameSender(frameSender * sender, int sock, bool zerocopy) {
+    memset(sender, 0, sizeof(frameSender));
+    sender->sock = sock;
+
+    if (zerocopy) {
+        int one = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+            std::cerr << "SO_ZEROCOPY not supported, using copying sends" << std::endl;
+        else
+            sender->zerocopy = true;
+    }
+}
+
+// Reads zero copy completions from the socket error queue without blocking.
+inline void reapZeroCopy(frameSender * sender) {
+    while (sender->zc_done != sender->zc_calls) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sender->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            const struct sock_extended_err * err = (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // ee_info .. ee_data is the inclusive range of completed call ids
+            uint32_t n = err->ee_data - err->ee_info + 1;
+            sender->zc_done += n;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                sender->zc_copied += n;
+        }
+    }
+}
+
+// Blocks until the kernel has released every buffer handed to it by earlier zero copy sends.
+inline void waitFrameSent(frameSender * sender) {
+    while (sender->zerocopy && sender->zc_done != sender->zc_calls) {
+        struct pollfd pfd = {sender->sock, 0, 0};   // POLLERR is always reported
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            return;
+        reapZeroCopy(sender);
+    }
+}
+
+// Drops the fully sent iovecs of msg and advances into a partially sent one.
+inline void advanceIov(struct msghdr * msg, size_t sent) {
+    while (msg->msg_iovlen > 0 && sent >= msg->msg_iov->iov_len) {
+        sent -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if (msg->msg_iovlen > 0) {
+        msg->msg_iov->iov_base = (uint8_t *)msg->msg_iov->iov_base + sent;
+        msg->msg_iov->iov_len -= sent;
+    }
+}
+
+// One non-blocking sendmsg of what is left in msg, advancing it by the bytes sent.
+// Returns the bytes sent, 0 when the socket buffer is full, or -1 on a socket error.
+inline ssize_t sendIovNow(frameSender * sender, struct msghdr * msg) {
+    const int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (sender->zerocopy ? MSG_ZEROCOPY : 0);
+
+    while (true) {
+        ssize_t sent = sendmsg(sender->sock, msg, flags);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || (errno == ENOBUFS && sender->zerocopy))
+                return 0;
+            return -1;
+        }
+
+        if (sender->zerocopy)
+            sender->zc_calls++;
+        advanceIov(msg, sent);
+        return sent;
+    }
+}
+
+// Sends all bytes described by iov, retrying on short writes and EINTR.
+// The iovec array is modified. Returns the number of bytes sent or -1 on a socket error.
+inline ssize_t sendFrameIov(frameSender * sender, struct iovec * iov, int iovcnt) {
+    const int flags = MSG_NOSIGNAL | (sender->zerocopy ? MSG_ZEROCOPY : 0);
+    ssize_t total = 0;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(sender->sock, &msg, flags);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS && sender->zerocopy) {
+                // Too many pages pinned by pending zero copy sends, let some complete first.
+                struct pollfd pfd = {sender->sock, 0, 0};
+                poll(&pfd, 1, 10);
+                reapZeroCopy(sender);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking socket with a full send buffer, wait until it drains.
+                struct pollfd pfd = {sender->sock, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return -1;
+        }
+
+        if (sender->zerocopy)
+            sender->zc_calls++;
+        total += sent;
+
+        advanceIov(&msg, sent);
+    }
+
+    if (sender->zerocopy)
+        reapZeroCopy(sender);
+
+    return total;
+}
+
+// Sends the len bytes of request on a blocking socket. Returns false on a socket error.
+inline bool sendRequestBytes(int sock, const uint8_t * request, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t sent = send(sock, request + total, len - total, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 1)
+            return false;
+        total += sent;
+    }
+    return true;
+}
+
+// Sends a request byte followed by its argument. Returns false on a socket error.
+inline bool sendRequest(int sock, uint8_t type, const void * arg, size_t arg_bytes) {
+    uint8_t request[16] = {type};
+    memcpy(request + 1, arg, arg_bytes);
+    return sendRequestBytes(sock, request, arg_bytes + 1);
+}
+
+// Grants the producer on sock credits more frames (REQUEST_CREDIT). Returns false on a socket error.
+inline bool sendCreditGrant(int sock, uint32_t credits) {
+    return sendRequest(sock, REQUEST_CREDIT, &credits, sizeof(credits));
+}
+
+// Tells the producer on sock that the FORMAT_DELTA keyframe frame_number arrived (REQUEST_KEY_ACK).
+inline bool sendKeyAck(int sock, uint64_t frame_number) {
+    return sendRequest(sock, REQUEST_KEY_ACK, &frame_number, sizeof(frame_number));
+}
+
+// Reads the credit count that follows a REQUEST_CREDIT byte. Returns false on a socket error.
+inline bool readCreditGrant(int sock, uint32_t * credits) {
+    return recv(sock, credits, sizeof(uint32_t), MSG_WAITALL) == sizeof(uint32_t);
+}
+
+// Replaces the region of interest of the producer on sock (REQUEST_ROI). Returns false on a socket error.
+inline bool sendRoiRequest(int sock, const roiSet & roi) {
+    uint8_t request[1 + ROI_MAX_BYTES] = {REQUEST_ROI};
+    return sendRequestBytes(sock, request, 1 + writeRoi(roi, request + 1));
+}
+
+// Reads the region that follows a REQUEST_ROI byte. Returns false on a socket error or a corrupt region.
+inline bool readRoiRequest(int sock, roiSet * roi) {
+    uint8_t request[ROI_MAX_BYTES];
+    size_t len = 1;
+    if (recv(sock, request, 1, MSG_WAITALL) != 1 || request[0] > ROI_MAX_VOLUMES)
+        return false;
+
+    for (int v = 0; v < request[0]; v++) {
+        if (recv(sock, request + len, 1, MSG_WAITALL) != 1)
+            return false;
+        const size_t plane_bytes = size_t(request[len++]) * 4 * sizeof(float);
+        if (plane_bytes > ROI_MAX_PLANES * 4 * sizeof(float) ||
+            recv(sock, request + len, plane_bytes, MSG_WAITALL) != ssize_t(plane_bytes))
+            return false;
+        len += plane_bytes;
+    }
+    return readRoi(request, len, roi) > 0;
+}
+
+// Sends records in the legacy framing: bare int payload length followed by the 5-short records.
+inline ssize_t sendLegacyFrame(frameSender * sender, const short * records, int num_points) {
+    sender->legacy_size = num_points * 5 * sizeof(short);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &sender->legacy_size;
+    iov[0].iov_len = sizeof(int);
+    iov[1].iov_base = (void *)records;
+    iov[1].iov_len = sender->legacy_size;
+
+    return sendFrameIov(sender, iov, 2);
+}
+
+// Builds a framed frame for records in out and describes it in iov (2 entries), with the quantExtension
+// quant when it is given. Raw records are not copied: the header goes to out and the payload iovec points
+// at the records. Returns the number of bytes of the frame.
+inline size_t packFrameIov(const short * records, int num_points, int format, uint64_t frame_number,
+                           uint64_t timestamp_us, uint8_t * out, struct iovec * iov, int num_threads = 1,
+                           const quantExtension * quant = NULL) {
+    const int header_bytes = frameHeaderBytes(format, quant != NULL);
+    if (format == FORMAT_XYZRGB16) {
+        size_t payload_bytes = size_t(num_points) * 10;
+        writeFrameHeader(out, format, num_points, payload_bytes, frame_number, timestamp_us, 0, quant);
+        iov[0].iov_base = out;
+        iov[0].iov_len = header_bytes;
+        iov[1].iov_base = (void *)records;
+        iov[1].iov_len = payload_bytes;
+        return header_bytes + payload_bytes;
+    }
+
+    size_t bytes = packFrame(records, num_points, format, frame_number, timestamp_us, out, num_threads, quant);
+    iov[0].iov_base = out;
+    iov[0].iov_len = header_bytes;
+    iov[1].iov_base = out + header_bytes;
+    iov[1].iov_len = bytes - header_bytes;
+    return bytes;
+}
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef META_OCTREE_H
+#define META_OCTREE_H
+
+/*
+ * Progressive octree coder for stitched point clouds (FORMAT_OCTREE in Meta/frame.h).
+ *
+ * Points are quantized to a 2^depth grid over their bounding cube and the
+ * occupied cells are coded breadth first: level l holds one occupancy byte
+ * per node of that level (bit k set when child octant k is occupied). Every
+ * node also carries the mean color of the points below it, coded as a
+ * residual to the color of its parent. Decoding level by level therefore
+ * yields a complete cloud at every depth, just with bigger cells, and a
+ * receiver can stop after any level.
+ *
+ * Each level is one chunk made of two byte streams coded with the order-0
+ * rANS coder of Meta/codec.h: the occupancy bytes of the level and the color
+ * residuals of the nodes one level down (R plane, G plane, B plane). With a
+ * byte budget the encoder only emits the levels that fit, so a congested link
+ * gets a coarser cloud rather than a late one.
+ *
+ * Layout (little endian):
+ *   u32 magic 'OCT1' | u8 depth | u8 levels | u16 0 | u32 num_points
+ *   f32 origin[3] | f32 size | u8 root_rgb[3] | u8 0 | u32 chunk_bytes[levels] | chunks...
+ * num_points is the number of nodes of the deepest level in the stream.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "codec.h"
+
+#define OCTREE_MAGIC        0x3154434f      // "OCT1"
+#define OCTREE_MAX_DEPTH    16
+#define OCTREE_HEADER_BYTES 32
+
+// Point type for coding 5-short records (x, y, z, r | g << 8, b), see recordsToOctreePoints.
+struct octreePoint {
+    float x, y, z;
+    uint8_t r, g, b;
+};
+
+// Converts records with coordinates in 1 / conv_rate meters to points in meters.
+inline void recordsToOctreePoints(const short * records, int num_points, float conv_rate, octreePoint * points) {
+    const float scale = 1 / conv_rate;
+    for (int i = 0; i < num_points; i++) {
+        const short * p = records + i * 5;
+        points[i].x = p[0] * scale;
+        points[i].y = p[1] * scale;
+        points[i].z = p[2] * scale;
+        points[i].r = uint8_t(p[3] & 0xFF);
+        points[i].g = uint8_t((p[3] >> 8) & 0xFF);
+        points[i].b = uint8_t(p[4]);
+    }
+}
+
+// Converts points in meters back to records in 1 / conv_rate meters.
+inline void octreePointsToRecords(const octreePoint * points, int num_points, float conv_rate, short * records) {
+    for (int i = 0; i < num_points; i++) {
+        short * p = records + i * 5;
+        p[0] = short(points[i].x * conv_rate);
+        p[1] = short(points[i].y * conv_rate);
+        p[2] = short(points[i].z * conv_rate);
+        p[3] = short(points[i].r | (points[i].g << 8));
+        p[4] = points[i].b;
+    }
+}
+
+// Spreads the low 16 bits of v to every third bit.
+inline uint64_t spreadBits3(uint64_t v) {
+    v &= 0xFFFF;
+    v = (v | (v << 16)) & 0x0000FF0000FFull;
+    v = (v | (v << 8))  & 0x00F00F00F00Full;
+    v = (v | (v << 4))  & 0x0C30C30C30C3ull;
+    v = (v | (v << 2))  & 0x249249249249ull;
+    return v;
+}
+
+inline uint32_t compactBits3(uint64_t v) {
+    v &= 0x249249249249ull;
+    v = (v | (v >> 2))  & 0x0C30C30C30C3ull;
+    v = (v | (v >> 4))  & 0x00F00F00F00Full;
+    v = (v | (v >> 8))  & 0x0000FF0000FFull;
+    v = (v | (v >> 16)) & 0xFFFF;
+    return uint32_t(v);
+}
+
+// Octant order of a code is (x, y, z) = bits (2, 1, 0).
+inline uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+    return (spreadBits3(x) << 2) | (spreadBits3(y) << 1) | spreadBits3(z);
+}
+
+// Sorts keys with their indices by the low key_bits bits, 8 bits per pass.
+inline void radixSortKeys(std::vector<uint64_t> & keys, std::vector<uint32_t> & idx, int key_bits) {
+    std::vector<uint64_t> keys_tmp(keys.size());
+    std::vector<uint32_t> idx_tmp(idx.size());
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        size_t count[257] = {0};
+        for (uint64_t k : keys) count[((k >> shift) & 0xFF) + 1]++;
+        for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            size_t dst = count[(keys[i] >> shift) & 0xFF]++;
+            keys_tmp[dst] = keys[i];
+            idx_tmp[dst] = idx[i];
+        }
+        keys.swap(keys_tmp);
+        idx.swap(idx_tmp);
+    }
+}
+
+// Worst case size of the level chunk of nodes nodes with children nodes below them (two raw streams).
+inline size_t octreeChunkBound(size_t nodes, size_t children) {
+    return 2 * 5 + nodes + 3 * children;
+}
+
+// Codes num_points points (PointT with x, y, z, r, g, b) into out, using at most max_bytes. Invalid
+// (non-finite) points are skipped. Levels that do not fit the budget are left out, max_bytes has to
+// leave room for the header and the chunk table (OCTREE_HEADER_BYTES + 4 * depth).
+// Returns the number of bytes written (0 if not even the header fits), *decoded_points receives the
+// number of points the stream decodes to.
+template <typename PointT>
+size_t encodeOctree(const PointT * points, int num_points, int depth, uint8_t * out, size_t max_bytes,
+                    int * decoded_points) {
+    depth = std::min(std::max(depth, 1), OCTREE_MAX_DEPTH);
+    *decoded_points = 0;
+    if (max_bytes < OCTREE_HEADER_BYTES + 4 * size_t(depth)) return 0;
+
+    // bounding cube of the valid points
+    float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    std::vector<uint32_t> idx;
+    idx.reserve(num_points);
+    for (int i = 0; i < num_points; i++) {
+        const PointT & p = points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) continue;
+        lo[0] = std::min(lo[0], p.x); hi[0] = std::max(hi[0], p.x);
+        lo[1] = std::min(lo[1], p.y); hi[1] = std::max(hi[1], p.y);
+        lo[2] = std::min(lo[2], p.z); hi[2] = std::max(hi[2], p.z);
+        idx.push_back(uint32_t(i));
+    }
+
+    const uint32_t cells = 1u << depth;
+    float size = 0;
+    if (idx.empty()) {
+        lo[0] = lo[1] = lo[2] = 0;
+    }
+    else {
+        size = std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+    }
+    size = size > 0 ? size * 1.0001f : 1e-3f;
+    const float scale = cells / size;
+
+    // Morton codes of the leaf cells, sorted so that every level comes out in breadth first order
+    std::vector<uint64_t> keys(idx.size());
+    for (size_t i = 0; i < idx.size(); i++) {
+        const PointT & p = points[idx[i]];
+        uint32_t q[3];
+        const float v[3] = {p.x, p.y, p.z};
+        for (int a = 0; a < 3; a++)
+            q[a] = std::min(uint32_t(std::max((v[a] - lo[a]) * scale, 0.f)), cells - 1);
+        keys[i] = mortonCode(q[0], q[1], q[2]);
+    }
+    radixSortKeys(keys, idx, 3 * depth);
+
+    // Nodes of every level with the color sums below them, built bottom up.
+    struct octNode { uint64_t code; uint32_t r, g, b, n; uint8_t occupancy; };
+    std::vector<std::vector<octNode>> levels(depth + 1);
+    levels[depth].reserve(keys.size());
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        const PointT & p = points[idx[i]];
+        if (levels[depth].empty() || levels[depth].back().code != keys[i])
+            levels[depth].push_back({keys[i], 0, 0, 0, 0, 0});
+        octNode & leaf = levels[depth].back();
+        leaf.r += p.r;
+        leaf.g += p.g;
+        leaf.b += p.b;
+        leaf.n++;
+    }
+    for (int l = depth - 1; l >= 0; l--) {
+        levels[l].reserve(levels[l + 1].size());
+        for (const octNode & child : levels[l + 1]) {
+            const uint64_t code = child.code >> 3;
+            if (levels[l].empty() || levels[l].back().code != code)
+                levels[l].push_back({code, 0, 0, 0, 0, 0});
+            octNode & node = levels[l].back();
+            node.occupancy |= uint8_t(1 << (child.code & 7));
+            node.r += child.r;
+            node.g += child.g;
+            node.b += child.b;
+            node.n += child.n;
+        }
+    }
+
+    // mean colors, levels[0] holds the root unless the cloud is empty
+    std::vector<std::vector<uint8_t>> colors(depth + 1);
+    for (int l = 0; l <= depth; l++) {
+        colors[l].resize(levels[l].size() * 3);
+        for (size_t i = 0; i < levels[l].size(); i++) {
+            // only the encoder averages, so the rounding does not have to be exact
+            const octNode & node = levels[l][i];
+            const float inv = 1.f / node.n;
+            colors[l][i * 3 + 0] = uint8_t(std::min(node.r * inv + .5f, 255.f));
+            colors[l][i * 3 + 1] = uint8_t(std::min(node.g * inv + .5f, 255.f));
+            colors[l][i * 3 + 2] = uint8_t(std::min(node.b * inv + .5f, 255.f));
+        }
+    }
+
+    putU32(out, OCTREE_MAGIC);
+    out[4] = uint8_t(depth);
+    out[5] = 0;
+    out[6] = out[7] = 0;
+    putU32(out + 8, levels[0].empty() ? 0 : 1);
+    memcpy(out + 12, lo, sizeof(lo));
+    memcpy(out + 24, &size, sizeof(size));
+    out[28] = levels[0].empty() ? 0 : colors[0][0];
+    out[29] = levels[0].empty() ? 0 : colors[0][1];
+    out[30] = levels[0].empty() ? 0 : colors[0][2];
+    out[31] = 0;
+    *decoded_points = levels[0].empty() ? 0 : 1;
+    if (levels[0].empty()) {
+        return OCTREE_HEADER_BYTES;
+    }
+
+    // the chunk size table is written once the number of levels that fit is known
+    uint8_t * chunk_table = out + OCTREE_HEADER_BYTES;
+    uint8_t * ptr = chunk_table + 4 * depth;
+    std::vector<uint8_t> occupancy, residuals, chunk, scratch;
+    int coded_levels = 0;
+
+    for (int l = 0; l < depth; l++) {
+        const std::vector<octNode> & nodes = levels[l];
+        const std::vector<octNode> & children = levels[l + 1];
+        if (size_t(ptr - out) + 10 + nodes.size() > max_bytes)
+            break;
+
+        occupancy.resize(nodes.size());
+        residuals.resize(children.size() * 3);
+        size_t c = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            occupancy[i] = nodes[i].occupancy;
+            for (int k = __builtin_popcount(nodes[i].occupancy); k > 0; k--, c++) {
+                for (int ch = 0; ch < 3; ch++)
+                    residuals[ch * children.size() + c] = uint8_t(colors[l + 1][c * 3 + ch] - colors[l][i * 3 + ch]);
+            }
+        }
+
+        // coded aside first, the level is only kept when it fits the budget
+        chunk.resize(octreeChunkBound(nodes.size(), children.size()));
+        size_t chunk_bytes = encodeStream(occupancy.data(), uint32_t(occupancy.size()), chunk.data(), scratch);
+        chunk_bytes += encodeStream(residuals.data(), uint32_t(residuals.size()), chunk.data() + chunk_bytes, scratch);
+        if (size_t(ptr - out) + chunk_bytes > max_bytes)
+            break;
+
+        memcpy(ptr, chunk.data(), chunk_bytes);
+        ptr += chunk_bytes;
+        putU32(chunk_table + 4 * l, uint32_t(chunk_bytes));
+        coded_levels++;
+        *decoded_points = int(children.size());
+    }
+
+    // drop the unused part of the chunk table
+    if (coded_levels < depth) {
+        memmove(chunk_table + 4 * coded_levels, chunk_table + 4 * depth, ptr - (chunk_table + 4 * depth));
+        ptr -= 4 * (depth - coded_levels);
+    }
+    out[5] = uint8_t(coded_levels);
+    putU32(out + 8, uint32_t(*decoded_points));
+    return size_t(ptr - out);
+}
+
+// Number of levels of a stream whose first avail bytes are present, -1 if the header is broken.
+inline int octreeAvailableLevels(const uint8_t * in, size_t avail) {
+    if (avail < OCTREE_HEADER_BYTES || getU32(in) != OCTREE_MAGIC) return -1;
+
+    const int levels = in[5];
+    if (in[4] > OCTREE_MAX_DEPTH || levels > in[4] || avail < OCTREE_HEADER_BYTES + 4 * size_t(levels)) return -1;
+
+    size_t offset = OCTREE_HEADER_BYTES + 4 * levels;
+    for (int l = 0; l < levels; l++) {
+        offset += getU32(in + OCTREE_HEADER_BYTES + 4 * l);
+        if (offset > avail) return l;
+    }
+    return levels;
+}
+
+// Decodes the first max_levels levels (or every level present in the avail bytes) of a stream into
+// points, one per node of the deepest decoded level at the center of its cell. points must hold
+// max_points. Returns the number of points, or -1 on a corrupt stream.
+template <typename PointT>
+int decodeOctree(const uint8_t * in, size_t avail, int max_levels, PointT * points, int max_points) {
+    int levels = octreeAvailableLevels(in, avail);
+    if (levels < 0) return -1;
+    levels = std::min(levels, max_levels);
+
+    float origin[3], size;
+    memcpy(origin, in + 12, sizeof(origin));
+    memcpy(&size, in + 24, sizeof(size));
+    if (getU32(in + 8) == 0) return 0;
+
+    std::vector<uint64_t> codes(1, 0), child_codes;
+    std::vector<uint8_t> colors(in + 28, in + 31), child_colors;
+    std::vector<uint8_t> occupancy, residuals;
+
+    const uint8_t * ptr = in + OCTREE_HEADER_BYTES + 4 * in[5];
+    for (int l = 0; l < levels; l++) {
+        const uint8_t * chunk_end = ptr + getU32(in + OCTREE_HEADER_BYTES + 4 * l);
+        uint32_t len;
+
+        occupancy.resize(codes.size());
+        size_t used = decodeStream(ptr, chunk_end - ptr, occupancy.data(), uint32_t(codes.size()), &len);
+        if (used == 0 || len != codes.size()) return -1;
+        ptr += used;
+
+        size_t children = 0;
+        for (uint8_t occ : occupancy) {
+            if (occ == 0) return -1;
+            children += __builtin_popcount(occ);
+        }
+        if (children > size_t(max_points)) return -1;
+
+        residuals.resize(children * 3);
+        used = decodeStream(ptr, chunk_end - ptr, residuals.data(), uint32_t(children * 3), &len);
+        if (used == 0 || len != children * 3) return -1;
+        ptr = chunk_end;
+
+        child_codes.resize(children);
+        child_colors.resize(children * 3);
+        size_t c = 0;
+        for (size_t i = 0; i < codes.size(); i++) {
+            for (int k = 0; k < 8; k++) {
+                if (!(occupancy[i] & (1 << k))) continue;
+                child_codes[c] = (codes[i] << 3) | k;
+                for (int ch = 0; ch < 3; ch++)
+                    child_colors[c * 3 + ch] = uint8_t(colors[i * 3 + ch] + residuals[ch * children + c]);
+                c++;
+            }
+        }
+        codes.swap(child_codes);
+        colors.swap(child_colors);
+    }
+
+    if (codes.size() > size_t(max_points)) return -1;
+
+    const float cell = size / float(1u << levels);
+    for (size_t i = 0; i < codes.size(); i++) {
+        PointT & p = points[i];
+        p.x = origin[0] + (compactBits3(codes[i] >> 2) + .5f) * cell;
+        p.y = origin[1] + (compactBits3(codes[i] >> 1) + .5f) * cell;
+        p.z = origin[2] + (compactBits3(codes[i]) + .5f) * cell;
+        p.r = colors[i * 3 + 0];
+        p.g = colors[i * 3 + 1];
+        p.b = colors[i * 3 + 2];
+    }
+
+    return int(codes.size());
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef META_PIPELINE_H
+#define META_PIPELINE_H
+
+/*
+ * Building blocks for the staged camera server and the receiver workers of
+ * the stitchers.
+ *
+ * Stages run on persistent threads and hand frames to each other through
+ * bounded rings. The rings only ever carry pointers into a fixed pool of
+ * preallocated frame slots, so a slot is owned by exactly one stage at a
+ * time and nothing is allocated per frame. A stage blocks when its input is
+ * empty or its output is full; closeRing wakes every waiter for shutdown.
+ *
+ * A latestSlot passes only the newest frame on instead: a producer that is
+ * faster than its consumer overwrites frames rather than blocking on them.
+ *
+ * stageStats accumulates the time a stage spends working (as opposed to
+ * waiting on a ring) so the server can report per-stage occupancy.
+ */
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#define RING_CAPACITY       8
+
+template <typename T>
+struct frameRing {
+    T items[RING_CAPACITY];
+    int head = 0;
+    int count = 0;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+// Appends item, blocking while the ring is full. Returns false once the ring is closed.
+template <typename T>
+bool pushRing(frameRing<T> * ring, const T & item) {
+    std::unique_lock<std::mutex> lock(ring->mutex);
+    ring->not_full.wait(lock, [ring] { return ring->count < RING_CAPACITY || ring->closed; });
+    if (ring->closed) return false;
+
+    ring->items[(ring->head + ring->count) % RING_CAPACITY] = item;
+    ring->count++;
+    ring->not_empty.notify_one();
+    return true;
+}
+
+// Removes the oldest item, blocking while the ring is empty. Returns false once the ring is closed and drained.
+template <typename T>
+bool popRing(frameRing<T> * ring, T * item) {
+    std::unique_lock<std::mutex> lock(ring->mutex);
+    ring->not_empty.wait(lock, [ring] { return ring->count > 0 || ring->closed; });
+    if (ring->count == 0) return false;
+
+    *item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % RING_CAPACITY;
+    ring->count--;
+    ring->not_full.notify_one();
+    return true;
+}
+
+// Non-blocking popRing, returns false when the ring is empty.
+template <typename T>
+bool tryPopRing(frameRing<T> * ring, T * item) {
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    if (ring->count == 0) return false;
+
+    *item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % RING_CAPACITY;
+    ring->count--;
+    ring->not_full.notify_one();
+    return true;
+}
+
+template <typename T>
+void closeRing(frameRing<T> * ring) {
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    ring->closed = true;
+    ring->not_empty.notify_all();
+    ring->not_full.notify_all();
+}
+
+// Newest-frame mailbox between one producer and one consumer thread over three preallocated items, for
+// stages that only ever want the latest frame. The producer fills an item and publishes it, getting back
+// the one to fill next; the consumer swaps the item it holds for the newest published one. Neither side
+// waits for the other, a published item the consumer never took is handed back and counted as dropped.
+template <typename T>
+struct latestSlot {
+    T * ready = NULL;           // newest published item, NULL once taken
+    T * spare = NULL;           // free item while nothing is ready
+    long published = 0;
+    long dropped = 0;
+    std::mutex mutex;
+};
+
+// items are three items: the producer fills the first, the consumer holds the third.
+template <typename T>
+void initLatestSlot(latestSlot<T> * slot, T * items) {
+    slot->ready = NULL;
+    slot->spare = &items[1];
+    slot->published = slot->dropped = 0;
+}
+
+// Publishes item, returns the item to fill next.
+template <typename T>
+T * publishLatest(latestSlot<T> * slot, T * item) {
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    T * next = slot->ready ? slot->ready : slot->spare;
+    if (slot->ready) slot->dropped++;
+    slot->ready = item;
+    slot->spare = NULL;
+    slot->published++;
+    return next;
+}
+
+// Swaps *held for the newest published item. Returns false and keeps *held when nothing new is ready.
+template <typename T>
+bool takeLatest(latestSlot<T> * slot, T ** held) {
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    if (!slot->ready) return false;
+
+    slot->spare = *held;
+    *held = slot->ready;
+    slot->ready = NULL;
+    return true;
+}
+
+template <typename T>
+void latestSlotStats(latestSlot<T> * slot, long * published, long * dropped) {
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    *published = slot->published;
+    *dropped = slot->dropped;
+}
+
+// Counter a consumer of several latestSlots sleeps on until any of their producers published.
+struct frameSignal {
+    uint64_t count = 0;
+    std::mutex mutex;
+    std::condition_variable raised;
+};
+
+inline void raiseSignal(frameSignal * signal) {
+    std::lock_guard<std::mutex> lock(signal->mutex);
+    signal->count++;
+    signal->raised.notify_all();
+}
+
+// Waits until the signal was raised past seen, returns the new count.
+inline uint64_t waitSignal(frameSignal * signal, uint64_t seen) {
+    std::unique_lock<std::mutex> lock(signal->mutex);
+    signal->raised.wait(lock, [signal, seen] { return signal->count > seen; });
+    return signal->count;
+}
+
+struct stageStats {
+    const char * name;
+    double busy_ms;             // time spent processing since the last report
+    long frames;                // frames processed since the last report
+    std::mutex mutex;
+};
+
+typedef std::chrono::time_point<std::chrono::high_resolution_clock> stageTime;
+
+inline void addStageTime(stageStats * stats, stageTime start, stageTime end, long frames = 1) {
+    std::lock_guard<std::mutex> lock(stats->mutex);
+    stats->busy_ms += std::chrono::duration<double, std::milli>(end - start).count();
+    stats->frames += frames;
+}
+
+// Returns the busy fraction of the stage over window_ms and resets its counters.
+inline double takeStageOccupancy(stageStats * stats, double window_ms, long * frames) {
+    std::lock_guard<std::mutex> lock(stats->mutex);
+    double occupancy = window_ms > 0 ? stats->busy_ms / window_ms : 0;
+    *frames = stats->frames;
+    stats->busy_ms = 0;
+    stats->frames = 0;
+    return occupancy;
+}
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef META_POSTPROCESS_H
+#define META_POSTPROCESS_H
+
+/*
+ * Depth post-processing chain on the Z16 image, in place between the capture and the deprojection,
+ * in the order of the librealsense filters it replaces (rs2::decimation_filter, rs2::threshold_filter,
+ * rs2::temporal_filter), which run single-threaded on the capture thread. Every stage is optional:
+ *
+ *   decimation   the median of the pixels with depth of every 2x2 or 4x4 block (the lower one of an
+ *                even count), a block without depth stays without. The image shrinks by the factor
+ *                in both directions and decimateExtension gives its intrinsics, so only the fused
+ *                depth kernels of Meta/convert.h can deproject it, rs2::pointcloud can not.
+ *   threshold    pixels closer than min_distance or farther than max_distance lose their depth.
+ *   temporal     exponential average with the previous output, weight alpha for the new frame,
+ *                restarted where the depth changed by more than delta. With persistence a pixel
+ *                without depth keeps its last value while it had depth in at least persistence of
+ *                the last 8 frames.
+ *
+ * Rows are split over OpenMP threads and every stage has an AVX2 kernel, the decimation sorts 16 blocks
+ * at a time with a sorting network. Everything is integer, so the result does not depend on the kernel
+ * or the number of threads.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#include <omp.h>
+
+#include "depth.h"
+
+#define DEPTH_TEMPORAL_DELTA    0.02f       // meters, default delta of the temporal filter
+#define DEPTH_HISTORY_FRAMES    8           // frames of the persistence history
+
+struct depthChain {
+    int decimation;             // 1, 2 or 4
+    float min_distance;         // meters, 0 keeps the close pixels
+    float max_distance;         // meters, 0 keeps the far pixels
+    float alpha;                // 0 disables the temporal filter
+    float delta;                // meters
+    int persistence;            // 0 never keeps a value, up to DEPTH_HISTORY_FRAMES
+    bool avx2;                  // run the AVX2 kernel, the caller checks the CPU
+    int max_pixels;
+    uint16_t * decimated;       // decimated image, before it goes back to the frame
+    int history_w, history_h;
+    uint16_t * history;         // last output of the temporal filter, the last depth where it had none
+    uint8_t * valid_bits;       // one bit per frame with depth, the current frame in bit 0
+};
+
+// The chain starts with every stage off, alpha > 0 enables the temporal filter.
+inline void initDepthChain(depthChain * chain, bool avx2) {
+    memset(chain, 0, sizeof(depthChain));
+    chain->decimation = 1;
+    chain->delta = DEPTH_TEMPORAL_DELTA;
+    chain->avx2 = avx2;
+}
+
+inline void freeDepthChain(depthChain * chain) {
+    free(chain->decimated);
+    free(chain->history);
+    free(chain->valid_bits);
+    chain->decimated = chain->history = NULL;
+    chain->valid_bits = NULL;
+    chain->max_pixels = chain->history_w = chain->history_h = 0;
+}
+
+inline bool depthChainActive(const depthChain * chain) {
+    return chain->decimation > 1 || chain->min_distance > 0 || chain->max_distance > 0 || chain->alpha > 0;
+}
+
+// Intrinsics of the image decimated by factor: the pixel (u, v) of it is the block around the pixel
+// (factor * u + (factor - 1) / 2, factor * v + (factor - 1) / 2) of ext. The distortion is in
+// normalized coordinates and stays.
+inline depthExtension decimateExtension(const depthExtension & ext, int factor) {
+    depthExtension out = ext;
+    out.width = uint16_t(ext.width / factor);
+    out.height = uint16_t(ext.height / factor);
+    out.fx = ext.fx / factor;
+    out.fy = ext.fy / factor;
+    out.ppx = (ext.ppx - (factor - 1) * .5f) / factor;
+    out.ppy = (ext.ppy - (factor - 1) * .5f) / factor;
+    return out;
+}
+
+// Median of the n values with depth, the lower one of an even count.
+inline uint16_t blockMedian(uint16_t * values, int n) {
+    int count = 0;
+    for (int k = 0; k < n; k++) {
+        const uint16_t d = values[k];
+        if (!d) continue;
+        int j = count++;
+        for (; j > 0 && values[j - 1] > d; j--)
+            values[j] = values[j - 1];
+        values[j] = d;
+    }
+    return count ? values[(count - 1) / 2] : 0;
+}
+
+// Decimates the output pixels [begin, end) of row v, out has width / factor pixels per row.
+inline void decimateRowScalar(const uint16_t * in, int width, int factor, int v, int begin, int end, uint16_t * out) {
+    const int out_w = width / factor;
+    uint16_t values[16];
+
+    for (int u = begin; u < end; u++) {
+        for (int dv = 0; dv < factor; dv++)
+            for (int du = 0; du < factor; du++)
+                values[dv * factor + du] = in[(v * factor + dv) * width + u * factor + du];
+        out[v * out_w + u] = blockMedian(values, factor * factor);
+    }
+}
+
+// Even and odd pixels of the 32 pixels of a and b, in order.
+__attribute__((target("avx2")))
+inline void deinterleaveAVX2(__m256i a, __m256i b, __m256i * even, __m256i * odd) {
+    const __m256i low = _mm256_set1_epi32(0xFFFF);
+    *even = _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_and_si256(a, low), _mm256_and_si256(b, low)), 0xD8);
+    *odd = _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_srli_epi32(a, 16), _mm256_srli_epi32(b, 16)), 0xD8);
+}
+
+// The 16 blocks from block column u of block row v, p[dv * factor + du] holds pixel (du, dv) of every block.
+template <int factor>
+__attribute__((target("avx2")))
+inline void loadBlocksAVX2(const uint16_t * in, int width, int v, int u, __m256i * p) {
+    for (int dv = 0; dv < factor; dv++) {
+        const __m256i * row = (const __m256i *)(in + size_t(v * factor + dv) * width + u * factor);
+        __m256i * q = p + dv * factor;
+
+        if (factor == 2) {
+            deinterleaveAVX2(_mm256_loadu_si256(row), _mm256_loadu_si256(row + 1), &q[0], &q[1]);
+        }
+        else {
+            __m256i even[2], odd[2];
+            deinterleaveAVX2(_mm256_loadu_si256(row), _mm256_loadu_si256(row + 1), &even[0], &odd[0]);
+            deinterleaveAVX2(_mm256_loadu_si256(row + 2), _mm256_loadu_si256(row + 3), &even[1], &odd[1]);
+            deinterleaveAVX2(even[0], even[1], &q[0], &q[2]);
+            deinterleaveAVX2(odd[0], odd[1], &q[1], &q[3]);
+        }
+    }
+}
+
+// Batcher's odd-even merge sort networks of 4 and 16 values, without the comparators that only order the
+// upper half. The medians are in the lower half.
+static const uint8_t median_network_4[][2] = {{0, 1}, {2, 3}, {0, 2}, {1, 3}, {1, 2}};
+static const uint8_t median_network_16[][2] = {
+    {0, 1}, {2, 3}, {4, 5}, {6, 7}, {8, 9}, {10, 11}, {12, 13}, {14, 15}, {0, 2}, {1, 3}, {4, 6}, {5, 7},
+    {8, 10}, {9, 11}, {12, 14}, {13, 15}, {1, 2}, {5, 6}, {9, 10}, {13, 14}, {0, 4}, {1, 5}, {2, 6}, {3, 7},
+    {8, 12}, {9, 13}, {10, 14}, {11, 15}, {2, 4}, {3, 5}, {10, 12}, {11, 13}, {1, 2}, {3, 4}, {5, 6}, {9, 10},
+    {11, 12}, {13, 14}, {0, 8}, {1, 9}, {2, 10}, {3, 11}, {4, 12}, {5, 13}, {6, 14}, {7, 15}, {4, 8}, {5, 9},
+    {6, 10}, {7, 11}, {2, 4}, {3, 5}, {6, 8}, {7, 9}, {1, 2}, {3, 4}, {5, 6}, {7, 8}};
+
+// Sorts the lower half of every lane over the n vectors.
+template <int n>
+__attribute__((target("avx2")))
+inline void sortLanesAVX2(__m256i * p) {
+    const uint8_t (*network)[2] = n == 4 ? median_network_4 : median_network_16;
+    const int size = n == 4 ? sizeof(median_network_4) / 2 : sizeof(median_network_16) / 2;
+
+    #pragma GCC unroll 64
+    for (int k = 0; k < size; k++) {
+        const int a = network[k][0], b = network[k][1];
+        const __m256i low = _mm256_min_epu16(p[a], p[b]);
+        p[b] = _mm256_max_epu16(p[a], p[b]);
+        p[a] = low;
+    }
+}
+
+// Decimation of row v, 16 blocks per step. Pixels without depth become 0xFFFF so the sorting network moves
+// them behind the others, the median of count pixels with depth is then the sorted value (count - 1) / 2.
+template <int factor>
+__attribute__((target("avx2")))
+inline void decimateRowAVX2(const uint16_t * in, int width, int v, uint16_t * out) {
+    const int n = factor * factor, out_w = width / factor;
+    const __m256i zero = _mm256_setzero_si256();
+
+    int u = 0;
+    for (; u + 16 <= out_w; u += 16) {
+        __m256i p[n];
+        loadBlocksAVX2<factor>(in, width, v, u, p);
+
+        __m256i count = _mm256_set1_epi16(n);
+        for (int k = 0; k < n; k++) {
+            const __m256i none = _mm256_cmpeq_epi16(p[k], zero);
+            count = _mm256_add_epi16(count, none);
+            p[k] = _mm256_or_si256(p[k], none);
+        }
+        sortLanesAVX2<n>(p);
+
+        __m256i median = p[0];
+        for (int j = 1; j < n / 2; j++)
+            median = _mm256_blendv_epi8(median, p[j], _mm256_cmpgt_epi16(count, _mm256_set1_epi16(short(2 * j))));
+        median = _mm256_andnot_si256(_mm256_cmpeq_epi16(count, zero), median);
+        _mm256_storeu_si256((__m256i *)(out + v * out_w + u), median);
+    }
+
+    decimateRowScalar(in, width, factor, v, u, out_w, out);
+}
+
+// Threshold and temporal filter parameters in depth units, alpha in 1/256.
+struct chainUnits {
+    int min, max;
+    int alpha, delta;
+    int persistence;
+};
+
+// Threshold and temporal filter of the pixels [begin, end), from in to out (which may be in).
+inline void filterPixelsScalar(depthChain * chain, const uint16_t * in, int begin, int end, const chainUnits & c,
+                               uint16_t * out) {
+    for (int i = begin; i < end; i++) {
+        int d = in[i];
+        if (d < c.min || d > c.max) d = 0;
+
+        if (c.alpha) {
+            const int last = chain->history[i];
+            unsigned bits = unsigned(chain->valid_bits[i]) << 1;
+
+            if (d) {
+                bits |= 1;
+                if (last && abs(d - last) <= c.delta)
+                    d = (c.alpha * d + (256 - c.alpha) * last + 128) >> 8;
+                chain->history[i] = uint16_t(d);
+            }
+            else if (c.persistence && last && __builtin_popcount(bits & 0xFF) >= c.persistence) {
+                d = last;
+            }
+            chain->valid_bits[i] = uint8_t(bits);
+        }
+        out[i] = uint16_t(d);
+    }
+}
+
+// last + ((alpha * (d - last) + 128) >> 8) of 8 pixels, the same as the weighted sum of the scalar filter.
+__attribute__((target("avx2")))
+inline __m256i blendDepthAVX2(__m128i d, __m128i last, __m256i alpha) {
+    const __m256i l = _mm256_cvtepu16_epi32(last);
+    const __m256i diff = _mm256_sub_epi32(_mm256_cvtepu16_epi32(d), l);
+    return _mm256_add_epi32(l, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, alpha), _mm256_set1_epi32(128)), 8));
+}
+
+// 16 pixels per step, the frames with depth of a pixel are counted with a nibble table.
+__attribute__((target("avx2")))
+inline void filterPixelsAVX2(depthChain * chain, const uint16_t * in, int begin, int end, const chainUnits & c,
+                             uint16_t * out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i min = _mm256_set1_epi16(short(c.min)), max = _mm256_set1_epi16(short(c.max));
+    const __m256i delta = _mm256_set1_epi16(short(c.delta));
+    const __m256i alpha = _mm256_set1_epi32(c.alpha);
+    const __m256i persistence = _mm256_set1_epi16(short(c.persistence ? c.persistence - 1 : DEPTH_HISTORY_FRAMES));
+    const __m128i nibble_bits = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+    int i = begin;
+    for (; i + 16 <= end; i += 16) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(in + i));
+        d = _mm256_and_si256(d, _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(d, min), d),
+                                                 _mm256_cmpeq_epi16(_mm256_min_epu16(d, max), d)));
+
+        if (c.alpha) {
+            const __m256i last = _mm256_loadu_si256((const __m256i *)(chain->history + i));
+            const __m256i has = _mm256_xor_si256(_mm256_cmpeq_epi16(d, zero), ones);
+            const __m256i has_last = _mm256_xor_si256(_mm256_cmpeq_epi16(last, zero), ones);
+
+            __m128i bits = _mm_loadu_si128((const __m128i *)(chain->valid_bits + i));
+            const __m128i has_bytes = _mm_packs_epi16(_mm256_castsi256_si128(has), _mm256_extracti128_si256(has, 1));
+            bits = _mm_or_si128(_mm_add_epi8(bits, bits), _mm_and_si128(has_bytes, _mm_set1_epi8(1)));
+            _mm_storeu_si128((__m128i *)(chain->valid_bits + i), bits);
+
+            const __m128i frames = _mm_add_epi8(_mm_shuffle_epi8(nibble_bits, _mm_and_si128(bits, low_nibble)),
+                                                _mm_shuffle_epi8(nibble_bits, _mm_and_si128(_mm_srli_epi16(bits, 4), low_nibble)));
+            const __m256i keep = _mm256_and_si256(has_last, _mm256_cmpgt_epi16(_mm256_cvtepu8_epi16(frames), persistence));
+
+            const __m256i diff = _mm256_or_si256(_mm256_subs_epu16(d, last), _mm256_subs_epu16(last, d));
+            const __m256i close = _mm256_and_si256(has_last, _mm256_cmpeq_epi16(_mm256_subs_epu16(diff, delta), zero));
+            const __m256i blended = _mm256_permute4x64_epi64(
+                _mm256_packus_epi32(blendDepthAVX2(_mm256_castsi256_si128(d), _mm256_castsi256_si128(last), alpha),
+                                    blendDepthAVX2(_mm256_extracti128_si256(d, 1), _mm256_extracti128_si256(last, 1), alpha)),
+                0xD8);
+
+            d = _mm256_blendv_epi8(d, blended, _mm256_and_si256(has, close));
+            d = _mm256_blendv_epi8(d, last, _mm256_andnot_si256(has, keep));
+            _mm256_storeu_si256((__m256i *)(chain->history + i), _mm256_blendv_epi8(last, d, has));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), d);
+    }
+
+    filterPixelsScalar(chain, in, i, end, c, out);
+}
+
+// Runs the enabled stages over the *width x *height image of depth in place. The decimated image is
+// written to the start of depth and *width, *height are updated. depth_scale is the depth unit in meters.
+inline void processDepth(depthChain * chain, uint16_t * depth, int * width, int * height, float depth_scale,
+                         int num_threads) {
+    if (!depthChainActive(chain) || *width <= 0 || *height <= 0)
+        return;
+
+    const uint16_t * in = depth;
+    if (chain->decimation > 1) {
+        const int factor = chain->decimation, w = *width;
+        const int out_w = w / factor, out_h = *height / factor;
+        if (!chain->decimated || out_w * out_h > chain->max_pixels) {
+            free(chain->decimated);
+            chain->decimated = (uint16_t *)malloc(sizeof(uint16_t) * std::max(out_w * out_h, 1));
+            chain->max_pixels = out_w * out_h;
+        }
+
+        // Rows of the decimated image overlap rows of the source still being read, so it goes to a buffer.
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int v = 0; v < out_h; v++) {
+            if (chain->avx2 && factor == 2)
+                decimateRowAVX2<2>(depth, w, v, chain->decimated);
+            else if (chain->avx2 && factor == 4)
+                decimateRowAVX2<4>(depth, w, v, chain->decimated);
+            else
+                decimateRowScalar(depth, w, factor, v, 0, out_w, chain->decimated);
+        }
+
+        *width = out_w;
+        *height = out_h;
+        in = chain->decimated;
+    }
+
+    const int num_pixels = *width * *height;
+    const bool threshold = chain->min_distance > 0 || chain->max_distance > 0;
+    if (!threshold && chain->alpha <= 0) {
+        memcpy(depth, in, sizeof(uint16_t) * num_pixels);
+        return;
+    }
+
+    // The history starts over whenever the resolution changes.
+    if (chain->alpha > 0 && (chain->history_w != *width || chain->history_h != *height)) {
+        free(chain->history);
+        free(chain->valid_bits);
+        chain->history = (uint16_t *)calloc(std::max(num_pixels, 1), sizeof(uint16_t));
+        chain->valid_bits = (uint8_t *)calloc(std::max(num_pixels, 1), 1);
+        chain->history_w = *width;
+        chain->history_h = *height;
+    }
+
+    chainUnits units;
+    units.min = int(std::min(chain->min_distance / depth_scale, 65535.f));
+    units.max = chain->max_distance > 0 ? int(std::min(chain->max_distance / depth_scale, 65535.f)) : 65535;
+    units.alpha = chain->alpha > 0 ? std::min(std::max(int(chain->alpha * 256 + .5f), 1), 256) : 0;
+    units.delta = int(std::min(chain->delta / depth_scale, 65535.f));
+    units.persistence = std::min(chain->persistence, DEPTH_HISTORY_FRAMES);
+
+    // blocks of whole rows, a multiple of 16 pixels for the AVX2 kernel
+    const int block = std::max(16, 4096 / std::max(*width, 1) * *width / 16 * 16);
+    const int num_blocks = (num_pixels + block - 1) / block;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int b = 0; b < num_blocks; b++) {
+        const int end = std::min((b + 1) * block, num_pixels);
+        if (chain->avx2)
+            filterPixelsAVX2(chain, in, b * block, end, units, depth);
+        else
+            filterPixelsScalar(chain, in, b * block, end, units, depth);
+    }
+}
+
+// Decimates a color frame aligned to the full depth image to the center pixel of every block, so the fused
+// kernels can read it as aligned to the decimated image. out has width / factor pixels of cl_bp bytes per row.
+inline void decimateColor(const uint8_t * color, int width, int height, int cl_bp, int cl_sb, int factor, uint8_t * out,
+                          int num_threads) {
+    const int out_w = width / factor, out_h = height / factor;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int v = 0; v < out_h; v++)
+        for (int u = 0; u < out_w; u++)
+            memcpy(out + (size_t(v) * out_w + u) * cl_bp,
+                   color + size_t(v * factor + factor / 2) * cl_sb + size_t(u * factor + factor / 2) * cl_bp, cl_bp);
+}
+
+#endif
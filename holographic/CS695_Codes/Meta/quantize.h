@@ -0,0 +1,373 @@
+#ifndef META_QUANTIZE_H
+#define META_QUANTIZE_H
+
+/*
+ * Quantization of the record coordinates (x, y, z of the 5-short records). A coordinate c in meters
+ * after the camera transform is sent as
+ *
+ *   saturate_int16(trunc((c - origin) * 1000 / step_mm))
+ *
+ * so the step trades precision for range: +-16.3 m around the origin at 0.5 mm, +-32.7 m at 1 mm and
+ * +-65.5 m at 2 mm. Points outside the range are clamped to its border instead of wrapping around.
+ * The conversion kernels of Meta/convert.h truncate and saturate exactly like this, they get the origin
+ * folded into their transform (quantizeTransform) and quantRate as conv_rate.
+ *
+ * Framed producers describe every frame with a quantExtension right behind the frameHeader
+ * (FRAME_FLAG_QUANT in Meta/frame.h): the step, the origin and the bounding box of the points of the
+ * frame in record units. Frames without it carry the legacy 1 mm records around the world origin.
+ * Receivers fold the origin into their own transform (dequantizeTransform) or use dequantizeRecords;
+ * a stitcher takes the records of a camera straight to the records it sends (transformRecords).
+ *
+ * A coarser step also makes the residuals of the predictive codec (Meta/codec.h) and the coordinate
+ * changes the delta coder (Meta/temporal.h) sees smaller, so the compressed formats shrink with it.
+ * Steps are powers of two in millimeters, so 1000 / step_mm and its inverse are exact in float.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "roi.h"
+#include "soa.h"
+
+#define QUANT_MIN_STEP_MM   0.25f
+#define QUANT_MAX_STEP_MM   8.0f
+
+struct quantizer {
+    float step_mm;              // record unit in millimeters
+    float origin[3];            // meters, subtracted after the camera transform
+};
+
+// Header extension of a frame with FRAME_FLAG_QUANT, little endian.
+struct quantExtension {
+    float step_mm;
+    float origin[3];
+    int16_t box_min[3];         // bounding box of the points of the frame in record units,
+    int16_t box_max[3];         // min > max for a frame without points
+};
+
+static_assert(sizeof(quantExtension) == 28, "quantExtension must stay 28 bytes on the wire");
+
+inline quantizer defaultQuantizer() {
+    quantizer q = {1.f, {0, 0, 0}};
+    return q;
+}
+
+// The legacy records: 1 mm around the world origin, what a frame without FRAME_FLAG_QUANT holds.
+inline bool isDefaultQuantizer(const quantizer & q) {
+    return q.step_mm == 1.f && q.origin[0] == 0 && q.origin[1] == 0 && q.origin[2] == 0;
+}
+
+inline bool validQuantStep(float step_mm) {
+    for (float step = QUANT_MIN_STEP_MM; step <= QUANT_MAX_STEP_MM; step *= 2)
+        if (step_mm == step) return true;
+    return false;
+}
+
+// Record units per meter, the conv_rate of the conversion kernels.
+inline float quantRate(const quantizer & q) {
+    return 1000.f / q.step_mm;
+}
+
+// The row-major transform tf followed by the subtraction of the origin, for the conversion kernels.
+inline void quantizeTransform(const quantizer & q, const float * tf, float * out) {
+    memcpy(out, tf, sizeof(float) * 16);
+    for (int r = 0; r < 3; r++)
+        out[r * 4 + 3] -= q.origin[r];
+}
+
+// The row-major transform tf (NULL for identity) applied after the origin is added back, for the receivers.
+// The step stays with the rate: tf * (record / quantRate + origin) = out * (record / quantRate).
+inline void dequantizeTransform(const quantizer & q, const float * tf, float * out) {
+    static const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    const float * m = tf ? tf : identity;
+
+    memcpy(out, m, sizeof(float) * 16);
+    for (int r = 0; r < 4; r++)
+        out[r * 4 + 3] = m[r * 4 + 3] + m[r * 4] * q.origin[0] + m[r * 4 + 1] * q.origin[1] + m[r * 4 + 2] * q.origin[2];
+}
+
+// The region of interest of the kernels: after quantizeTransform in meters (convertParams) and in record
+// units (depthConvertParams).
+inline void quantizeRoi(const roiSet & roi, const quantizer & q, roiSet * meters, roiSet * records) {
+    const float shift[16] = {1, 0, 0, q.origin[0], 0, 1, 0, q.origin[1], 0, 0, 1, q.origin[2], 0, 0, 0, 1};
+    transformRoi(roi, shift, meters);
+    scaleRoi(*meters, quantRate(q), records);
+}
+
+// One coordinate with the semantics of the kernels: truncated like cvttps (NaN and out of range give
+// INT32_MIN) and saturated to int16.
+inline short quantizeCoordinate(float v, float origin, float rate) {
+    const float s = (v - origin) * rate;
+    const int t = s >= -2147483648.f && s < 2147483648.f ? int(s) : INT32_MIN;
+    return short(std::min(std::max(t, -32768), 32767));
+}
+
+// Converts points in meters with x, y, z, r, g, b members (e.g. pcl::PointXYZRGB) to records. Four points
+// per iteration: cvttps and the saturating packs do the clamping, only the interleave is per point.
+template <typename PointT>
+inline void quantizePoints(const PointT * points, int num_points, const quantizer & q, short * records) {
+    const float rate = quantRate(q);
+    const __m128 r = _mm_set1_ps(rate);
+    const __m128 ox = _mm_set1_ps(q.origin[0]), oy = _mm_set1_ps(q.origin[1]), oz = _mm_set1_ps(q.origin[2]);
+    int i = 0;
+
+    for (; i + 4 <= num_points; i += 4) {
+        const PointT * p = points + i;
+        __attribute__((aligned(16))) short c[16];
+
+        const __m128 x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+        const __m128 y = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+        const __m128 z = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+        const __m128i qz = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(z, oz), r));
+        _mm_store_si128((__m128i *)c, _mm_packs_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(x, ox), r)),
+                                                      _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(y, oy), r))));
+        _mm_store_si128((__m128i *)(c + 8), _mm_packs_epi32(qz, qz));
+
+        for (int k = 0; k < 4; k++) {
+            short * out = records + size_t(i + k) * 5;
+            out[0] = c[k];
+            out[1] = c[4 + k];
+            out[2] = c[8 + k];
+            out[3] = short(p[k].r | (p[k].g << 8));
+            out[4] = short(p[k].b);
+        }
+    }
+
+    for (; i < num_points; i++) {
+        short * out = records + size_t(i) * 5;
+        out[0] = quantizeCoordinate(points[i].x, q.origin[0], rate);
+        out[1] = quantizeCoordinate(points[i].y, q.origin[1], rate);
+        out[2] = quantizeCoordinate(points[i].z, q.origin[2], rate);
+        out[3] = short(points[i].r | (points[i].g << 8));
+        out[4] = short(points[i].b);
+    }
+}
+
+// Converts every downsample-th record back to a point in meters, returns the number of points.
+template <typename PointT>
+inline int dequantizeRecords(const short * records, int num_points, int downsample, const quantizer & q,
+                             PointT * points) {
+    const float rate = quantRate(q);
+    int count = 0;
+
+    for (int i = 0; i < num_points; i += downsample) {
+        const short * p = records + size_t(i) * 5;
+        PointT & out = points[count++];
+        out.x = (float)p[0] / rate + q.origin[0];
+        out.y = (float)p[1] / rate + q.origin[1];
+        out.z = (float)p[2] / rate + q.origin[2];
+        out.r = (uint8_t)(p[3] & 0xFF);
+        out.g = (uint8_t)((p[3] >> 8) & 0xFF);
+        out.b = (uint8_t)(p[4] & 0xFF);
+    }
+    return count;
+}
+
+// Converts records of quantizer from to quantizer to in place, e.g. to forward records of several cameras
+// as legacy 1 mm records. Coordinates outside the range of to saturate.
+inline void requantizeRecords(short * records, int num_points, const quantizer & from, const quantizer & to) {
+    const float scale = to.step_mm / from.step_mm, rate = quantRate(to);
+    float offset[3];
+    for (int c = 0; c < 3; c++)
+        offset[c] = (from.origin[c] - to.origin[c]) * rate;
+
+    for (int i = 0; i < num_points; i++) {
+        short * p = records + size_t(i) * 5;
+        for (int c = 0; c < 3; c++)
+            p[c] = quantizeCoordinate(p[c] / scale + offset[c], 0, 1);
+    }
+}
+
+// The row-major transform that takes records of quantizer from through the camera transform tf (NULL for
+// identity) straight to records of quantizer to, for transformRecords: out = m * record, truncated.
+inline void recordTransform(const quantizer & from, const float * tf, const quantizer & to, float * m) {
+    float world[16];
+    dequantizeTransform(from, tf, world);
+    quantizeTransform(to, world, m);
+
+    const float rate = quantRate(to), scale = rate / quantRate(from);
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++)
+            m[r * 4 + c] *= scale;
+        m[r * 4 + 3] *= rate;
+    }
+}
+
+// Transforms the records of the samples [begin, end), sample s being record s * downsample, into out and
+// returns how many were kept. roi is in the record units of the output, NULL keeps every point.
+inline int transformRecordsScalar(const short * in, int begin, int end, int downsample, const float * m,
+                                  const roiSet * roi, short * out) {
+    int count = 0;
+
+    for (int s = begin; s < end; s++) {
+        const short * p = in + size_t(s) * downsample * 5;
+        const float x = p[0], y = p[1], z = p[2];
+        const float wx = fmaf(m[0], x, fmaf(m[1], y, fmaf(m[2], z, m[3])));
+        const float wy = fmaf(m[4], x, fmaf(m[5], y, fmaf(m[6], z, m[7])));
+        const float wz = fmaf(m[8], x, fmaf(m[9], y, fmaf(m[10], z, m[11])));
+        if (roi && !roiContains(*roi, wx, wy, wz)) continue;
+
+        short * o = out + size_t(count++) * 5;
+        o[0] = quantizeCoordinate(wx, 0, 1);
+        o[1] = quantizeCoordinate(wy, 0, 1);
+        o[2] = quantizeCoordinate(wz, 0, 1);
+        o[3] = p[3];
+        o[4] = p[4];
+    }
+    return count;
+}
+
+// 8 samples per iteration: x|y and z|color words are gathered with the record stride, so downsampling
+// costs nothing extra, and cvttps with the saturating packs does the clamping. Only the interleave of
+// the kept records is per point.
+__attribute__((target("avx2,fma")))
+inline int transformRecordsAVX2(const short * in, int begin, int end, int downsample, const float * m,
+                                const roiSet * roi, short * out) {
+    const __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(downsample * 10));
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+    const int simd_end = begin + ((end - begin) & ~7);
+    int count = 0;
+
+    for (int s = begin; s < simd_end; s += 8) {
+        const short * p = in + size_t(s) * downsample * 5;
+        const __m256i xy = _mm256_i32gather_epi32((const int *)p, idx, 1);
+        const __m256i zc = _mm256_i32gather_epi32((const int *)(p + 2), idx, 1);
+        const __m256 x = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(xy, 16), 16));
+        const __m256 y = _mm256_cvtepi32_ps(_mm256_srai_epi32(xy, 16));
+        const __m256 z = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(zc, 16), 16));
+
+        const __m256 wx = _mm256_fmadd_ps(m00, x, _mm256_fmadd_ps(m01, y, _mm256_fmadd_ps(m02, z, m03)));
+        const __m256 wy = _mm256_fmadd_ps(m10, x, _mm256_fmadd_ps(m11, y, _mm256_fmadd_ps(m12, z, m13)));
+        const __m256 wz = _mm256_fmadd_ps(m20, x, _mm256_fmadd_ps(m21, y, _mm256_fmadd_ps(m22, z, m23)));
+        unsigned mask = roi ? _mm256_movemask_ps(roiMaskAVX2(*roi, wx, wy, wz)) : 0xFF;
+        if (mask == 0) continue;
+
+        __attribute__((aligned(16))) short c[24];
+        const __m256i qx = _mm256_cvttps_epi32(wx), qy = _mm256_cvttps_epi32(wy), qz = _mm256_cvttps_epi32(wz);
+        _mm_store_si128((__m128i *)c, _mm_packs_epi32(_mm256_castsi256_si128(qx), _mm256_extracti128_si256(qx, 1)));
+        _mm_store_si128((__m128i *)(c + 8), _mm_packs_epi32(_mm256_castsi256_si128(qy), _mm256_extracti128_si256(qy, 1)));
+        _mm_store_si128((__m128i *)(c + 16), _mm_packs_epi32(_mm256_castsi256_si128(qz), _mm256_extracti128_si256(qz, 1)));
+
+        for (; mask; mask &= mask - 1) {
+            const int k = __builtin_ctz(mask);
+            const short * src = p + size_t(k) * downsample * 5;
+            short * o = out + size_t(count++) * 5;
+            o[0] = c[k];
+            o[1] = c[8 + k];
+            o[2] = c[16 + k];
+            o[3] = src[3];
+            o[4] = src[4];
+        }
+    }
+    return count;
+}
+
+// Moves every downsample-th of the records in through m (recordTransform) into out, keeping only the points
+// inside roi (record units of the output, NULL for all), so a stitcher can place the records of every
+// camera straight into its outgoing buffer. Returns the records written, at most
+// (num_points + downsample - 1) / downsample.
+inline int transformRecords(const short * in, int num_points, int downsample, const float * m, const roiSet * roi,
+                            short * out) {
+    const int samples = (num_points + downsample - 1) / downsample;
+    if (roi && !roiActive(roi)) roi = NULL;
+
+    int count = 0, s = 0;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        s = samples & ~7;
+        count = transformRecordsAVX2(in, 0, s, downsample, m, roi, out);
+    }
+    return count + transformRecordsScalar(in, s, samples, downsample, m, roi, out + size_t(count) * 5);
+}
+
+// Bounding box of the records. 8 records are 40 shorts, so in five consecutive registers every lane
+// always holds the same field and the minimum and maximum are taken lane by lane.
+inline void recordBounds(const short * records, int num_points, int16_t * box_min, int16_t * box_max) {
+    __m128i lo[5], hi[5];
+    for (int k = 0; k < 5; k++) {
+        lo[k] = _mm_set1_epi16(32767);
+        hi[k] = _mm_set1_epi16(-32768);
+    }
+
+    int i = 0;
+    for (; i + 8 <= num_points; i += 8) {
+        const __m128i * p = (const __m128i *)(records + size_t(i) * 5);
+        for (int k = 0; k < 5; k++) {
+            const __m128i v = _mm_loadu_si128(p + k);
+            lo[k] = _mm_min_epi16(lo[k], v);
+            hi[k] = _mm_max_epi16(hi[k], v);
+        }
+    }
+
+    int16_t lanes_lo[40], lanes_hi[40];
+    for (int k = 0; k < 5; k++) {
+        _mm_storeu_si128((__m128i *)(lanes_lo + k * 8), lo[k]);
+        _mm_storeu_si128((__m128i *)(lanes_hi + k * 8), hi[k]);
+    }
+    for (int c = 0; c < 3; c++) {
+        box_min[c] = 32767;
+        box_max[c] = -32768;
+    }
+    for (int j = 0; j < 40; j++) {
+        if (j % 5 > 2) continue;
+        box_min[j % 5] = std::min(box_min[j % 5], lanes_lo[j]);
+        box_max[j % 5] = std::max(box_max[j % 5], lanes_hi[j]);
+    }
+
+    for (; i < num_points; i++)
+        for (int c = 0; c < 3; c++) {
+            box_min[c] = std::min(box_min[c], int16_t(records[size_t(i) * 5 + c]));
+            box_max[c] = std::max(box_max[c], int16_t(records[size_t(i) * 5 + c]));
+        }
+}
+
+// Same for one int16 plane of a SoA payload.
+inline void planeBounds(const int16_t * plane, int num_points, int16_t * lo, int16_t * hi) {
+    __m128i vlo = _mm_set1_epi16(32767), vhi = _mm_set1_epi16(-32768);
+    int i = 0;
+    for (; i + 8 <= num_points; i += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(plane + i));
+        vlo = _mm_min_epi16(vlo, v);
+        vhi = _mm_max_epi16(vhi, v);
+    }
+
+    int16_t lanes_lo[8], lanes_hi[8];
+    _mm_storeu_si128((__m128i *)lanes_lo, vlo);
+    _mm_storeu_si128((__m128i *)lanes_hi, vhi);
+    *lo = 32767;
+    *hi = -32768;
+    for (int k = 0; k < 8; k++) {
+        *lo = std::min(*lo, lanes_lo[k]);
+        *hi = std::max(*hi, lanes_hi[k]);
+    }
+    for (; i < num_points; i++) {
+        *lo = std::min(*lo, plane[i]);
+        *hi = std::max(*hi, plane[i]);
+    }
+}
+
+// Header extension of a frame of records.
+inline quantExtension quantExtensionOf(const quantizer & q, const short * records, int num_points) {
+    quantExtension ext;
+    ext.step_mm = q.step_mm;
+    memcpy(ext.origin, q.origin, sizeof(ext.origin));
+    recordBounds(records, num_points, ext.box_min, ext.box_max);
+    return ext;
+}
+
+// Same for a SoA payload.
+inline quantExtension quantExtensionOfSoA(const quantizer & q, const uint8_t * payload, int num_points) {
+    const soaPlanes planes = soaPlanesOf(payload, num_points);
+    quantExtension ext;
+    ext.step_mm = q.step_mm;
+    memcpy(ext.origin, q.origin, sizeof(ext.origin));
+    planeBounds(planes.x, num_points, &ext.box_min[0], &ext.box_max[0]);
+    planeBounds(planes.y, num_points, &ext.box_min[1], &ext.box_max[1]);
+    planeBounds(planes.z, num_points, &ext.box_min[2], &ext.box_max[2]);
+    return ext;
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef META_REACTOR_H
+#define META_REACTOR_H
+
+/*
+ * Receive side of the stitchers: one epoll loop over every camera connection.
+ *
+ * Camera sockets are non-blocking and each one reassembles its frames
+ * incrementally as the bytes arrive: the frameHeader, its extension and the
+ * payload go straight into the wireFrame the connection currently fills, so
+ * nothing is copied or allocated however a frame is split up on the wire.
+ * A complete frame is handed to on_frame on the reactor thread, which leaves
+ * the connection with the wireFrame to fill next (e.g. from a latestSlot).
+ * Reads stop after READ_BUDGET bytes per connection and round, so a camera
+ * with a deep socket buffer cannot starve the others.
+ *
+ * Failures are per connection. A camera that disconnects, sends a frame
+ * that does not fit its header, or stalls in the middle of a frame for
+ * RECV_STALL_MS is closed and reported to on_close; the other connections
+ * keep streaming.
+ *
+ * One more descriptor (the VR client connection of the stitcher) can be
+ * watched with watchReactorFd. Other threads wake the loop with wakeReactor,
+ * on_wake then runs on the reactor thread, so the reactor stays the only
+ * writer of the camera sockets.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+#include "frame.h"
+
+#define READ_BUDGET         (4 << 20)
+#define RECV_STALL_MS       2000
+#define MAX_REACTOR_EVENTS  64
+
+#define PART_HEADER         0
+#define PART_EXTENSION      1
+#define PART_PAYLOAD        2
+
+// One frame as it came off the wire.
+struct wireFrame {
+    frameHeader header;
+    uint8_t extension[MAX_HEADER_BYTES];    // header_bytes - sizeof(frameHeader) bytes
+    uint8_t * payload;                      // SOA_ALIGN aligned, max_payload bytes of the connection
+};
+
+struct cameraConn {
+    int sock;                               // -1 once closed
+    int index;                              // camera number of the application
+    wireFrame * frame;                      // frame being reassembled
+    size_t max_payload;
+    int part;                               // PART_HEADER, PART_EXTENSION or PART_PAYLOAD
+    size_t have;                            // bytes of the part received so far
+    std::chrono::steady_clock::time_point last_progress;
+    long frames;                            // since the last report
+    double bytes;
+};
+
+struct receiveReactor {
+    int epfd;
+    int wake_fd;
+    int watch_fd;                           // -1 for none
+    void * user;
+    void (*on_frame)(receiveReactor *, cameraConn *);
+    void (*on_close)(receiveReactor *, cameraConn *, const char *);
+    void (*on_wake)(receiveReactor *);
+    void (*on_watch)(receiveReactor *);
+    std::atomic<bool> running;
+    std::vector<cameraConn *> conns;
+    int open_conns;
+};
+
+inline size_t partBytes(const cameraConn * conn) {
+    const frameHeader & header = conn->frame->header;
+    switch (conn->part) {
+        case PART_HEADER:       return sizeof(frameHeader);
+        case PART_EXTENSION:    return header.header_bytes - sizeof(frameHeader);
+        default:                return header.payload_bytes;
+    }
+}
+
+inline uint8_t * partTarget(cameraConn * conn) {
+    switch (conn->part) {
+        case PART_HEADER:       return (uint8_t *)&conn->frame->header + conn->have;
+        case PART_EXTENSION:    return conn->frame->extension + conn->have;
+        default:                return conn->frame->payload + conn->have;
+    }
+}
+
+// Closes the connection, the other connections are not affected. The caller is told through on_close.
+inline void closeCameraConn(receiveReactor * reactor, cameraConn * conn, const char * reason) {
+    if (conn->sock < 0) return;
+
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+    close(conn->sock);
+    conn->sock = -1;
+    reactor->open_conns--;
+    if (reactor->on_close)
+        reactor->on_close(reactor, conn, reason);
+}
+
+// Moves on to the next part once the current one is complete, handing complete frames to on_frame.
+// Returns false when the header does not describe a frame the connection can take.
+inline bool finishPart(receiveReactor * reactor, cameraConn * conn) {
+    while (conn->have == partBytes(conn)) {
+        const frameHeader & header = conn->frame->header;
+        conn->have = 0;
+
+        if (conn->part == PART_HEADER) {
+            if (!validFrameHeader(header) || header.payload_bytes > conn->max_payload)
+                return false;
+            conn->part = PART_EXTENSION;
+        }
+        else if (conn->part == PART_EXTENSION) {
+            conn->part = PART_PAYLOAD;
+        }
+        else {
+            conn->part = PART_HEADER;
+            conn->frames++;
+            reactor->on_frame(reactor, conn);
+            // on_frame may have closed the connection
+            if (conn->sock < 0) return true;
+        }
+    }
+    return true;
+}
+
+// Reads what the socket holds, at most READ_BUDGET bytes.
+inline void readCameraConn(receiveReactor * reactor, cameraConn * conn) {
+    size_t budget = READ_BUDGET;
+
+    while (conn->sock >= 0 && budget > 0) {
+        const size_t want = std::min(partBytes(conn) - conn->have, budget);
+        ssize_t received = recv(conn->sock, partTarget(conn), want, MSG_DONTWAIT);
+        if (received == 0) {
+            closeCameraConn(reactor, conn, "Camera disconnected");
+            return;
+        }
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                closeCameraConn(reactor, conn, "Receive failure");
+            return;
+        }
+
+        conn->have += received;
+        conn->bytes += received;
+        conn->last_progress = std::chrono::steady_clock::now();
+        budget -= received;
+
+        if (!finishPart(reactor, conn)) {
+            closeCameraConn(reactor, conn, "Bad frame header");
+            return;
+        }
+    }
+}
+
+inline void initReceiveReactor(receiveReactor * reactor, void * user) {
+    reactor->watch_fd = -1;
+    reactor->user = user;
+    reactor->on_frame = NULL;
+    reactor->on_close = NULL;
+    reactor->on_wake = NULL;
+    reactor->on_watch = NULL;
+    reactor->running = true;
+    reactor->open_conns = 0;
+
+    if ((reactor->epfd = epoll_create1(0)) < 0 || (reactor->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        std::cerr << "\nepoll setup failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // the eventfd is tagged with its own address, the watched descriptor with that of watch_fd
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->wake_fd;
+    epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wake_fd, &ev);
+}
+
+// Adds a connected camera socket, switching it to non-blocking. frame is the first wireFrame to fill,
+// its payload max_payload bytes. Returns the connection, NULL when epoll does not take the socket.
+inline cameraConn * addCameraConn(receiveReactor * reactor, int sock, int index, wireFrame * frame, size_t max_payload) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    cameraConn * conn = new cameraConn();
+    conn->sock = sock;
+    conn->index = index;
+    conn->frame = frame;
+    conn->max_payload = max_payload;
+    conn->part = PART_HEADER;
+    conn->have = 0;
+    conn->last_progress = std::chrono::steady_clock::now();
+    conn->frames = 0;
+    conn->bytes = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        std::cerr << "epoll_ctl failed: " << strerror(errno) << std::endl;
+        delete conn;
+        return NULL;
+    }
+
+    reactor->conns.push_back(conn);
+    reactor->open_conns++;
+    return conn;
+}
+
+// Calls on_watch whenever fd is readable. The descriptor is left blocking, the callback reads with MSG_DONTWAIT.
+inline void watchReactorFd(receiveReactor * reactor, int fd, void (*on_watch)(receiveReactor *)) {
+    reactor->watch_fd = fd;
+    reactor->on_watch = on_watch;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->watch_fd;
+    epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Makes the reactor thread call on_wake, callable from any thread and async signal safe.
+inline void wakeReactor(receiveReactor * reactor) {
+    uint64_t one = 1;
+    if (write(reactor->wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+inline void stopReceiveReactor(receiveReactor * reactor) {
+    reactor->running = false;
+    wakeReactor(reactor);
+}
+
+// One round of the event loop, waiting at most timeout_ms for events.
+inline void pollReceiveReactor(receiveReactor * reactor, int timeout_ms) {
+    struct epoll_event events[MAX_REACTOR_EVENTS];
+    int n = epoll_wait(reactor->epfd, events, MAX_REACTOR_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == &reactor->wake_fd) {
+            uint64_t value;
+            while (read(reactor->wake_fd, &value, sizeof(value)) < 0 && errno == EINTR) {}
+            if (reactor->on_wake)
+                reactor->on_wake(reactor);
+            continue;
+        }
+        if (events[i].data.ptr == &reactor->watch_fd) {
+            reactor->on_watch(reactor);
+            continue;
+        }
+
+        cameraConn * conn = (cameraConn *)events[i].data.ptr;
+        if (conn->sock >= 0)
+            readCameraConn(reactor, conn);
+    }
+
+    // A camera stuck in the middle of a frame. Between frames a pulled camera is idle by design.
+    auto now = std::chrono::steady_clock::now();
+    for (cameraConn * conn : reactor->conns) {
+        if (conn->sock >= 0 && (conn->part != PART_HEADER || conn->have > 0) &&
+            std::chrono::duration<double, std::milli>(now - conn->last_progress).count() > RECV_STALL_MS)
+            closeCameraConn(reactor, conn, "Camera stalled");
+    }
+}
+
+// Runs the event loop until stopReceiveReactor is called or no camera is left.
+inline void runReceiveReactor(receiveReactor * reactor, void (*tick)(receiveReactor *) = NULL) {
+    while (reactor->running && reactor->open_conns > 0) {
+        pollReceiveReactor(reactor, 100);
+        if (tick)
+            tick(reactor);
+    }
+}
+
+// Prints what every camera delivered over window_ms and resets the counters, on the reactor thread.
+inline void printConnStats(receiveReactor * reactor, double window_ms) {
+    for (cameraConn * conn : reactor->conns) {
+        std::cout << "camera " << conn->index << (conn->sock < 0 ? " (closed)" : "") << ": "
+                  << conn->frames * 1000.0 / window_ms << " fps, " << conn->bytes / 1000.0 / window_ms << " MB/s" << std::endl;
+        conn->frames = 0;
+        conn->bytes = 0;
+    }
+}
+
+inline void closeReceiveReactor(receiveReactor * reactor) {
+    for (cameraConn * conn : reactor->conns) {
+        if (conn->sock >= 0)
+            close(conn->sock);
+        delete conn;
+    }
+    reactor->conns.clear();
+    reactor->open_conns = 0;
+    close(reactor->wake_fd);
+    close(reactor->epfd);
+}
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef META_ROI_H
+#define META_ROI_H
+
+/*
+ * World-space region of interest: the union of convex volumes the points have to lie in.
+ *
+ * Every volume is a set of half-spaces a * x + b * y + c * z <= d, so axis aligned boxes, oriented boxes
+ * and general convex polytopes are all tested the same way. A point is kept when every plane of at least
+ * one volume holds; a set without volumes keeps everything. The tests run after the transform, so all
+ * cameras cull against the same capture volume.
+ *
+ * Config file, one volume per line, meters in world space, '#' starts a comment:
+ *   aabb     <min x y z> <max x y z>
+ *   obb      <center x y z> <half extents x y z> <yaw pitch roll, degrees, applied as Rz * Ry * Rx>
+ *   polytope <a b c d> [<a b c d> ...]
+ *
+ * On the control connection a set is sent as REQUEST_ROI followed by
+ *   u8 num_volumes | per volume: u8 num_planes | float a, b, c, d per plane (little endian)
+ * and replaces the set the producer uses from its next frame on; no volumes switches culling off.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <immintrin.h>
+
+#define ROI_MAX_VOLUMES     8
+#define ROI_MAX_PLANES      16
+#define ROI_MAX_BYTES       (1 + ROI_MAX_VOLUMES * (1 + ROI_MAX_PLANES * 16))
+
+struct roiSet {
+    int num_volumes;
+    int num_planes[ROI_MAX_VOLUMES];
+    float planes[ROI_MAX_VOLUMES][ROI_MAX_PLANES][4];
+};
+
+inline bool roiActive(const roiSet * roi) {
+    return roi && roi->num_volumes > 0;
+}
+
+// Adds a volume made of num_planes planes, false when the set or the volume is full.
+inline bool addRoiVolume(roiSet * roi, const float (*planes)[4], int num_planes) {
+    if (roi->num_volumes == ROI_MAX_VOLUMES || num_planes < 1 || num_planes > ROI_MAX_PLANES)
+        return false;
+    memcpy(roi->planes[roi->num_volumes], planes, sizeof(float) * 4 * num_planes);
+    roi->num_planes[roi->num_volumes++] = num_planes;
+    return true;
+}
+
+// Oriented box with the given center, half extents and axes (columns of the row-major rotation r).
+inline bool addRoiBox(roiSet * roi, const float * center, const float * half, const float * r) {
+    float planes[6][4];
+    for (int k = 0; k < 3; k++) {
+        const float ax = r[k], ay = r[3 + k], az = r[6 + k];
+        const float c = ax * center[0] + ay * center[1] + az * center[2];
+        const float front[4] = {ax, ay, az, c + half[k]};
+        const float back[4] = {-ax, -ay, -az, -c + half[k]};
+        memcpy(planes[2 * k], front, sizeof(front));
+        memcpy(planes[2 * k + 1], back, sizeof(back));
+    }
+    return addRoiVolume(roi, planes, 6);
+}
+
+inline bool addRoiAABB(roiSet * roi, const float * min, const float * max) {
+    const float center[3] = {(min[0] + max[0]) / 2, (min[1] + max[1]) / 2, (min[2] + max[2]) / 2};
+    const float half[3] = {(max[0] - min[0]) / 2, (max[1] - min[1]) / 2, (max[2] - min[2]) / 2};
+    const float identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    return addRoiBox(roi, center, half, identity);
+}
+
+// Rotation Rz(yaw) * Ry(pitch) * Rx(roll), angles in degrees, row major.
+inline void roiRotation(float yaw, float pitch, float roll, float * r) {
+    const float d = float(M_PI) / 180;
+    const float cy = cosf(yaw * d), sy = sinf(yaw * d);
+    const float cp = cosf(pitch * d), sp = sinf(pitch * d);
+    const float cr = cosf(roll * d), sr = sinf(roll * d);
+    const float m[9] = {cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr,
+                        sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr,
+                        -sp,     cp * sr,                cp * cr};
+    memcpy(r, m, sizeof(m));
+}
+
+// Parses a config (see the top of this file). Returns false and reports the line on an error.
+inline bool parseRoiConfig(std::istream & in, roiSet * roi) {
+    memset(roi, 0, sizeof(roiSet));
+    std::string line;
+
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string kind;
+        if (!(words >> kind)) continue;
+
+        std::vector<float> values;
+        float value;
+        while (words >> value) values.push_back(value);
+        bool ok = words.eof();
+
+        if (ok && kind == "aabb" && values.size() == 6) {
+            ok = addRoiAABB(roi, &values[0], &values[3]);
+        }
+        else if (ok && kind == "obb" && values.size() == 9) {
+            float r[9];
+            roiRotation(values[6], values[7], values[8], r);
+            ok = addRoiBox(roi, &values[0], &values[3], r);
+        }
+        else if (ok && kind == "polytope" && !values.empty() && values.size() % 4 == 0) {
+            ok = addRoiVolume(roi, (const float (*)[4])&values[0], int(values.size() / 4));
+        }
+        else {
+            ok = false;
+        }
+
+        if (!ok) {
+            std::cerr << "ROI config line " << line_number << ": bad volume or too many volumes/planes" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool loadRoiFile(const char * path, roiSet * roi) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Cannot open ROI config " << path << std::endl;
+        return false;
+    }
+    return parseRoiConfig(in, roi);
+}
+
+// The same region for points before the row-major transform tf: n . (R p + t) <= d becomes (R^T n) . p <= d - n . t.
+inline void transformRoi(const roiSet & roi, const float * tf, roiSet * out) {
+    roiSet result = roi;
+    for (int v = 0; v < roi.num_volumes; v++)
+        for (int k = 0; k < roi.num_planes[v]; k++) {
+            const float * n = roi.planes[v][k];
+            float * o = result.planes[v][k];
+            o[0] = n[0] * tf[0] + n[1] * tf[4] + n[2] * tf[8];
+            o[1] = n[0] * tf[1] + n[1] * tf[5] + n[2] * tf[9];
+            o[2] = n[0] * tf[2] + n[1] * tf[6] + n[2] * tf[10];
+            o[3] = n[3] - (n[0] * tf[3] + n[1] * tf[7] + n[2] * tf[11]);
+        }
+    *out = result;
+}
+
+// The same region with coordinates multiplied by scale (> 0), e.g. in record units instead of meters.
+inline void scaleRoi(const roiSet & roi, float scale, roiSet * out) {
+    *out = roi;
+    for (int v = 0; v < roi.num_volumes; v++)
+        for (int k = 0; k < roi.num_planes[v]; k++)
+            out->planes[v][k][3] *= scale;
+}
+
+// Serializes the set for REQUEST_ROI, returns the bytes written (at most ROI_MAX_BYTES).
+inline size_t writeRoi(const roiSet & roi, uint8_t * out) {
+    uint8_t * ptr = out;
+    *ptr++ = uint8_t(roi.num_volumes);
+    for (int v = 0; v < roi.num_volumes; v++) {
+        *ptr++ = uint8_t(roi.num_planes[v]);
+        memcpy(ptr, roi.planes[v], sizeof(float) * 4 * roi.num_planes[v]);
+        ptr += sizeof(float) * 4 * roi.num_planes[v];
+    }
+    return size_t(ptr - out);
+}
+
+// Parses a serialized set from the len bytes at in. Returns the bytes it took, 0 when more bytes are
+// needed or -1 when the set is corrupt.
+inline int readRoi(const uint8_t * in, size_t len, roiSet * roi) {
+    if (len < 1) return 0;
+    if (in[0] > ROI_MAX_VOLUMES) return -1;
+
+    roiSet result;
+    memset(&result, 0, sizeof(result));
+    size_t pos = 1;
+    for (int v = 0; v < in[0]; v++) {
+        if (pos >= len) return 0;
+        const int num_planes = in[pos++];
+        if (num_planes < 1 || num_planes > ROI_MAX_PLANES) return -1;
+        if (pos + sizeof(float) * 4 * num_planes > len) return 0;
+        memcpy(result.planes[v], in + pos, sizeof(float) * 4 * num_planes);
+        pos += sizeof(float) * 4 * num_planes;
+        result.num_planes[v] = num_planes;
+    }
+    result.num_volumes = in[0];
+    *roi = result;
+    return int(pos);
+}
+
+inline bool roiContains(const roiSet & roi, float x, float y, float z) {
+    for (int v = 0; v < roi.num_volumes; v++) {
+        bool inside = true;
+        for (int k = 0; k < roi.num_planes[v] && inside; k++) {
+            const float * n = roi.planes[v][k];
+            inside = fmaf(z, n[2], fmaf(y, n[1], x * n[0])) <= n[3];
+        }
+        if (inside) return true;
+    }
+    return false;
+}
+
+// All ones in the lanes of the points inside the region, with the rounding of roiContains.
+__attribute__((target("avx2,fma")))
+inline __m256 roiMaskAVX2(const roiSet & roi, __m256 x, __m256 y, __m256 z) {
+    __m256 any = _mm256_setzero_ps();
+    for (int v = 0; v < roi.num_volumes; v++) {
+        __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int k = 0; k < roi.num_planes[v]; k++) {
+            const float * n = roi.planes[v][k];
+            __m256 dot = _mm256_fmadd_ps(z, _mm256_set1_ps(n[2]), _mm256_fmadd_ps(y, _mm256_set1_ps(n[1]), _mm256_mul_ps(x, _mm256_set1_ps(n[0]))));
+            all = _mm256_and_ps(all, _mm256_cmp_ps(dot, _mm256_set1_ps(n[3]), _CMP_LE_OQ));
+        }
+        any = _mm256_or_ps(any, all);
+    }
+    return any;
+}
+
+__attribute__((target("avx512f,fma")))
+inline __mmask16 roiMask512(const roiSet & roi, __m512 x, __m512 y, __m512 z) {
+    __mmask16 any = 0;
+    for (int v = 0; v < roi.num_volumes; v++) {
+        __mmask16 all = 0xFFFF;
+        for (int k = 0; k < roi.num_planes[v] && all; k++) {
+            const float * n = roi.planes[v][k];
+            __m512 dot = _mm512_fmadd_ps(z, _mm512_set1_ps(n[2]), _mm512_fmadd_ps(y, _mm512_set1_ps(n[1]), _mm512_mul_ps(x, _mm512_set1_ps(n[0]))));
+            all &= _mm512_cmp_ps_mask(dot, _mm512_set1_ps(n[3]), _CMP_LE_OQ);
+        }
+        any |= all;
+    }
+    return any;
+}
+
+template <typename PointT>
+__attribute__((target("avx2,fma")))
+inline int cullPointsROIAVX2(const roiSet & roi, PointT * points, int num_points, int * count) {
+    const int stride = sizeof(PointT) / sizeof(float);
+    const __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    const int simd_end = num_points & ~7;
+    int kept = 0;
+
+    for (int i = 0; i < simd_end; i += 8) {
+        __m256 x = _mm256_i32gather_ps(&points[i].x, idx, 4);
+        __m256 y = _mm256_i32gather_ps(&points[i].y, idx, 4);
+        __m256 z = _mm256_i32gather_ps(&points[i].z, idx, 4);
+        unsigned mask = _mm256_movemask_ps(roiMaskAVX2(roi, x, y, z));
+
+        if (mask == 0xFF && kept == i) {
+            kept += 8;
+            continue;
+        }
+        for (; mask; mask &= mask - 1)
+            points[kept++] = points[i + __builtin_ctz(mask)];
+    }
+
+    *count = kept;
+    return simd_end;
+}
+
+// Keeps the points of points[0, num_points) inside the region, in order, and returns how many are left.
+// PointT has float x, y, z (pcl::PointXYZRGB), read 8 points at a time with strided gathers.
+template <typename PointT>
+inline int cullPointsROI(const roiSet & roi, PointT * points, int num_points) {
+    static_assert(sizeof(PointT) % sizeof(float) == 0, "points have to be made of 4 byte words");
+    if (!roiActive(&roi)) return num_points;
+
+    int count = 0, i = 0;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        i = cullPointsROIAVX2(roi, points, num_points, &count);
+
+    for (; i < num_points; i++)
+        if (roiContains(roi, points[i].x, points[i].y, points[i].z))
+            points[count++] = points[i];
+    return count;
+}
+
+#endif
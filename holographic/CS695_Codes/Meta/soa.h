@@ -0,0 +1,154 @@
+#ifndef META_SOA_H
+#define META_SOA_H
+
+/*
+ * Structure-of-arrays point layout (FORMAT_SOA in Meta/frame.h).
+ *
+ * The payload holds six planes in the order X, Y, Z (int16) then R, G, B
+ * (uint8). Every plane starts on a SOA_ALIGN boundary relative to the start
+ * of the payload, and SoA frames use a SOA_HEADER_BYTES header so the payload
+ * itself stays aligned inside a 64-byte aligned frame buffer.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+
+#define SOA_ALIGN           64
+#define SOA_HEADER_BYTES    64
+
+struct soaPlanes {
+    int16_t * x;
+    int16_t * y;
+    int16_t * z;
+    uint8_t * r;
+    uint8_t * g;
+    uint8_t * b;
+};
+
+inline size_t soaPlaneBytes(int num_points, int elem_bytes) {
+    return (size_t(num_points) * elem_bytes + SOA_ALIGN - 1) & ~size_t(SOA_ALIGN - 1);
+}
+
+inline size_t soaPayloadBytes(int num_points) {
+    return 3 * soaPlaneBytes(num_points, 2) + 3 * soaPlaneBytes(num_points, 1);
+}
+
+inline soaPlanes soaPlanesOf(const uint8_t * payload, int num_points) {
+    uint8_t * p = const_cast<uint8_t *>(payload);
+    const size_t geo = soaPlaneBytes(num_points, 2);
+    const size_t col = soaPlaneBytes(num_points, 1);
+    soaPlanes planes;
+    planes.x = reinterpret_cast<int16_t *>(p);
+    planes.y = reinterpret_cast<int16_t *>(p + geo);
+    planes.z = reinterpret_cast<int16_t *>(p + 2 * geo);
+    planes.r = p + 3 * geo;
+    planes.g = p + 3 * geo + col;
+    planes.b = p + 3 * geo + 2 * col;
+    return planes;
+}
+
+// Transposes 5-short records into SoA planes, used by producers whose converter still writes records.
+inline void packSoA(const short * records, int num_points, uint8_t * payload) {
+    soaPlanes planes = soaPlanesOf(payload, num_points);
+
+    for (int i = 0; i < num_points; i++) {
+        const short * p = records + i * 5;
+        planes.x[i] = p[0];
+        planes.y[i] = p[1];
+        planes.z[i] = p[2];
+        planes.r[i] = uint8_t(p[3]);
+        planes.g[i] = uint8_t(uint16_t(p[3]) >> 8);
+        planes.b[i] = uint8_t(p[4]);
+    }
+}
+
+inline void unpackSoA(const uint8_t * payload, int num_points, short * records) {
+    soaPlanes planes = soaPlanesOf(payload, num_points);
+
+    for (int i = 0; i < num_points; i++) {
+        short * p = records + i * 5;
+        p[0] = planes.x[i];
+        p[1] = planes.y[i];
+        p[2] = planes.z[i];
+        p[3] = short(planes.r[i] | (planes.g[i] << 8));
+        p[4] = planes.b[i];
+    }
+}
+
+// Decodes the points [begin, end) of the planes through the row-major m with the FMA order of the vector kernel.
+template <typename PointT>
+inline void decodeSoAScalar(const soaPlanes & planes, int begin, int end, const float * m, float conv_rate,
+                            PointT * points) {
+    for (int i = begin; i < end; i++) {
+        const float x = planes.x[i] / conv_rate;
+        const float y = planes.y[i] / conv_rate;
+        const float z = planes.z[i] / conv_rate;
+        PointT & p = points[i];
+        p.x = fmaf(m[0], x, fmaf(m[1], y, fmaf(m[2], z, m[3])));
+        p.y = fmaf(m[4], x, fmaf(m[5], y, fmaf(m[6], z, m[7])));
+        p.z = fmaf(m[8], x, fmaf(m[9], y, fmaf(m[10], z, m[11])));
+        p.r = planes.r[i];
+        p.g = planes.g[i];
+        p.b = planes.b[i];
+    }
+}
+
+// Same for [begin, end), a multiple of 8 long: planes are read with contiguous 8-wide loads, only the final
+// store into the AoS points is per point.
+template <typename PointT>
+__attribute__((target("avx2,fma")))
+inline void decodeSoAAVX2(const soaPlanes & planes, int begin, int end, const float * m, float conv_rate,
+                          PointT * points) {
+    const __m256 rate = _mm256_set1_ps(conv_rate);
+    const __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m02 = _mm256_set1_ps(m[2]),  m03 = _mm256_set1_ps(m[3]);
+    const __m256 m10 = _mm256_set1_ps(m[4]), m11 = _mm256_set1_ps(m[5]), m12 = _mm256_set1_ps(m[6]),  m13 = _mm256_set1_ps(m[7]);
+    const __m256 m20 = _mm256_set1_ps(m[8]), m21 = _mm256_set1_ps(m[9]), m22 = _mm256_set1_ps(m[10]), m23 = _mm256_set1_ps(m[11]);
+
+    for (int i = begin; i < end; i += 8) {
+        __attribute__((aligned(32))) float px[8], py[8], pz[8];
+        __attribute__((aligned(32))) uint8_t cr[8], cg[8], cb[8];
+
+        __m256 x = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(planes.x + i)))), rate);
+        __m256 y = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(planes.y + i)))), rate);
+        __m256 z = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(planes.z + i)))), rate);
+
+        _mm256_store_ps(px, _mm256_fmadd_ps(m00, x, _mm256_fmadd_ps(m01, y, _mm256_fmadd_ps(m02, z, m03))));
+        _mm256_store_ps(py, _mm256_fmadd_ps(m10, x, _mm256_fmadd_ps(m11, y, _mm256_fmadd_ps(m12, z, m13))));
+        _mm256_store_ps(pz, _mm256_fmadd_ps(m20, x, _mm256_fmadd_ps(m21, y, _mm256_fmadd_ps(m22, z, m23))));
+
+        memcpy(cr, planes.r + i, 8);
+        memcpy(cg, planes.g + i, 8);
+        memcpy(cb, planes.b + i, 8);
+
+        for (int k = 0; k < 8; k++) {
+            PointT & p = points[i + k];
+            p.x = px[k];
+            p.y = py[k];
+            p.z = pz[k];
+            p.r = cr[k];
+            p.g = cg[k];
+            p.b = cb[k];
+        }
+    }
+}
+
+// Decodes SoA planes straight into points with x, y, z, r, g, b members (e.g. pcl::PointXYZRGB).
+// tf is an optional row-major 4x4 transform applied on the way, so no separate transform pass is needed.
+// The AVX2 kernel runs when the CPU has it, the scalar one takes the tail.
+template <typename PointT>
+void decodeSoA(const uint8_t * payload, int num_points, const float * tf, float conv_rate, PointT * points) {
+    static const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    const soaPlanes planes = soaPlanesOf(payload, num_points);
+    const float * m = tf ? tf : identity;
+
+    int i = 0;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        i = num_points & ~7;
+        decodeSoAAVX2(planes, 0, i, m, conv_rate, points);
+    }
+    decodeSoAScalar(planes, i, num_points, m, conv_rate, points);
+}
+
+#endif
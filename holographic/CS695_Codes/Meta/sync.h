@@ -0,0 +1,333 @@
+#ifndef META_SYNC_H
+#define META_SYNC_H
+
+/*
+ * Capture time alignment of the frames of several cameras for the stitchers.
+ *
+ * The producer of every camera pushes its complete frames with their capture
+ * time (frameHeader.timestamp_us) into a jitter buffer of SYNC_DEPTH frames.
+ * The stitch loop takes one frame per camera at a time, by policy:
+ *
+ *   SYNC_LATEST  the newest frame of every camera, as soon as any camera has
+ *                a new one. No added latency, but the stitched frames can be
+ *                captured up to a frame period or more apart.
+ *   SYNC_WAIT    frames matched on capture time. The reference is the newest
+ *                capture time every camera has reached and each camera gives
+ *                its frame closest to it (the one the stitch loop already
+ *                holds counts too, so slower cameras pace the set). The set is
+ *                taken once these frames are at most window_us apart, at the
+ *                latest max_wait_ms after the first new frame: then the
+ *                reference only takes the cameras with new frames into
+ *                account and the late ones keep what they had.
+ *
+ * Frames older than the ones taken are dropped, except for frames pushed with
+ * keep set (keyframes later frames depend on): a set never skips one but
+ * takes the kept frame of a camera before any newer one. Like latestSlot the
+ * buffers only pass pointers into a pool of preallocated items, SYNC_DEPTH + 2
+ * per camera: one being filled by the producer, one held by the stitch loop.
+ *
+ * Capture times of different cameras are only comparable in a common time
+ * base: the camera servers stamp frames in the global time of librealsense,
+ * so their hosts have to be synchronized (NTP or PTP). A frame pushed without
+ * a capture time is matched on its arrival instead.
+ *
+ * syncStats reports the skew between the capture times of the stitched
+ * frames, the frames dropped unstitched and the latency the policy added:
+ * how long the stitch loop waited after it could have taken a new frame.
+ */
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#define SYNC_DEPTH          3
+
+#define SYNC_LATEST         0
+#define SYNC_WAIT           1
+
+typedef std::chrono::steady_clock syncClock;
+
+template <typename T>
+struct syncEntry {
+    T * item;
+    uint64_t time_us;           // capture time, or arrival when the frame has none
+    bool keep;                  // never dropped unseen
+    syncClock::time_point arrival;
+};
+
+template <typename T>
+struct syncCamera {
+    syncEntry<T> pending[SYNC_DEPTH];           // oldest first
+    int count;
+    T * spare[SYNC_DEPTH + 1];
+    int num_spare;
+    uint64_t held_time_us;                      // capture time of the frame the stitch loop holds
+    bool holds_frame;
+    bool active;                                // false for a camera that is gone
+    long pushed, dropped;                       // since the last report
+};
+
+struct syncStats {
+    long sets;                  // sets taken
+    long late;                  // SYNC_WAIT sets taken at the deadline
+    long dropped;               // frames dropped unstitched
+    double skew_ms_sum, skew_ms_max;
+    double wait_ms_sum, wait_ms_max;
+};
+
+template <typename T>
+struct frameSync {
+    int num_cameras;
+    int policy;
+    uint64_t window_us;
+    double max_wait_ms;
+    std::vector<syncCamera<T>> cameras;
+    syncStats stats;
+    std::mutex mutex;
+    std::condition_variable pushed;
+};
+
+inline uint64_t syncNowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(syncClock::now().time_since_epoch()).count();
+}
+
+// items holds SYNC_DEPTH + 2 items per camera, starting at items[c * (SYNC_DEPTH + 2)] for camera c. Its
+// producer fills the first one, the stitch loop holds the second one in held[c].
+template <typename T>
+void initFrameSync(frameSync<T> * sync, int num_cameras, T * items, T ** held, int policy, double window_ms,
+                   double max_wait_ms) {
+    sync->num_cameras = num_cameras;
+    sync->policy = policy;
+    sync->window_us = uint64_t(window_ms * 1000);
+    sync->max_wait_ms = max_wait_ms;
+    sync->cameras.assign(num_cameras, syncCamera<T>());
+    sync->stats = syncStats();
+
+    for (int c = 0; c < num_cameras; c++) {
+        syncCamera<T> & cam = sync->cameras[c];
+        T * pool = items + size_t(c) * (SYNC_DEPTH + 2);
+        held[c] = &pool[1];
+        cam.count = 0;
+        cam.num_spare = 0;
+        for (int k = 2; k < SYNC_DEPTH + 2; k++)
+            cam.spare[cam.num_spare++] = &pool[k];
+        cam.held_time_us = 0;
+        cam.holds_frame = false;
+        cam.active = true;
+        cam.pushed = cam.dropped = 0;
+    }
+}
+
+template <typename T>
+void dropSyncFrame(frameSync<T> * sync, syncCamera<T> & cam, int k) {
+    cam.spare[cam.num_spare++] = cam.pending[k].item;
+    std::copy(cam.pending + k + 1, cam.pending + cam.count, cam.pending + k);
+    cam.count--;
+    cam.dropped++;
+    sync->stats.dropped++;
+}
+
+// Pending frames of the camera a set can choose from: up to the first kept one.
+template <typename T>
+int syncChoices(const syncCamera<T> & cam) {
+    for (int k = 0; k < cam.count; k++)
+        if (cam.pending[k].keep) return k + 1;
+    return cam.count;
+}
+
+// Queues the complete frame item of camera with its capture time (0 for none) and returns the item to fill
+// next. A full jitter buffer drops its oldest frame that is not kept.
+template <typename T>
+T * pushSyncFrame(frameSync<T> * sync, int camera, T * item, uint64_t capture_us, bool keep = false) {
+    std::lock_guard<std::mutex> lock(sync->mutex);
+    syncCamera<T> & cam = sync->cameras[camera];
+
+    if (cam.count == SYNC_DEPTH) {
+        int k = 0;
+        while (k < cam.count - 1 && cam.pending[k].keep) k++;
+        dropSyncFrame(sync, cam, k);
+    }
+
+    syncEntry<T> & entry = cam.pending[cam.count++];
+    entry.item = item;
+    entry.arrival = syncClock::now();
+    entry.time_us = capture_us ? capture_us : syncNowUs();
+    entry.keep = keep;
+    cam.pushed++;
+
+    sync->pushed.notify_all();
+    return cam.spare[--cam.num_spare];
+}
+
+// A camera that is gone no longer holds up SYNC_WAIT sets.
+template <typename T>
+void setSyncCameraActive(frameSync<T> * sync, int camera, bool active) {
+    std::lock_guard<std::mutex> lock(sync->mutex);
+    sync->cameras[camera].active = active;
+    sync->pushed.notify_all();
+}
+
+inline uint64_t syncDistance(uint64_t a, uint64_t b) {
+    return std::max(a, b) - std::min(a, b);
+}
+
+// The frame of every camera for reference time ref: the index of its closest pending frame, -1 when the
+// held frame is at least as close and -2 when the camera has no frame at all.
+template <typename T>
+void chooseSyncFrames(frameSync<T> * sync, uint64_t ref, int * choice) {
+    for (int c = 0; c < sync->num_cameras; c++) {
+        const syncCamera<T> & cam = sync->cameras[c];
+        choice[c] = cam.holds_frame ? -1 : -2;
+        uint64_t best = cam.holds_frame ? syncDistance(cam.held_time_us, ref) : UINT64_MAX;
+
+        for (int k = 0; k < syncChoices(cam); k++) {
+            const uint64_t dist = syncDistance(cam.pending[k].time_us, ref);
+            if (dist <= best) {                 // the newer one on a tie
+                best = dist;
+                choice[c] = k;
+            }
+        }
+    }
+}
+
+// Reference time of a set: the newest capture time every active camera has reached. At the deadline only
+// the cameras with pending frames count. Returns false when a camera that counts has no frame yet.
+template <typename T>
+bool syncReference(frameSync<T> * sync, bool pending_only, uint64_t * ref) {
+    *ref = UINT64_MAX;
+    for (const syncCamera<T> & cam : sync->cameras) {
+        if (!cam.active || (pending_only && cam.count == 0)) continue;
+        if (cam.count == 0 && !cam.holds_frame) return false;
+        *ref = std::min(*ref, cam.count ? cam.pending[syncChoices(cam) - 1].time_us : cam.held_time_us);
+    }
+    return *ref != UINT64_MAX;
+}
+
+// A set for SYNC_WAIT: the frames of the active cameras at most window_us apart and at least one new frame.
+template <typename T>
+bool syncMatched(frameSync<T> * sync, int * choice) {
+    uint64_t ref;
+    if (!syncReference(sync, false, &ref)) return false;
+    chooseSyncFrames(sync, ref, choice);
+
+    uint64_t t_min = UINT64_MAX, t_max = 0;
+    bool fresh = false;
+    for (int c = 0; c < sync->num_cameras; c++) {
+        const syncCamera<T> & cam = sync->cameras[c];
+        if (!cam.active) continue;
+        if (choice[c] == -2) return false;
+        const uint64_t t = choice[c] >= 0 ? cam.pending[choice[c]].time_us : cam.held_time_us;
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+        fresh |= choice[c] >= 0;
+    }
+    return fresh && t_max - t_min <= sync->window_us;
+}
+
+template <typename T>
+bool syncHasPending(frameSync<T> * sync) {
+    for (const syncCamera<T> & cam : sync->cameras)
+        if (cam.count > 0) return true;
+    return false;
+}
+
+// Takes one frame per camera into held by the policy, the frames held before go back to their producers.
+// Blocks until a camera has a new frame, with SYNC_WAIT until the set is matched or the deadline passed.
+// fresh[c] tells whether held[c] changed.
+template <typename T>
+void takeSyncSet(frameSync<T> * sync, T ** held, bool * fresh) {
+    std::unique_lock<std::mutex> lock(sync->mutex);
+    const syncClock::time_point call = syncClock::now();
+    sync->pushed.wait(lock, [sync] { return syncHasPending(sync); });
+
+    // The set could have been taken from the first new frame on, or from the call on if it was there before.
+    syncClock::time_point first = syncClock::time_point::max();
+    for (const syncCamera<T> & cam : sync->cameras)
+        if (cam.count > 0) first = std::min(first, cam.pending[0].arrival);
+    const syncClock::time_point start = std::max(call, first);
+
+    std::vector<int> choice(sync->num_cameras);
+    bool late = false;
+
+    if (sync->policy == SYNC_WAIT) {
+        const syncClock::time_point deadline = start + std::chrono::microseconds(int64_t(sync->max_wait_ms * 1000));
+        while (!syncMatched(sync, choice.data())) {
+            if (sync->pushed.wait_until(lock, deadline) == std::cv_status::timeout && !syncMatched(sync, choice.data())) {
+                late = true;
+                break;
+            }
+        }
+        if (late) {
+            uint64_t ref;
+            syncReference(sync, true, &ref);
+            chooseSyncFrames(sync, ref, choice.data());
+            // the late cameras keep their frame
+            for (int c = 0; c < sync->num_cameras; c++)
+                if (sync->cameras[c].count == 0) choice[c] = sync->cameras[c].holds_frame ? -1 : -2;
+        }
+    }
+    else {
+        for (int c = 0; c < sync->num_cameras; c++) {
+            const syncCamera<T> & cam = sync->cameras[c];
+            choice[c] = cam.count ? syncChoices(cam) - 1 : (cam.holds_frame ? -1 : -2);
+        }
+    }
+
+    // Swap the chosen frames in and drop the older pending ones.
+    uint64_t t_min = UINT64_MAX, t_max = 0;
+    for (int c = 0; c < sync->num_cameras; c++) {
+        syncCamera<T> & cam = sync->cameras[c];
+        fresh[c] = choice[c] >= 0;
+
+        if (fresh[c]) {
+            for (int k = 0; k < choice[c]; k++)
+                dropSyncFrame(sync, cam, 0);
+            cam.spare[cam.num_spare++] = held[c];
+            held[c] = cam.pending[0].item;
+            cam.held_time_us = cam.pending[0].time_us;
+            cam.holds_frame = true;
+            std::copy(cam.pending + 1, cam.pending + cam.count, cam.pending);
+            cam.count--;
+        }
+        if (cam.active && cam.holds_frame) {
+            t_min = std::min(t_min, cam.held_time_us);
+            t_max = std::max(t_max, cam.held_time_us);
+        }
+    }
+
+    const double skew_ms = t_max >= t_min ? (t_max - t_min) / 1000.0 : 0;
+    const double wait_ms = std::max(std::chrono::duration<double, std::milli>(syncClock::now() - start).count(), 0.0);
+    syncStats & stats = sync->stats;
+    stats.sets++;
+    stats.late += late;
+    stats.skew_ms_sum += skew_ms;
+    stats.skew_ms_max = std::max(stats.skew_ms_max, skew_ms);
+    stats.wait_ms_sum += wait_ms;
+    stats.wait_ms_max = std::max(stats.wait_ms_max, wait_ms);
+}
+
+// Prints the statistics since the last report and resets them.
+template <typename T>
+void printSyncStats(frameSync<T> * sync) {
+    std::lock_guard<std::mutex> lock(sync->mutex);
+    syncStats & stats = sync->stats;
+    const long sets = std::max(stats.sets, 1L);
+
+    std::cout << "Sync (" << (sync->policy == SYNC_WAIT ? "wait" : "latest") << "): " << stats.sets << " sets, "
+              << stats.late << " late, " << stats.dropped << " frames dropped, skew " << stats.skew_ms_sum / sets
+              << " ms avg " << stats.skew_ms_max << " ms max, added latency " << stats.wait_ms_sum / sets
+              << " ms avg " << stats.wait_ms_max << " ms max" << std::endl;
+    for (int c = 0; c < sync->num_cameras; c++) {
+        syncCamera<T> & cam = sync->cameras[c];
+        std::cout << "Camera " << c << (cam.active ? "" : " (gone)") << ": " << cam.pushed << " frames, "
+                  << cam.dropped << " dropped" << std::endl;
+        cam.pushed = cam.dropped = 0;
+    }
+    stats = syncStats();
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef META_TEMPORAL_H
+#define META_TEMPORAL_H
+
+/*
+ * Keyframe / delta frame coding of the camera records (FORMAT_DELTA in Meta/frame.h).
+ *
+ * A static rig sees mostly the same scene from frame to frame, so instead of
+ * the full records every frame the producer sends a keyframe now and then and
+ * in between delta frames that only carry the pixels whose record changed by
+ * more than a threshold: a coordinate by more than depth_threshold mm or a
+ * color channel by more than color_threshold. Unchanged pixels are taken
+ * from the keyframe on the receiver.
+ *
+ * Delta frames are coded against a keyframe the receivers have acknowledged
+ * (REQUEST_KEY_ACK), not against the previous frame, so a dropped delta frame
+ * costs nothing and a dropped keyframe only delays the switch to the next
+ * one. A new keyframe is used as reference right away only while there is no
+ * acknowledged one yet; receivers therefore keep the last two keyframes.
+ *
+ * Payload (little endian), the frame header carries FRAME_FLAG_KEY on keyframes:
+ *   u64 key_number | u32 num_pixels | u32 num_changed
+ *   keyframe:    records[num_pixels]
+ *   delta frame: encodeStream(bitmap of the changed pixels) | records[num_changed]
+ * key_number is the frame number of the keyframe, a keyframe carries its own.
+ *
+ * Pixels are matched by their index in the records, so a delta frame needs
+ * the point count of its keyframe. Records compacted by a region of interest,
+ * a voxel grid or the decimated depth path, which keeps only valid pixels,
+ * change their count every frame and are sent as keyframes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "codec.h"
+
+#define TEMPORAL_HEADER_BYTES   16
+#define TEMPORAL_MISSING_KEY    -2          // decodeTemporal: the keyframe of a delta frame is not held
+
+// Largest payload encodeTemporal writes for num_points points.
+inline size_t temporalPayloadBound(int num_points) {
+    return TEMPORAL_HEADER_BYTES + 5 + (size_t(num_points) + 7) / 8 + size_t(num_points) * 10;
+}
+
+struct temporalEncoder {
+    short * ref;                // acknowledged keyframe, delta frames are coded against it
+    short * pending;            // newest keyframe, waiting for acknowledgements
+    int ref_points, pending_points;
+    uint64_t ref_number, pending_number;
+    bool has_ref, has_pending;
+    int since_key;              // frames since the last keyframe
+    int interval;               // frames between keyframes
+    int depth_threshold;        // largest coordinate change still sent as unchanged, in record units
+    int color_threshold;        // same for a color channel
+    uint8_t * bitmap;
+    uint32_t * changed;
+    std::vector<uint8_t> scratch;
+    long key_frames, delta_frames;      // since the last report
+    double raw_bytes, coded_bytes;
+    double min_saving, max_saving;
+};
+
+inline void initTemporalEncoder(temporalEncoder * enc, int max_points, int interval, int depth_threshold,
+                                int color_threshold) {
+    enc->ref = (short *)malloc(sizeof(short) * 5 * size_t(max_points));
+    enc->pending = (short *)malloc(sizeof(short) * 5 * size_t(max_points));
+    enc->bitmap = (uint8_t *)malloc((size_t(max_points) + 7) / 8);
+    enc->changed = (uint32_t *)malloc(sizeof(uint32_t) * size_t(max_points));
+    enc->has_ref = enc->has_pending = false;
+    enc->since_key = 0;
+    enc->interval = std::max(interval, 1);
+    enc->depth_threshold = depth_threshold;
+    enc->color_threshold = color_threshold;
+    enc->key_frames = enc->delta_frames = 0;
+    enc->raw_bytes = enc->coded_bytes = 0;
+    enc->min_saving = 1;
+    enc->max_saving = 0;
+}
+
+inline void freeTemporalEncoder(temporalEncoder * enc) {
+    free(enc->ref);
+    free(enc->pending);
+    free(enc->bitmap);
+    free(enc->changed);
+}
+
+// Makes the pending keyframe the reference once number, the keyframe every receiver acknowledged, matches it.
+inline void acknowledgeKeyframe(temporalEncoder * enc, uint64_t number) {
+    if (!enc->has_pending || number != enc->pending_number) return;
+
+    std::swap(enc->ref, enc->pending);
+    enc->ref_points = enc->pending_points;
+    enc->ref_number = enc->pending_number;
+    enc->has_ref = true;
+    enc->has_pending = false;
+}
+
+inline bool recordChanged(const short * a, const short * b, int depth_threshold, int color_threshold) {
+    if (abs(a[0] - b[0]) > depth_threshold || abs(a[1] - b[1]) > depth_threshold || abs(a[2] - b[2]) > depth_threshold)
+        return true;
+    return abs((a[3] & 0xFF) - (b[3] & 0xFF)) > color_threshold ||
+           abs(((a[3] >> 8) & 0xFF) - ((b[3] >> 8) & 0xFF)) > color_threshold ||
+           abs(a[4] - b[4]) > color_threshold;
+}
+
+// Codes the records of frame frame_number into out (temporalPayloadBound bytes). A keyframe is sent when
+// force_key is set, the interval is over, there is no reference of the same size or the delta frame would
+// not be smaller. Returns the payload size, *keyframe and *key_number describe the frame.
+inline size_t encodeTemporal(temporalEncoder * enc, const short * records, int num_points, uint64_t frame_number,
+                             bool force_key, uint8_t * out, bool * keyframe, uint64_t * key_number) {
+    const short * reference = enc->has_ref ? enc->ref : enc->pending;
+    const int reference_points = enc->has_ref ? enc->ref_points : enc->pending_points;
+    const uint64_t reference_number = enc->has_ref ? enc->ref_number : enc->pending_number;
+    const size_t key_bytes = TEMPORAL_HEADER_BYTES + size_t(num_points) * 10;
+
+    bool key = force_key || (!enc->has_ref && !enc->has_pending) || reference_points != num_points ||
+               enc->since_key + 1 >= enc->interval;
+    size_t bytes = 0;
+
+    if (!key) {
+        const size_t bitmap_bytes = (size_t(num_points) + 7) / 8;
+        memset(enc->bitmap, 0, bitmap_bytes);
+        int num_changed = 0;
+
+        for (int i = 0; i < num_points; i++) {
+            if (!recordChanged(records + i * 5, reference + i * 5, enc->depth_threshold, enc->color_threshold))
+                continue;
+            enc->bitmap[i >> 3] |= uint8_t(1 << (i & 7));
+            enc->changed[num_changed++] = uint32_t(i);
+        }
+
+        // a scene change makes the delta frame as big as a keyframe, better start a new reference then
+        if (size_t(num_changed) * 10 + bitmap_bytes + 5 < size_t(num_points) * 10) {
+            uint8_t * ptr = out + TEMPORAL_HEADER_BYTES;
+            ptr += encodeStream(enc->bitmap, uint32_t(bitmap_bytes), ptr, enc->scratch);
+            short * dst = (short *)ptr;
+            for (int c = 0; c < num_changed; c++)
+                memcpy(dst + c * 5, records + size_t(enc->changed[c]) * 5, 5 * sizeof(short));
+            ptr += size_t(num_changed) * 10;
+
+            memcpy(out, &reference_number, sizeof(uint64_t));
+            putU32(out + 8, uint32_t(num_points));
+            putU32(out + 12, uint32_t(num_changed));
+            bytes = size_t(ptr - out);
+            enc->since_key++;
+            enc->delta_frames++;
+            *keyframe = false;
+            *key_number = reference_number;
+        }
+        else {
+            key = true;
+        }
+    }
+
+    if (key) {
+        memcpy(enc->pending, records, sizeof(short) * 5 * size_t(num_points));
+        enc->pending_points = num_points;
+        enc->pending_number = frame_number;
+        enc->has_pending = true;
+        enc->since_key = 0;
+
+        memcpy(out, &frame_number, sizeof(uint64_t));
+        putU32(out + 8, uint32_t(num_points));
+        putU32(out + 12, uint32_t(num_points));
+        memcpy(out + TEMPORAL_HEADER_BYTES, records, size_t(num_points) * 10);
+        bytes = key_bytes;
+        enc->key_frames++;
+        *keyframe = true;
+        *key_number = frame_number;
+    }
+
+    const double saving = 1 - double(bytes) / std::max<size_t>(size_t(num_points) * 10, 1);
+    enc->raw_bytes += double(num_points) * 10;
+    enc->coded_bytes += double(bytes);
+    enc->min_saving = std::min(enc->min_saving, saving);
+    enc->max_saving = std::max(enc->max_saving, saving);
+    return bytes;
+}
+
+struct temporalDecoder {
+    short * keys[2];
+    int key_points[2];
+    uint64_t key_numbers[2];
+    bool has_key[2];
+    int last_ref;               // slot the newest delta frame was decoded against, -1 before the first one
+    uint8_t * bitmap;
+    int max_points;
+};
+
+inline void initTemporalDecoder(temporalDecoder * dec, int max_points) {
+    for (int s = 0; s < 2; s++) {
+        dec->keys[s] = (short *)malloc(sizeof(short) * 5 * size_t(max_points));
+        dec->has_key[s] = false;
+    }
+    dec->bitmap = (uint8_t *)malloc((size_t(max_points) + 7) / 8);
+    dec->last_ref = -1;
+    dec->max_points = max_points;
+}
+
+inline void freeTemporalDecoder(temporalDecoder * dec) {
+    free(dec->keys[0]);
+    free(dec->keys[1]);
+    free(dec->bitmap);
+}
+
+// Reconstructs the full records of a FORMAT_DELTA frame. Keyframes replace the keyframe no delta frame
+// referred to last. Returns the number of points, TEMPORAL_MISSING_KEY when a delta frame refers to a
+// keyframe that is not held, or -1 on a corrupt payload.
+inline int decodeTemporal(temporalDecoder * dec, const uint8_t * payload, size_t payload_bytes, bool keyframe,
+                          short * records) {
+    if (payload_bytes < TEMPORAL_HEADER_BYTES) return -1;
+
+    uint64_t key_number;
+    memcpy(&key_number, payload, sizeof(uint64_t));
+    const int num_points = int(getU32(payload + 8));
+    const int num_changed = int(getU32(payload + 12));
+    if (num_points < 0 || num_points > dec->max_points || num_changed < 0 || num_changed > num_points) return -1;
+
+    if (keyframe) {
+        if (num_changed != num_points || payload_bytes != TEMPORAL_HEADER_BYTES + size_t(num_points) * 10) return -1;
+
+        int slot = dec->last_ref >= 0 ? 1 - dec->last_ref : (!dec->has_key[0] ? 0 : !dec->has_key[1] ? 1 :
+                   dec->key_numbers[0] < dec->key_numbers[1] ? 0 : 1);
+        memcpy(dec->keys[slot], payload + TEMPORAL_HEADER_BYTES, size_t(num_points) * 10);
+        dec->key_points[slot] = num_points;
+        dec->key_numbers[slot] = key_number;
+        dec->has_key[slot] = true;
+        memcpy(records, dec->keys[slot], size_t(num_points) * 10);
+        return num_points;
+    }
+
+    int slot = -1;
+    for (int s = 0; s < 2; s++)
+        if (dec->has_key[s] && dec->key_numbers[s] == key_number && dec->key_points[s] == num_points)
+            slot = s;
+    if (slot < 0) return TEMPORAL_MISSING_KEY;
+
+    const uint32_t bitmap_bytes = uint32_t((size_t(num_points) + 7) / 8);
+    uint32_t len;
+    size_t used = decodeStream(payload + TEMPORAL_HEADER_BYTES, payload_bytes - TEMPORAL_HEADER_BYTES, dec->bitmap,
+                               bitmap_bytes, &len);
+    if (used == 0 || len != bitmap_bytes ||
+        payload_bytes != TEMPORAL_HEADER_BYTES + used + size_t(num_changed) * 10) return -1;
+
+    const short * changed = (const short *)(payload + TEMPORAL_HEADER_BYTES + used);
+    memcpy(records, dec->keys[slot], size_t(num_points) * 10);
+
+    int c = 0;
+    for (uint32_t b = 0; b < bitmap_bytes; b++) {
+        for (unsigned bits = dec->bitmap[b]; bits; bits &= bits - 1) {
+            const int i = int(b * 8 + __builtin_ctz(bits));
+            if (i >= num_points || c == num_changed) return -1;
+            memcpy(records + size_t(i) * 5, changed + size_t(c) * 5, 5 * sizeof(short));
+            c++;
+        }
+    }
+    if (c != num_changed) return -1;
+
+    dec->last_ref = slot;
+    return num_points;
+}
+
+#endif
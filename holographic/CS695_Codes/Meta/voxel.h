@@ -0,0 +1,280 @@
+#ifndef META_VOXEL_H
+#define META_VOXEL_H
+
+/*
+ * Voxel-grid downsampling of 5-short records (x, y, z, r | g << 8, b) before they are sent.
+ *
+ * Every record falls into the cube of voxel_size record units that holds it, and every occupied voxel
+ * becomes one record at the rounded centroid of its points with their mean color. Unlike the stride
+ * sampling of the stitcher every surface keeps one point per voxel at any distance from the camera, so
+ * the cloud has a uniform density and a frame never has more points than the stage has voxels.
+ *
+ * Three parallel passes over blocks of points:
+ *   1. every point finds or inserts the key of its voxel in an open-addressing hash table (linear
+ *      probing, the key is claimed with a compare-and-swap), a new voxel takes the next dense index of
+ *      the sums. Coordinates and colors are summed per thread in a small cache of voxels and added to
+ *      the shared sums with atomic adds, and the voxel keeps its lowest point index.
+ *   2. every block counts the points that are the first of their voxel, an exclusive prefix sum over
+ *      the counts gives each block its first output record (as in convertPointsInRange).
+ *   3. the first point of every voxel writes the voxel record.
+ * The output is in the raster order of the first points and the sums are integers, so it is the same
+ * for every number of threads. The output only reads the sums, so it may overwrite the input records.
+ *
+ * The table keeps its memory between frames and only the slots of the last frame are cleared.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <alloca.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#include <omp.h>
+
+#define VOXEL_BLOCK         10240                   // points per OpenMP block
+#define VOXEL_CACHE         2048                    // voxels summed per thread before the atomic adds
+#define VOXEL_CACHE_SHIFT   (64 - 11)               // log2(VOXEL_CACHE) bits of the key hash
+#define VOXEL_EMPTY         UINT64_MAX
+#define VOXEL_LOCKED        (UINT64_MAX - 1)        // slot claimed, its voxel index is not written yet
+
+struct voxelSlot {
+    uint64_t key;
+    int voxel;
+};
+
+struct voxelSum {
+    int64_t x, y, z;
+    uint32_t r, g, b;
+    int count;
+    int first;                  // lowest point index, INT_MAX while empty
+};
+
+struct voxelGrid {
+    int max_points;
+    size_t mask;                // slots - 1, the table has at least twice as many slots as points
+    int shift;                  // 64 - log2(slots)
+    voxelSlot * slots;
+    voxelSum * sums;            // per voxel, max_points of them
+    int * slot_of;              // slot of every voxel, to clear the table
+    int * point_voxel;          // voxel of every point of the frame
+    int num_voxels;
+};
+
+inline void freeVoxelGrid(voxelGrid * grid) {
+    free(grid->slots);
+    free(grid->sums);
+    free(grid->slot_of);
+    free(grid->point_voxel);
+    memset(grid, 0, sizeof(voxelGrid));
+}
+
+// Makes room for frames of num_points points. The grid has to start zeroed.
+inline void reserveVoxelGrid(voxelGrid * grid, int num_points) {
+    if (grid->slots && num_points <= grid->max_points)
+        return;
+    freeVoxelGrid(grid);
+
+    int bits = 4;
+    while ((size_t(1) << bits) < size_t(num_points) * 2)
+        bits++;
+    grid->max_points = num_points;
+    grid->mask = (size_t(1) << bits) - 1;
+    grid->shift = 64 - bits;
+    grid->slots = (voxelSlot *)malloc(sizeof(voxelSlot) * (grid->mask + 1));
+    grid->sums = (voxelSum *)calloc(std::max(num_points, 1), sizeof(voxelSum));
+    grid->slot_of = (int *)malloc(sizeof(int) * std::max(num_points, 1));
+    grid->point_voxel = (int *)malloc(sizeof(int) * std::max(num_points, 1));
+
+    for (size_t h = 0; h <= grid->mask; h++)
+        grid->slots[h].key = VOXEL_EMPTY;
+    for (int v = 0; v < num_points; v++)
+        grid->sums[v].first = INT_MAX;
+}
+
+// Voxel coordinates by a multiply instead of a division, which is several times slower than the rest of
+// the point. The coordinates are biased by a multiple of voxel_size so they are positive and the voxels
+// left and right of 0 have the same size, (c + bias) * magic >> 40 is then exactly (c + bias) / voxel_size
+// for the 17 bits of c + bias. The keys keep the bias.
+struct voxelDivider {
+    uint32_t bias;
+    uint64_t magic;
+};
+
+inline voxelDivider makeVoxelDivider(int voxel_size) {
+    voxelDivider d;
+    d.bias = uint32_t((32768 + voxel_size - 1) / voxel_size * voxel_size);
+    d.magic = (uint64_t(1) << 40) / uint64_t(voxel_size) + 1;
+    return d;
+}
+
+inline uint64_t voxelIndex(int coordinate, const voxelDivider & d) {
+    return (uint64_t(uint32_t(coordinate + int(d.bias))) * d.magic) >> 40;
+}
+
+inline uint64_t voxelKey(const short * record, const voxelDivider & d) {
+    return (voxelIndex(record[0], d) << 42) | (voxelIndex(record[1], d) << 21) | voxelIndex(record[2], d);
+}
+
+// Index of the voxel with key, inserted when it is new. Callable from any number of threads.
+inline int findVoxel(voxelGrid * grid, uint64_t key) {
+    for (size_t h = (key * 0x9E3779B97F4A7C15ull) >> grid->shift; ; h = (h + 1) & grid->mask) {
+        voxelSlot & slot = grid->slots[h];
+        uint64_t k = __atomic_load_n(&slot.key, __ATOMIC_ACQUIRE);
+
+        if (k == VOXEL_EMPTY &&
+            __atomic_compare_exchange_n(&slot.key, &k, VOXEL_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            const int voxel = __atomic_fetch_add(&grid->num_voxels, 1, __ATOMIC_RELAXED);
+            slot.voxel = voxel;
+            grid->slot_of[voxel] = int(h);
+            __atomic_store_n(&slot.key, key, __ATOMIC_RELEASE);
+            return voxel;
+        }
+
+        // claimed meanwhile by another point, k holds what is in the slot now
+        while (k == VOXEL_LOCKED) {
+            _mm_pause();
+            k = __atomic_load_n(&slot.key, __ATOMIC_ACQUIRE);
+        }
+        if (k == key)
+            return slot.voxel;
+    }
+}
+
+// Partial sums of one voxel in the cache of a thread.
+struct voxelPartial {
+    uint64_t key;
+    int voxel;
+    int first;
+    int count;
+    uint32_t r, g, b;
+    int64_t x, y, z;
+};
+
+// Adds the partial sums of a thread to its voxel.
+inline void flushVoxel(voxelGrid * grid, const voxelPartial & part) {
+    voxelSum * sum = &grid->sums[part.voxel];
+    __atomic_fetch_add(&sum->x, part.x, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->y, part.y, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->z, part.z, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->r, part.r, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->g, part.g, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->b, part.b, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sum->count, part.count, __ATOMIC_RELAXED);
+
+    int current = __atomic_load_n(&sum->first, __ATOMIC_RELAXED);
+    while (part.first < current &&
+           !__atomic_compare_exchange_n(&sum->first, &current, part.first, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {}
+}
+
+// Pass 1 over the points [begin, end). Neighbouring rows of the frame hit the same voxels, so the points
+// are summed in a direct-mapped cache of voxels on the stack first: a voxel is looked up in the shared table
+// when it enters the cache and its sums are added when it leaves, which saves most of the hash lookups and
+// atomic adds.
+inline void accumulateVoxels(voxelGrid * grid, const short * records, int begin, int end, int voxel_size) {
+    voxelPartial cache[VOXEL_CACHE];
+    for (int c = 0; c < VOXEL_CACHE; c++)
+        cache[c].key = VOXEL_EMPTY;
+    const voxelDivider divider = makeVoxelDivider(voxel_size);
+
+    for (int i = begin; i < end; i++) {
+        const short * p = records + size_t(i) * 5;
+        const uint64_t key = voxelKey(p, divider);
+        voxelPartial & part = cache[(key * 0x9E3779B97F4A7C15ull) >> VOXEL_CACHE_SHIFT];
+
+        if (part.key != key) {
+            if (part.key != VOXEL_EMPTY)
+                flushVoxel(grid, part);
+            part.key = key;
+            part.voxel = findVoxel(grid, key);
+            part.first = i;
+            part.count = 0;
+            part.r = part.g = part.b = 0;
+            part.x = part.y = part.z = 0;
+        }
+
+        part.x += p[0];
+        part.y += p[1];
+        part.z += p[2];
+        part.r += uint16_t(p[3]) & 0xFF;
+        part.g += uint16_t(p[3]) >> 8;
+        part.b += uint16_t(p[4]) & 0xFF;
+        part.count++;
+        grid->point_voxel[i] = part.voxel;
+    }
+
+    for (int c = 0; c < VOXEL_CACHE; c++)
+        if (cache[c].key != VOXEL_EMPTY)
+            flushVoxel(grid, cache[c]);
+}
+
+// Rounded to nearest, halves away from zero.
+inline short voxelMean(int64_t sum, int count) {
+    return short(sum >= 0 ? (sum + count / 2) / count : -((-sum + count / 2) / count));
+}
+
+// Downsamples the num_points records to one record per voxel of voxel_size record units (> 0) and returns
+// the number of voxels. out may be records.
+inline int voxelDownsample(voxelGrid * grid, const short * records, int num_points, int voxel_size, short * out,
+                           int num_threads) {
+    reserveVoxelGrid(grid, num_points);
+    grid->num_voxels = 0;
+
+    const int num_blocks = (num_points + VOXEL_BLOCK - 1) / VOXEL_BLOCK;
+    int * first = (int *)alloca(sizeof(int) * (num_blocks + 1));
+    first[0] = 0;
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        #pragma omp for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            const int begin = b * VOXEL_BLOCK;
+            accumulateVoxels(grid, records, begin, std::min(begin + VOXEL_BLOCK, num_points), voxel_size);
+        }
+
+        #pragma omp for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            const int end = std::min((b + 1) * VOXEL_BLOCK, num_points);
+            int count = 0;
+            for (int i = b * VOXEL_BLOCK; i < end; i++)
+                count += grid->sums[grid->point_voxel[i]].first == i;
+            first[b + 1] = count;
+        }
+
+        #pragma omp single
+        {
+            for (int b = 0; b < num_blocks; b++)
+                first[b + 1] += first[b];
+        }
+
+        #pragma omp for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            const int end = std::min((b + 1) * VOXEL_BLOCK, num_points);
+            short * p = out + size_t(first[b]) * 5;
+            for (int i = b * VOXEL_BLOCK; i < end; i++) {
+                const voxelSum & s = grid->sums[grid->point_voxel[i]];
+                if (s.first != i) continue;
+                p[0] = voxelMean(s.x, s.count);
+                p[1] = voxelMean(s.y, s.count);
+                p[2] = voxelMean(s.z, s.count);
+                p[3] = short(((s.r + s.count / 2) / s.count) | (((s.g + s.count / 2) / s.count) << 8));
+                p[4] = short((s.b + s.count / 2) / s.count);
+                p += 5;
+            }
+        }
+
+        // back to an empty table for the next frame
+        #pragma omp for schedule(static)
+        for (int v = 0; v < grid->num_voxels; v++) {
+            grid->slots[grid->slot_of[v]].key = VOXEL_EMPTY;
+            memset(&grid->sums[v], 0, sizeof(voxelSum));
+            grid->sums[v].first = INT_MAX;
+        }
+    }
+
+    return first[num_blocks];
+}
+
+#endif